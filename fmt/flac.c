@@ -62,6 +62,18 @@ struct flac_readdata {
 
 		uint32_t samples_decoded;
 	} uncompressed;
+
+	/* set if this is being decoded a block at a time (see fmt_flac_open_decoder) */
+	struct flac_decoder *stream;
+};
+
+struct flac_decoder {
+	struct flac_readdata read_data;
+	FLAC__StreamDecoder *decoder;
+
+	/* the last block decoded, and how much of it has been read */
+	uint8_t *pending;
+	uint32_t pending_size, pending_frames, pending_pos;
 };
 
 static void read_on_meta(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data)
@@ -222,9 +234,41 @@ static void read_on_error(const FLAC__StreamDecoder *decoder, FLAC__StreamDecode
 	(void)decoder, (void)client_data;
 }
 
+/* converts 'count' samples (not frames) of decoded audio to 8 or 16 bits, interleaved */
+static void flac_convert(const struct flac_readdata *read_data, void *dst, const FLAC__int32 *const buffer[], uint32_t count)
+{
+	const uint32_t channels = read_data->streaminfo.channels;
+	const uint32_t bits = read_data->streaminfo.bits_per_sample;
+	size_t i, j, c;
+
+	if (bits <= 8) {
+		int8_t *buf_ptr = dst;
+		uint32_t bit_shift = 8 - bits;
+
+		for (i = 0, j = 0; i < count; j++)
+			for (c = 0; c < channels; c++)
+				buf_ptr[i++] = lshift_signed(buffer[c][j], bit_shift);
+	} else if (bits <= 16) {
+		int16_t *buf_ptr = dst;
+		uint32_t bit_shift = 16 - bits;
+
+		for (i = 0, j = 0; i < count; j++)
+			for (c = 0; c < channels; c++)
+				buf_ptr[i++] = lshift_signed(buffer[c][j], bit_shift);
+	} else { /* >= 16 */
+		int16_t *buf_ptr = dst;
+		uint32_t bit_shift = bits - 16;
+
+		for (i = 0, j = 0; i < count; j++)
+			for (c = 0; c < channels; c++)
+				buf_ptr[i++] = rshift_signed(buffer[c][j], bit_shift);
+	}
+}
+
 static FLAC__StreamDecoderWriteStatus read_on_write(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 *const buffer[], void *client_data)
 {
 	struct flac_readdata* read_data = (struct flac_readdata*)client_data;
+	const uint32_t sample_size = (read_data->streaminfo.bits_per_sample <= 8) ? sizeof(int8_t) : sizeof(int16_t);
 
 	/* invalid?; FIXME: this should probably make sure the total_samples
 	 * is less than the max sample constant thing */
@@ -232,12 +276,31 @@ static FLAC__StreamDecoderWriteStatus read_on_write(const FLAC__StreamDecoder *d
 		|| read_data->streaminfo.channels > 2)
 		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
 
+	if (read_data->stream) {
+		struct flac_decoder *fd = read_data->stream;
+		uint32_t size = frame->header.blocksize * read_data->streaminfo.channels * sample_size;
+
+		if (size > fd->pending_size) {
+			uint8_t *pending = realloc(fd->pending, size);
+			if (!pending)
+				return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+			fd->pending = pending;
+			fd->pending_size = size;
+		}
+
+		flac_convert(read_data, fd->pending, buffer, frame->header.blocksize * read_data->streaminfo.channels);
+		fd->pending_frames = frame->header.blocksize;
+		fd->pending_pos = 0;
+
+		return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+	}
+
 	if (frame->header.number.sample_number == 0) {
 		/* allocate our buffer. for some reason the length isn't the real
 		 * length of the buffer in bytes but I can't be bothered to figure
 		 * out why. */
 		read_data->uncompressed.len = ((size_t)read_data->streaminfo.total_samples * read_data->streaminfo.channels * read_data->streaminfo.bits_per_sample/8);
-		read_data->uncompressed.data = (uint8_t*)malloc(read_data->uncompressed.len * ((read_data->streaminfo.bits_per_sample == 8) ? sizeof(int8_t) : sizeof(int16_t)));
+		read_data->uncompressed.data = (uint8_t*)malloc(read_data->uncompressed.len * sample_size);
 		if (!read_data->uncompressed.data)
 			return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
 
@@ -250,31 +313,8 @@ static FLAC__StreamDecoderWriteStatus read_on_write(const FLAC__StreamDecoder *d
 	if (read_data->uncompressed.samples_decoded + block_size > samples_allocated)
 		block_size = samples_allocated - read_data->uncompressed.samples_decoded;
 
-	if (read_data->streaminfo.bits_per_sample <= 8) {
-		int8_t *buf_ptr = (int8_t*)read_data->uncompressed.data + read_data->uncompressed.samples_decoded;
-		uint32_t bit_shift = 8 - read_data->streaminfo.bits_per_sample;
-
-		size_t i, j, c;
-		for (i = 0, j = 0; i < block_size; j++)
-			for (c = 0; c < read_data->streaminfo.channels; c++)
-				buf_ptr[i++] = lshift_signed(buffer[c][j], bit_shift);
-	} else if (read_data->streaminfo.bits_per_sample <= 16) {
-		int16_t *buf_ptr = (int16_t*)read_data->uncompressed.data + read_data->uncompressed.samples_decoded;
-		uint32_t bit_shift = 16 - read_data->streaminfo.bits_per_sample;
-
-		size_t i, j, c;
-		for (i = 0, j = 0; i < block_size; j++)
-			for (c = 0; c < read_data->streaminfo.channels; c++)
-				buf_ptr[i++] = lshift_signed(buffer[c][j], bit_shift);
-	} else { /* >= 16 */
-		int16_t *buf_ptr = (int16_t*)read_data->uncompressed.data + read_data->uncompressed.samples_decoded;
-		uint32_t bit_shift = read_data->streaminfo.bits_per_sample - 16;
-
-		size_t i, j, c;
-		for (i = 0, j = 0; i < block_size; j++)
-			for (c = 0; c < read_data->streaminfo.channels; c++)
-				buf_ptr[i++] = rshift_signed(buffer[c][j], bit_shift);
-	}
+	flac_convert(read_data, read_data->uncompressed.data + read_data->uncompressed.samples_decoded * sample_size,
+		buffer, block_size);
 
 	read_data->uncompressed.samples_decoded += block_size;
 
@@ -283,7 +323,7 @@ static FLAC__StreamDecoderWriteStatus read_on_write(const FLAC__StreamDecoder *d
 	(void)decoder;
 }
 
-static int flac_load(struct flac_readdata* read_data, int meta_only)
+static FLAC__StreamDecoder *flac_init(struct flac_readdata *read_data)
 {
 	unsigned char magic[4];
 
@@ -291,11 +331,11 @@ static int flac_load(struct flac_readdata* read_data, int meta_only)
 
 	if (slurp_peek(read_data->fp, magic, sizeof(magic)) != sizeof(magic)
 		|| memcmp(magic, "fLaC", sizeof(magic)))
-		return 0;
+		return NULL;
 
 	FLAC__StreamDecoder *decoder = FLAC__stream_decoder_new();
 	if (!decoder)
-		return 0;
+		return NULL;
 
 	FLAC__stream_decoder_set_metadata_respond_all(decoder);
 
@@ -309,6 +349,20 @@ static int flac_load(struct flac_readdata* read_data, int meta_only)
 			read_data
 		);
 
+	if (initStatus != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+		FLAC__stream_decoder_delete(decoder);
+		return NULL;
+	}
+
+	return decoder;
+}
+
+static int flac_load(struct flac_readdata* read_data, int meta_only)
+{
+	FLAC__StreamDecoder *decoder = flac_init(read_data);
+	if (!decoder)
+		return 0;
+
 	/* flac function names are such a yapfest */
 	if (!(meta_only ? FLAC__stream_decoder_process_until_end_of_metadata(decoder) : FLAC__stream_decoder_process_until_end_of_stream(decoder))) {
 		FLAC__stream_decoder_delete(decoder);
@@ -322,33 +376,21 @@ static int flac_load(struct flac_readdata* read_data, int meta_only)
 }
 #undef FLAC_ERROR
 
-int fmt_flac_load_sample(slurp_t *fp, song_sample_t *smp)
+/* fills in everything about the sample but its data, and returns the flags to read that with */
+static uint32_t flac_sample_header(const struct flac_readdata *read_data, song_sample_t *smp)
 {
-	struct flac_readdata read_data = {
-		.fp = fp,
-		.flags = {
-			.sample_rate = 0,
-			.loop = {
-				.type = -1,
-			},
-		},
-	};
-
-	if (!flac_load(&read_data, 0))
-		return 0;
-
 	smp->volume        = 64 * 4;
 	smp->global_volume = 64;
-	smp->c5speed       = read_data.streaminfo.sample_rate;
-	smp->length        = read_data.streaminfo.total_samples;
-	if (read_data.flags.loop.type != -1) {
-		smp->loop_start = read_data.flags.loop.start;
-		smp->loop_end   = read_data.flags.loop.end + 1;
-		smp->flags |= (read_data.flags.loop.type ? (CHN_LOOP | CHN_PINGPONGLOOP) : CHN_LOOP);
+	smp->c5speed       = read_data->streaminfo.sample_rate;
+	smp->length        = read_data->streaminfo.total_samples;
+	if (read_data->flags.loop.type != -1) {
+		smp->loop_start = read_data->flags.loop.start;
+		smp->loop_end   = read_data->flags.loop.end + 1;
+		smp->flags |= (read_data->flags.loop.type ? (CHN_LOOP | CHN_PINGPONGLOOP) : CHN_LOOP);
 	}
 
-	if (read_data.flags.sample_rate)
-		smp->c5speed = read_data.flags.sample_rate;
+	if (read_data->flags.sample_rate)
+		smp->c5speed = read_data->flags.sample_rate;
 
 	// endianness, based on host system
 	uint32_t flags = 0;
@@ -359,14 +401,34 @@ int fmt_flac_load_sample(slurp_t *fp, song_sample_t *smp)
 #endif
 
 	// channels
-	flags |= (read_data.streaminfo.channels == 2) ? SF_SI : SF_M;
+	flags |= (read_data->streaminfo.channels == 2) ? SF_SI : SF_M;
 
 	// bit width
-	flags |= (read_data.streaminfo.bits_per_sample <= 8) ? SF_8 : SF_16;
+	flags |= (read_data->streaminfo.bits_per_sample <= 8) ? SF_8 : SF_16;
 
 	// libFLAC always returns signed
 	flags |= SF_PCMS;
 
+	return flags;
+}
+
+int fmt_flac_load_sample(slurp_t *fp, song_sample_t *smp)
+{
+	struct flac_readdata read_data = {
+		.fp = fp,
+		.flags = {
+			.sample_rate = 0,
+			.loop = {
+				.type = -1,
+			},
+		},
+	};
+
+	if (!flac_load(&read_data, 0))
+		return 0;
+
+	uint32_t flags = flac_sample_header(&read_data, smp);
+
 	int ret = csf_read_sample(smp, flags, read_data.uncompressed.data, read_data.uncompressed.len);
 
 	free(read_data.uncompressed.data);
@@ -374,6 +436,96 @@ int fmt_flac_load_sample(slurp_t *fp, song_sample_t *smp)
 	return ret;
 }
 
+/* --------------------------------------------------------------------------------------------------------- */
+/* ...a bit at a time */
+
+static uint32_t flac_decoder_read(struct sample_decoder *d, void *buf, uint32_t frames)
+{
+	struct flac_decoder *fd = d->data;
+	const uint32_t frame_size = fd->read_data.streaminfo.channels
+		* ((fd->read_data.streaminfo.bits_per_sample <= 8) ? sizeof(int8_t) : sizeof(int16_t));
+	uint32_t done = 0, n;
+
+	while (done < frames) {
+		while (fd->pending_pos >= fd->pending_frames) {
+			fd->pending_frames = fd->pending_pos = 0;
+			if (FLAC__stream_decoder_get_state(fd->decoder) == FLAC__STREAM_DECODER_END_OF_STREAM
+			    || !FLAC__stream_decoder_process_single(fd->decoder))
+				return done;
+		}
+
+		n = MIN(frames - done, fd->pending_frames - fd->pending_pos);
+		memcpy((uint8_t *) buf + done * frame_size, fd->pending + fd->pending_pos * frame_size, n * frame_size);
+		fd->pending_pos += n;
+		done += n;
+	}
+
+	return done;
+}
+
+static int flac_decoder_seek(struct sample_decoder *d, uint32_t frame)
+{
+	struct flac_decoder *fd = d->data;
+
+	/* the decoder writes out the block with the frame in it (from that frame on) while seeking */
+	fd->pending_frames = fd->pending_pos = 0;
+	if (FLAC__stream_decoder_seek_absolute(fd->decoder, frame))
+		return 1;
+
+	/* it has to be flushed after a failed seek before it'll do anything else */
+	FLAC__stream_decoder_flush(fd->decoder);
+	return 0;
+}
+
+static void flac_decoder_close(struct sample_decoder *d)
+{
+	struct flac_decoder *fd = d->data;
+
+	FLAC__stream_decoder_finish(fd->decoder);
+	FLAC__stream_decoder_delete(fd->decoder);
+	free(fd->pending);
+	free(fd);
+}
+
+int fmt_flac_open_decoder(slurp_t *fp, song_sample_t *smp, struct sample_decoder *d)
+{
+	struct flac_decoder *fd = mem_calloc(1, sizeof(*fd));
+
+	fd->read_data.fp = fp;
+	fd->read_data.flags.loop.type = -1;
+	fd->read_data.stream = fd;
+
+	fd->decoder = flac_init(&fd->read_data);
+	if (!fd->decoder) {
+		free(fd);
+		return 0;
+	}
+
+	if (!FLAC__stream_decoder_process_until_end_of_metadata(fd->decoder)
+	    || !fd->read_data.streaminfo.total_samples
+	    || !fd->read_data.streaminfo.channels || fd->read_data.streaminfo.channels > 2) {
+		FLAC__stream_decoder_delete(fd->decoder);
+		free(fd);
+		return 0;
+	}
+
+	/* set up the sample the same way csf_read_sample would */
+	flac_sample_header(&fd->read_data, smp);
+	smp->flags &= ~(CHN_16BIT | CHN_STEREO);
+	if (fd->read_data.streaminfo.bits_per_sample > 8)
+		smp->flags |= CHN_16BIT;
+	if (fd->read_data.streaminfo.channels == 2)
+		smp->flags |= CHN_STEREO;
+
+	d->read = flac_decoder_read;
+	d->seek = flac_decoder_seek;
+	d->close = flac_decoder_close;
+	d->fp = fp;
+	d->data = fd;
+
+	return 1;
+}
+
 int fmt_flac_read_info(dmoz_file_t *file, slurp_t *fp)
 {
 	struct flac_readdata read_data = {
@@ -585,15 +737,29 @@ int fmt_flac_save_sample(disko_t *fp, song_sample_t *smp)
 	/* need to buffer this or else we'll make a HUGE array when
 	 * saving huge samples */
 	size_t offset;
-	const size_t total_bytes = smp->length * ((smp->flags & CHN_16BIT) ? 2 : 1) * ((smp->flags & CHN_STEREO) ? 2 : 1);
+	const size_t frame_size = ((smp->flags & CHN_16BIT) ? 2 : 1) * ((smp->flags & CHN_STEREO) ? 2 : 1);
+	const size_t total_bytes = (size_t) smp->length * frame_size;
+	/* paged samples are mostly still in the file, so they get read back out of it */
+	struct sample_pager *pager = csf_sample_pager(smp->data);
+	uint8_t *paged = pager ? mem_alloc(SAMPLE_BUFFER_LENGTH) : NULL;
+	int ret = SAVE_SUCCESS;
 	for (offset = 0; offset < total_bytes; offset += SAMPLE_BUFFER_LENGTH) {
-		size_t needed = total_bytes - offset;
-		if (fmt_flac_export_body(fp, (uint8_t*)smp->data + offset, MIN(needed, SAMPLE_BUFFER_LENGTH)) != DW_OK)
-			return SAVE_INTERNAL_ERROR;
+		size_t needed = MIN(total_bytes - offset, SAMPLE_BUFFER_LENGTH);
+		const uint8_t *data = (uint8_t*)smp->data + offset;
+		if (pager) {
+			uint32_t got = pager->read(pager, offset / frame_size, paged, needed / frame_size);
+			memset(paged + got * frame_size, 0, needed - got * frame_size);
+			data = paged;
+		}
+		if (fmt_flac_export_body(fp, data, needed) != DW_OK) {
+			ret = SAVE_INTERNAL_ERROR;
+			break;
+		}
 	}
+	free(paged);
 
-	if (fmt_flac_export_tail(fp) != DW_OK)
-		return SAVE_INTERNAL_ERROR;
+	if (ret == SAVE_SUCCESS && fmt_flac_export_tail(fp) != DW_OK)
+		ret = SAVE_INTERNAL_ERROR;
 
-	return SAVE_SUCCESS;
+	return ret;
 }
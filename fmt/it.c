@@ -417,7 +417,7 @@ int fmt_it_load_song(song_t *song, slurp_t *fp, unsigned int lflags)
 	}
 	if (hist) {
 		song->histlen = hist;
-		song->histdata = mem_alloc(8 * song->histlen);
+		song->histdata = csf_pool_alloc(&song->pool, 8 * song->histlen);
 		slurp_read(fp, song->histdata, 8 * song->histlen);
 	}
 	if (ignoremidi) {
@@ -523,7 +523,7 @@ static struct mdlpat *mdl_read_patterns(song_t *song, slurp_t *fp)
 			if (!trknum)
 				continue;
 
-			patptr->next = mem_alloc(sizeof(struct mdlpat));
+			patptr->next = csf_pool_alloc(&song->scratch, sizeof(struct mdlpat));
 			patptr = patptr->next;
 			patptr->track = trknum;
 			patptr->rows = rows;
@@ -556,7 +556,7 @@ static struct mdlpat *mdl_read_patterns_v0(song_t *song, slurp_t *fp)
 			if (!trknum)
 				continue;
 
-			patptr->next = mem_alloc(sizeof(struct mdlpat));
+			patptr->next = csf_pool_alloc(&song->scratch, sizeof(struct mdlpat));
 			patptr = patptr->next;
 			patptr->track = trknum;
 			patptr->rows = 64;
@@ -568,9 +568,9 @@ static struct mdlpat *mdl_read_patterns_v0(song_t *song, slurp_t *fp)
 	return pat_head.next;
 }
 
-static song_note_t **mdl_read_tracks(slurp_t *fp)
+static song_note_t **mdl_read_tracks(song_t *song, slurp_t *fp)
 {
-	song_note_t **tracks = mem_calloc(65536, sizeof(song_note_t *));
+	song_note_t **tracks = csf_pool_alloc(&song->scratch, 65536 * sizeof(song_note_t *));
 	int ntrks, trk, row, lostfx = 0;
 	uint16_t h;
 	uint8_t b, x, y;
@@ -583,7 +583,7 @@ static song_note_t **mdl_read_tracks(slurp_t *fp)
 	for (trk = 1; trk <= ntrks; trk++) {
 		// hope and pray that we don't overshoot
 		slurp_seek(fp, 2, SEEK_CUR);
-		tracks[trk] = mem_calloc(256, sizeof(song_note_t));
+		tracks[trk] = csf_pool_alloc(&song->scratch, 256 * sizeof(song_note_t));
 		row = 0;
 		while (row < 256 && !slurp_eof(fp)) {
 			b = slurp_getc(fp);
@@ -823,7 +823,7 @@ static void mdl_read_sampleinfo_v0(song_t *song, slurp_t *fp, uint8_t *packtype)
 	}
 }
 
-static void mdl_read_envelopes(slurp_t *fp, struct mdlenv **envs, uint32_t flags)
+static void mdl_read_envelopes(song_t *song, slurp_t *fp, struct mdlenv **envs, uint32_t flags)
 {
 	struct mdl_envelope ehdr;
 	song_envelope_t *env;
@@ -837,7 +837,7 @@ static void mdl_read_envelopes(slurp_t *fp, struct mdlenv **envs, uint32_t flags
 			continue;
 
 		if (!envs[ehdr.envnum])
-			envs[ehdr.envnum] = mem_calloc(1, sizeof(struct mdlenv));
+			envs[ehdr.envnum] = csf_pool_alloc(&song->scratch, sizeof(struct mdlenv));
 		env = &envs[ehdr.envnum]->data;
 
 		env->nodes = 15;
@@ -932,7 +932,7 @@ int fmt_mdl_load_song(song_t *song, slurp_t *fp, UNUSED unsigned int lflags)
 		case MDL_BLK_TRACKS:
 			if (!(readflags & MDL_HAS_TRACKS)) {
 				readflags |= MDL_HAS_TRACKS;
-				tracks = mdl_read_tracks(fp);
+				tracks = mdl_read_tracks(song, fp);
 			}
 			break;
 		case MDL_BLK_INSTRUMENTS:
@@ -944,19 +944,19 @@ int fmt_mdl_load_song(song_t *song, slurp_t *fp, UNUSED unsigned int lflags)
 		case MDL_BLK_VOLENVS:
 			if (!(readflags & MDL_HAS_VOLENVS)) {
 				readflags |= MDL_HAS_VOLENVS;
-				mdl_read_envelopes(fp, volenvs, ENV_VOLLOOP | ENV_VOLSUSTAIN);
+				mdl_read_envelopes(song, fp, volenvs, ENV_VOLLOOP | ENV_VOLSUSTAIN);
 			}
 			break;
 		case MDL_BLK_PANENVS:
 			if (!(readflags & MDL_HAS_PANENVS)) {
 				readflags |= MDL_HAS_PANENVS;
-				mdl_read_envelopes(fp, panenvs, ENV_PANLOOP | ENV_PANSUSTAIN);
+				mdl_read_envelopes(song, fp, panenvs, ENV_PANLOOP | ENV_PANSUSTAIN);
 			}
 			break;
 		case MDL_BLK_FREQENVS:
 			if (!(readflags & MDL_HAS_FREQENVS)) {
 				readflags |= MDL_HAS_FREQENVS;
-				mdl_read_envelopes(fp, freqenvs, ENV_PITCHLOOP | ENV_PITCHSUSTAIN);
+				mdl_read_envelopes(song, fp, freqenvs, ENV_PITCHLOOP | ENV_PITCHSUSTAIN);
 			}
 			break;
 		case MDL_BLK_SAMPLEINFO:
@@ -1067,15 +1067,6 @@ int fmt_mdl_load_song(song_t *song, slurp_t *fp, UNUSED unsigned int lflags)
 				*patnote = *trknote;
 			}
 		}
-		// and clean up
-		for (trk = 1; trk < 65536 && tracks[trk]; trk++)
-			free(tracks[trk]);
-		free(tracks);
-	}
-	while (patptr) {
-		pat = patptr;
-		patptr = patptr->next;
-		free(pat);
 	}
 
 	// Finish fixing up the instruments
@@ -1121,19 +1112,6 @@ int fmt_mdl_load_song(song_t *song, slurp_t *fp, UNUSED unsigned int lflags)
 		}
 	}
 
-	if (readflags & MDL_HAS_VOLENVS) {
-		for (n = 0; n < 64; n++)
-			free(volenvs[n]);
-	}
-	if (readflags & MDL_HAS_PANENVS) {
-		for (n = 0; n < 64; n++)
-			free(panenvs[n]);
-	}
-	if (readflags & MDL_HAS_FREQENVS) {
-		for (n = 0; n < 64; n++)
-			free(freqenvs[n]);
-	}
-
 	if (restartpos > 0)
 		csf_insert_restart_pos(song, restartpos);
 
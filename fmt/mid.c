@@ -80,13 +80,10 @@ struct event {
 	struct event *next;
 };
 
-static struct event *alloc_event(unsigned int pulse, uint8_t chan, const song_note_t *note, struct event *next)
+static struct event *alloc_event(song_t *song, unsigned int pulse, uint8_t chan, const song_note_t *note,
+	struct event *next)
 {
-	struct event *ev = malloc(sizeof(struct event));
-	if (!ev) {
-		perror("malloc");
-		return NULL;
-	}
+	struct event *ev = csf_pool_alloc(&song->scratch, sizeof(struct event));
 	ev->pulse = pulse;
 	ev->chan = chan;
 	ev->note = *note;
@@ -182,7 +179,7 @@ int fmt_mid_load_song(song_t *song, slurp_t *fp, unsigned int lflags)
 
 	Stuff a useless event at the start of the event queue. */
 	note = (song_note_t) {.note = NOTE_NONE};
-	event_queue = alloc_event(0, 0, &note, NULL);
+	event_queue = alloc_event(song, 0, 0, &note, NULL);
 
 	for (int trknum = 0; trknum < mthd.num_tracks; trknum++) {
 		unsigned int delta; // time since last event (read from file)
@@ -417,7 +414,7 @@ int fmt_mid_load_song(song_t *song, slurp_t *fp, unsigned int lflags)
 				cur = cur->next;
 			}
 			// and now, cur is either NULL or has a higher timestamp, so insert before it
-			new = alloc_event(pulse, cn, &note, cur);
+			new = alloc_event(song, pulse, cn, &note, cur);
 			prev->next = new;
 			prev = prev->next;
 		}
@@ -434,14 +431,8 @@ int fmt_mid_load_song(song_t *song, slurp_t *fp, unsigned int lflags)
 	prev = NULL;
 	cur = event_queue;
 
-	if (lflags & LOAD_NOPATTERNS) {
-		while (cur) {
-			prev = cur;
-			cur = cur->next;
-			free(prev);
-		}
+	if (lflags & LOAD_NOPATTERNS)
 		return LOAD_SUCCESS;
-	}
 
 	// okey doke! now let's write this crap out to the patterns
 	song_note_t *pattern = NULL, *rowdata;
@@ -495,9 +486,7 @@ int fmt_mid_load_song(song_t *song, slurp_t *fp, unsigned int lflags)
 			rowdata[cur->chan].param = cur->note.param;
 		}
 
-		prev = cur;
 		cur = cur->next;
-		free(prev);
 	}
 
 	return LOAD_SUCCESS;
@@ -200,10 +200,10 @@ int fmt_mtm_load_song(song_t *song, slurp_t *fp, unsigned int lflags)
 	memset(song->orderlist + nord, ORDER_LAST, MAX_ORDERS - nord);
 
 	/* tracks */
-	trackdata = mem_calloc(ntrk, sizeof(song_note_t *));
+	trackdata = csf_pool_alloc(&song->scratch, ntrk * sizeof(song_note_t *));
 	for (n = 0; n < ntrk; n++) {
 		slurp_read(fp, b, 3 * rows);
-		trackdata[n] = mem_calloc(rows, sizeof(song_note_t));
+		trackdata[n] = csf_pool_alloc(&song->scratch, rows * sizeof(song_note_t));
 		mtm_unpack_track(b, trackdata[n], rows);
 	}
 
@@ -226,9 +226,6 @@ int fmt_mtm_load_song(song_t *song, slurp_t *fp, unsigned int lflags)
 			if (tmp == 0) {
 				continue;
 			} else if (tmp > ntrk) {
-				for (n = 0; n < ntrk; n++)
-					free(trackdata[n]);
-				free(trackdata);
 				return LOAD_FORMAT_ERROR;
 			}
 			note = song->patterns[pat] + chan;
@@ -246,11 +243,6 @@ int fmt_mtm_load_song(song_t *song, slurp_t *fp, unsigned int lflags)
 		}
 	}
 
-	/* free willy */
-	for (n = 0; n < ntrk; n++)
-		free(trackdata[n]);
-	free(trackdata);
-
 	read_lined_message(song->message, fp, comment_len, 40);
 
 	/* sample data */
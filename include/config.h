@@ -40,6 +40,7 @@ extern int cfg_video_want_menu_bar;
 
 extern char cfg_dir_modules[], cfg_dir_samples[], cfg_dir_instruments[];
 extern char cfg_dir_dotschism[]; /* the full path to ~/.schism */
+extern int cfg_autosave_interval; /* in minutes; zero to turn it off */
 extern char cfg_font[];
 extern int cfg_palette;
 
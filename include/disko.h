@@ -51,6 +51,10 @@ struct disko {
 	// data for memory buffers (no filename/handle)
 	uint8_t *data;
 
+	// write buffer for disk files, and how much is waiting in it
+	uint8_t *buffer;
+	size_t buffered;
+
 	// First errno value recorded after something went wrong.
 	int error;
 
@@ -73,7 +77,7 @@ enum {
 };
 
 /* fopen/fclose-ish writeout/finish wrapper that shoves data into the
- * user-allocated structure */
+ * user-allocated structure (which is cleared first, and never freed) */
 int disko_open(disko_t *ds, const char *filename);
 /* Close the file. If there was no error writing the file, it is renamed
 to the name specified in disko_open; otherwise, the original file is left
@@ -116,7 +120,9 @@ int disko_sync(void);
 
 /* For use by the diskwriter drivers: */
 
-/* Write data to the file, as in fwrite() */
+/* Write data to the file, as in fwrite(). Small writes are collected in a
+big buffer; large ones go straight out along with whatever's buffered, so
+writing a whole sample at once is cheaper than writing it piece by piece. */
 void disko_write(disko_t *ds, const void *buf, size_t len);
 
 /* Write one character (unsigned char, cast to int) */
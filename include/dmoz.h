@@ -162,7 +162,9 @@ int dmoz_fill_ext_data(dmoz_file_t *file);
 void dmoz_filter_filelist(dmoz_filelist_t *flist, int (*grep)(dmoz_file_t *f), int *pointer, void (*onmove)(void));
 
 /* butt */
-int song_preload_sample(dmoz_file_t *f);
+/* loads a file into the hidden sample slot for the sample browser; if 'stream' is
+nonzero, big files are streamed from disk instead (see sample-stream.h) */
+int song_preload_sample(dmoz_file_t *f, int stream);
 
 
 /* Path handling functions */
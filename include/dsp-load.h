@@ -0,0 +1,57 @@
+/*
+ * Schism Tracker - a cross-platform Impulse Tracker clone
+ * copyright (c) 2003-2005 Storlek <storlek@rigelseven.com>
+ * copyright (c) 2005-2008 Mrs. Brisby <mrs.brisby@nimh.org>
+ * copyright (c) 2009 Storlek & Mrs. Brisby
+ * copyright (c) 2010-2012 Storlek
+ * URL: http://schismtracker.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef SCHISM_DSP_LOAD_H_
+#define SCHISM_DSP_LOAD_H_
+
+#include "player/sndfile.h"
+
+/* all percentages are in tenths of a percent of the time the rendered audio
+lasts, so 1000 means the mixer only just kept up */
+struct dsp_load {
+	int load; /* smoothed over the last few buffers */
+	int peak; /* highest recent load; decays over a second or so */
+	unsigned int underruns; /* buffers that took longer to render than to play */
+	int stage[CSF_NUM_STAGES]; /* smoothed, per stage (the mix stage includes AdLib) */
+};
+
+/* hooks the timer into the player */
+void dsp_load_init(void);
+
+/* called from the audio thread around rendering each buffer */
+void dsp_load_begin(void);
+void dsp_load_end(unsigned int frames, unsigned int rate);
+
+void dsp_load_get(struct dsp_load *load);
+void dsp_load_reset(void);
+
+/* Records every stage of every buffer until stopped, then writes it out in
+Chrome's trace event format (load it in chrome://tracing or Perfetto). Only the
+most recent events are kept if it runs for a long time. dsp_trace_start returns
+zero if it's already running or out of memory; dsp_trace_stop returns the number
+of events written, or -1 on error. */
+int dsp_trace_start(void);
+int dsp_trace_stop(const char *filename);
+int dsp_trace_active(void);
+
+#endif /* SCHISM_DSP_LOAD_H_ */
@@ -30,6 +30,8 @@
 #define SCHISM_EVENT_PLAYBACK           (SDL_USEREVENT+2)
 #define SCHISM_EVENT_NATIVE             (SDL_USEREVENT+3)
 #define SCHISM_EVENT_PASTE              (SDL_USEREVENT+4)
+#define SCHISM_EVENT_VIS                (SDL_USEREVENT+5)
+#define SCHISM_EVENT_SAVE_DONE          (SDL_USEREVENT+6)
 
 #define SCHISM_EVENT_MIDI_NOTE          1
 #define SCHISM_EVENT_MIDI_CONTROLLER    2
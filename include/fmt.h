@@ -47,6 +47,7 @@ enum {
 	LOAD_UNSUPPORTED,       /* wrong file type for the loader */
 	LOAD_FILE_ERROR,        /* couldn't read the file; check errno */
 	LOAD_FORMAT_ERROR,      /* it appears to be the correct type, but there's something wrong */
+	LOAD_CANCELLED,         /* the user called it off (never returned by the loaders themselves) */
 };
 
 /* return codes for modules savers */
@@ -164,6 +165,26 @@ int riff_chunk_peek(iff_chunk_t *chunk, slurp_t *fp);
 int iff_chunk_read(iff_chunk_t *chunk, slurp_t *fp, void *data, size_t size);
 int iff_read_sample(iff_chunk_t *chunk, slurp_t *fp, song_sample_t *smp, uint32_t flags, size_t offset);
 
+/* --------------------------------------------------------------------------------------------------------- */
+
+/* Decoding sample data a bit at a time, for playing it straight from the file (see sample-stream.c).
+The data comes out the same way it would be loaded: 8 or 16 bits, interleaved if it's stereo. */
+struct sample_decoder {
+	/* returns how many frames were decoded; less than asked for means it's reached the end */
+	uint32_t (*read)(struct sample_decoder *d, void *buf, uint32_t frames);
+	/* returns zero on error */
+	int (*seek)(struct sample_decoder *d, uint32_t frame);
+	void (*close)(struct sample_decoder *d);
+	slurp_t *fp;
+	void *data;
+};
+
+#ifdef USE_FLAC
+/* fills in the sample's header (but doesn't read any data) and sets up the decoder; returns zero if
+the file isn't a FLAC file */
+int fmt_flac_open_decoder(slurp_t *fp, song_sample_t *smp, struct sample_decoder *d);
+#endif
+
 /* --------------------------------------------------------------------------------------------------------- */
 // other misc functions...
 
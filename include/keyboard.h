@@ -61,6 +61,8 @@ void kbd_key_translate(struct key_event *k);
 
 int kbd_key_repeat_enabled(void);
 void kbd_handle_key_repeat(void);
+/* milliseconds until the next repeat is due, or -1 if there isn't one */
+int kbd_key_repeat_timeout(void);
 void kbd_cache_key_repeat(struct key_event* kk);
 void kbd_empty_key_repeat(void);
 
@@ -153,6 +153,9 @@ int macosx_midi_setup(void);    // SCHISM_MACOSX
 
 /* called by audio system when buffer stuff change */
 void midi_queue_alloc(int buffer_size, int channels, int samples_per_second);
+/* called by the audio thread before mixing each buffer; midi_send_buffer
+ * positions are relative to the time of the last call */
+void midi_queue_sync(void);
 
 /* MIDI_PITCH_BEND is defined by OSS -- maybe these need more specific names? */
 #define MIDI_TICK_QUANTIZE      0x00000001
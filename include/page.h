@@ -453,6 +453,11 @@ int pattern_max_channels(int patno, int opt_bits[64]);
 /* page_orderpan.c */
 void update_current_order(void);
 
+/* page_waterfall.c */
+void vis_init(void);
+void vis_push_samples(const void *data, int frames, int bits, int channels);
+void vis_handle_event(void);
+
 /* menu.c */
 void menu_show(void);
 void menu_hide(void);
@@ -461,6 +466,8 @@ int menu_handle_key(struct key_event * k);
 
 /* status.c */
 void status_text_redraw(void);
+/* milliseconds until the status message expires, or -1 if there isn't one */
+int status_text_timeout(void);
 
 // page_message.c
 void message_reset_selection(void);
@@ -46,6 +46,12 @@ PATTERN_VIEW(1)
 
 #undef PATTERN_VIEW
 
+/* Same as calling draw_note(x, y, note, cursor_pos, fg, bg), but the cells get
+cached, so drawing the same note again is just a copy. width is how many cells
+draw_note fills in, which has to be the same every time. */
+void draw_note_cached(draw_note_func draw_note, int width, int x, int y,
+	const song_note_t *note, int cursor_pos, int fg, int bg);
+
 /* for the pattern editor masks (the ^^^ ^^ ^^ --- markers at the bottom) */
 #define MASK_NOTE       1 /* immutable */
 #define MASK_INSTRUMENT 2
@@ -20,7 +20,8 @@ void mono_from_stereo(int *, unsigned int);
 
 unsigned int csf_create_stereo_mix(song_t *csf, int count);
 
-void setup_channel_filter(song_voice_t *pChn, int reset, int flt_modifier, int freq);
+void init_filter_table(song_t *csf);
+void setup_channel_filter(song_t *csf, song_voice_t *pChn, int reset, int flt_modifier);
 
 
 //typedef unsigned int (*convert_clip_t)(void *, int *, unsigned int, int*, int*) __attribute__((cdecl))
@@ -39,11 +40,6 @@ void initialize_eq(int, float);
 void set_eq_gains(const unsigned int *, unsigned int, const unsigned int *, int, int);
 
 
-// sndmix.c
-extern int g_dry_rofs_vol;
-extern int g_dry_lofs_vol;
-
-
 // mixer.c
 void ResampleMono8BitFirFilter(signed char *oldbuf, signed char *newbuf, unsigned long oldlen, unsigned long newlen);
 void ResampleMono16BitFirFilter(signed short *oldbuf, signed short *newbuf, unsigned long oldlen, unsigned long newlen);
@@ -21,11 +21,12 @@
 #define MAX_PATTERNS            240
 #define MAX_SAMPLES             236
 #define MAX_INSTRUMENTS         MAX_SAMPLES
-#define MAX_VOICES              256
+#define MAX_VOICES              256 /* default voice pool; also the most voices AdLib and MIDI can track */
+#define MAX_VOICE_POOL          4096 /* no more than 4096 (see NNA_KEY_VOICE in effects.c) */
 #define MAX_CHANNELS            64
 #define MAX_ENVPOINTS           32
 #define MAX_INFONAME            80
-#define MAX_EQ_BANDS            6
+#define MAX_EQ_BANDS            16
 #define MAX_MESSAGE             8000
 
 #define MIX_MAX_CHANNELS		2 /* used for filters and stuff */
@@ -230,6 +231,12 @@
 #define SNDMIX_NOSURROUND       0x200000 // ignore S91
 //#define SNDMIX_NOMIXING       0x400000
 #define SNDMIX_NORAMPING        0x800000 // don't apply ramping on volume change (causes clicks)
+#define SNDMIX_NOEQ             0x1000000 // skip the EQ (for rendering patterns into samples)
+
+/* Only the song that's actually playing talks to the MIDI outputs; one that's
+being rendered (possibly several at once, on other threads) mustn't send
+anything, or touch the GM channel state that goes with it. */
+#define CSF_MIDI_OUT(csf) (!((csf)->mix_flags & SNDMIX_DIRECTTODISK))
 
 enum {
 	SRCMODE_NEAREST,
@@ -420,6 +427,7 @@ typedef struct song_voice {
 	//int32_t filter_a0, filter_b0, filter_b1;
 	int32_t filter_y[MIX_MAX_CHANNELS][2];
 	int32_t filter_a0, filter_b0, filter_b1;
+	uint32_t filter_key; // cutoff and resonance the coefficients are for (see setup_channel_filter)
 
 	int32_t rofs, lofs; // ?
 	int32_t ramp_length;
@@ -524,8 +532,59 @@ typedef struct {
 
 extern midi_config_t default_midi_config;
 
+/* A macro from the table above, worked out ahead of time (see
+csf_compile_midi_cfg): each byte of the message is a constant, or a constant
+with the MIDI channel filled into one or both nibbles, or one of the values
+that the letters stand for. Macros that only set the cutoff or resonance of
+the IT filter are flagged so they don't have to go through csf_midi_send. */
+enum {
+	MIDI_OP_CONST,
+	MIDI_OP_CHAN_LO,        /* value | channel */
+	MIDI_OP_CHAN_HI,        /* value | channel << 4 */
+	MIDI_OP_CHAN_BOTH,      /* channel << 4 | channel */
+	MIDI_OP_NOTE,           /* n */
+	MIDI_OP_VELOCITY,       /* v */
+	MIDI_OP_VOLUME,         /* u */
+	MIDI_OP_PANNING,        /* x */
+	MIDI_OP_FINAL_PANNING,  /* y */
+	MIDI_OP_BANK_HI,        /* a */
+	MIDI_OP_BANK_LO,        /* b */
+	MIDI_OP_PROGRAM,        /* p */
+	MIDI_OP_PARAM,          /* z */
+	MIDI_OP_HOST_CHANNEL,   /* h */
+	MIDI_OP_LOOP_DIR,       /* m */
+	MIDI_OP_OFFSET,         /* o */
+};
+
+#define MIDI_MACRO_SAW_C        0x01 // has a 'c' in it
+#define MIDI_MACRO_CUTOFF       0x02 // just F0F000xx
+#define MIDI_MACRO_RESONANCE    0x04 // just F0F001xx
+
+typedef struct {
+	uint8_t len;
+	uint8_t flags; // MIDI_MACRO_*
+	uint8_t op[32];
+	uint8_t value[32];
+} midi_macro_t;
+
+/* same layout as midi_config_t */
+typedef struct {
+	midi_macro_t start;
+	midi_macro_t stop;
+	midi_macro_t tick;
+	midi_macro_t note_on;
+	midi_macro_t note_off;
+	midi_macro_t set_volume;
+	midi_macro_t set_panning;
+	midi_macro_t set_bank;
+	midi_macro_t set_program;
+	midi_macro_t sfx[16];
+	midi_macro_t zxx[128];
+} midi_compiled_t;
+
 
 extern uint32_t max_voices;
+extern uint32_t csf_voice_pool_size; /* for new songs; see csf_set_voice_pool */
 extern uint32_t global_vu_left, global_vu_right;
 
 extern const song_note_t blank_pattern[64 * 64];
@@ -543,11 +602,24 @@ struct multi_write {
 	int buffer[MIXBUFFERSIZE * 2];
 };
 
+/* Memory pool for things that all go away at the same time. Allocations are
+carved out of large chunks and can't be freed individually; csf_pool_release
+frees everything at once. */
+struct csf_pool_chunk;
+
+typedef struct csf_pool {
+	struct csf_pool_chunk *chunks;
+} csf_pool_t;
+
+void *csf_pool_alloc(csf_pool_t *pool, size_t size); /* zeroed; never returns NULL */
+void csf_pool_release(csf_pool_t *pool);
+
 typedef struct song {
 	int mix_buffer[MIXBUFFERSIZE * 2];
 
-	song_voice_t voices[MAX_VOICES];                // Channels
-	uint32_t voice_mix[MAX_VOICES];                 // Channels to be mixed
+	song_voice_t *voices;                           // Channels (voice_pool_size of them)
+	uint32_t *voice_mix;                            // Channels to be mixed
+	uint32_t voice_pool_size;                       // MAX_CHANNELS..MAX_VOICE_POOL
 	song_sample_t samples[MAX_SAMPLES+1];           // Samples (1-based!)
 	song_instrument_t *instruments[MAX_INSTRUMENTS+1]; // Instruments (1-based!)
 	song_channel_t channels[MAX_CHANNELS];          // Channel settings
@@ -556,6 +628,7 @@ typedef struct song {
 	uint16_t pattern_alloc_size[MAX_PATTERNS];      // Allocated lengths (for async. resizing/playback)
 	uint8_t orderlist[MAX_ORDERS + 1];              // Pattern Orders
 	midi_config_t midi_config;                      // Midi macro config table
+	midi_compiled_t midi_compiled;                  // ... and what's run (see csf_compile_midi_cfg)
 	uint32_t initial_speed;
 	uint32_t initial_tempo;
 	uint32_t initial_global_volume;
@@ -564,6 +637,7 @@ typedef struct song {
 	uint32_t num_voices; // how many are currently playing. (POTENTIALLY larger than global max_voices)
 	uint32_t mix_stat; // number of channels being mixed (not really used)
 	uint32_t buffer_count; // number of samples to mix per tick
+	uint32_t buffer_offset; // frames already mixed in the current csf_read, for timing midi output
 	uint32_t tick_count;
 	uint32_t frame_delay;
 	int32_t row_count; /* IMPORTANT needs to be signed */
@@ -589,7 +663,7 @@ typedef struct song {
 	// These store the existing IT save history from prior editing sessions.
 	// Current session data is added at save time, and is NOT a part of histdata.
 	int histlen; // How many session history data entries exist (each entry is eight bytes)
-	uint8_t *histdata; // Preserved entries from prior sessions, might be NULL if histlen = 0
+	uint8_t *histdata; // Preserved entries from prior sessions, might be NULL if histlen = 0 (in csf->pool)
 	struct timeval editstart; // When the song was loaded
 
 	// mixer stuff
@@ -601,29 +675,132 @@ typedef struct song {
 	// noise reduction filter
 	int32_t left_nr, right_nr;
 
+	// resonant filters: the cutoff-dependent part of the coefficients, at this mix_frequency
+	float filter_r[256];
+	uint32_t filter_freq;
+
+	// click removal: where the voices that just stopped left off
+	int32_t dry_rofs_vol, dry_lofs_vol;
+
 	// chaseback
 	int stop_at_order;
 	int stop_at_row;
 	unsigned int stop_at_time;
 
+	// NNA voice allocation (effects.c): free background voices, and a heap of
+	// the busy ones keyed by loudness. Both live in the same block as the voices,
+	// and are rebuilt the first time they're needed after the voices have changed.
+	uint32_t *voice_free;
+	uint64_t *voice_heap;
+	uint32_t voice_nfree, voice_nheap;
+	uint32_t voice_taken; // last one handed out, still to go on the heap (or 0)
+	int voice_alloc_valid;
+
 	// multi-write stuff -- NULL if no multi-write is in progress, else array of one struct per channel
 	struct multi_write *multi_write;
+
+	// Allocations that live exactly as long as the song does; released by csf_destroy.
+	// (Patterns, instruments and sample data don't go here, since they get handed
+	// between songs -- undo, the instrument library, etc.)
+	csf_pool_t pool;
+	// Loader scratch space; released after each loader runs, and by csf_destroy.
+	csf_pool_t scratch;
 } song_t;
 
 song_note_t *csf_allocate_pattern(uint32_t rows);
 void csf_free_pattern(void *pat);
 signed char *csf_allocate_sample(uint32_t nbytes);
+/* drops a reference to the data, and frees it once nothing's using it */
 void csf_free_sample(void *p);
+/* adds a reference to the data, and returns it */
+signed char *csf_share_sample(signed char *p);
+/* nonzero if anything else has a reference to the data, in which case it
+ * mustn't be changed in place */
+int csf_sample_is_shared(const signed char *p);
+/* bumped every time sample data is freed (on any thread); anything that
+ * caches information about sample data by its address can use this to tell
+ * when the address might have been reused. */
+uint32_t csf_freed_samples(void);
 song_instrument_t *csf_allocate_instrument(void);
 void csf_init_instrument(song_instrument_t *ins, int samp);
 void csf_free_instrument(song_instrument_t *p);
 
 uint32_t csf_read_sample(song_sample_t *sample, uint32_t flags, const void *filedata, uint32_t datalength);
+uint32_t csf_sample_data_length(const song_sample_t *sample, uint32_t flags);
 uint32_t csf_write_sample(disko_t *fp, song_sample_t *sample, uint32_t flags, uint32_t maxlengthmask);
 void csf_adjust_sample_loop(song_sample_t *sample);
 
+/* Loop guards: csf_adjust_sample_loop keeps a copy of the frames around the
+end of each loop past the end of the sample data, with the loop continued
+after it -- unrolled for forward loops, reflected for ping-pong ones. The mixer
+reads from these near a loop point, so interpolation sees the right neighbours
+and tiny loops can be mixed in long runs instead of one pass at a time.
+A guard is only checked against the data pointer and the loop points, so
+anything that changes the data in place has to call csf_adjust_sample_loop
+afterwards (with the audio locked) or the mixer will keep playing the old
+frames. */
+#define SAMPLE_GUARD_BEHIND 8   /* frames before the loop end */
+#define SAMPLE_GUARD_AHEAD  248 /* frames after it */
+#define SAMPLE_GUARD_FRAMES (SAMPLE_GUARD_BEHIND + SAMPLE_GUARD_AHEAD)
+
+struct sample_loop_guard {
+	const signed char *data; /* sample data this was built from */
+	uint32_t loop_start, loop_end;
+	uint32_t pingpong;
+	/* followed by SAMPLE_GUARD_FRAMES frames, starting at loop_end - SAMPLE_GUARD_BEHIND */
+};
+
+/* returns the guard for the given loop, or NULL if there isn't an up-to-date one */
+const struct sample_loop_guard *csf_get_loop_guard(const song_sample_t *sample,
+	uint32_t loop_start, uint32_t loop_end, int pingpong);
+
+/* Paged samples: data that's too long to keep in memory is read from its file
+a page at a time, as it plays. Only the first page (plus SAMPLE_PAGE_EDGE frames)
+is kept in sample->data, so anything looking at the data directly sees the start
+of the sample; the mixer asks the pager for the rest. Paged samples don't get
+loop guards, and can't be edited. */
+#define SAMPLE_PAGE_FRAMES      65536
+#define SAMPLE_PAGE_EDGE        8 /* extra frames either side of a page, for interpolating */
+#define MAX_PAGED_SAMPLE_LENGTH 0x3fffffff /* so the size in bytes still fits in 32 bits */
+
+struct sample_pager {
+	/* Returns frames page * SAMPLE_PAGE_FRAMES - SAMPLE_PAGE_EDGE through
+	(page + 1) * SAMPLE_PAGE_FRAMES + SAMPLE_PAGE_EDGE, or NULL if they're not
+	loaded yet, unless 'wait' is set, in which case it loads them first. Called
+	from the mixer; the page stays put until it's released. */
+	const signed char *(*acquire)(struct sample_pager *pager, uint32_t page, int wait);
+	void (*release)(struct sample_pager *pager, uint32_t page);
+	/* a hint that the page is going to be needed soon */
+	void (*prefetch)(struct sample_pager *pager, uint32_t page);
+	/* reads frames straight out of the file (for saving); returns how many it got */
+	uint32_t (*read)(struct sample_pager *pager, uint32_t frame, void *buf, uint32_t frames);
+	void (*free)(struct sample_pager *pager);
+};
+
+/* like csf_allocate_sample, but the pager is freed along with the data */
+signed char *csf_allocate_paged_sample(struct sample_pager *pager, uint32_t nbytes);
+/* the pager for some sample data, or NULL if it's all in memory */
+struct sample_pager *csf_sample_pager(const signed char *data);
+
 extern void (*csf_midi_out_note)(int chan, const song_note_t *m);
 extern void (*csf_midi_out_raw)(const unsigned char *, unsigned int, unsigned int);
+/* called before mixing each chunk with the offset into the buffer in frames;
+returns the number of frames until the host wants to be called again */
+extern uint32_t (*csf_live_input)(song_t *csf, uint32_t offset);
+
+/* stages of csf_read, for timing */
+enum {
+	CSF_STAGE_TICK,    /* csf_read_note (row and tick processing) */
+	CSF_STAGE_MIX,     /* csf_create_stereo_mix, including... */
+	CSF_STAGE_ADLIB,   /* ...Fmdrv_MixTo */
+	CSF_STAGE_EQ,      /* eq and normalize */
+	CSF_STAGE_CONVERT, /* clipping, VU meter and conversion to the output format */
+	CSF_NUM_STAGES,
+};
+/* if csf_profile_clock is set, csf_read calls csf_profile_stage with the start
+and end time of every stage it runs, in whatever units the clock uses */
+extern uint64_t (*csf_profile_clock)(void);
+extern void (*csf_profile_stage)(int stage, uint64_t start, uint64_t end);
 
 void csf_import_mod_effect(song_note_t *m, int from_xm);
 uint16_t csf_export_mod_effect(const song_note_t *m, int xm);
@@ -676,7 +853,7 @@ int32_t csf_fx_do_freq_slide(uint32_t flags, int32_t frequency, int32_t slide, i
 void fx_note_cut(song_t *csf, uint32_t chan, int clear_note);
 void fx_key_off(song_t *csf, uint32_t chan);
 void csf_midi_send(song_t *csf, const unsigned char *data, unsigned int len, uint32_t chan, int fake);
-void csf_process_midi_macro(song_t *csf, uint32_t chan, const char *midi_macro, uint32_t param,
+void csf_process_midi_macro(song_t *csf, uint32_t chan, const midi_macro_t *macro, uint32_t param,
 			uint32_t note, uint32_t velocity, uint32_t use_instr);
 song_sample_t *csf_translate_keyboard(song_t *csf, song_instrument_t *ins, uint32_t note, song_sample_t *def);
 
@@ -690,8 +867,22 @@ unsigned long calc_halftone(unsigned long hz, int rel);
 
 // sndfile
 song_t *csf_allocate(void);
+/* Copies the parts of the song that a saver looks at, so it can be written out
+on another thread while the original carries on being edited and played. The
+patterns and instruments are copied outright, but the sample data is shared
+(see csf_share_sample), and the snapshot's references are dropped by csf_free
+on whichever thread frees it. */
+song_t *csf_snapshot(song_t *csf);
 void csf_free(song_t *csf);
 
+/* The voices are allocated separately from the song, so they can be sized at
+run time. csf_set_voice_pool resizes them, which stops everything that's
+playing. Songs that are memcpy'd from another need csf_copy_voices to get their
+own, and csf_free_voices to give them back. */
+void csf_set_voice_pool(song_t *csf, uint32_t size);
+void csf_copy_voices(song_t *dest, const song_t *src);
+void csf_free_voices(song_t *csf);
+
 void csf_destroy(song_t *csf); /* erase everything -- equiv. to new song */
 int csf_destroy_sample(song_t *csf, uint32_t smpnum);
 
@@ -699,6 +890,10 @@ void csf_stop_sample(song_t *csf, song_sample_t *smp);
 
 void csf_reset_midi_cfg(song_t *csf);
 void csf_copy_midi_cfg(song_t *dest, song_t *src);
+/* This has to be called after changing midi_config directly; the two functions
+above already do it. */
+void csf_compile_midi_cfg(song_t *csf);
+void csf_compile_midi_macro(midi_macro_t *macro, const char *text); /* at most 32 chars */
 void csf_set_current_order(song_t *csf, uint32_t position);
 void csf_loop_pattern(song_t *csf, int pattern, int start_row);
 void csf_reset_playmarks(song_t *csf);
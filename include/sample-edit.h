@@ -40,10 +40,22 @@ int sample_get_amplify_amount(song_sample_t *sample);
  * pitch) */
 void sample_toggle_quality(song_sample_t * sample, int convert_data);
 
-/* resize a sample; if aa is set, attempt to antialias (resample) the
- * output waveform.
- */
-void sample_resize(song_sample_t * sample, unsigned long newlen, int aa);
+/* quality for sample_resize and sample_resample: NONE just picks the
+ * nearest sample, the others run a windowed sinc filter of increasing
+ * length over the data. */
+enum {
+	SAMPLE_RESAMPLE_NONE = 0,
+	SAMPLE_RESAMPLE_LOW,
+	SAMPLE_RESAMPLE_MEDIUM,
+	SAMPLE_RESAMPLE_HIGH,
+};
+
+/* resize a sample, scaling its speed so that it plays at the same pitch */
+void sample_resize(song_sample_t * sample, unsigned long newlen, int quality);
+
+/* convert a sample to a different sample rate (i.e. resize it so that
+ * its c5speed comes out exactly as 'rate') */
+void sample_resample(song_sample_t * sample, unsigned int rate, int quality);
 
 /* AFAIK, this was in some registered versions of IT */
 void sample_invert(song_sample_t * sample);
@@ -54,5 +66,9 @@ void sample_delta_decode(song_sample_t * sample);
 void sample_mono_left(song_sample_t * sample);
 void sample_mono_right(song_sample_t * sample);
 
+/* gives the sample its own copy of its data if it's shared (with a song being
+ * saved in the background); call this before changing the data in place */
+void sample_unshare(song_sample_t * sample);
+
 
 #endif /* SCHISM_SAMPLE_EDIT_H_ */
@@ -0,0 +1,63 @@
+/*
+ * Schism Tracker - a cross-platform Impulse Tracker clone
+ * copyright (c) 2003-2005 Storlek <storlek@rigelseven.com>
+ * copyright (c) 2005-2008 Mrs. Brisby <mrs.brisby@nimh.org>
+ * copyright (c) 2009 Storlek & Mrs. Brisby
+ * copyright (c) 2010-2012 Storlek
+ * URL: http://schismtracker.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef SCHISM_SAMPLE_STREAM_H_
+#define SCHISM_SAMPLE_STREAM_H_
+
+#include "player/sndfile.h"
+
+/* Previewing big files in the sample browser without loading them first. The
+file plays straight from disk, through a small ring buffer that's put in the
+sample slot as a looped sample; a thread keeps it filled ahead of the voice
+that's playing it. Only one voice can play it at a time. */
+
+/* files smaller than this are just loaded */
+#define SAMPLE_STREAM_MIN_SIZE (4 << 20)
+
+/* Starts streaming the file into the given slot. Returns zero if the file
+can't be streamed (it might not be a sample at all, or it might be short, or
+compressed in a way that can't be read a bit at a time); in that case, nothing
+is changed. */
+int sample_stream_preview(const char *filename, int slot);
+
+/* stops streaming, and clears out the slot if it still has the ring buffer in it */
+void sample_stream_stop(void);
+
+/* Back to the start of the file. Call this before playing a note, since it
+stops the voices already playing the stream. */
+void sample_stream_restart(void);
+
+/* the slot that's being streamed into, or -1 */
+int sample_stream_slot(void);
+
+/* the start of the file, as a regular sample (for drawing); don't keep it */
+song_sample_t *sample_stream_head(void);
+
+/* Samples longer than MAX_SAMPLE_LENGTH are played straight from their file as
+paged samples (see csf_allocate_paged_sample). This fills in the sample (whose
+name should already be set) if the file is one of those; otherwise, it returns
+zero and leaves it alone, and the file can be loaded the usual way. */
+int sample_stream_load_paged(const char *filename, song_sample_t *smp);
+
+#endif /* SCHISM_SAMPLE_STREAM_H_ */
@@ -38,6 +38,18 @@ enum {
 	SLURP_OPEN_SUCCESS =  1,
 };
 
+/* Where the data for each sample of a song lives in the file, for reading it later.
+If a slurp_t has one of these attached, slurp_read_sample doesn't decode the samples
+belonging to `base`; it only records their offset and format here and skips past them.
+This is what lets a module be browsed as a sample library without decompressing
+every sample in it. */
+struct slurp_sample_refs {
+	song_sample_t *base; /* song->samples of the song being loaded */
+	int64_t offset[MAX_SAMPLES + 1];
+	uint32_t flags[MAX_SAMPLES + 1]; /* SF_* flags; zero if the sample was read normally */
+	uint32_t length[MAX_SAMPLES + 1]; /* in frames, before it was cut down to MAX_SAMPLE_LENGTH */
+};
+
 typedef struct slurp_struct_ slurp_t;
 struct slurp_struct_ {
 	/* stdio-style interfaces */
@@ -52,6 +64,14 @@ struct slurp_struct_ {
 	/* receive data in a callback function; keeps away useless allocation for memory mapping */
 	int (*receive)(slurp_t *, int (*callback)(const void *, size_t, void *), size_t length, void *userdata);
 
+	/* NULL unless sample data is being deferred (see above) */
+	struct slurp_sample_refs *sample_refs;
+
+	/* NULL unless someone is watching the load (see slurp_set_progress) */
+	int (*progress)(slurp_t *, void *);
+	void *progress_data;
+	int cancelled;
+
 	union {
 		struct {
 			unsigned char *data;
@@ -110,7 +130,19 @@ int slurp_receive(slurp_t *t, int (*callback)(const void *, size_t, void *), siz
 
 size_t slurp_length(slurp_t *t);
 
+/* Calls 'progress' before every read, so it can look at slurp_tell to see how
+far along things are. If it returns nonzero, the read fails, and so does every
+read after it: the file appears to end right there, which every loader already
+has to cope with anyway. */
+void slurp_set_progress(slurp_t *t, int (*progress)(slurp_t *, void *), void *data);
+
 /* csndfile */
 int slurp_read_sample(slurp_t *t, song_sample_t *sample, uint32_t flags);
 
+/* read the data for a sample that was deferred while loading `filename`. returns zero
+if the sample wasn't deferred (e.g. it was already loaded, or isn't one of that song's
+samples at all), negative on error. this reads the file, so don't call it with the
+audio locked */
+int slurp_read_deferred_sample(const char *filename, struct slurp_sample_refs *refs, song_sample_t *sample);
+
 #endif /* SCHISM_SLURP_H */
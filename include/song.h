@@ -52,6 +52,7 @@ extern unsigned int max_channels_used;
 struct audio_settings {
 	int sample_rate, bits, channels, buffer_size;
 	int channel_limit, interpolation_mode;
+	int voice_pool; /* channels + background voices; only settable in the config file */
 
 	struct {
 		int left;
@@ -60,9 +61,20 @@ struct audio_settings {
 	
 	int surround_effect;
 
-	unsigned int eq_freq[4];
-	unsigned int eq_gain[4];
+	/* the first four are on the preferences page; the rest can only be set in
+	the config file, and their frequency is in Hz */
+	int eq_bands;
+	unsigned int eq_freq[MAX_EQ_BANDS];
+	unsigned int eq_gain[MAX_EQ_BANDS];
 	int no_ramping;
+
+	/* offline sample resampling (see sample-edit.h) */
+	int resample_quality;
+	int import_resample; /* convert samples above the mixing rate when loading them */
+
+	/* native JACK output */
+	int jack_channel_ports; /* a stereo pair of outputs for every channel */
+	int jack_transport; /* follow the JACK transport */
 };
 
 extern struct audio_settings audio_settings;
@@ -105,6 +117,9 @@ song_load_unchecked:
 	doesn't set the page after loading.
 	this also loads into the global song.
 	return value is nonzero if the load was successful.
+	the file is read on another thread, so the old song keeps playing
+	until the new one is ready; if it takes a while, there's a progress
+	dialog, and Escape cancels the load (leaving the old song in place).
 	generally speaking, don't use this function directly;
 	use song_load instead.
 song_create_load:
@@ -123,6 +138,22 @@ const char *fmt_strerror(int n);
 int song_save(const char *file, const char *type); // IT, S3M
 int song_export(const char *file, const char *type); // WAV
 
+/* song_save writes a snapshot of the song out on another thread, and only
+reports errors opening the file; anything else turns up in song_save_finish,
+which main calls when the SCHISM_EVENT_SAVE_DONE event comes in. song_save_wait
+blocks until the save in progress (if any) is finished. */
+void song_save_finish(void);
+void song_save_wait(void);
+/* called from the main loop; saves a copy to ~/.schism/autosave.it every
+cfg_autosave_interval minutes while there are unsaved changes */
+void song_autosave_poll(void);
+/* also called from the main loop; picks up whatever the audio backend couldn't
+deal with from its own thread (currently, the JACK server going away and the
+JACK transport starting or stopping). song_audio_poll_timeout returns how soon,
+in milliseconds, it wants to be called again, or -1 if it doesn't care. */
+void song_audio_poll(void);
+int song_audio_poll_timeout(void);
+
 /* 'num' is only for status text feedback -- all of the sample's data is taken from 'smp'.
 this provides an eventual mechanism for saving samples modified from disk (not yet implemented) */
 int song_save_sample(const char *file, const char *type, song_sample_t *smp, int num);
@@ -283,6 +314,17 @@ int song_keydown(int samp, int ins, int note, int vol, int chan);
 int song_keyrecord(int samp, int ins, int note, int vol, int chan, int effect, int param);
 int song_keyup(int samp, int ins, int note);
 int song_keyup_channel(int samp, int ins, int note, int chan);
+/* timestamp (from SDL_GetPerformanceCounter) to use for keyjazz notes instead
+of the current time, e.g. when a MIDI note is handled; zero to go back */
+void song_set_keyjazz_time(uint64_t time);
+/* Called from the MIDI input thread: queues a MIDI note (vol < 0 for a note-off)
+for the audio thread with the same sample, instrument and channel as the last
+MIDI note the UI played, if nothing else has happened in the UI since then.
+Note-offs for notes that were played this way always go the same way. Returns
+zero if it didn't, and the note has to go through the event loop. */
+int song_live_midi_note(int note, int vol, uint64_t time);
+/* something happened in the UI, so MIDI notes might mean something else now */
+void song_forget_live_midi(void);
 
 void song_start(void);
 void song_start_once(void);
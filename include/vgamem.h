@@ -24,6 +24,7 @@
 #ifndef SCHISM_VGAMEM_H_
 #define SCHISM_VGAMEM_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 void vgamem_clear(void);
@@ -39,6 +40,15 @@ struct vgamem_overlay {
 
 void vgamem_flip(void);
 
+/* ORs in the rows of text (0-49) that changed in any vgamem_flip() since the
+last call, and forgets about them */
+void vgamem_collect_dirty(uint8_t rows[50]);
+
+/* Marks every row as changed. vgamem only notices cells changing, so this has
+to be called after anything that changes what the cells look like instead, like
+loading or editing the font. */
+void vgamem_dirty_all(void);
+
 void vgamem_ovl_alloc(struct vgamem_overlay *n);
 void vgamem_ovl_apply(struct vgamem_overlay *n);
 
@@ -71,6 +81,13 @@ void draw_fill_chars(int xs, int ys, int xe, int ye, uint32_t fg, uint32_t bg);
 void draw_half_width_chars(uint8_t c1, uint8_t c2, int x, int y,
 			   uint32_t fg1, uint32_t bg1, uint32_t fg2, uint32_t bg2);
 
+/* copying runs of character cells out of and back into the screen, for things
+ * that draw the same text over and over (see draw_note_cached). the buffer has
+ * to have room for len * vgamem_cell_size bytes. */
+extern const size_t vgamem_cell_size;
+void vgamem_save_cells(void *buf, int x, int y, int len);
+void vgamem_load_cells(const void *buf, int x, int y, int len);
+
 /* --------------------------------------------------------------------- */
 /* boxes */
 
@@ -111,6 +128,11 @@ void draw_box(int xs, int ys, int xe, int ye, int flags);
 struct song_sample;
 void draw_sample_data(struct vgamem_overlay *r, struct song_sample *sample);
 
+/* draw_sample_data caches the waveform of long samples; this has to be called
+ * after changing frames start..end-1 of a sample's data in place, so that
+ * the cache gets patched up. (reallocating the data takes care of itself) */
+void draw_sample_data_invalidate(struct song_sample *sample, uint32_t start, uint32_t end);
+
 /* this works like draw_sample_data, just without having to allocate a
  * song_sample structure, and without caching the waveform.
  * mostly it's just for the oscilloscope view. */
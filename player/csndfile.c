@@ -33,6 +33,8 @@
 #include "util.h"
 #include "fmt.h" // for it_decompress8 / it_decompress16
 
+#include "sdlmain.h" // for SDL_atomic_t
+
 
 static void _csf_reset(song_t *csf)
 {
@@ -63,8 +65,11 @@ static void _csf_reset(song_t *csf)
 	csf->mix_bits_per_sample = 8;
 	csf->mix_channels = 1;
 
-	memset(csf->voices, 0, sizeof(csf->voices));
-	memset(csf->voice_mix, 0, sizeof(csf->voice_mix));
+	if (csf->voices) {
+		memset(csf->voices, 0, csf->voice_pool_size * sizeof(song_voice_t));
+		memset(csf->voice_mix, 0, csf->voice_pool_size * sizeof(uint32_t));
+	}
+	csf->voice_alloc_valid = 0;
 	memset(csf->samples, 0, sizeof(csf->samples));
 	memset(csf->instruments, 0, sizeof(csf->instruments));
 	memset(csf->orderlist, 0xFF, sizeof(csf->orderlist));
@@ -89,12 +94,61 @@ static void _csf_reset(song_t *csf)
 	}
 }
 
+//////////////////////////////////////////////////////////
+// voice pool
+
+uint32_t csf_voice_pool_size = MAX_VOICES;
+
+/* the voices, then the NNA heap, the mix list, and the free list */
+static size_t _voice_block_size(uint32_t size)
+{
+	return size * (sizeof(song_voice_t) + sizeof(uint64_t) + 2 * sizeof(uint32_t));
+}
+
+static void _set_voice_block(song_t *csf, void *block, uint32_t size)
+{
+	csf->voices = block;
+	csf->voice_heap = (uint64_t *) (csf->voices + size);
+	csf->voice_mix = (uint32_t *) (csf->voice_heap + size);
+	csf->voice_free = csf->voice_mix + size;
+	csf->voice_pool_size = size;
+	csf->voice_nfree = csf->voice_nheap = 0;
+	csf->voice_alloc_valid = 0;
+}
+
+void csf_set_voice_pool(song_t *csf, uint32_t size)
+{
+	size = CLAMP(size, MAX_CHANNELS, MAX_VOICE_POOL);
+	free(csf->voices);
+	_set_voice_block(csf, mem_calloc(1, _voice_block_size(size)), size);
+	csf->num_voices = 0;
+}
+
+void csf_copy_voices(song_t *dest, const song_t *src)
+{
+	void *block = mem_alloc(_voice_block_size(src->voice_pool_size));
+
+	memcpy(block, src->voices, _voice_block_size(src->voice_pool_size));
+	_set_voice_block(dest, block, src->voice_pool_size);
+}
+
+void csf_free_voices(song_t *csf)
+{
+	free(csf->voices);
+	csf->voices = NULL;
+	csf->voice_heap = NULL;
+	csf->voice_mix = csf->voice_free = NULL;
+	csf->voice_pool_size = 0;
+	csf->num_voices = 0;
+}
+
 //////////////////////////////////////////////////////////
 // song_t
 
 song_t *csf_allocate(void)
 {
 	song_t *csf = mem_calloc(1, sizeof(song_t));
+	csf_set_voice_pool(csf, csf_voice_pool_size);
 	_csf_reset(csf);
 	return csf;
 }
@@ -103,6 +157,7 @@ void csf_free(song_t *csf)
 {
 	if (csf) {
 		csf_destroy(csf);
+		csf_free_voices(csf);
 		free(csf);
 	}
 }
@@ -149,10 +204,56 @@ void csf_free_instrument(song_instrument_t *i)
 }
 
 
+song_t *csf_snapshot(song_t *csf)
+{
+	song_t *snap = mem_alloc(sizeof(song_t));
+	int n;
+
+	memcpy(snap, csf, sizeof(song_t));
+	memset(&snap->pool, 0, sizeof(snap->pool));
+	memset(&snap->scratch, 0, sizeof(snap->scratch));
+	snap->multi_write = NULL;
+	/* (savers don't look at the voices) */
+	snap->voices = NULL;
+	snap->voice_heap = NULL;
+	snap->voice_mix = snap->voice_free = NULL;
+	snap->voice_pool_size = 0;
+
+	for (n = 0; n < MAX_PATTERNS; n++) {
+		if (!csf->patterns[n])
+			continue;
+		snap->patterns[n] = csf_allocate_pattern(csf->pattern_alloc_size[n]);
+		memcpy(snap->patterns[n], csf->patterns[n],
+			csf->pattern_alloc_size[n] * MAX_CHANNELS * sizeof(song_note_t));
+	}
+	for (n = 0; n < MAX_INSTRUMENTS; n++) {
+		if (!csf->instruments[n])
+			continue;
+		snap->instruments[n] = mem_alloc(sizeof(song_instrument_t));
+		memcpy(snap->instruments[n], csf->instruments[n], sizeof(song_instrument_t));
+	}
+	/* (sample zero is scratch space, and csf_destroy doesn't free it) */
+	snap->samples[0].data = NULL;
+	for (n = 1; n < MAX_SAMPLES; n++)
+		csf_share_sample(snap->samples[n].data);
+	snap->samples[MAX_SAMPLES].data = NULL;
+
+	if (csf->histdata) {
+		snap->histdata = csf_pool_alloc(&snap->pool, 8 * csf->histlen);
+		memcpy(snap->histdata, csf->histdata, 8 * csf->histlen);
+	}
+
+	return snap;
+}
+
+
 void csf_destroy(song_t *csf)
 {
 	int i;
 
+	csf_pool_release(&csf->scratch);
+	csf_pool_release(&csf->pool);
+
 	for (i = 0; i < MAX_PATTERNS; i++) {
 		if (csf->patterns[i]) {
 			csf_free_pattern(csf->patterns[i]);
@@ -186,24 +287,145 @@ void csf_free_pattern(void *pat)
 	free(pat);
 }
 
+//////////////////////////////////////////////////////////
+// memory pools
+
+#define POOL_CHUNK_SIZE (64 * 1024)
+
+struct csf_pool_chunk {
+	struct csf_pool_chunk *next;
+	size_t used, size;
+	/* keep the data suitably aligned for anything */
+	union {
+		long double ld;
+		void *p;
+		uint64_t u;
+	} data[];
+};
+
+void *csf_pool_alloc(csf_pool_t *pool, size_t size)
+{
+	struct csf_pool_chunk *chunk = pool->chunks;
+	void *p;
+
+	size = (size + sizeof(chunk->data[0]) - 1) & ~(sizeof(chunk->data[0]) - 1);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t csize = MAX(size, POOL_CHUNK_SIZE - sizeof(*chunk));
+
+		chunk = mem_calloc(1, sizeof(*chunk) + csize);
+		chunk->size = csize;
+		if (pool->chunks && csize == size) {
+			/* oversized; tuck it in behind the current chunk so that the
+			space left over in that one doesn't go to waste */
+			chunk->next = pool->chunks->next;
+			pool->chunks->next = chunk;
+		} else {
+			chunk->next = pool->chunks;
+			pool->chunks = chunk;
+		}
+	}
+
+	p = (char *) chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+void csf_pool_release(csf_pool_t *pool)
+{
+	struct csf_pool_chunk *chunk = pool->chunks, *next;
+
+	while (chunk) {
+		next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	pool->chunks = NULL;
+}
+
+/* room for the loop guards (normal and sustain) after the end padding,
+plus some slack for aligning them */
+#define SAMPLE_GUARD_SPACE (8 + 2 * (sizeof(struct sample_loop_guard) + SAMPLE_GUARD_FRAMES * 4))
+
+/* sample data is reference counted, so a snapshot of the song (see csf_snapshot)
+can hang on to it while it's being saved. the count lives in front of the
+buffer, out of the interpolation's reach. it's atomic since samples are
+allocated and freed on the loader, stream and pager threads as well as the main
+one; sharing only ever happens on the main thread, but that doesn't stop some
+other thread from dropping its own reference at the same time. */
+struct sample_header {
+	union {
+		struct {
+			SDL_atomic_t refs;
+			struct sample_pager *pager; /* see csf_allocate_paged_sample */
+		} h;
+		uint8_t pad[16];
+	} u;
+};
+
+#define SAMPLE_HEADER(p) ((struct sample_header *) ((signed char *) (p) - 16 - sizeof(struct sample_header)))
+
 signed char *csf_allocate_sample(uint32_t nbytes)
 {
 	/* Sinc interpolation can look forwards or backwards
 	 * 4 samples; the maximum sample size for Schism is
 	 * 4 bytes per sample (16-bit stereo, 2 * 2). 4 * 4 = 16,
-	 * so allocate 16 extra bytes before and after the buffer */
-	return (signed char*)mem_calloc(1, nbytes + 32) + 16;
+	 * so allocate 16 extra bytes before and after the buffer
+	 * (and then the loop guards after that) */
+	struct sample_header *hdr = mem_calloc(1, sizeof(struct sample_header) + nbytes + 32 + SAMPLE_GUARD_SPACE);
+	SDL_AtomicSet(&hdr->u.h.refs, 1);
+	return (signed char *) (hdr + 1) + 16;
+}
+
+signed char *csf_allocate_paged_sample(struct sample_pager *pager, uint32_t nbytes)
+{
+	signed char *p = csf_allocate_sample(nbytes);
+
+	SAMPLE_HEADER(p)->u.h.pager = pager;
+	return p;
+}
+
+struct sample_pager *csf_sample_pager(const signed char *data)
+{
+	return data ? SAMPLE_HEADER(data)->u.h.pager : NULL;
+}
+
+/* bumped by whichever thread drops the last reference (see above) */
+static SDL_atomic_t freed_samples;
+
+uint32_t csf_freed_samples(void)
+{
+	return (uint32_t) SDL_AtomicGet(&freed_samples);
 }
 
 void csf_free_sample(void *p)
+{
+	if (p) {
+		struct sample_header *hdr = SAMPLE_HEADER(p);
+		if (!SDL_AtomicDecRef(&hdr->u.h.refs))
+			return;
+		if (hdr->u.h.pager)
+			hdr->u.h.pager->free(hdr->u.h.pager);
+		free(hdr);
+		SDL_AtomicIncRef(&freed_samples);
+	}
+}
+
+signed char *csf_share_sample(signed char *p)
 {
 	if (p)
-		free((signed char*)p - 16);
+		SDL_AtomicIncRef(&SAMPLE_HEADER(p)->u.h.refs);
+	return p;
+}
+
+int csf_sample_is_shared(const signed char *p)
+{
+	return p && SDL_AtomicGet(&SAMPLE_HEADER(p)->u.h.refs) > 1;
 }
 
 void csf_forget_history(song_t *csf)
 {
-	free(csf->histdata);
+	/* the data itself is in csf->pool, and goes away with the song */
 	csf->histdata = NULL;
 	csf->histlen = 0;
 	gettimeofday(&csf->editstart, NULL);
@@ -405,11 +627,34 @@ midi_config_t default_midi_config;
 void csf_reset_midi_cfg(song_t *csf)
 {
 	memcpy(&csf->midi_config, &default_midi_config, sizeof(default_midi_config));
+	csf_compile_midi_cfg(csf);
 }
 
 void csf_copy_midi_cfg(song_t *dest, song_t *src)
 {
 	memcpy(&dest->midi_config, &src->midi_config, sizeof(midi_config_t));
+	memcpy(&dest->midi_compiled, &src->midi_compiled, sizeof(midi_compiled_t));
+}
+
+void csf_compile_midi_cfg(song_t *csf)
+{
+	const midi_config_t *cfg = &csf->midi_config;
+	midi_compiled_t *out = &csf->midi_compiled;
+	int n;
+
+	csf_compile_midi_macro(&out->start, cfg->start);
+	csf_compile_midi_macro(&out->stop, cfg->stop);
+	csf_compile_midi_macro(&out->tick, cfg->tick);
+	csf_compile_midi_macro(&out->note_on, cfg->note_on);
+	csf_compile_midi_macro(&out->note_off, cfg->note_off);
+	csf_compile_midi_macro(&out->set_volume, cfg->set_volume);
+	csf_compile_midi_macro(&out->set_panning, cfg->set_panning);
+	csf_compile_midi_macro(&out->set_bank, cfg->set_bank);
+	csf_compile_midi_macro(&out->set_program, cfg->set_program);
+	for (n = 0; n < 16; n++)
+		csf_compile_midi_macro(&out->sfx[n], cfg->sfx[n]);
+	for (n = 0; n < 128; n++)
+		csf_compile_midi_macro(&out->zxx[n], cfg->zxx[n]);
 }
 
 
@@ -447,7 +692,7 @@ int csf_set_resampling_mode(song_t *csf, uint32_t mode)
 static void set_current_pos_0(song_t *csf)
 {
 	song_voice_t *v = csf->voices;
-	for (uint32_t i = 0; i < MAX_VOICES; i++, v++) {
+	for (uint32_t i = 0; i < csf->voice_pool_size; i++, v++) {
 		memset(v, 0, sizeof(*v));
 		v->note = v->new_note = 1;
 		v->cutoff = 0x7F;
@@ -469,7 +714,7 @@ static void set_current_pos_0(song_t *csf)
 
 void csf_set_current_order(song_t *csf, uint32_t position)
 {
-	for (uint32_t j = 0; j < MAX_VOICES; j++) {
+	for (uint32_t j = 0; j < csf->voice_pool_size; j++) {
 		song_voice_t *v = csf->voices + j;
 
 		v->frequency = 0;
@@ -484,6 +729,7 @@ void csf_set_current_order(song_t *csf, uint32_t position)
 		v->vibrato_position = (csf->flags & SONG_ITOLDEFFECTS) ? 0 : 0x10;
 		v->tremolo_position = 0;
 	}
+	csf->voice_alloc_valid = 0;
 	if (position > MAX_ORDERS)
 		position = 0;
 	if (!position)
@@ -535,25 +781,49 @@ void csf_loop_pattern(song_t *csf, int pat, int row)
 
 /* --------------------------------------------------------------------------------------------------------- */
 
+/* how many samples csf_write_sample converts at a time */
+#define SF_WRITE_BLOCK 4096
+
 #define SF_FAIL(name, n) \
 	do { log_appendf(4, "%s: internal error: unsupported %s %d", __func__, name, n); return 0; } while (0);
 
+/* frames pos..pos+count-1 of a paged sample, read into buf (with silence if the file comes up short) */
+static const signed char *_paged_frames(struct sample_pager *pager, uint32_t pos, uint32_t count,
+	signed char *buf, uint32_t fs)
+{
+	uint32_t got = pager->read(pager, pos, buf, count);
+
+	if (got < count)
+		memset(buf + got * fs, 0, (count - got) * fs);
+	return buf;
+}
+
 uint32_t csf_write_sample(disko_t *fp, song_sample_t *sample, uint32_t flags, uint32_t maxlengthmask)
 {
 	uint32_t pos, len = sample->length;
 	if(maxlengthmask != UINT32_MAX)
 		len = len > maxlengthmask ? maxlengthmask : (len & maxlengthmask);
 	int stride = 1;           // how much to add to the left/right pointer per sample written
+	int per_frame = 1;        // how many samples are written per frame on each pass
 	int byteswap = 0;         // should the sample data be byte-swapped?
 	int add = 0;              // how much to add to the sample data (for converting to unsigned/delta)
 	int channel;              // counter.
+	int bytes;                // per sample
+	uint32_t count, n, fs;
+	struct sample_pager *pager;
+	const signed char *src;
+	signed char *paged = NULL; // paged samples are read into this a block at a time
+	union {
+		uint16_t s16[SF_WRITE_BLOCK];
+		uint8_t s8[SF_WRITE_BLOCK];
+	} block;
 
 	// validate the write flags, and set up the save params
 	switch (flags & SF_CHN_MASK) {
 	case SF_SI:
 		if (!(sample->flags & CHN_STEREO))
 			SF_FAIL("channel mask", flags & SF_CHN_MASK);
-		len *= 2;
+		per_frame = 2;
 		break;
 	case SF_SS:
 		if (!(sample->flags & CHN_STEREO))
@@ -608,94 +878,68 @@ uint32_t csf_write_sample(disko_t *fp, song_sample_t *sample, uint32_t flags, ui
 		SF_FAIL("extra flag", flags & ~(SF_BIT_MASK | SF_CHN_MASK | SF_END_MASK | SF_ENC_MASK));
 	}
 
-	if (!sample || sample->length < 1 || sample->length > MAX_SAMPLE_LENGTH || !sample->data)
+	if (!sample || sample->length < 1 || !sample->data)
+		return 0;
+	pager = csf_sample_pager(sample->data);
+	if (sample->length > (pager ? MAX_PAGED_SAMPLE_LENGTH : MAX_SAMPLE_LENGTH))
 		return 0;
 
-	// No point buffering the processing here -- the disk output already SHOULD have a 64kb buffer
-	switch (flags & SF_ENC_MASK) {
-	case SF_PCMU:
-	case SF_PCMS:
-		if ((flags & SF_BIT_MASK) == SF_16) {
-			// 16-bit data.
-			const int16_t *data;
-
-			for (channel = 0; channel < stride; channel++) {
-				data = (const int16_t *) sample->data + channel;
-				for (pos = 0; pos < len; pos++) {
-					uint16_t v = *data + add;
-					if (byteswap)
-						v = bswap_16(v);
-
-					disko_write(fp, &v, 2);
-					
-					data += stride;
-				}
-			}
-
-			len *= 2;
-		} else {
-			// 8-bit data. Mostly the same as above, but a little bit simpler since
-			// there's no byteswapping, and the values can be written with putc.
-			const int8_t *data;
-			uint8_t c;
-
-			for (channel = 0; channel < stride; channel++) {
-				int v_old = 0;
-
-				data = (const int8_t *) sample->data + channel;
-				for (pos = 0; pos < len; pos++) {
-					disko_putc(fp, *data + add);
-					data += stride;
-				}
-			}
+	bytes = ((flags & SF_BIT_MASK) == SF_16) ? 2 : 1;
+	fs = bytes * ((sample->flags & CHN_STEREO) ? 2 : 1);
+	if (pager)
+		paged = mem_alloc(SF_WRITE_BLOCK * fs);
+
+	if (stride == 1 && !add && !byteswap && (flags & SF_ENC_MASK) != SF_PCMD) {
+		// it's already in the right format, so hand the whole thing over at once
+		// (or as much of it as is in memory at once, for a paged sample)
+		if (!pager) {
+			disko_write(fp, sample->data, len * fs);
+			return len * fs;
 		}
-		break;
-	case SF_PCMD:
-		if ((flags & SF_BIT_MASK) == SF_16) {
-			const int16_t *data;
+		for (pos = 0; pos < len; pos += count) {
+			count = MIN(len - pos, SF_WRITE_BLOCK);
+			disko_write(fp, _paged_frames(pager, pos, count, paged, fs), count * fs);
+		}
+		free(paged);
+		return len * fs;
+	}
 
-			for (channel = 0; channel < stride; channel++) {
-				int v_old = 0;
+	// otherwise convert a block at a time, so the output gets a few big writes
+	// rather than one per sample
+	for (channel = 0; channel < stride; channel++) {
+		int v_old = 0;
 
-				data = (const int16_t *)sample->data + channel;
-				for (pos = 0; pos < len; pos++) {
-					int v_new = *data + add;
+		for (pos = 0; pos < len; pos += count) {
+			count = MIN(len - pos, SF_WRITE_BLOCK / per_frame);
+			src = pager ? _paged_frames(pager, pos, count, paged, fs) : sample->data + pos * fs;
 
-					int16_t c = v_new - v_old;
-					if (byteswap)
-						c = bswap_16(c);
+			if (bytes == 2) {
+				const int16_t *data = (const int16_t *) src + channel;
 
-					disko_write(fp, &c, 2);
+				for (n = 0; n < count * per_frame; n++, data += stride) {
+					int v_new = *data + add;
+					uint16_t v = (flags & SF_ENC_MASK) == SF_PCMD ? v_new - v_old : v_new;
 
+					block.s16[n] = byteswap ? bswap_16(v) : v;
 					v_old = v_new;
-
-					data += stride;
 				}
-			}
-		} else {
-			const int8_t *data;
-			int v_old = 0;
-
-			for (channel = 0; channel < stride; channel++) {
-				int v_old = 0;
+				disko_write(fp, block.s16, count * per_frame * 2);
+			} else {
+				const int8_t *data = (const int8_t *) src + channel;
 
-				data = (const int8_t *)sample->data + channel;
-				for (pos = 0; pos < len; pos++) {
+				for (n = 0; n < count * per_frame; n++, data += stride) {
 					int v_new = *data + add;
 
-					disko_putc(fp, (int8_t)(v_new - v_old));
-
+					block.s8[n] = (flags & SF_ENC_MASK) == SF_PCMD ? v_new - v_old : v_new;
 					v_old = v_new;
-
-					data += stride;
 				}
+				disko_write(fp, block.s8, count * per_frame);
 			}
 		}
-		break;
 	}
 
-	len *= stride;
-	return len;
+	free(paged);
+	return len * per_frame * stride * bytes;
 }
 
 
@@ -1190,8 +1434,100 @@ uint32_t csf_read_sample(song_sample_t *sample, uint32_t flags, const void *file
 	return len;
 }
 
+/* How many bytes of file data csf_read_sample will use for a sample, without actually reading it.
+Returns zero for compressed formats, where the size can't be known without decoding everything. */
+uint32_t csf_sample_data_length(const song_sample_t *sample, uint32_t flags)
+{
+	uint32_t len = MIN(sample->length, MAX_SAMPLE_LENGTH);
+
+	switch (flags & SF_ENC_MASK) {
+	case SF_PCMS: case SF_PCMU: case SF_PCMD:
+		break;
+	case SF_PTM:
+		return len * 2;
+	case SF_PCMD16:
+		return (len + 1) / 2 + 16;
+	default:
+		return 0;
+	}
+
+	switch (flags & SF_BIT_MASK) {
+	case SF_7: case SF_8: break;
+	case SF_16: len *= 2; break;
+	case SF_24: len *= 3; break;
+	case SF_32: len *= 4; break;
+	default: return 0;
+	}
+
+	switch (flags & SF_CHN_MASK) {
+	case SF_SI: case SF_SS:
+		len *= 2;
+	}
+
+	return len;
+}
+
 /* --------------------------------------------------------------------------------------------------------- */
 
+static struct sample_loop_guard *_loop_guard(const song_sample_t *sample, int n)
+{
+	uint32_t fs = ((sample->flags & CHN_16BIT) ? 2 : 1) * ((sample->flags & CHN_STEREO) ? 2 : 1);
+	uintptr_t p = (uintptr_t) (sample->data + sample->length * fs + 16);
+
+	p = (p + 7) & ~(uintptr_t) 7;
+	p += n * (sizeof(struct sample_loop_guard) + SAMPLE_GUARD_FRAMES * 4);
+	return (struct sample_loop_guard *) p;
+}
+
+/* which frame of the sample plays at 'pos', if the loop had kept going in
+both directions forever */
+static uint32_t _loop_frame(int64_t pos, uint32_t loop_start, uint32_t loop_end, int pingpong)
+{
+	int64_t len = loop_end - loop_start, t;
+
+	if (pingpong) {
+		/* the mixer plays the frames at each end twice on the way back
+		(see PINGPONG_OFFSET in mixer.c) */
+		t = (pos - loop_start) % (2 * len);
+		if (t < 0) t += 2 * len;
+		return loop_start + ((t < len) ? t : 2 * len - 1 - t);
+	}
+
+	t = (pos - loop_start) % len;
+	if (t < 0) t += len;
+	return loop_start + t;
+}
+
+static void _build_loop_guard(song_sample_t *sample, int n, int enabled,
+	uint32_t loop_start, uint32_t loop_end, int pingpong)
+{
+	struct sample_loop_guard *guard = _loop_guard(sample, n);
+	uint32_t fs = ((sample->flags & CHN_16BIT) ? 2 : 1) * ((sample->flags & CHN_STEREO) ? 2 : 1);
+	signed char *frames = (signed char *) (guard + 1);
+	int64_t pos = (int64_t) loop_end - SAMPLE_GUARD_BEHIND;
+	int i;
+
+	if (!enabled || (sample->flags & CHN_ADLIB) || loop_end > sample->length || loop_start + 2 >= loop_end) {
+		guard->data = NULL;
+		return;
+	}
+
+	for (i = 0; i < SAMPLE_GUARD_FRAMES; i++, pos++) {
+		/* the frames leading up to the loop end are what the sample really
+		has there, unless the loop is so short that they'd come from before
+		it starts; after the loop end, it's wherever the loop takes us */
+		uint32_t f = (pos >= loop_start && pos < loop_end)
+			? (uint32_t) pos
+			: _loop_frame(pos, loop_start, loop_end, pingpong);
+		memcpy(frames + i * fs, sample->data + f * fs, fs);
+	}
+
+	guard->loop_start = loop_start;
+	guard->loop_end = loop_end;
+	guard->pingpong = !!pingpong;
+	guard->data = sample->data;
+}
+
 void csf_adjust_sample_loop(song_sample_t *sample)
 {
 	if (!sample->data || sample->length < 1) return;
@@ -1201,6 +1537,11 @@ void csf_adjust_sample_loop(song_sample_t *sample)
 		sample->flags &= ~CHN_LOOP;
 	}
 
+	/* the end of a paged sample isn't in memory, and the mixer pages the loops in
+	like everything else */
+	if (csf_sample_pager(sample->data))
+		return;
+
 	// poopy, removing all that loop-hacking code has produced... very nasty sounding loops!
 	// so I guess I should rewrite the crap at the end of the sample at least.
 	uint32_t len = sample->length;
@@ -1249,6 +1590,30 @@ void csf_adjust_sample_loop(song_sample_t *sample)
 				= data[len-1];
 		}
 	}
+
+	_build_loop_guard(sample, 0, (sample->flags & CHN_LOOP),
+		sample->loop_start, sample->loop_end, (sample->flags & CHN_PINGPONGLOOP));
+	_build_loop_guard(sample, 1, (sample->flags & CHN_SUSTAINLOOP),
+		sample->sustain_start, sample->sustain_end, (sample->flags & CHN_PINGPONGSUSTAIN));
+}
+
+const struct sample_loop_guard *csf_get_loop_guard(const song_sample_t *sample,
+	uint32_t loop_start, uint32_t loop_end, int pingpong)
+{
+	const struct sample_loop_guard *guard;
+	int n;
+
+	if (!sample->data || (sample->flags & CHN_ADLIB) || csf_sample_pager(sample->data))
+		return NULL;
+
+	for (n = 0; n < 2; n++) {
+		guard = _loop_guard(sample, n);
+		if (guard->data == sample->data && guard->loop_start == loop_start
+		    && guard->loop_end == loop_end && guard->pingpong == !!pingpong)
+			return guard;
+	}
+
+	return NULL;
 }
 
 
@@ -1259,7 +1624,7 @@ void csf_stop_sample(song_t *csf, song_sample_t *smp)
 
 	if (!smp->data)
 		return;
-	for (int i = 0; i < MAX_VOICES; i++, v++) {
+	for (uint32_t i = 0; i < csf->voice_pool_size; i++, v++) {
 		if (v->ptr_sample == smp || v->current_sample_data == smp->data) {
 			v->note = v->new_note = 1;
 			v->new_instrument = 0;
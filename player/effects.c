@@ -104,8 +104,10 @@ void fx_note_cut(song_t *csf, uint32_t nchan, int clear_note)
 		OPL_NoteOff(nchan);
 		OPL_Touch(nchan, 0);
 	}
-	GM_KeyOff(nchan);
-	GM_Touch(nchan, 0);
+	if (CSF_MIDI_OUT(csf)) {
+		GM_KeyOff(nchan);
+		GM_Touch(nchan, 0);
+	}
 }
 
 void fx_key_off(song_t *csf, uint32_t nchan)
@@ -118,7 +120,8 @@ void fx_key_off(song_t *csf, uint32_t nchan)
 		//Do this only if really an adlib chan. Important!
 		OPL_NoteOff(nchan);
 	}
-	GM_KeyOff(nchan);
+	if (CSF_MIDI_OUT(csf))
+		GM_KeyOff(nchan);
 
 	song_instrument_t *penv = (csf->flags & SONG_INSTRUMENTMODE) ? chan->ptr_instrument : NULL;
 
@@ -690,8 +693,9 @@ static void fx_special(song_t *csf, uint32_t nchan, uint32_t param)
 		case 2:
 			{
 				song_voice_t *bkp = &csf->voices[MAX_CHANNELS];
-				for (uint32_t i=MAX_CHANNELS; i<MAX_VOICES; i++, bkp++) {
+				for (uint32_t i=MAX_CHANNELS; i<csf->voice_pool_size; i++, bkp++) {
 					if (bkp->master_channel == nchan+1) {
+						csf->voice_alloc_valid = 0;
 						if (param == 1) {
 							fx_key_off(csf, i);
 						} else if (param == 2) {
@@ -778,7 +782,7 @@ void csf_midi_send(song_t *csf, const unsigned char *data, unsigned int len, uin
 
 	if (len >= 1 && (data[0] == 0xFA || data[0] == 0xFC || data[0] == 0xFF)) {
 		// Start Song, Stop Song, MIDI Reset
-		for (uint32_t c = 0; c < MAX_VOICES; c++) {
+		for (uint32_t c = 0; c < csf->voice_pool_size; c++) {
 			csf->voices[c].cutoff = 0x7F;
 			csf->voices[c].resonance = 0x00;
 		}
@@ -790,28 +794,21 @@ void csf_midi_send(song_t *csf, const unsigned char *data, unsigned int len, uin
 		case 0x00: // set cutoff
 			if (data[3] < 0x80) {
 				chan->cutoff = data[3];
-				setup_channel_filter(chan, !(chan->flags & CHN_FILTER), 256, csf->mix_frequency);
+				setup_channel_filter(csf, chan, !(chan->flags & CHN_FILTER), 256);
 			}
 			break;
 		case 0x01: // set resonance
 			if (data[3] < 0x80) {
 				chan->resonance = data[3];
-				setup_channel_filter(chan, !(chan->flags & CHN_FILTER), 256, csf->mix_frequency);
+				setup_channel_filter(csf, chan, !(chan->flags & CHN_FILTER), 256);
 			}
 			break;
 		}
-	} else if (!fake && csf_midi_out_raw) {
-		/* okay, this is kind of how it works.
-		we pass buffer_count as here because while
-			1000 * ((8((buffer_size/2) - buffer_count)) / sample_rate)
-		is the number of msec we need to delay by, libmodplug simply doesn't know
-		what the buffer size is at this point so buffer_count simply has no
-		frame of reference.
-
-		fortunately, schism does and can complete this (tags: _schism_midi_out_raw )
-
-		*/
-		csf_midi_out_raw(data, len, csf->buffer_count);
+	} else if (!fake && csf_midi_out_raw && CSF_MIDI_OUT(csf)) {
+		/* the position is how far into the buffer being mixed the current tick
+		starts, in frames; the host knows when that buffer is going to be
+		heard, and can schedule the event from there (tags: _schism_midi_out_raw) */
+		csf_midi_out_raw(data, len, csf->buffer_offset);
 	}
 }
 
@@ -843,139 +840,96 @@ static uint8_t midi_event_length(uint8_t first_byte)
 
 
 
-void csf_process_midi_macro(song_t *csf, uint32_t nchan, const char * macro, uint32_t param,
-			uint32_t note, uint32_t velocity, uint32_t use_instr)
+/* The macro text is only read here, when the config changes; playing a macro
+just has to fill in the blanks (see midi_macro_t). Where the nibbles fall is
+known up front, since only the hex digits and 'c' are nibbles. */
+void csf_compile_midi_macro(midi_macro_t *macro, const char *text)
 {
-/* this was all wrong. -mrsb */
-	song_voice_t *chan = &csf->voices[nchan];
-	song_instrument_t *penv = ((csf->flags & SONG_INSTRUMENTMODE)
-				   && chan->last_instrument < MAX_INSTRUMENTS)
-			? csf->instruments[use_instr ? use_instr : chan->last_instrument]
-			: NULL;
-	unsigned char outbuffer[64];
-	int midi_channel, fake_midi_channel = 0;
-	int saw_c;
-	int nibble_pos = 0, write_pos = 0;
-
-	saw_c = 0;
-	if (!penv || penv->midi_channel_mask == 0) {
-		/* okay, there _IS_ no real midi channel. forget this for now... */
-		midi_channel = 15;
-		fake_midi_channel = 1;
+	int nibble_pos = 0;
+	uint8_t len = 0;
 
-	} else if (penv->midi_channel_mask >= 0x10000) {
-		midi_channel = (nchan-1) % 16;
-	} else {
-		midi_channel = 0;
-		while(!(penv->midi_channel_mask & (1 << midi_channel))) ++midi_channel;
-	}
+	memset(macro, 0, sizeof(*macro));
+	for (int read_pos = 0; read_pos < 32 && text[read_pos]; read_pos++) {
+		int nibble = -1; /* 16 for the channel */
+		uint8_t op = MIDI_OP_CONST;
 
-	for (int read_pos = 0; read_pos <= 32 && macro[read_pos]; read_pos++) {
-		unsigned char data = 0;
-		int is_nibble = 0;
-		switch (macro[read_pos]) {
+		switch (text[read_pos]) {
 			case '0': case '1': case '2':
 			case '3': case '4': case '5':
 			case '6': case '7': case '8':
 			case '9':
-				data = (unsigned char)(macro[read_pos] - '0');
-				is_nibble = 1;
+				nibble = text[read_pos] - '0';
 				break;
 			case 'A': case 'B': case 'C':
 			case 'D': case 'E': case 'F':
-				data = (unsigned char)((macro[read_pos] - 'A') + 0x0A);
-				is_nibble = 1;
-				break;
-			case 'c':
-				/* Channel */
-				data = (unsigned char)midi_channel;
-				is_nibble = 1;
-				saw_c = 1;
-				break;
-			case 'n':
-				/* Note */
-				data = (note - 1);
-				break;
-			case 'v': {
-				data = (unsigned char)CLAMP(velocity, 0x01, 0x7F);
-				break;
-			}
-			case 'u': {
-				/* Volume */
-				/* this will definitely be wrong when processing MIDI out */
-				if (!(chan->flags & CHN_MUTE))
-					data = (unsigned char)CLAMP(chan->final_volume >> 7, 0x01, 0x7F);
-				break;
-			}
-			case 'x':
-				/* Panning */
-				data = (unsigned char)MIN(chan->panning, 0x7F);
-				break;
-			case 'y':
-				/* Final Panning */
-				data = (unsigned char)MIN(chan->final_panning, 0x7F);
-				break;
-			case 'a':
-				/* MIDI Bank (high byte) */
-				if (penv && penv->midi_bank != -1)
-					data = (unsigned char)((penv->midi_bank >> 7) & 0x7F);
-				break;
-			case 'b':
-				/* MIDI Bank (low byte) */
-				if (penv && penv->midi_bank != -1)
-					data = (unsigned char)(penv->midi_bank & 0x7F);
-				break;
-			case 'p':
-				/* MIDI Program */
-				if (penv && penv->midi_program != -1)
-					data = (unsigned char)(penv->midi_program & 0x7F);
-				break;
-			case 'z':
-				/* Zxx Param */
-				data = (unsigned char)(param);
-				break;
-			case 'h':
-				/* Host channel */
-				data = (unsigned char)(nchan & 0x7F);
-				break;
-			case 'm':
-				/* Loop direction (judging from the macro letter, this was supposed to be
-				   loop mode instead, but a wrong offset into the channel structure was used in IT.) */
-				data = (chan->flags & CHN_PINGPONGFLAG) ? 1 : 0;
-				break;
-			case 'o':
-				/* OpenMPT test case ZxxSecrets.it:
-				   offsets are NOT clamped! also SAx doesn't count :) */
-				data = (unsigned char)((chan->mem_offset >> 8) & 0xFF);
+				nibble = (text[read_pos] - 'A') + 0x0A;
 				break;
+			case 'c': nibble = 16; macro->flags |= MIDI_MACRO_SAW_C; break;
+			case 'n': op = MIDI_OP_NOTE; break;
+			case 'v': op = MIDI_OP_VELOCITY; break;
+			case 'u': op = MIDI_OP_VOLUME; break;
+			case 'x': op = MIDI_OP_PANNING; break;
+			case 'y': op = MIDI_OP_FINAL_PANNING; break;
+			case 'a': op = MIDI_OP_BANK_HI; break;
+			case 'b': op = MIDI_OP_BANK_LO; break;
+			case 'p': op = MIDI_OP_PROGRAM; break;
+			case 'z': op = MIDI_OP_PARAM; break;
+			case 'h': op = MIDI_OP_HOST_CHANNEL; break;
+			case 'm': op = MIDI_OP_LOOP_DIR; break;
+			case 'o': op = MIDI_OP_OFFSET; break;
 			default:
 				continue;
 		}
 
-		if (is_nibble == 1) {
-			if (nibble_pos == 0) {
-				outbuffer[write_pos] = data;
-				nibble_pos = 1;
-			} else {
-				outbuffer[write_pos] = (outbuffer[write_pos] << 4) | data;
-				write_pos++;
+		if (nibble < 0) {
+			if (nibble_pos == 1) {
+				len++;
 				nibble_pos = 0;
 			}
+			macro->op[len++] = op;
+		} else if (nibble_pos == 0) {
+			/* on its own, this is the whole byte */
+			macro->op[len] = (nibble == 16) ? MIDI_OP_CHAN_LO : MIDI_OP_CONST;
+			macro->value[len] = (nibble == 16) ? 0 : nibble;
+			nibble_pos = 1;
 		} else {
-			if (nibble_pos == 1) {
-				write_pos++;
-				nibble_pos = 0;
+			/* the first nibble moves up */
+			if (macro->op[len] == MIDI_OP_CONST) {
+				if (nibble == 16) {
+					macro->op[len] = MIDI_OP_CHAN_LO;
+					macro->value[len] <<= 4;
+				} else {
+					macro->value[len] = (macro->value[len] << 4) | nibble;
+				}
+			} else if (nibble == 16) {
+				macro->op[len] = MIDI_OP_CHAN_BOTH;
+			} else {
+				macro->op[len] = MIDI_OP_CHAN_HI;
+				macro->value[len] = nibble;
 			}
-			outbuffer[write_pos] = data;
-			write_pos++;
+			len++;
+			nibble_pos = 0;
 		}
 	}
 	if (nibble_pos == 1) {
 		// Finish current byte
-		write_pos++;
+		len++;
 	}
+	macro->len = len;
+
+	if (len == 4 && macro->op[0] == MIDI_OP_CONST && macro->op[1] == MIDI_OP_CONST
+	    && macro->op[2] == MIDI_OP_CONST && macro->value[0] == 0xF0 && macro->value[1] == 0xF0) {
+		if (macro->value[2] == 0x00)
+			macro->flags |= MIDI_MACRO_CUTOFF;
+		else if (macro->value[2] == 0x01)
+			macro->flags |= MIDI_MACRO_RESONANCE;
+	}
+}
 
-	// Macro string has been parsed and translated, now send the message(s)...
+
+// Split up the translated macro and send the message(s)
+static void csf_midi_send_split(song_t *csf, uint32_t nchan, unsigned char *outbuffer, uint32_t write_pos, int fake)
+{
 	uint32_t send_pos = 0;
 	uint8_t running_status = 0;
 	while (send_pos < write_pos) {
@@ -1022,12 +976,121 @@ void csf_process_midi_macro(song_t *csf, uint32_t nchan, const char * macro, uin
 		if (outbuffer[send_pos] < 0xF0) {
 			running_status = outbuffer[send_pos];
 		}
-		csf_midi_send(csf, outbuffer + send_pos, send_length, nchan, saw_c && fake_midi_channel);
+		csf_midi_send(csf, outbuffer + send_pos, send_length, nchan, fake);
 		send_pos += send_length;
 	}
 }
 
 
+void csf_process_midi_macro(song_t *csf, uint32_t nchan, const midi_macro_t *macro, uint32_t param,
+			uint32_t note, uint32_t velocity, uint32_t use_instr)
+{
+/* this was all wrong. -mrsb */
+	song_voice_t *chan = &csf->voices[nchan];
+	song_instrument_t *penv;
+	unsigned char outbuffer[64];
+	int midi_channel, fake_midi_channel = 0;
+
+	if (!macro->len)
+		return;
+
+	penv = ((csf->flags & SONG_INSTRUMENTMODE)
+		&& chan->last_instrument < MAX_INSTRUMENTS)
+			? csf->instruments[use_instr ? use_instr : chan->last_instrument]
+			: NULL;
+	if (!penv || penv->midi_channel_mask == 0) {
+		/* okay, there _IS_ no real midi channel. forget this for now... */
+		midi_channel = 15;
+		fake_midi_channel = 1;
+
+	} else if (penv->midi_channel_mask >= 0x10000) {
+		midi_channel = (nchan-1) % 16;
+	} else {
+		midi_channel = 0;
+		while(!(penv->midi_channel_mask & (1 << midi_channel))) ++midi_channel;
+	}
+
+	for (int i = 0; i < macro->len; i++) {
+		unsigned char data = 0;
+		switch (macro->op[i]) {
+			case MIDI_OP_CONST:
+				data = macro->value[i];
+				break;
+			case MIDI_OP_CHAN_LO:
+				data = macro->value[i] | midi_channel;
+				break;
+			case MIDI_OP_CHAN_HI:
+				data = macro->value[i] | (midi_channel << 4);
+				break;
+			case MIDI_OP_CHAN_BOTH:
+				data = (midi_channel << 4) | midi_channel;
+				break;
+			case MIDI_OP_NOTE:
+				data = (note - 1);
+				break;
+			case MIDI_OP_VELOCITY:
+				data = (unsigned char)CLAMP(velocity, 0x01, 0x7F);
+				break;
+			case MIDI_OP_VOLUME:
+				/* this will definitely be wrong when processing MIDI out */
+				if (!(chan->flags & CHN_MUTE))
+					data = (unsigned char)CLAMP(chan->final_volume >> 7, 0x01, 0x7F);
+				break;
+			case MIDI_OP_PANNING:
+				data = (unsigned char)MIN(chan->panning, 0x7F);
+				break;
+			case MIDI_OP_FINAL_PANNING:
+				data = (unsigned char)MIN(chan->final_panning, 0x7F);
+				break;
+			case MIDI_OP_BANK_HI:
+				if (penv && penv->midi_bank != -1)
+					data = (unsigned char)((penv->midi_bank >> 7) & 0x7F);
+				break;
+			case MIDI_OP_BANK_LO:
+				if (penv && penv->midi_bank != -1)
+					data = (unsigned char)(penv->midi_bank & 0x7F);
+				break;
+			case MIDI_OP_PROGRAM:
+				if (penv && penv->midi_program != -1)
+					data = (unsigned char)(penv->midi_program & 0x7F);
+				break;
+			case MIDI_OP_PARAM:
+				data = (unsigned char)(param);
+				break;
+			case MIDI_OP_HOST_CHANNEL:
+				data = (unsigned char)(nchan & 0x7F);
+				break;
+			case MIDI_OP_LOOP_DIR:
+				/* Loop direction (judging from the macro letter, this was supposed to be
+				   loop mode instead, but a wrong offset into the channel structure was used in IT.) */
+				data = (chan->flags & CHN_PINGPONGFLAG) ? 1 : 0;
+				break;
+			case MIDI_OP_OFFSET:
+				/* OpenMPT test case ZxxSecrets.it:
+				   offsets are NOT clamped! also SAx doesn't count :) */
+				data = (unsigned char)((chan->mem_offset >> 8) & 0xFF);
+				break;
+		}
+		outbuffer[i] = data;
+	}
+
+	/* filter sweeps: no need to split anything up, or to look at the bytes again */
+	if (macro->flags & (MIDI_MACRO_CUTOFF | MIDI_MACRO_RESONANCE)) {
+		if (outbuffer[3] < 0x80) {
+			if (macro->flags & MIDI_MACRO_CUTOFF)
+				chan->cutoff = outbuffer[3];
+			else
+				chan->resonance = outbuffer[3];
+			setup_channel_filter(csf, chan, !(chan->flags & CHN_FILTER), 256);
+		}
+		return;
+	}
+
+	csf_midi_send_split(csf, nchan, outbuffer, macro->len,
+		(macro->flags & MIDI_MACRO_SAW_C) && fake_midi_channel);
+}
+
+
 ////////////////////////////////////////////////////////////
 // Length
 
@@ -1551,48 +1614,125 @@ void csf_note_change(song_t *csf, uint32_t nchan, int note, int porta, int retri
 }
 
 
+/* Picking a voice for a New Note Action used to mean going through every
+background voice, twice, for each note. Instead, there's a stack of the free
+ones (lowest number on top), and a heap of the rest ordered the same way the
+old search picked which one to steal. These are built the first time they're
+needed after the voices have changed (see csf_read_note), and kept up to date
+from there, so a pattern full of NNA notes only pays for it once per tick. */
+
+/* A voice's place in the heap: dead voices (no fadeout volume left) come first,
+and after those the quietest, then the furthest along its volume envelope.
+The voice number is in the low bits, so it's also the last tie-break. */
+#define NNA_KEY_VOICE(k)        ((uint32_t) ((k) & 0xfff))
+#define NNA_KEY_LIVE            (UINT64_C(1) << 61)
+#define NNA_KEY_STEAL           (NNA_KEY_LIVE | ((uint64_t) (64 * 65536) << 36)) /* 25% */
+
+static uint64_t nna_voice_key(const song_voice_t *v, uint32_t n)
+{
+	uint64_t loud;
+
+	if (!v->fadeout_volume)
+		return n;
+	loud = v->volume;
+	if (v->flags & CHN_NOTEFADE)
+		loud *= v->fadeout_volume;
+	else
+		loud <<= 16;
+	if (v->flags & CHN_LOOP)
+		loud >>= 1;
+	loud = MIN(loud, 0x1ffffff);
+	return NNA_KEY_LIVE | (loud << 36)
+		| ((uint64_t) (0xffffff - CLAMP(v->vol_env_position, 0, 0xffffff)) << 12) | n;
+}
+
+static void nna_heap_down(uint64_t *heap, uint32_t count, uint32_t i)
+{
+	uint64_t k = heap[i];
+
+	for (;;) {
+		uint32_t c = 2 * i + 1;
+		if (c >= count)
+			break;
+		if (c + 1 < count && heap[c + 1] < heap[c])
+			c++;
+		if (k <= heap[c])
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = k;
+}
+
+static void nna_heap_push(song_t *csf, uint64_t k)
+{
+	uint64_t *heap = csf->voice_heap;
+	uint32_t i = csf->voice_nheap++;
+
+	while (i > 0 && k < heap[(i - 1) / 2]) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = k;
+}
+
+static void nna_build(song_t *csf)
+{
+	uint32_t n;
+
+	csf->voice_nfree = csf->voice_nheap = 0;
+	for (n = csf->voice_pool_size; n-- > MAX_CHANNELS;) {
+		const song_voice_t *v = csf->voices + n;
+		if (!v->length && (!(v->flags & CHN_MUTE) || (v->flags & CHN_NNAMUTE)))
+			csf->voice_free[csf->voice_nfree++] = n;
+		else
+			csf->voice_heap[csf->voice_nheap++] = nna_voice_key(v, n);
+	}
+	for (n = csf->voice_nheap / 2; n-- > 0;)
+		nna_heap_down(csf->voice_heap, csf->voice_nheap, n);
+	csf->voice_taken = 0;
+	csf->voice_alloc_valid = 1;
+}
+
 uint32_t csf_get_nna_channel(song_t *csf, uint32_t nchan)
 {
 	song_voice_t *chan = &csf->voices[nchan];
+	uint32_t result;
+
+	if (!csf->voice_alloc_valid) {
+		nna_build(csf);
+	} else if (csf->voice_taken) {
+		/* the last one handed out is set up by now, so it can be stolen in turn */
+		nna_heap_push(csf, nna_voice_key(csf->voices + csf->voice_taken, csf->voice_taken));
+		csf->voice_taken = 0;
+	}
+
 	// Check for empty channel
-	song_voice_t *pi = &csf->voices[MAX_CHANNELS];
-	for (uint32_t i=MAX_CHANNELS; i<MAX_VOICES; i++, pi++) {
-		if (!pi->length) {
-			if (pi->flags & CHN_MUTE) {
-				if (pi->flags & CHN_NNAMUTE) {
-					pi->flags &= ~(CHN_NNAMUTE|CHN_MUTE);
-				} else {
-					/* this channel is muted; skip */
-					continue;
-				}
-			}
-			return i;
+	while (csf->voice_nfree) {
+		song_voice_t *pi;
+
+		result = csf->voice_free[--csf->voice_nfree];
+		pi = &csf->voices[result];
+		if (pi->length) {
+			nna_heap_push(csf, nna_voice_key(pi, result));
+			continue;
 		}
+		if (pi->flags & CHN_MUTE)
+			pi->flags &= ~(CHN_NNAMUTE|CHN_MUTE); /* (only NNA-muted ones are on the list) */
+		csf->voice_taken = result;
+		return result;
 	}
 	if (!chan->fadeout_volume) return 0;
-	// All channels are used: check for lowest volume
-	uint32_t result = 0;
-	uint32_t vol = 64*65536;        // 25%
-	int envpos = 0xFFFFFF;
-	const song_voice_t *pj = &csf->voices[MAX_CHANNELS];
-	for (uint32_t j=MAX_CHANNELS; j<MAX_VOICES; j++, pj++) {
-		if (!pj->fadeout_volume) return j;
-		uint32_t v = pj->volume;
-		if (pj->flags & CHN_NOTEFADE)
-			v = v * pj->fadeout_volume;
-		else
-			v <<= 16;
-		if (pj->flags & CHN_LOOP) v >>= 1;
-		if (v < vol || (v == vol && pj->vol_env_position > envpos)) {
-			envpos = pj->vol_env_position;
-			vol = v;
-			result = j;
-		}
-	}
-	if (result) {
-		/* unmute new nna channel */
+	// All channels are used: take the quietest, if it's quiet enough
+	if (!csf->voice_nheap || csf->voice_heap[0] >= NNA_KEY_STEAL)
+		return 0;
+	result = NNA_KEY_VOICE(csf->voice_heap[0]);
+	/* unmute new nna channel (but not dead ones, which were always taken as-is) */
+	if (csf->voice_heap[0] >= NNA_KEY_LIVE)
 		csf->voices[result].flags &= ~(CHN_MUTE|CHN_NNAMUTE);
-	}
+	csf->voice_heap[0] = csf->voice_heap[--csf->voice_nheap];
+	nna_heap_down(csf->voice_heap, csf->voice_nheap, 0);
+	csf->voice_taken = result;
 	return result;
 }
 
@@ -1632,8 +1772,10 @@ void csf_check_nna(song_t *csf, uint32_t nchan, uint32_t instr, int note, int fo
 			OPL_NoteOff(nchan);
 			OPL_Touch(nchan, 0);
 		}
-		GM_KeyOff(nchan);
-		GM_Touch(nchan, 0);
+		if (CSF_MIDI_OUT(csf)) {
+			GM_KeyOff(nchan);
+			GM_Touch(nchan, 0);
+		}
 		return;
 	}
 	if (instr >= MAX_INSTRUMENTS) instr = 0;
@@ -1652,7 +1794,7 @@ void csf_check_nna(song_t *csf, uint32_t nchan, uint32_t instr, int note, int fo
 	}
 	if (!penv) return;
 	p = chan;
-	for (uint32_t i=nchan; i<MAX_VOICES; p++, i++) {
+	for (uint32_t i=nchan; i<csf->voice_pool_size; p++, i++) {
 		if (!((i >= MAX_CHANNELS || p == chan)
 		      && ((p->master_channel == nchan + 1 || p == chan)
 			  && p->ptr_instrument)))
@@ -1673,6 +1815,8 @@ void csf_check_nna(song_t *csf, uint32_t nchan, uint32_t instr, int note, int fo
 
 		// Duplicate Note Action
 		if (apply_dna) {
+			if (i >= MAX_CHANNELS)
+				csf->voice_alloc_valid = 0;
 			switch(p->ptr_instrument->dca) {
 			case DCA_NOTECUT:
 				fx_note_cut(csf, i, 1);
@@ -1988,7 +2132,7 @@ static void handle_effect(song_t *csf, uint32_t nchan, uint32_t cmd, uint32_t pa
 			1 << 21);
 
 		csf_process_midi_macro(csf, nchan,
-			(param < 0x80) ? csf->midi_config.sfx[chan->active_macro] : csf->midi_config.zxx[param & 0x7F],
+			(param < 0x80) ? &csf->midi_compiled.sfx[chan->active_macro] : &csf->midi_compiled.zxx[param & 0x7F],
 			param, chan->note, vel, 0);
 		break;
 	}
@@ -2288,8 +2432,10 @@ void csf_process_effects(song_t *csf, int firsttick)
 					OPL_NoteOff(nchan);
 					OPL_Touch(nchan, 0);
 				}
-				GM_KeyOff(nchan);
-				GM_Touch(nchan, 0);
+				if (CSF_MIDI_OUT(csf)) {
+					GM_KeyOff(nchan);
+					GM_Touch(nchan, 0);
+				}
 			}
 
 			const int previous_new_note = chan->new_note; 
@@ -2316,7 +2462,7 @@ void csf_process_effects(song_t *csf, int firsttick)
 					OPL_Patch(nchan, csf->samples[instr].adlib_bytes);
 				}
 
-				if((csf->flags & SONG_INSTRUMENTMODE) && csf->instruments[instr])
+				if ((csf->flags & SONG_INSTRUMENTMODE) && csf->instruments[instr] && CSF_MIDI_OUT(csf))
 					GM_DPatch(nchan, csf->instruments[instr]->midi_program,
 						csf->instruments[instr]->midi_bank,
 						csf->instruments[instr]->midi_channel_mask);
@@ -2342,9 +2488,10 @@ void csf_process_effects(song_t *csf, int firsttick)
 						if (csf->samples[chan->new_instrument].flags & CHN_ADLIB) {
 							OPL_Patch(nchan, csf->samples[chan->new_instrument].adlib_bytes);
 						}
-						GM_DPatch(nchan, csf->instruments[chan->new_instrument]->midi_program,
-							csf->instruments[chan->new_instrument]->midi_bank,
-							csf->instruments[chan->new_instrument]->midi_channel_mask);
+						if (CSF_MIDI_OUT(csf))
+							GM_DPatch(nchan, csf->instruments[chan->new_instrument]->midi_program,
+								csf->instruments[chan->new_instrument]->midi_bank,
+								csf->instruments[chan->new_instrument]->midi_channel_mask);
 					}
 					chan->new_instrument = 0;
 				}
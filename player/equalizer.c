@@ -25,14 +25,29 @@
 #include "player/cmixer.h"
 #include "song.h"
 #include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+/* DAZ is in the same register as FTZ, but only pmmintrin.h has a name for it.
+(the earliest SSE2 processors don't have it, and fault if it's set, but every
+64-bit one does) */
+# if defined(__SSE3__) || defined(__x86_64__) || defined(_M_X64)
+#  define EQ_MXCSR_DENORMALS 0x0040
+# else
+#  define EQ_MXCSR_DENORMALS 0
+# endif
+#endif
 
 
 #define EQ_BANDWIDTH    2.0
 #define EQ_ZERO         0.000001
 
+/* Both sides always have the same settings, so each band is one set of
+coefficients with the left and right history side by side. */
 typedef struct {
     float a0, a1, a2, b1, b2;
-    float x1, x2, y1, y2;
+    float x1[2], x2[2], y1[2], y2[2];
     float gain, center_frequency;
     int   enabled;
 } eq_band;
@@ -42,41 +57,66 @@ typedef struct {
 //static REAL f2ic = (REAL)(1 << 28);
 //static REAL i2fc = (REAL)(1.0 / (1 << 28));
 
-static eq_band eq[MAX_EQ_BANDS * 2] =
+static eq_band eq[MAX_EQ_BANDS] =
 {
     // Default: Flat EQ
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,   120, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,   600, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,  1200, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,  3000, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,  6000, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 10000, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,   120, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,   600, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,  1200, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,  3000, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,  6000, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 10000, 0},
+    {0, 0, 0, 0, 0, {0}, {0}, {0}, {0}, 1,   120, 0},
+    {0, 0, 0, 0, 0, {0}, {0}, {0}, {0}, 1,   600, 0},
+    {0, 0, 0, 0, 0, {0}, {0}, {0}, {0}, 1,  1200, 0},
+    {0, 0, 0, 0, 0, {0}, {0}, {0}, {0}, 1,  3000, 0},
+    {0, 0, 0, 0, 0, {0}, {0}, {0}, {0}, 1,  6000, 0},
+    {0, 0, 0, 0, 0, {0}, {0}, {0}, {0}, 1, 10000, 0},
 };
 
+/* the bands that actually do something, in order; see initialize_eq */
+static unsigned int eq_active[MAX_EQ_BANDS];
+static unsigned int eq_nactive = 0;
+
+
+/* Every band runs over each frame before moving on to the next, rather than
+each band making its own pass over the buffer. The result is the same as
+running them one after another: each band's output is still truncated to an
+integer before it goes into the next one, as it was when the buffer was in
+between. */
+
+/* Denormals creep in as the history decays after the music stops, and they're
+very slow on some processors; anything this small is cleared after each chunk. */
+static void eq_flush(eq_band *pbs, int lanes)
+{
+	for (int c = 0; c < lanes; c++) {
+		if (fabsf(pbs->y1[c]) < EQ_ZERO)
+			pbs->y1[c] = 0;
+		if (fabsf(pbs->y2[c]) < EQ_ZERO)
+			pbs->y2[c] = 0;
+	}
+}
 
-static void eq_filter(eq_band *pbs, int *buffer, unsigned int count)
+static void eq_cascade(int *buffer, unsigned int count, int lanes)
 {
-	int amt = (!!(audio_settings.channels-1)+1); // if 1, amt is 1, else 2
-	for (unsigned int i = 0; i < count; i+=amt) {
-		float x = buffer[i];
-		float y = pbs->a1 * pbs->x1 +
-			  pbs->a2 * pbs->x2 +
-			  pbs->a0 * x +
-			  pbs->b1 * pbs->y1 +
-			  pbs->b2 * pbs->y2;
-
-		pbs->x2 = pbs->x1;
-		pbs->y2 = pbs->y1;
-		pbs->x1 = x;
-		buffer[i] = y;
-		pbs->y1 = y;
+	for (unsigned int i = 0; i < count; i++, buffer += lanes) {
+		for (int c = 0; c < lanes; c++) {
+			int v = buffer[c];
+			for (unsigned int n = 0; n < eq_nactive; n++) {
+				eq_band *pbs = &eq[eq_active[n]];
+				float x = v;
+				float y = pbs->a1 * pbs->x1[c] +
+					  pbs->a2 * pbs->x2[c] +
+					  pbs->a0 * x +
+					  pbs->b1 * pbs->y1[c] +
+					  pbs->b2 * pbs->y2[c];
+
+				pbs->x2[c] = pbs->x1[c];
+				pbs->y2[c] = pbs->y1[c];
+				pbs->x1[c] = x;
+				pbs->y1[c] = y;
+				v = y;
+			}
+			buffer[c] = v;
+		}
 	}
+
+	for (unsigned int n = 0; n < eq_nactive; n++)
+		eq_flush(&eq[eq_active[n]], lanes);
 }
 
 void normalize_mono(song_t *csf, int *buffer, unsigned int count)
@@ -97,27 +137,70 @@ void normalize_stereo(song_t *csf, int *buffer, unsigned int count)
 
 void eq_mono(song_t *csf, int *buffer, unsigned int count)
 {
-	for (unsigned int b = 0; b < MAX_EQ_BANDS; b++)
-	{
-		if (eq[b].enabled && eq[b].gain != 1.0f)
-			eq_filter(&eq[b], buffer, count);
-	}
+	eq_cascade(buffer, count, 1);
 }
 
-// XXX: I rolled the two loops into one. Make sure this works.
 void eq_stereo(song_t *csf, int *buffer, unsigned int count)
 {
-	for (unsigned int b = 0; b < MAX_EQ_BANDS; b++) {
-		int br = b + MAX_EQ_BANDS;
+#if defined(__SSE2__)
+	/* left and right in the low two lanes */
+	__m128 a0[MAX_EQ_BANDS], a1[MAX_EQ_BANDS], a2[MAX_EQ_BANDS], b1[MAX_EQ_BANDS], b2[MAX_EQ_BANDS];
+	__m128 x1[MAX_EQ_BANDS], x2[MAX_EQ_BANDS], y1[MAX_EQ_BANDS], y2[MAX_EQ_BANDS];
+	unsigned int i, n, csr;
+
+	if (!eq_nactive)
+		return;
+
+	/* flush denormals to zero as they happen, rather than just at the end of
+	the chunk; the rest of the mixer doesn't expect that, so it's put back */
+	csr = _mm_getcsr();
+	_mm_setcsr(csr | _MM_FLUSH_ZERO_ON | EQ_MXCSR_DENORMALS);
+
+	for (n = 0; n < eq_nactive; n++) {
+		const eq_band *pbs = &eq[eq_active[n]];
+		a0[n] = _mm_set1_ps(pbs->a0);
+		a1[n] = _mm_set1_ps(pbs->a1);
+		a2[n] = _mm_set1_ps(pbs->a2);
+		b1[n] = _mm_set1_ps(pbs->b1);
+		b2[n] = _mm_set1_ps(pbs->b2);
+		x1[n] = _mm_setr_ps(pbs->x1[0], pbs->x1[1], 0, 0);
+		x2[n] = _mm_setr_ps(pbs->x2[0], pbs->x2[1], 0, 0);
+		y1[n] = _mm_setr_ps(pbs->y1[0], pbs->y1[1], 0, 0);
+		y2[n] = _mm_setr_ps(pbs->y2[0], pbs->y2[1], 0, 0);
+	}
 
-		// Left band
-		if (eq[b].enabled && eq[b].gain != 1.0f)
-			eq_filter(&eq[b], buffer, count << 1);
+	for (i = 0; i < count; i++, buffer += 2) {
+		__m128i v = _mm_loadl_epi64((const __m128i *) buffer);
+		for (n = 0; n < eq_nactive; n++) {
+			__m128 x = _mm_cvtepi32_ps(v);
+			__m128 y = _mm_add_ps(_mm_mul_ps(a1[n], x1[n]), _mm_mul_ps(a2[n], x2[n]));
+			y = _mm_add_ps(y, _mm_mul_ps(a0[n], x));
+			y = _mm_add_ps(y, _mm_mul_ps(b1[n], y1[n]));
+			y = _mm_add_ps(y, _mm_mul_ps(b2[n], y2[n]));
+
+			x2[n] = x1[n];
+			y2[n] = y1[n];
+			x1[n] = x;
+			y1[n] = y;
+			v = _mm_cvttps_epi32(y);
+		}
+		_mm_storel_epi64((__m128i *) buffer, v);
+	}
 
-		// Right band
-		if (eq[br].enabled && eq[br].gain != 1.0f)
-			eq_filter(&eq[br], buffer + 1, count << 1);
+	_mm_setcsr(csr);
+
+	for (n = 0; n < eq_nactive; n++) {
+		eq_band *pbs = &eq[eq_active[n]];
+		float t[4];
+		_mm_storeu_ps(t, x1[n]); pbs->x1[0] = t[0]; pbs->x1[1] = t[1];
+		_mm_storeu_ps(t, x2[n]); pbs->x2[0] = t[0]; pbs->x2[1] = t[1];
+		_mm_storeu_ps(t, y1[n]); pbs->y1[0] = t[0]; pbs->y1[1] = t[1];
+		_mm_storeu_ps(t, y2[n]); pbs->y2[0] = t[0]; pbs->y2[1] = t[1];
+		eq_flush(pbs, 2);
 	}
+#else
+	eq_cascade(buffer, count, 2);
+#endif
 }
 
 
@@ -126,7 +209,8 @@ void initialize_eq(int reset, float freq)
 	//float fMixingFreq = (REAL)mix_frequency;
 
 	// Gain = 0.5 (-6dB) .. 2 (+6dB)
-	for (unsigned int band = 0; band < MAX_EQ_BANDS * 2; band++) {
+	eq_nactive = 0;
+	for (unsigned int band = 0; band < MAX_EQ_BANDS; band++) {
 		float k, k2, r, f;
 		float v0, v1;
 		int b = reset;
@@ -137,10 +221,10 @@ void initialize_eq(int reset, float freq)
 			eq[band].a2 = 0;
 			eq[band].b1 = 0;
 			eq[band].b2 = 0;
-			eq[band].x1 = 0;
-			eq[band].x2 = 0;
-			eq[band].y1 = 0;
-			eq[band].y2 = 0;
+			memset(eq[band].x1, 0, sizeof(eq[band].x1));
+			memset(eq[band].x2, 0, sizeof(eq[band].x2));
+			memset(eq[band].y1, 0, sizeof(eq[band].y1));
+			memset(eq[band].y2, 0, sizeof(eq[band].y2));
 			continue;
 		}
 
@@ -209,11 +293,14 @@ void initialize_eq(int reset, float freq)
 		}
 
 		if (b) {
-			eq[band].x1 = 0;
-			eq[band].x2 = 0;
-			eq[band].y1 = 0;
-			eq[band].y2 = 0;
+			memset(eq[band].x1, 0, sizeof(eq[band].x1));
+			memset(eq[band].x2, 0, sizeof(eq[band].x2));
+			memset(eq[band].y1, 0, sizeof(eq[band].y1));
+			memset(eq[band].y2, 0, sizeof(eq[band].y2));
 		}
+
+		if (eq[band].gain != 1.0f)
+			eq_active[eq_nactive++] = band;
 	}
 }
 
@@ -239,23 +326,12 @@ void set_eq_gains(const unsigned int *gainbuff, unsigned int gains, const unsign
 			g = 1;
 		}
 
-		eq[i].gain =
-		eq[i + MAX_EQ_BANDS].gain = g;
-		eq[i].center_frequency =
-		eq[i + MAX_EQ_BANDS].center_frequency = f;
+		eq[i].gain = g;
+		eq[i].center_frequency = f;
 
 		/* don't enable bands outside... */
-		if (f > 20.0f &&
-		    i < gains) {
-			eq[i].enabled =
-			eq[i + MAX_EQ_BANDS].enabled = 1;
-		}
-		else {
-			eq[i].enabled =
-			eq[i + MAX_EQ_BANDS].enabled = 0;
-		}
+		eq[i].enabled = (f > 20.0f && i < gains);
 	}
 
 	initialize_eq(reset, mix_freq);
 }
-
@@ -68,11 +68,36 @@ static const float resonance_table[128] = {
 // XXX freq WAS unused but is now mix_frequency!
 //
 #define FREQ_PARAM_MULT (128.0 / (24.0 * 256.0))
-void setup_channel_filter(song_voice_t *chan, int reset, int flt_modifier, int freq)
+
+/* The only part of the coefficients that takes any real work (a powf) depends
+on nothing but the cutoff and the mixing rate, so it's worked out for every
+cutoff whenever the rate is set. Voices also remember what their coefficients
+were made from, since the same cutoff tends to get set over and over. */
+void init_filter_table(song_t *csf)
+{
+	int freq = csf->mix_frequency;
+	uint32_t n;
+
+	for (n = 0; n < 256; n++) {
+		// 2 ^ (i / 24 * 256)
+		float frequency = 110.0 * powf(2.0, (float)n * FREQ_PARAM_MULT + 0.25);
+		if (frequency > freq / 2.0)
+			frequency = freq / 2.0;
+		csf->filter_r[n] = freq / (2.0 * M_PI * frequency);
+	}
+	csf->filter_freq = freq;
+
+	/* anything worked out at the old rate has to be done again */
+	for (n = 0; n < csf->voice_pool_size; n++)
+		csf->voices[n].filter_key = 0;
+}
+
+void setup_channel_filter(song_t *csf, song_voice_t *chan, int reset, int flt_modifier)
 {
 	int cutoff = chan->cutoff;
 	int resonance = chan->resonance;
-	float frequency, r, d, e, fg, fb0, fb1;
+	uint32_t key;
+	float r, d, e, fg, fb0, fb1;
 
 	cutoff = cutoff * (flt_modifier + 256) / 256;
 
@@ -94,26 +119,29 @@ void setup_channel_filter(song_voice_t *chan, int reset, int flt_modifier, int f
 	}
 	chan->flags |= CHN_FILTER;
 
-	// 2 ^ (i / 24 * 256)
-	frequency = 110.0 * powf(2.0, (float)cutoff * FREQ_PARAM_MULT + 0.25);
-	if (frequency > freq / 2.0)
-		frequency = freq / 2.0;
-	r = freq / (2.0 * M_PI * frequency);
+	/* (for songs that haven't been through csf_init_player) */
+	if (csf->filter_freq != csf->mix_frequency)
+		init_filter_table(csf);
 
-	d = resonance_table[resonance] * r + resonance_table[resonance] - 1.0;
-	e = r * r;
+	key = 0x10000 | (cutoff << 8) | resonance;
+	if (chan->filter_key != key) {
+		r = csf->filter_r[cutoff];
 
-	fg = 1.0 / (1.0 + d + e);
-	fb0 = (d + e + e) / (1.0 + d + e);
-	fb1 = -e / (1.0 + d + e);
+		d = resonance_table[resonance] * r + resonance_table[resonance] - 1.0;
+		e = r * r;
 
-	chan->filter_a0 = (int32_t)(fg * (1 << FILTERPRECISION));
-	chan->filter_b0 = (int32_t)(fb0 * (1 << FILTERPRECISION));
-	chan->filter_b1 = (int32_t)(fb1 * (1 << FILTERPRECISION));
+		fg = 1.0 / (1.0 + d + e);
+		fb0 = (d + e + e) / (1.0 + d + e);
+		fb1 = -e / (1.0 + d + e);
+
+		chan->filter_a0 = (int32_t)(fg * (1 << FILTERPRECISION));
+		chan->filter_b0 = (int32_t)(fb0 * (1 << FILTERPRECISION));
+		chan->filter_b1 = (int32_t)(fb1 * (1 << FILTERPRECISION));
+		chan->filter_key = key;
+	}
 
 	if (reset) {
 		chan->filter_y[0][0] = chan->filter_y[0][1] = 0;
 		chan->filter_y[1][0] = chan->filter_y[1][1] = 0;
 	}
 }
-
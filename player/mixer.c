@@ -701,6 +701,143 @@ static int get_sample_count(song_voice_t *chan, int samples)
 }
 
 
+/* Once a looping voice gets within reach of its loop end, switch it over to
+the sample's loop guard (see csf_adjust_sample_loop) and figure out how far it
+can go from there; before that, make sure it stops short of the switch-over
+point. 'count' is what get_sample_count came up with, 'samples' what was asked
+for. If the voice was switched, '*saved' gets its real sample pointer back. */
+static int loop_guard_enter(song_voice_t *chan, int samples, int count, signed char **saved)
+{
+	const struct sample_loop_guard *guard;
+	int64_t pos, entry, limit, n;
+	int64_t increment = chan->increment;
+	uint32_t fs, loop_length;
+
+	*saved = NULL;
+
+	if (!(chan->flags & CHN_LOOP) || chan->length != chan->loop_end
+	    || !chan->ptr_sample || chan->current_sample_data != chan->ptr_sample->data)
+		return count;
+
+	guard = csf_get_loop_guard(chan->ptr_sample, chan->loop_start, chan->loop_end,
+		chan->flags & CHN_PINGPONGLOOP);
+	if (!guard)
+		return count;
+
+	/* the interpolators look up to four frames either way */
+	entry = (int64_t) chan->loop_end - SAMPLE_GUARD_BEHIND + 4;
+	loop_length = chan->loop_end - chan->loop_start;
+	pos = chan->position;
+
+	if (!(chan->flags & CHN_PINGPONGLOOP)) {
+		/* just came around from the end? then keep going in the guard,
+		where the frames before this one are the end of the loop rather
+		than whatever's before the loop start */
+		if (pos >= chan->loop_start && pos < (int64_t) chan->loop_start + 4)
+			while (pos < entry)
+				pos += loop_length;
+		limit = (int64_t) chan->loop_end + SAMPLE_GUARD_AHEAD - 4;
+	} else {
+		limit = (increment > 0) ? chan->loop_end : entry;
+	}
+
+	if (pos < entry) {
+		/* not there yet */
+		if (increment > 0) {
+			n = (((entry - pos) << 16) - chan->position_frac - 1) / increment + 1;
+			count = MIN(count, n);
+		}
+		return count;
+	}
+
+	if (increment > 0) {
+		if (!(chan->flags & CHN_PINGPONGLOOP)) {
+			n = (((limit - pos) << 16) - chan->position_frac - 1) / increment + 1;
+			count = MIN(samples, MAX(n, 1));
+			count = MIN(count, MAX(16384 / ((increment >> 16) + 1), 2));
+		}
+	} else {
+		n = (((pos - limit) << 16) + chan->position_frac) / -increment + 1;
+		count = MIN(count, n);
+	}
+
+	fs = ((chan->flags & CHN_16BIT) ? 2 : 1) * ((chan->flags & CHN_STEREO) ? 2 : 1);
+	*saved = chan->current_sample_data;
+	chan->current_sample_data = (signed char *) (guard + 1)
+		- ((int64_t) chan->loop_end - SAMPLE_GUARD_BEHIND) * fs;
+	chan->position = pos;
+	return count;
+}
+
+/* put the voice back on its sample, and bring the position back into the loop */
+static void loop_guard_leave(song_voice_t *chan, signed char *saved)
+{
+	chan->current_sample_data = saved;
+	if (!(chan->flags & CHN_PINGPONGLOOP) && chan->position >= chan->loop_end)
+		chan->position = chan->loop_start
+			+ (chan->position - chan->loop_start) % (chan->loop_end - chan->loop_start);
+}
+
+
+/* The same sort of thing for paged samples (see csf_allocate_paged_sample):
+past the first page, which is always in memory, switch the voice over to the
+page it's in, and keep it from running off either end. '*page' is set to the
+page to release afterwards, if one was acquired. Returns zero if the page isn't
+loaded yet, in which case the voice just moves along silently. The disk writer
+waits for pages instead, since it isn't in any hurry. */
+static int page_enter(song_t *csf, song_voice_t *chan, int *count, uint32_t *page, signed char **saved)
+{
+	struct sample_pager *pager = csf_sample_pager(chan->current_sample_data);
+	const signed char *data;
+	int64_t pos = chan->position, limit, n;
+	int64_t increment = chan->increment;
+	uint32_t fs, k;
+
+	*saved = NULL;
+	if (!pager)
+		return 1;
+
+	k = chan->position / SAMPLE_PAGE_FRAMES;
+	if (increment > 0) {
+		limit = (int64_t) (k + 1) * SAMPLE_PAGE_FRAMES;
+		n = (((limit - pos) << 16) - chan->position_frac - 1) / increment + 1;
+		*count = MIN(*count, n);
+		pager->prefetch(pager, k + 1);
+	} else if (increment < 0) {
+		limit = (int64_t) k * SAMPLE_PAGE_FRAMES;
+		n = (((pos - limit) << 16) + chan->position_frac) / -increment + 1;
+		*count = MIN(*count, n);
+		if (k)
+			pager->prefetch(pager, k - 1);
+	}
+	/* coming up on the end of a loop? then get the start of it ready too */
+	if ((chan->flags & CHN_LOOP) && chan->loop_end - MIN(chan->loop_end, chan->position) < 2 * SAMPLE_PAGE_FRAMES)
+		pager->prefetch(pager, chan->loop_start / SAMPLE_PAGE_FRAMES);
+
+	if (!k)
+		return 1;
+
+	data = pager->acquire(pager, k, (csf->mix_flags & SNDMIX_DIRECTTODISK));
+	if (!data)
+		return 0;
+
+	fs = ((chan->flags & CHN_16BIT) ? 2 : 1) * ((chan->flags & CHN_STEREO) ? 2 : 1);
+	*page = k;
+	*saved = chan->current_sample_data;
+	chan->current_sample_data = (signed char *) data
+		- ((int64_t) k * SAMPLE_PAGE_FRAMES - SAMPLE_PAGE_EDGE) * fs;
+	return 1;
+}
+
+static void page_leave(song_voice_t *chan, uint32_t page, signed char *saved)
+{
+	struct sample_pager *pager = csf_sample_pager(saved);
+
+	chan->current_sample_data = saved;
+	pager->release(pager, page);
+}
+
+
 unsigned int csf_create_stereo_mix(song_t *csf, int count)
 {
 	int* ofsl, *ofsr;
@@ -728,8 +865,8 @@ unsigned int csf_create_stereo_mix(song_t *csf, int count)
 		if (!channel->current_sample_data)
 			continue;
 
-		ofsr = &g_dry_rofs_vol;
-		ofsl = &g_dry_lofs_vol;
+		ofsr = &csf->dry_rofs_vol;
+		ofsl = &csf->dry_lofs_vol;
 		flags = 0;
 
 		if (channel->flags & CHN_16BIT)
@@ -779,6 +916,10 @@ unsigned int csf_create_stereo_mix(song_t *csf, int count)
 		unsigned int naddmix = 0;
 
 		do {
+			signed char *guard_saved = NULL, *page_saved = NULL;
+			uint32_t page = 0;
+			int paged_in = 1;
+
 			nrampsamples = nsamples;
 
 			if (channel->ramp_length > 0) {
@@ -794,6 +935,10 @@ unsigned int csf_create_stereo_mix(song_t *csf, int count)
 			 */
 			if (!(channel->flags & CHN_ADLIB)) {
 				smpcount = get_sample_count(channel, nrampsamples);
+				if (smpcount > 0)
+					smpcount = loop_guard_enter(channel, nrampsamples, smpcount, &guard_saved);
+				if (smpcount > 0 && !guard_saved)
+					paged_in = page_enter(csf, channel, &smpcount, &page, &page_saved);
 			}
 
 			if (smpcount <= 0) {
@@ -814,7 +959,8 @@ unsigned int csf_create_stereo_mix(song_t *csf, int count)
 			// Should we mix this channel ?
 
 			if ((nchmixed >= max_voices && !(csf->mix_flags & SNDMIX_DIRECTTODISK))
-				|| (!channel->ramp_length && !(channel->left_volume | channel->right_volume))) {
+				|| (!channel->ramp_length && !(channel->left_volume | channel->right_volume))
+				|| !paged_in) {
 				int delta = (channel->increment * (int) smpcount) + (int) channel->position_frac;
 				channel->position_frac = delta & 0xFFFF;
 				channel->position += (delta >> 16);
@@ -842,6 +988,11 @@ unsigned int csf_create_stereo_mix(song_t *csf, int count)
 				}
 			}
 
+			if (guard_saved)
+				loop_guard_leave(channel, guard_saved);
+			if (page_saved)
+				page_leave(channel, page, page_saved);
+
 			nsamples -= smpcount;
 
 			if (channel->ramp_length) {
@@ -865,7 +1016,10 @@ unsigned int csf_create_stereo_mix(song_t *csf, int count)
 		nchmixed += naddmix;
 	}
 
-	GM_IncrementSongCounter(count);
+	if (CSF_MIDI_OUT(csf))
+		GM_IncrementSongCounter(count);
+
+	uint64_t prof = csf_profile_clock ? csf_profile_clock() : 0;
 
 	if (csf->multi_write) {
 		/* mix all adlib onto track one */
@@ -874,5 +1028,8 @@ unsigned int csf_create_stereo_mix(song_t *csf, int count)
 		Fmdrv_MixTo(csf->mix_buffer, count);
 	}
 
+	if (csf_profile_clock)
+		csf_profile_stage(CSF_STAGE_ADLIB, prof, csf_profile_clock());
+
 	return nchused;
 }
@@ -213,12 +213,17 @@ static int Pans[MAX_VOICES];
 static int OPLtoChan[9];
 static int ChantoOPL[MAX_VOICES];
 
+/* voices past MAX_VOICES (see csf_set_voice_pool) just don't get an OPL channel */
 static int GetVoice(int c) {
+    if (c < 0 || c >= MAX_VOICES)
+        return -1;
     return ChantoOPL[c];
 }
 static int SetVoice(int c)
 {
     int a,s=-1,t=0;
+    if (c < 0 || c >= MAX_VOICES)
+        return -1;
     if (ChantoOPL[c] == -1) {
         t=1;
         // Search for unused chans
@@ -249,7 +254,7 @@ static int SetVoice(int c)
 
 
 static void FreeVoice(int c) {
-    if (ChantoOPL[c] == -1)
+    if (c < 0 || c >= MAX_VOICES || ChantoOPL[c] == -1)
         return;
     OPLtoChan[ChantoOPL[c]]=-1;
     ChantoOPL[c]=-1;
@@ -401,6 +406,8 @@ void OPL_Touch(int c, unsigned vol)
 
 void OPL_Pan(int c, int val)
 {
+	if (c < 0 || c >= MAX_VOICES)
+		return;
 	Pans[c] = CLAMP(val, 0, 256);
 
 	int oplc = GetVoice(c);
@@ -43,14 +43,32 @@ unsigned int max_voices = 32; // ITT it is 1994
 static unsigned int volume_ramp_samples = 64;
 unsigned int global_vu_left = 0;
 unsigned int global_vu_right = 0;
-int32_t g_dry_rofs_vol = 0;
-int32_t g_dry_lofs_vol = 0;
 
 typedef uint32_t (* convert_t)(void *, int *, uint32_t, int *, int *);
 
 
 // see also csf_midi_out_raw in effects.c
 void (*csf_midi_out_note)(int chan, const song_note_t *m) = NULL;
+uint32_t (*csf_live_input)(song_t *csf, uint32_t offset) = NULL;
+uint64_t (*csf_profile_clock)(void) = NULL;
+void (*csf_profile_stage)(int stage, uint64_t start, uint64_t end) = NULL;
+
+static inline uint64_t profile_start(void)
+{
+	return csf_profile_clock ? csf_profile_clock() : 0;
+}
+
+/* returns the end time, so it can start the next stage */
+static inline uint64_t profile_end(int stage, uint64_t start)
+{
+	uint64_t end;
+
+	if (!csf_profile_clock)
+		return 0;
+	end = csf_profile_clock();
+	csf_profile_stage(stage, start, end);
+	return end;
+}
 
 
 // The volume we have here is in range 0..(63*255) (0..16065)
@@ -508,7 +526,8 @@ static inline int rn_update_sample(song_t *csf, song_voice_t *chan, int nchan, i
 
 		if ((csf->flags & SONG_INSTRUMENTMODE)
 		    && chan->ptr_instrument
-		    && chan->ptr_instrument->midi_channel_mask > 0)
+		    && chan->ptr_instrument->midi_channel_mask > 0
+		    && CSF_MIDI_OUT(csf))
 			GM_Pan(nchan, pan);
 
 		pan += 128;
@@ -605,7 +624,7 @@ static inline int rn_update_sample(song_t *csf, song_voice_t *chan, int nchan, i
 	// Adding the channel in the channel list
 	csf->voice_mix[csf->num_voices++] = nchan;
 
-	if (csf->num_voices >= MAX_VOICES)
+	if (csf->num_voices >= csf->voice_pool_size)
 		return 0;
 
 	return 1;
@@ -625,7 +644,8 @@ static inline void rn_gen_key(song_t *csf, song_voice_t *chan, int chan_num, int
 		return;
 	} else if (csf->flags & SONG_INSTRUMENTMODE &&
 	    chan->ptr_instrument &&
-	    chan->ptr_instrument->midi_channel_mask > 0) {
+	    chan->ptr_instrument->midi_channel_mask > 0 &&
+	    CSF_MIDI_OUT(csf)) {
 		MidiBendMode BendMode = MIDI_BEND_NORMAL;
 		/* TODO: If we're expecting a large bend exclusively
 		 * in either direction, update BendMode to indicate so.
@@ -689,7 +709,10 @@ static inline void update_vu_meter(song_voice_t *chan)
 		// can't fake the funk
 		int n;
 		int pos = chan->position; // necessary on 64-bit systems (sometimes pos == -1, weird)
-		if (chan->flags & CHN_16BIT) {
+		if (pos >= SAMPLE_PAGE_FRAMES && csf_sample_pager(chan->current_sample_data)) {
+			// only the first page of a paged sample is in memory, so go by the volume
+			n = 128;
+		} else if (chan->flags & CHN_16BIT) {
 			const signed short *p = (signed short *)(chan->current_sample_data);
 			if (chan->flags & CHN_STEREO)
 				n = p[2 * pos];
@@ -717,8 +740,8 @@ static inline void update_vu_meter(song_voice_t *chan)
 
 int csf_init_player(song_t *csf, int reset)
 {
-	if (max_voices > MAX_VOICES)
-		max_voices = MAX_VOICES;
+	if (max_voices > csf->voice_pool_size)
+		max_voices = csf->voice_pool_size;
 
 	csf->mix_frequency = CLAMP(csf->mix_frequency, 4000, MAX_SAMPLE_RATE);
 	volume_ramp_samples = (csf->mix_frequency * VOLUMERAMPLEN) / 100000;
@@ -729,7 +752,7 @@ int csf_init_player(song_t *csf, int reset)
 	if (csf->mix_flags & SNDMIX_NORAMPING)
 		volume_ramp_samples = 2;
 
-	g_dry_rofs_vol = g_dry_lofs_vol = 0;
+	csf->dry_rofs_vol = csf->dry_lofs_vol = 0;
 
 	if (reset) {
 		global_vu_left  = 0;
@@ -737,6 +760,7 @@ int csf_init_player(song_t *csf, int reset)
 	}
 
 	song_init_eq(reset, csf->mix_frequency);
+	init_filter_table(csf);
 
 	// I don't know why, but this "if" makes it work at the desired sample rate instead of 4000.
 	// the "4000Hz" value comes from csf_reset, but I don't yet understand why the opl keeps that value, if
@@ -744,11 +768,33 @@ int csf_init_player(song_t *csf, int reset)
 	if (csf->mix_frequency != 4000) {
 		Fmdrv_Init(csf->mix_frequency);
 	}
-	GM_Reset(0);
+	if (CSF_MIDI_OUT(csf))
+		GM_Reset(0);
 	return 1;
 }
 
 
+// With multi-write, the voices are mixed into each channel's own buffer
+// instead of the master; add them all up so there's a master mix as well.
+static void multi_to_master(song_t *csf, uint32_t count)
+{
+	uint32_t n, i;
+	int *mix, *buf;
+
+	if (!csf->multi_write)
+		return;
+
+	mix = csf->mix_buffer;
+	for (n = 0; n < 64; n++) {
+		if (!csf->multi_write[n].used)
+			continue;
+		buf = csf->multi_write[n].buffer;
+		for (i = 0; i < count * 2; i++)
+			mix[i] += buf[i];
+	}
+}
+
+
 unsigned int csf_read(song_t *csf, void * v_buffer, unsigned int bufsize)
 {
 	uint8_t * buffer = (uint8_t *)v_buffer;
@@ -756,6 +802,9 @@ unsigned int csf_read(song_t *csf, void * v_buffer, unsigned int bufsize)
 	int32_t vu_min[2];
 	int32_t vu_max[2];
 	unsigned int bufleft, max, sample_size, count, smpcount, mix_stat=0;
+	uint32_t live;
+	uint64_t prof;
+	int ok;
 
 	vu_min[0] = vu_min[1] = 0x7FFFFFFF;
 	vu_max[0] = vu_max[1] = -0x7FFFFFFF;
@@ -780,13 +829,22 @@ unsigned int csf_read(song_t *csf, void * v_buffer, unsigned int bufsize)
 		bufleft = 0; // skip the loop
 
 	while (bufleft > 0) {
+		// Anything played live goes in before this chunk
+		live = csf_live_input ? csf_live_input(csf, max - bufleft) : bufleft;
+
 		// Update Channel Data
 
 		if (!csf->buffer_count) {
 			if (!(csf->mix_flags & SNDMIX_DIRECTTODISK))
 				csf->buffer_count = bufleft;
 
-			if (!csf_read_note(csf)) {
+			csf->buffer_offset = max - bufleft;
+
+			prof = profile_start();
+			ok = csf_read_note(csf);
+			profile_end(CSF_STAGE_TICK, prof);
+
+			if (!ok) {
 				csf->flags |= SONG_ENDREACHED;
 
 				if (csf->stop_at_order > -1)
@@ -811,24 +869,33 @@ unsigned int csf_read(song_t *csf, void * v_buffer, unsigned int bufsize)
 		if (count > bufleft)
 			count = bufleft;
 
+		if (count > live)
+			count = live;
+
 		if (!count)
 			break;
 
 		smpcount = count;
 
 		// Resetting sound buffer
-		stereo_fill(csf->mix_buffer, smpcount, &g_dry_rofs_vol, &g_dry_lofs_vol);
+		prof = profile_start();
+		stereo_fill(csf->mix_buffer, smpcount, &csf->dry_rofs_vol, &csf->dry_lofs_vol);
 
 		if (csf->mix_channels >= 2) {
 			smpcount *= 2;
 			csf->mix_stat += csf_create_stereo_mix(csf, count);
+			multi_to_master(csf, count);
 		} else {
 			csf->mix_stat += csf_create_stereo_mix(csf, count);
+			multi_to_master(csf, count);
 			mono_from_stereo(csf->mix_buffer, count);
 		}
+		prof = profile_end(CSF_STAGE_MIX, prof);
 
 		// Handle eq
-		if (csf->mix_channels >= 2) {
+		if (csf->mix_flags & SNDMIX_NOEQ) {
+			/* nothing */
+		} else if (csf->mix_channels >= 2) {
 			eq_stereo(csf, csf->mix_buffer, count);
 			// FIXME: disable this when we're writing WAVs
 			if (!(csf->mix_flags & SNDMIX_DIRECTTODISK)) normalize_stereo(csf, csf->mix_buffer, count << 1);
@@ -836,12 +903,13 @@ unsigned int csf_read(song_t *csf, void * v_buffer, unsigned int bufsize)
 			eq_mono(csf, csf->mix_buffer, count);
 			if (!(csf->mix_flags & SNDMIX_DIRECTTODISK)) normalize_mono(csf, csf->mix_buffer, count);
 		}
+		prof = profile_end(CSF_STAGE_EQ, prof);
 
 		mix_stat++;
 
 		if (csf->multi_write) {
-			/* multi doesn't actually write meaningful data into 'buffer', so we can use that
-			as temp space for converting */
+			/* the master mix hasn't been written yet, so 'buffer' can be used as temp
+			space for converting */
 			for (unsigned int n = 0; n < 64; n++) {
 				if (csf->multi_write[n].used) {
 					if (csf->mix_channels < 2)
@@ -854,11 +922,12 @@ unsigned int csf_read(song_t *csf, void * v_buffer, unsigned int bufsize)
 						smpcount * ((csf->mix_bits_per_sample + 7) / 8));
 				}
 			}
-		} else {
-			// Perform clipping + VU-Meter
-			buffer += convert_func(buffer, csf->mix_buffer, smpcount, vu_min, vu_max);
 		}
 
+		// Perform clipping + VU-Meter
+		buffer += convert_func(buffer, csf->mix_buffer, smpcount, vu_min, vu_max);
+		profile_end(CSF_STAGE_CONVERT, prof);
+
 		// Buffer ready
 		bufleft -= count;
 		csf->buffer_count -= count;
@@ -1018,7 +1087,9 @@ int csf_process_tick(song_t *csf)
 			// commands... ALL WE DO is dump raw midi data to
 			// our super-secret "midi buffer"
 			// -mrsb
-			if (csf_midi_out_note)
+			// (not when rendering, though -- that can be on any thread,
+			// and nobody's listening)
+			if (csf_midi_out_note && CSF_MIDI_OUT(csf))
 				csf_midi_out_note(nchan, m);
 
 			chan->row_note = m->note;
@@ -1043,7 +1114,7 @@ int csf_process_tick(song_t *csf)
 		/* [-- No --] */
 		/* [Update effects for each channel as required.] */
 
-		if (csf_midi_out_note) {
+		if (csf_midi_out_note && CSF_MIDI_OUT(csf)) {
 			song_note_t *m = csf->patterns[csf->current_pattern] + csf->row * MAX_CHANNELS;
 
 			for (unsigned int nchan=0; nchan<MAX_CHANNELS; nchan++, m++) {
@@ -1124,7 +1195,10 @@ int csf_read_note(song_t *csf)
 
 	csf->num_voices = 0;
 
-	for (cn = 0, chan = csf->voices; cn < MAX_VOICES; cn++, chan++) {
+	// the voices are about to move on, so the NNA lists have to be rebuilt
+	csf->voice_alloc_valid = 0;
+
+	for (cn = 0, chan = csf->voices; cn < csf->voice_pool_size; cn++, chan++) {
 		/*if(cn == 0 || cn == 1)
 		fprintf(stderr, "considering channel %d (per %d, pos %d/%d, flags %X)\n",
 			(int)cn, chan->frequency, chan->position, chan->length, chan->flags);*/
@@ -1231,13 +1305,13 @@ int csf_read_note(song_t *csf)
 				rn_gen_key(csf, chan, cn, frequency, vol);
 
 			if (chan->flags & CHN_NEWNOTE) {
-				setup_channel_filter(chan, 1, 256, csf->mix_frequency);
+				setup_channel_filter(csf, chan, 1, 256);
 			}
 
 			// Filter Envelope: controls cutoff frequency
 			if (chan && chan->ptr_instrument && chan->ptr_instrument->flags & ENV_FILTER) {
-				setup_channel_filter(chan,
-					!(chan->flags & CHN_FILTER), envpitch, csf->mix_frequency);
+				setup_channel_filter(csf, chan,
+					!(chan->flags & CHN_FILTER), envpitch);
 			}
 
 			chan->sample_freq = frequency;
@@ -25,13 +25,19 @@
 
 #include "bswap.h"
 #include "charset.h"
+#include "config.h"
 #include "dialog.h"
+#include "event.h"
 #include "fakemem.h"
 #include "it.h"
 #include "song.h"
 #include "slurp.h"
 #include "page.h"
+#include "sample-edit.h"
+#include "sample-stream.h"
 #include "version.h"
+#include "video.h"
+#include "vgamem.h"
 
 #include "fmt.h"
 #include "dmoz.h"
@@ -44,6 +50,8 @@
 #include "midi.h"
 #include "disko.h"
 
+#include "sdlmain.h"
+
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -185,6 +193,8 @@ const char *fmt_strerror(int n)
 		return "Unrecognised file type";
 	case -LOAD_FORMAT_ERROR:
 		return "File format error (corrupt?)";
+	case -LOAD_CANCELLED:
+		return "Cancelled";
 	default:
 		return strerror(errno);
 	}
@@ -200,7 +210,10 @@ void message_convert_newlines(song_t *song) {
 	}
 }
 
-song_t *song_create_load(const char *file)
+/* if 'refs' is non-NULL, sample data is left on disk where possible (see slurp.h).
+if 'progress' is non-NULL, it's hooked into the file (see slurp_set_progress) */
+static song_t *song_create_load_ex(const char *file, unsigned int lflags, struct slurp_sample_refs *refs,
+	int (*progress)(slurp_t *, void *), void *progress_data)
 {
 	slurp_t s;
 	fmt_load_song_func *func;
@@ -211,6 +224,16 @@ song_t *song_create_load(const char *file)
 
 	song_t *newsong = csf_allocate();
 
+	if (refs) {
+		memset(refs, 0, sizeof(*refs));
+		refs->base = newsong->samples;
+		s.sample_refs = refs;
+	}
+	if (progress)
+		slurp_set_progress(&s, progress, progress_data);
+
+	/* this might be running on the loader thread, but the main thread is waiting
+	on it, and nothing else changes these */
 	if (current_song) {
 		newsong->mix_flags = current_song->mix_flags;
 		csf_set_wave_config(newsong,
@@ -224,9 +247,9 @@ song_t *song_create_load(const char *file)
 		csf_copy_midi_cfg(newsong, current_song);
 	}
 
-	for (func = load_song_funcs; *func && !ok; func++) {
+	for (func = load_song_funcs; *func && !ok && !s.cancelled; func++) {
 		slurp_rewind(&s);
-		switch ((*func)(newsong, &s, 0)) {
+		switch ((*func)(newsong, &s, lflags)) {
 		case LOAD_SUCCESS:
 			err = 0;
 			ok = 1;
@@ -241,7 +264,8 @@ song_t *song_create_load(const char *file)
 			err = errno;
 			break;
 		}
-		if (err) {
+		csf_pool_release(&newsong->scratch);
+		if (err && !s.cancelled) {
 			csf_free(newsong);
 			unslurp(&s);
 			errno = err;
@@ -249,6 +273,10 @@ song_t *song_create_load(const char *file)
 		}
 	}
 
+	/* whatever the loader made of the truncated file, it's not wanted */
+	if (s.cancelled)
+		err = -LOAD_CANCELLED;
+
 	unslurp(&s);
 
 	if (err) {
@@ -260,11 +288,133 @@ song_t *song_create_load(const char *file)
 
 	newsong->stop_at_order = newsong->stop_at_row = -1;
 	message_convert_newlines(newsong);
-	message_reset_selection();
+	/* (the loader might have brought its own macros) */
+	csf_compile_midi_cfg(newsong);
 
 	return newsong;
 }
 
+song_t *song_create_load(const char *file)
+{
+	return song_create_load_ex(file, 0, NULL, NULL, NULL);
+}
+
+/* ------------------------------------------------------------------------- */
+/* loading a song in the background, so the old one keeps playing and the
+screen keeps updating while a big file comes off a slow disk */
+
+/* don't bother with the progress dialog for anything quicker than this */
+#define SONG_LOAD_DIALOG_DELAY 150
+
+struct song_load_job {
+	const char *file;
+	song_t *song;
+	int err;
+	size_t length;
+	SDL_atomic_t pos; /* how far along the file, out of 64 */
+	SDL_atomic_t cancel;
+	SDL_atomic_t done;
+};
+
+static struct song_load_job *load_job = NULL;
+static struct widget load_widgets[1];
+
+/* called by the loader thread before every read */
+static int _song_load_progress(slurp_t *t, void *data)
+{
+	struct song_load_job *job = data;
+	int64_t pos = slurp_tell(t);
+
+	if (!job->length)
+		job->length = MAX(slurp_length(t), 1);
+
+	/* each loader starts over at the beginning while looking for the right one */
+	if (pos > 0) {
+		int n = MIN(pos * 64 / (int64_t) job->length, 64);
+		if (n > SDL_AtomicGet(&job->pos))
+			SDL_AtomicSet(&job->pos, n);
+	}
+
+	return SDL_AtomicGet(&job->cancel);
+}
+
+static int SDLCALL _song_load_worker(void *data)
+{
+	struct song_load_job *job = data;
+
+	job->song = song_create_load_ex(job->file, 0, NULL, _song_load_progress, job);
+	job->err = errno;
+	SDL_AtomicSet(&job->done, 1);
+	return 0;
+}
+
+static void _song_load_draw(void)
+{
+	draw_text("Loading...", 27, 27, 0, 2);
+	draw_fill_chars(24, 30, 55, 30, DEFAULT_FG, 0);
+	draw_vu_meter(24, 30, 32, SDL_AtomicGet(&load_job->pos), 4, 4);
+	draw_box(23, 29, 56, 31, BOX_THIN | BOX_INNER | BOX_INSET);
+}
+
+/* same deal as the sample editor's progress dialog: everything else is on hold,
+but the screen and the audio keep going, and Escape cancels */
+static void _song_load_wait(struct song_load_job *job)
+{
+	Uint32 start = SDL_GetTicks();
+	SDL_Event event[16];
+	int n, i, dialog = 0;
+
+	load_job = job;
+
+	while (!SDL_AtomicGet(&job->done)) {
+		if (!dialog && SDL_GetTicks() - start >= SONG_LOAD_DIALOG_DELAY) {
+			dialog_create_custom(22, 25, 36, 8, load_widgets, 0, 0, _song_load_draw, NULL);
+			dialog = 1;
+		}
+
+		SDL_PumpEvents();
+		while ((n = SDL_PeepEvents(event, ARRAY_SIZE(event), SDL_GETEVENT, SDL_KEYDOWN, SDL_TEXTINPUT)) > 0) {
+			for (i = 0; i < n; i++)
+				if (event[i].type == SDL_KEYDOWN && event[i].key.keysym.sym == SDLK_ESCAPE)
+					SDL_AtomicSet(&job->cancel, 1);
+		}
+
+		if (dialog) {
+			redraw_screen();
+			video_refresh();
+			video_blit();
+		}
+		SDL_Delay(dialog ? 20 : 5);
+	}
+
+	if (dialog) {
+		dialog_destroy();
+		status.flags |= NEED_UPDATE;
+	}
+	load_job = NULL;
+}
+
+/* loads the song on another thread and waits for it */
+static song_t *song_create_load_async(const char *file)
+{
+	struct song_load_job job = { .file = file };
+	SDL_Thread *thread;
+
+	SDL_AtomicSet(&job.pos, 0);
+	SDL_AtomicSet(&job.cancel, 0);
+	SDL_AtomicSet(&job.done, 0);
+
+	thread = SDL_CreateThread(_song_load_worker, "Schism song loader", &job);
+	if (!thread)
+		return song_create_load(file);
+
+	_song_load_wait(&job);
+	SDL_WaitThread(thread, NULL);
+
+	errno = job.err;
+	return job.song;
+}
+
 int song_load_unchecked(const char *file)
 {
 	const char *base = get_basename(file);
@@ -272,20 +422,18 @@ int song_load_unchecked(const char *file)
 	song_t *newsong;
 
 	// IT stops the song even if the new song can't be loaded
-	if (status.flags & PLAY_AFTER_LOAD) {
-		was_playing = (song_get_mode() == MODE_PLAYING);
-	} else {
-		was_playing = 0;
-		song_stop();
-	}
+	// (but it keeps playing while the new one loads)
+	was_playing = (status.flags & PLAY_AFTER_LOAD) && (song_get_mode() == MODE_PLAYING);
 
 	log_nl();
 	log_nl();
 	log_appendf(2, "Loading %s", base);
 	log_underline(strlen(base) + 8);
 
-	newsong = song_create_load(file);
+	newsong = song_create_load_async(file);
 	if (!newsong) {
+		if (!(status.flags & PLAY_AFTER_LOAD))
+			song_stop();
 		log_appendf(4, " %s", fmt_strerror(errno));
 		return 0;
 	}
@@ -301,9 +449,10 @@ int song_load_unchecked(const char *file)
 	song_stop_unlocked(0);
 	song_unlock_audio();
 
-	if (was_playing && (status.flags & PLAY_AFTER_LOAD))
+	if (was_playing)
 		song_start();
 
+	message_reset_selection();
 	main_song_changed_cb();
 
 	status.flags &= ~SONG_NEEDS_SAVE;
@@ -458,9 +607,145 @@ int song_export(const char *filename, const char *type)
 }
 
 
+/* ------------------------------------------------------------------------- */
+/* saving a song in the background
+
+song_save takes a snapshot of the song (see csf_snapshot) and hands it to a
+thread to write out, so it doesn't hold anything up. The thread pushes an event
+when it's done, and the main thread picks up the result in song_save_finish. */
+
+struct song_save_job {
+	song_t *song; /* the snapshot */
+	song_t *original; /* what current_song was when the snapshot was taken */
+	const struct save_format *format;
+	char *filename;
+	disko_t fp;
+	int backup;
+	int autosave;
+	int ret, err;
+	SDL_Thread *thread;
+	SDL_atomic_t done;
+};
+
+static struct song_save_job *save_job = NULL;
+static Uint32 last_autosave = 0;
+
+static int SDLCALL _song_save_worker(void *data)
+{
+	struct song_save_job *job = data;
+	SDL_Event e = {0};
+
+	job->ret = job->format->f.save_song(&job->fp, job->song);
+	if (job->ret != SAVE_SUCCESS)
+		disko_seterror(&job->fp, EINVAL);
+
+	// this was not as successful as originally claimed!
+	if (disko_close(&job->fp, job->backup) == DW_ERROR && job->ret == SAVE_SUCCESS)
+		job->ret = SAVE_FILE_ERROR;
+	job->err = errno;
+	SDL_AtomicSet(&job->done, 1);
+
+	e.user.type = SCHISM_EVENT_SAVE_DONE;
+	SDL_PushEvent(&e);
+	return 0;
+}
+
+static void _song_save_end(void)
+{
+	struct song_save_job *job = save_job;
+
+	save_job = NULL;
+
+	SDL_WaitThread(job->thread, NULL);
+	/* drop the snapshot's references to the sample data */
+	csf_free(job->song);
+
+	if (job->autosave) {
+		if (job->ret == SAVE_SUCCESS)
+			status_text_flash("Autosaved");
+		else
+			log_appendf(4, "Autosave failed: %s", strerror(job->err));
+	} else {
+		switch (job->ret) {
+		case SAVE_SUCCESS:
+			if (job->original == current_song && strcasecmp(song_filename, job->filename))
+				song_set_filename(job->filename);
+			log_appendf(5, " Done");
+			break;
+		case SAVE_FILE_ERROR:
+			errno = job->err;
+			log_perror(job->filename);
+			break;
+		case SAVE_INTERNAL_ERROR:
+		default: // ???
+			log_appendf(4, " Internal error saving song");
+			break;
+		}
+		if (job->ret != SAVE_SUCCESS) {
+			/* whatever was saved, it wasn't */
+			if (job->original == current_song)
+				status.flags |= SONG_NEEDS_SAVE;
+			dialog_create(DIALOG_OK, "Could not save file", NULL, NULL, 0, NULL);
+		}
+	}
+
+	free(job->filename);
+	free(job);
+	status.flags |= NEED_UPDATE;
+}
+
+void song_save_finish(void)
+{
+	/* (the event might be left over from a save that song_save_wait already
+	dealt with) */
+	if (save_job && SDL_AtomicGet(&save_job->done))
+		_song_save_end();
+}
+
+void song_save_wait(void)
+{
+	if (save_job)
+		_song_save_end();
+}
+
+static int _song_save_start(const char *filename, const struct save_format *format, int backup, int autosave)
+{
+	struct song_save_job *job;
+	int err;
+
+	song_save_wait();
+
+	job = mem_calloc(1, sizeof(*job));
+	if (disko_open(&job->fp, filename) < 0) {
+		err = errno;
+		free(job);
+		errno = err;
+		return SAVE_FILE_ERROR;
+	}
+	job->format = format;
+	job->filename = str_dup(filename);
+	job->backup = backup;
+	job->autosave = autosave;
+
+	/* patterns are copied here, so this is quick */
+	song_lock_audio();
+	job->song = csf_snapshot(current_song);
+	song_unlock_audio();
+	job->original = current_song;
+
+	job->thread = SDL_CreateThread(_song_save_worker, "Schism song saver", job);
+	save_job = job;
+	if (!job->thread) {
+		/* fine, do it the old-fashioned way */
+		_song_save_worker(job);
+		_song_save_end();
+	}
+
+	return SAVE_SUCCESS;
+}
+
 int song_save(const char *filename, const char *type)
 {
-	disko_t fp;
 	int ret, backup;
 	const struct save_format *format = get_save_format(song_save_formats, type);
 	char *mangle;
@@ -500,44 +785,45 @@ saying "Could not save file". This can be seen rather easily by trying to save a
 such as "abc|def.it". This dialog is presented both when saving from F10 and Ctrl-S.
 */
 
-	if (disko_open(&fp, mangle) < 0) {
-		log_perror(mangle);
-		free(mangle);
-		return SAVE_FILE_ERROR;
-	}
-
-	ret = format->f.save_song(&fp, current_song);
-	if (ret != SAVE_SUCCESS)
-		disko_seterror(&fp, EINVAL);
-
 	backup = ((status.flags & MAKE_BACKUPS)
 		  ? (status.flags & NUMBERED_BACKUPS)
 		  ? 65536 : 1 : 0);
 
-	// this was not as successful as originally claimed!
-	if (disko_close(&fp, backup) == DW_ERROR && ret == SAVE_SUCCESS)
-		ret = SAVE_FILE_ERROR;
-
-	switch (ret) {
-	case SAVE_SUCCESS:
+	/* if anything goes wrong from here on, it's reported when the save finishes */
+	ret = _song_save_start(mangle, format, backup, 0);
+	if (ret == SAVE_SUCCESS)
 		status.flags &= ~SONG_NEEDS_SAVE;
-		if (strcasecmp(song_filename, mangle))
-			song_set_filename(mangle);
-		log_appendf(5, " Done");
-		break;
-	case SAVE_FILE_ERROR:
+	else
 		log_perror(mangle);
-		break;
-	case SAVE_INTERNAL_ERROR:
-	default: // ???
-		log_appendf(4, " Internal error saving song");
-		break;
-	}
 
 	free(mangle);
 	return ret;
 }
 
+/* call this every so often; saves a copy of the song to the .schism directory
+if it's been changed, and it's been long enough since the last time */
+void song_autosave_poll(void)
+{
+	char *path;
+	Uint32 now = SDL_GetTicks();
+
+	if (cfg_autosave_interval <= 0 || save_job)
+		return;
+	if (!last_autosave) {
+		last_autosave = now;
+		return;
+	}
+	if (!(status.flags & SONG_NEEDS_SAVE)
+	    || (now - last_autosave) < (Uint32) cfg_autosave_interval * 60000)
+		return;
+
+	last_autosave = now;
+	path = dmoz_path_concat(cfg_dir_dotschism, "autosave.it");
+	if (_song_save_start(path, get_save_format(song_save_formats, "IT"), 0, 1) != SAVE_SUCCESS)
+		log_perror(path);
+	free(path);
+}
+
 int song_save_sample(const char *filename, const char *type, song_sample_t *smp, int num)
 {
 	disko_t fp;
@@ -552,7 +838,7 @@ int song_save_sample(const char *filename, const char *type, song_sample_t *smp,
 		return SAVE_INTERNAL_ERROR; // ?
 	}
 
-	if (disko_open(&fp, filename) < 0) {
+	if (disko_open(&fp, filename) == 0) {
 		ret = format->f.save_sample(&fp, smp);
 		if (ret != SAVE_SUCCESS)
 			disko_seterror(&fp, EINVAL);
@@ -613,11 +899,19 @@ void song_clear_sample(int n)
 	song_unlock_audio();
 }
 
+static int library_load_sample_data(song_sample_t *smp);
+
 void song_copy_sample(int n, song_sample_t *src)
 {
+	/* samples browsed in a library aren't decoded until they're actually used */
+	library_load_sample_data(src);
+
 	memcpy(current_song->samples + n, src, sizeof(song_sample_t));
 
-	if (src->data) {
+	if (csf_sample_pager(src->data)) {
+		/* far too big to copy, and it can't be changed anyway */
+		current_song->samples[n].data = csf_share_sample(src->data);
+	} else if (src->data) {
 		unsigned long bytelength = src->length;
 		if (src->flags & CHN_16BIT)
 			bytelength *= 2;
@@ -669,10 +963,13 @@ int song_load_instrument_ex(int target, const char *file, const char *libf, int
 
 	if (libf) { /* file is ignored */
 		int sampmap[MAX_SAMPLES] = {0};
+		struct slurp_sample_refs *refs = mem_alloc(sizeof(*refs));
 
-		song_t *xl = song_create_load(libf);
+		/* only the samples this instrument uses get decoded */
+		song_t *xl = song_create_load_ex(libf, LOAD_NOPATTERNS, refs, NULL, NULL);
 		if (!xl) {
 			log_appendf(4, "%s: %s", libf, fmt_strerror(errno));
+			free(refs);
 			song_unlock_audio();
 			return 0;
 		}
@@ -693,6 +990,8 @@ int song_load_instrument_ex(int target, const char *file, const char *libf, int
 						}
 						xl->samples[x].name[25] = 0;
 
+						if (slurp_read_deferred_sample(libf, refs, &xl->samples[x]) < 0)
+							log_appendf(4, "%s: failed to read sample %d", libf, x);
 						song_copy_sample(k, &xl->samples[x]);
 						break;
 					}
@@ -703,6 +1002,8 @@ int song_load_instrument_ex(int target, const char *file, const char *libf, int
 		/* transfer the instrument */
 		current_song->instruments[target] = xl->instruments[n];
 		xl->instruments[n] = NULL; /* dangle */
+		csf_free(xl);
+		free(refs);
 
 		/* and rewrite! */
 		for (unsigned int k = 0; k < 128; k++) {
@@ -767,14 +1068,19 @@ int song_load_instrument_with_prompt(int n, const char* file)
 	return retval;
 }
 
-int song_preload_sample(dmoz_file_t *file)
+int song_preload_sample(dmoz_file_t *file, int stream)
 {
 	// 0 is our "hidden sample"
 #define FAKE_SLOT 0
 	//csf_stop_sample(current_song, current_song->samples + FAKE_SLOT);
+	sample_stream_stop();
 	if (file->sample) {
 		song_sample_t *smp = song_get_sample(FAKE_SLOT);
 
+		/* reading it in can take a while; do that before locking, so the
+		copy is all that happens with the audio locked */
+		library_load_sample_data(file->sample);
+
 		song_lock_audio();
 		csf_destroy_sample(current_song, FAKE_SLOT);
 		song_copy_sample(FAKE_SLOT, file->sample);
@@ -785,6 +1091,16 @@ int song_preload_sample(dmoz_file_t *file)
 		song_unlock_audio();
 		return FAKE_SLOT;
 	}
+	/* don't make them wait for a huge file to load just to hear it */
+	if (stream && file->filesize >= SAMPLE_STREAM_MIN_SIZE && sample_stream_preview(file->path, FAKE_SLOT)) {
+		song_sample_t *smp = song_get_sample(FAKE_SLOT);
+
+		song_lock_audio();
+		strncpy(smp->filename, file->base, 12);
+		smp->filename[12] = 0;
+		song_unlock_audio();
+		return FAKE_SLOT;
+	}
 	// WARNING this function must return 0 or KEYJAZZ_NOINST
 	return song_load_sample(FAKE_SLOT, file->path) ? FAKE_SLOT : KEYJAZZ_NOINST;
 #undef FAKE_SLOT
@@ -795,30 +1111,37 @@ int song_load_sample(int n, const char *file)
 	slurp_t s;
 	fmt_load_sample_func *load;
 	song_sample_t smp = {0};
+	int paged;
 
 	const char *base = get_basename(file);
 
-	if (slurp(&s, file, NULL, 0)) {
+	// set some default stuff
+	strncpy(smp.name, base, 25);
+
+	/* anything too long to load is played from the file instead */
+	paged = (file_size(file) > MAX_SAMPLE_LENGTH && sample_stream_load_paged(file, &smp));
+
+	if (!paged && slurp(&s, file, NULL, 0)) {
 		log_perror(base);
 		return 0;
 	}
 
-	// set some default stuff
 	song_lock_audio();
 	csf_stop_sample(current_song, current_song->samples + n);
-	strncpy(smp.name, base, 25);
 
-	for (load = load_sample_funcs; *load; load++) {
-		slurp_rewind(&s);
-		if ((*load)(&s, &smp))
-			break;
-	}
+	if (!paged) {
+		for (load = load_sample_funcs; *load; load++) {
+			slurp_rewind(&s);
+			if ((*load)(&s, &smp))
+				break;
+		}
 
-	if (!load) {
-		unslurp(&s);
-		log_perror(base);
-		song_unlock_audio();
-		return 0;
+		if (!load) {
+			unslurp(&s);
+			log_perror(base);
+			song_unlock_audio();
+			return 0;
+		}
 	}
 
 	// this is after the loaders because i don't trust them, even though i wrote them ;)
@@ -835,7 +1158,15 @@ int song_load_sample(int n, const char *file)
 	memcpy(&(current_song->samples[n]), &smp, sizeof(song_sample_t));
 	song_unlock_audio();
 
-	unslurp(&s);
+	if (!paged)
+		unslurp(&s);
+
+	/* convert high-rate recordings down to the mixing rate once, here, rather
+	than having the mixer interpolate them every time they're played.
+	(not for the keyjazz preview, since that's thrown away anyway) */
+	if (n && audio_settings.import_resample && !(smp.flags & CHN_ADLIB) && !paged
+	    && smp.c5speed > (unsigned int) audio_settings.sample_rate)
+		sample_resample(current_song->samples + n, audio_settings.sample_rate, audio_settings.resample_quality);
 
 	return 1;
 }
@@ -922,6 +1253,37 @@ const char *song_get_basename(void)
 // FIXME: unload the module when leaving the library 'directory'
 static song_t *library = NULL;
 
+// Libraries are loaded without sample data; each sample gets read from
+// library_path when it's previewed or copied into the song.
+static char *library_path = NULL;
+static struct slurp_sample_refs library_refs;
+
+static song_t *library_load(const char *path)
+{
+	free(library_path);
+	library_path = NULL;
+
+	library = song_create_load_ex(path, LOAD_NOPATTERNS, &library_refs, NULL, NULL);
+	if (library)
+		library_path = str_dup(path);
+
+	return library;
+}
+
+static int library_load_sample_data(song_sample_t *smp)
+{
+	int r;
+
+	if (!library || !library_path || !smp || smp->data)
+		return 0;
+
+	r = slurp_read_deferred_sample(library_path, &library_refs, smp);
+	if (r < 0)
+		log_appendf(4, "%s: failed to read sample", get_basename(library_path));
+
+	return r;
+}
+
 
 // TODO: stat the file?
 int dmoz_read_instrument_library(const char *path, dmoz_filelist_t *flist, UNUSED dmoz_dirlist_t *dlist)
@@ -931,9 +1293,10 @@ int dmoz_read_instrument_library(const char *path, dmoz_filelist_t *flist, UNUSE
 
 	csf_stop_sample(current_song, current_song->samples + 0);
 	csf_free(library);
+	library = NULL;
 
 	const char *base = get_basename(path);
-	library = song_create_load(path);
+	library = library_load(path);
 	if (!library) {
 		log_appendf(4, "%s: %s", base, fmt_strerror(errno));
 		return -1;
@@ -977,6 +1340,7 @@ int dmoz_read_sample_library(const char *path, dmoz_filelist_t *flist, UNUSED dm
 {
 	csf_stop_sample(current_song, current_song->samples + 0);
 	csf_free(library);
+	library = NULL;
 
 	const char *base = get_basename(path);
 
@@ -1008,10 +1372,12 @@ int dmoz_read_sample_library(const char *path, dmoz_filelist_t *flist, UNUSED dm
 	}
 
 	if (info_file.type & TYPE_MODULE_MASK) {
-		library = song_create_load(path);
+		library = library_load(path);
 	} else if (info_file.type & TYPE_INST_MASK) {
 		/* temporarily set the current song to the library */
 		song_t* tmp_ptr = current_song;
+		free(library_path);
+		library_path = NULL;
 		library = current_song = csf_allocate();
 
 		int ret = song_load_instrument(1, path);
@@ -26,6 +26,8 @@
 #include "it.h"
 #include "page.h"
 #include "song.h"
+#include "sample-edit.h"
+#include "dsp-load.h"
 #include "slurp.h"
 #include "config-parser.h"
 
@@ -104,14 +106,29 @@ int audio_device_list_size = 0;
 
 static SDL_AudioDeviceID current_audio_device = 0;
 
+#ifdef USE_JACK
+/* sys/jack/audio-jack.c */
+int jack_audio_init(void);
+int jack_audio_open(unsigned int *rate, unsigned int *frames, int channel_ports, int transport,
+	void (*callback)(void *, uint8_t *, int));
+void jack_audio_close(void);
+void jack_audio_lock(void);
+void jack_audio_unlock(void);
+void jack_audio_pause(int pause);
+int jack_audio_poll(int *transport);
+
+/* set when the "jack" driver is our own rather than SDL's */
+static int audio_jack = 0;
+#endif
+
 // ------------------------------------------------------------------------
 // playback
 
 extern int midi_bend_hit[64], midi_last_bend_hit[64];
-extern void vis_work_16s(short *in, int inlen);
-extern void vis_work_16m(short *in, int inlen);
-extern void vis_work_8s(char *in, int inlen);
-extern void vis_work_8m(char *in, int inlen);
+
+/* when the previous and current audio callbacks started, for timing keyjazz */
+static uint64_t keyjazz_prev_buffer = 0, keyjazz_this_buffer = 0;
+static uint32_t _schism_live_input(song_t *csf, uint32_t offset);
 
 // this gets called from sdl
 static void audio_callback(UNUSED void *qq, uint8_t * stream, int len)
@@ -124,26 +141,39 @@ static void audio_callback(UNUSED void *qq, uint8_t * stream, int len)
 
 	if (!stream || !len || !current_song) {
 		if (status.current_page == PAGE_WATERFALL || status.vis_style == VIS_FFT) {
-			vis_work_8m(NULL, 0);
+			vis_push_samples(NULL, 0, 8, 1);
 		}
 		song_stop_unlocked(0);
 		goto POST_EVENT;
 	}
 
 	if (samples_played >= SMP_INIT) {
+		/* nothing gets mixed, so play anything queued right now rather
+		 * than letting it pile up */
+		_schism_live_input(current_song, UINT32_MAX);
 		memset(stream, 0x80, len);
 		samples_played++; // will loop back to 0
 		return;
 	}
 
+	keyjazz_prev_buffer = keyjazz_this_buffer;
+	keyjazz_this_buffer = SDL_GetPerformanceCounter();
+	if (current_song->flags & SONG_ENDREACHED) {
+		/* nothing's playing, so there's no point in waiting */
+		_schism_live_input(current_song, UINT32_MAX);
+	}
+
 	if (current_song->flags & SONG_ENDREACHED) {
 		n = 0;
 	} else {
+		midi_queue_sync();
+		dsp_load_begin();
 		n = csf_read(current_song, stream, len);
+		dsp_load_end(len / audio_sample_size, current_song->mix_frequency);
 		if (!n) {
 			if (status.current_page == PAGE_WATERFALL
 			|| status.vis_style == VIS_FFT) {
-				vis_work_8m(NULL, 0);
+				vis_push_samples(NULL, 0, 8, 1);
 			}
 			song_stop_unlocked(0);
 			goto POST_EVENT;
@@ -157,25 +187,15 @@ static void audio_callback(UNUSED void *qq, uint8_t * stream, int len)
 		/* libmodplug emits unsigned 8bit output...
 		*/
 		stream = (uint8_t *) audio_buffer;
-		n *= audio_output_channels;
-		for (i = 0; i < n; i++) {
+		for (i = 0; i < n * audio_output_channels; i++) {
 			stream[i] ^= 128;
 		}
-		if (status.current_page == PAGE_WATERFALL
-		|| status.vis_style == VIS_FFT) {
-			if (audio_output_channels == 2) {
-				vis_work_8s((char*)stream, n/2);
-			} else {
-				vis_work_8m((char*)stream, n);
-			}
-		}
-	} else if (status.current_page == PAGE_WATERFALL
-				|| status.vis_style == VIS_FFT) {
-		if (audio_output_channels == 2) {
-			vis_work_16s((short*)stream, n);
-		} else {
-			vis_work_16m((short*)stream, n);
-		}
+	}
+
+	/* the analysis itself happens on the vis worker */
+	if (status.current_page == PAGE_WATERFALL
+	|| status.vis_style == VIS_FFT) {
+		vis_push_samples(audio_buffer, n, audio_output_bits, audio_output_channels);
 	}
 
 	if (current_song->num_voices > max_channels_used)
@@ -292,40 +312,115 @@ static int keyjazz_note_to_chan[NOTE_LAST + 1];
 /* last note played by channel tracking */
 static int keyjazz_chan_to_note[MAX_CHANNELS + 1];
 
+/* Keyjazz notes are handed to the audio thread through these queues, instead of
+locking the audio device and waiting for the buffer being mixed to finish.
+Each one is stamped with the time it was played (for MIDI, the time it came in)
+and gets mixed in at that same point in the next buffer, so the latency is
+always one buffer, no matter how long the event loop took to get to it.
+
+The UI thread pushes onto keyjazz_ui. MIDI notes can skip the event loop
+entirely, if we already know what the page would do with them: the first time
+a page plays a MIDI note on the current play channel, the sample, instrument
+and channel it used become the "live target", and until anything else happens
+in the UI, song_live_midi_note queues notes straight from the MIDI input
+thread(s) onto keyjazz_midi with that same target. Only the audio thread pops
+from either queue. */
+
+#define KEYJAZZ_QUEUE_SIZE 256 /* must be a power of two */
+
+struct keyjazz_event {
+	int samp, ins, note, vol, chan, effect, param;
+	uint64_t time; /* SDL_GetPerformanceCounter */
+	uint32_t target; /* live target it was played with, or zero if from the UI */
+	int key; /* MIDI notes: which note a note-off is for */
+};
+
+struct keyjazz_queue {
+	struct keyjazz_event ev[KEYJAZZ_QUEUE_SIZE];
+	SDL_atomic_t head, tail;
+};
+
+static struct keyjazz_queue keyjazz_ui, keyjazz_midi;
+static SDL_SpinLock keyjazz_midi_lock; /* between MIDI input threads */
+static uint64_t keyjazz_time = 0;
+
+/* zero, or the sample, instrument and channel to play live MIDI notes with */
+static SDL_atomic_t keyjazz_live_target;
+#define LIVE_TARGET(samp, ins, chan) \
+	(0x80000000u | ((uint32_t) ((samp) + 2) << 16) | ((uint32_t) ((ins) + 2) << 7) | (uint32_t) (chan))
+#define LIVE_TARGET_SAMP(t) ((int) (((t) >> 16) & 0x3ff) - 2)
+#define LIVE_TARGET_INS(t)  ((int) (((t) >> 7) & 0x1ff) - 2)
+#define LIVE_TARGET_CHAN(t) ((int) ((t) & 0x7f))
+
+/* MIDI input: the target each note that's down was played live with, so the
+note-off can follow it even if the target's been forgotten in the meantime
+(otherwise it'd go to song_keyup, which never heard of it) */
+static SDL_atomic_t keyjazz_live_held[NOTE_LAST + 1];
+
+/* audio thread: the target the notes below were played with, and which note
+each channel has down, for matching up note-offs */
+static uint32_t keyjazz_live_last;
+static int keyjazz_live_chan_to_note[MAX_CHANNELS + 1];
+
+/* whether the audio callback is being called (i.e. something is going to
+drain the queues) */
+static SDL_atomic_t audio_running;
+
+void song_set_keyjazz_time(uint64_t time)
+{
+	keyjazz_time = time;
+}
+
+void song_forget_live_midi(void)
+{
+	SDL_AtomicSet(&keyjazz_live_target, 0);
+}
+
+static int _keyjazz_push(struct keyjazz_queue *q, const struct keyjazz_event *ev)
+{
+	unsigned int tail = SDL_AtomicGet(&q->tail);
+
+	if (tail - SDL_AtomicGet(&q->head) >= KEYJAZZ_QUEUE_SIZE)
+		return 0;
+	q->ev[tail & (KEYJAZZ_QUEUE_SIZE - 1)] = *ev;
+	SDL_AtomicSet(&q->tail, tail + 1);
+	return 1;
+}
+
+static struct keyjazz_event *_keyjazz_peek(struct keyjazz_queue *q)
+{
+	unsigned int head = SDL_AtomicGet(&q->head);
+
+	if (head == (unsigned int) SDL_AtomicGet(&q->tail))
+		return NULL;
+	return q->ev + (head & (KEYJAZZ_QUEUE_SIZE - 1));
+}
+
+static void _keyjazz_pop(struct keyjazz_queue *q)
+{
+	SDL_AtomicSet(&q->head, SDL_AtomicGet(&q->head) + 1);
+}
+
 /* **** chan ranges from 1 to 64   */
-static int song_keydown_ex(int samp, int ins, int note, int vol, int chan, int effect, int param)
+/* audio thread (or audio locked) */
+static void _keyjazz_apply(const struct keyjazz_event *ev)
 {
+	int samp = ev->samp, ins = ev->ins, note = ev->note, vol = ev->vol;
+	int effect = ev->effect, param = ev->param;
 	int ins_mode;
 	int midi_note = note; /* note gets overwritten, possibly NOTE_NONE */
 	song_voice_t *c;
 	song_note_t mc;
 	song_sample_t *s = NULL;
 	song_instrument_t *i = NULL;
-
-	if (chan == KEYJAZZ_CHAN_CURRENT) {
-		chan = current_play_channel;
-		if (multichannel_mode)
-			song_change_current_play_channel(1, 1);
-	}
-    // back to the 0..63 range
-    int chan_internal = chan -1;
-
-	song_lock_audio();
+	// back to the 0..63 range
+	int chan_internal = ev->chan - 1;
 
 	c = current_song->voices + chan_internal;
 
 	ins_mode = song_is_instrument_mode();
 
 	if (NOTE_IS_NOTE(note)) {
-		// keep track of what channel this note was played in so we can note-off properly later
-		if (keyjazz_chan_to_note[chan]) {
-			// reset note-off pending state for last note in channel
-			keyjazz_note_to_chan[keyjazz_chan_to_note[chan]] = 0;
-		}
-
-		keyjazz_note_to_chan[note] = chan;
-		keyjazz_chan_to_note[chan] = note;
-
 		// handle blank instrument values and "fake" sample #0 (used by sample loader)
 		if (samp == 0)
 			samp = c->last_instrument;
@@ -457,12 +552,160 @@ static int song_keydown_ex(int samp, int ins, int note, int vol, int chan, int e
 		current_song->flags &= ~SONG_ENDREACHED;
 		current_song->flags |= SONG_PAUSED;
 	}
+}
 
-	song_unlock_audio();
+/* where in the current buffer an event should be mixed, in frames */
+static uint32_t _keyjazz_offset(uint64_t time)
+{
+	if (!keyjazz_prev_buffer || time <= keyjazz_prev_buffer)
+		return 0;
+	return MIN((time - keyjazz_prev_buffer) * current_song->mix_frequency
+		/ SDL_GetPerformanceFrequency(), UINT32_MAX);
+}
+
+/* audio thread: a note from song_live_midi_note */
+static void _keyjazz_apply_live(const struct keyjazz_event *ev)
+{
+	int *held = keyjazz_live_chan_to_note + ev->chan;
+
+	if (ev->note != NOTE_OFF && ev->target != keyjazz_live_last) {
+		/* the notes from before were played some other way (note-offs
+		for them can still turn up with the old target, and are left to
+		the check below) */
+		memset(keyjazz_live_chan_to_note, 0, sizeof(keyjazz_live_chan_to_note));
+		keyjazz_live_last = ev->target;
+	}
+
+	if (ev->note == NOTE_OFF) {
+		/* if another note's been played on the channel since, leave it be
+		(but if we don't know, it was the note the target was learned from) */
+		if (*held && *held != ev->key)
+			return;
+		*held = 0;
+	} else {
+		*held = ev->note;
+	}
+
+	_keyjazz_apply(ev);
+}
+
+/* Called by the mixer before each chunk it mixes: plays everything that's due
+by 'offset' frames into the buffer, and returns how many frames are left until
+the next event (so the mixer can stop there). */
+static uint32_t _schism_live_input(song_t *csf, uint32_t offset)
+{
+	struct keyjazz_event *ui, *midi, *ev;
+	uint32_t due;
+
+	if (csf != current_song)
+		return UINT32_MAX;
+
+	for (;;) {
+		/* whichever came first */
+		ui = _keyjazz_peek(&keyjazz_ui);
+		midi = _keyjazz_peek(&keyjazz_midi);
+		ev = (ui && (!midi || ui->time <= midi->time)) ? ui : midi;
+		if (!ev)
+			return UINT32_MAX;
+
+		due = _keyjazz_offset(ev->time);
+		if (due > offset)
+			return due - offset;
+
+		if (ev == ui) {
+			_keyjazz_apply(ev);
+			_keyjazz_pop(&keyjazz_ui);
+		} else {
+			_keyjazz_apply_live(ev);
+			_keyjazz_pop(&keyjazz_midi);
+		}
+	}
+}
+
+int song_live_midi_note(int note, int vol, uint64_t time)
+{
+	uint32_t target = SDL_AtomicGet(&keyjazz_live_target), held;
+	struct keyjazz_event ev = {0};
+	int ok;
+
+	if (!NOTE_IS_NOTE(note))
+		return 0;
+	if (vol < 0) {
+		/* whatever the note was played with, if it was played live */
+		held = SDL_AtomicSet(&keyjazz_live_held[note], 0);
+		if (held)
+			target = held;
+	}
+	if (!target || !SDL_AtomicGet(&audio_running))
+		return 0;
+
+	ev.chan = LIVE_TARGET_CHAN(target);
+	ev.time = time;
+	ev.target = target;
+	ev.key = note;
+	if (vol < 0) {
+		/* note-off; see song_keyup_channel */
+		ev.samp = ev.ins = KEYJAZZ_NOINST;
+		ev.note = NOTE_OFF;
+		ev.vol = KEYJAZZ_DEFAULTVOL;
+	} else {
+		ev.samp = LIVE_TARGET_SAMP(target);
+		ev.ins = LIVE_TARGET_INS(target);
+		ev.note = note;
+		ev.vol = vol;
+		ev.effect = FX_PANNING;
+		ev.param = 0x80;
+	}
+
+	SDL_AtomicLock(&keyjazz_midi_lock);
+	ok = _keyjazz_push(&keyjazz_midi, &ev);
+	SDL_AtomicUnlock(&keyjazz_midi_lock);
+
+	if (ok && vol >= 0)
+		SDL_AtomicSet(&keyjazz_live_held[note], target);
+	return ok;
+}
+
+static int song_keydown_ex(int samp, int ins, int note, int vol, int chan, int effect, int param)
+{
+	struct keyjazz_event ev = {samp, ins, note, vol, chan, effect, param, 0, 0, 0};
+
+	if (chan == KEYJAZZ_CHAN_CURRENT) {
+		chan = current_play_channel;
+		if (multichannel_mode)
+			song_change_current_play_channel(1, 1);
+		else if (keyjazz_time && NOTE_IS_NOTE(note) && effect == FX_PANNING && param == 0x80
+			 && samp != KEYJAZZ_INST_FAKE && ins != KEYJAZZ_INST_FAKE)
+			/* a page playing a MIDI note the plain way: the next ones can
+			 * go straight to the audio thread (but not on the sample
+			 * loader, which has to do more than just play the note) */
+			SDL_AtomicSet(&keyjazz_live_target, LIVE_TARGET(samp, ins, chan));
+	}
+	ev.chan = chan;
+	ev.time = keyjazz_time ? keyjazz_time : SDL_GetPerformanceCounter();
+
+	if (NOTE_IS_NOTE(note)) {
+		// keep track of what channel this note was played in so we can note-off properly later
+		if (keyjazz_chan_to_note[chan]) {
+			// reset note-off pending state for last note in channel
+			keyjazz_note_to_chan[keyjazz_chan_to_note[chan]] = 0;
+		}
+
+		keyjazz_note_to_chan[note] = chan;
+		keyjazz_chan_to_note[chan] = note;
+	}
+
+	if (!SDL_AtomicGet(&audio_running) || !_keyjazz_push(&keyjazz_ui, &ev)) {
+		/* nothing's going to drain the queue (or it's full), so do it here */
+		song_lock_audio();
+		_keyjazz_apply(&ev);
+		song_unlock_audio();
+	}
 
 	return chan;
 }
 
+
 int song_keydown(int samp, int ins, int note, int vol, int chan)
 {
 	return song_keydown_ex(samp, ins, note, vol, chan, FX_PANNING, 0x80);
@@ -539,6 +782,9 @@ static void song_reset_play_state(void)
 	memset(midi_last_bend_hit, 0, sizeof(midi_last_bend_hit));
 	memset(keyjazz_note_to_chan, 0, sizeof(keyjazz_note_to_chan));
 	memset(keyjazz_chan_to_note, 0, sizeof(keyjazz_chan_to_note));
+	/* forget about any notes that haven't been played yet */
+	SDL_AtomicSet(&keyjazz_ui.head, SDL_AtomicGet(&keyjazz_ui.tail));
+	SDL_AtomicSet(&keyjazz_midi.head, SDL_AtomicGet(&keyjazz_midi.tail));
 
 	// turn this crap off
 	current_song->mix_flags &= ~(SNDMIX_NOBACKWARDJUMPS | SNDMIX_DIRECTTODISK);
@@ -627,7 +873,7 @@ void song_stop_unlocked(int quitting)
 			if (note_tracker[chan] != 0) {
 				for (int j = 0; j < 16; j++) {
 					csf_process_midi_macro(current_song, chan,
-						current_song->midi_config.note_off,
+						&current_song->midi_compiled.note_off,
 						0, note_tracker[chan], 0, j);
 				}
 				moff[0] = 0x80 + chan;
@@ -652,7 +898,7 @@ void song_stop_unlocked(int quitting)
 			csf_midi_send(current_song, (unsigned char *) moff, 3, 0, 0);
 		}
 
-		csf_process_midi_macro(current_song, 0, current_song->midi_config.stop, 0, 0, 0, 0); // STOP!
+		csf_process_midi_macro(current_song, 0, &current_song->midi_compiled.stop, 0, 0, 0, 0); // STOP!
 		midi_send_flush(); // NOW!
 
 		midi_playing = 0;
@@ -836,11 +1082,11 @@ void song_update_playing_instrument(int i_changed)
 			}
 			if (inst->ifc & 0x80) {
 				channel->cutoff = inst->ifc & 0x7F;
-				setup_channel_filter(channel, 0, 256, current_song->mix_frequency);
+				setup_channel_filter(current_song, channel, 0, 256);
 			} else {
 				channel->cutoff = 0x7F;
 				if (inst->ifr & 0x80) {
-					setup_channel_filter(channel, 0, 256, current_song->mix_frequency);
+					setup_channel_filter(current_song, channel, 0, 256);
 				}
 			}
 
@@ -1024,12 +1270,17 @@ void audio_parse_driver_spec(const char* spec, char** driver, char** device) {
 #define CFG_GET_M(v,d) audio_settings.v = cfg_get_number(cfg, "Mixer Settings", #v, d)
 void cfg_load_audio(cfg_file_t *cfg)
 {
+	char section[16];
+	int n;
+
 	CFG_GET_A(sample_rate, DEF_SAMPLE_RATE);
 	CFG_GET_A(bits, 16);
 	CFG_GET_A(channels, 2);
 	CFG_GET_A(buffer_size, DEF_BUFFER_SIZE);
 	CFG_GET_A(master.left, 31);
 	CFG_GET_A(master.right, 31);
+	CFG_GET_A(jack_channel_ports, 0);
+	CFG_GET_A(jack_transport, 1);
 
 	cfg_get_string(cfg, "Audio", "driver", cfg_audio_driver, 255, NULL);
 	if (!cfg_get_string(cfg, "Audio", "device", cfg_audio_device, 255, NULL)) {
@@ -1044,16 +1295,22 @@ void cfg_load_audio(cfg_file_t *cfg)
 	}
 
 	CFG_GET_M(channel_limit, DEF_CHANNEL_LIMIT);
+	CFG_GET_M(voice_pool, MAX_VOICES);
 	CFG_GET_M(interpolation_mode, SRCMODE_LINEAR);
 	CFG_GET_M(no_ramping, 0);
 	CFG_GET_M(surround_effect, 1);
+	CFG_GET_M(resample_quality, SAMPLE_RESAMPLE_MEDIUM);
+	CFG_GET_M(import_resample, 0);
 
 	if (audio_settings.channels != 1 && audio_settings.channels != 2)
 		audio_settings.channels = 2;
 	if (audio_settings.bits != 8 && audio_settings.bits != 16)
 		audio_settings.bits = 16;
-	audio_settings.channel_limit = CLAMP(audio_settings.channel_limit, 4, MAX_VOICES);
+	audio_settings.voice_pool = CLAMP(audio_settings.voice_pool, MAX_VOICES, MAX_VOICE_POOL);
+	audio_settings.channel_limit = CLAMP(audio_settings.channel_limit, 4, audio_settings.voice_pool);
 	audio_settings.interpolation_mode = CLAMP(audio_settings.interpolation_mode, 0, 3);
+	audio_settings.resample_quality = CLAMP(audio_settings.resample_quality,
+		SAMPLE_RESAMPLE_LOW, SAMPLE_RESAMPLE_HIGH);
 
 	audio_settings.eq_freq[0] = cfg_get_number(cfg, "EQ Low Band", "freq", 0);
 	audio_settings.eq_freq[1] = cfg_get_number(cfg, "EQ Med Low Band", "freq", 16);
@@ -1065,6 +1322,14 @@ void cfg_load_audio(cfg_file_t *cfg)
 	audio_settings.eq_gain[2] = cfg_get_number(cfg, "EQ Med High Band", "gain", 0);
 	audio_settings.eq_gain[3] = cfg_get_number(cfg, "EQ High Band", "gain", 0);
 
+	CFG_GET_M(eq_bands, 4);
+	audio_settings.eq_bands = CLAMP(audio_settings.eq_bands, 4, MAX_EQ_BANDS);
+	for (n = 4; n < MAX_EQ_BANDS; n++) {
+		snprintf(section, sizeof(section), "EQ Band %d", n + 1);
+		audio_settings.eq_freq[n] = cfg_get_number(cfg, section, "freq", 0);
+		audio_settings.eq_gain[n] = cfg_get_number(cfg, section, "gain", 0);
+	}
+
 	if (cfg_get_number(cfg, "General", "stop_on_load", 1)) {
 		status.flags &= ~PLAY_AFTER_LOAD;
 	} else {
@@ -1076,20 +1341,29 @@ void cfg_load_audio(cfg_file_t *cfg)
 #define CFG_SET_M(v) cfg_set_number(cfg, "Mixer Settings", #v, audio_settings.v)
 void cfg_atexit_save_audio(cfg_file_t *cfg)
 {
+	char section[16];
+	int n;
+
 	CFG_SET_A(sample_rate);
 	CFG_SET_A(bits);
 	CFG_SET_A(channels);
 	CFG_SET_A(buffer_size);
 	CFG_SET_A(master.left);
 	CFG_SET_A(master.right);
+	CFG_SET_A(jack_channel_ports);
+	CFG_SET_A(jack_transport);
 
 	CFG_SET_M(channel_limit);
+	CFG_SET_M(voice_pool);
 	CFG_SET_M(interpolation_mode);
 	CFG_SET_M(no_ramping);
 
 	// Say, what happened to the switch for this in the gui?
 	CFG_SET_M(surround_effect);
 
+	CFG_SET_M(resample_quality);
+	CFG_SET_M(import_resample);
+
 	// hmmm....
 	//     [Equalizer]
 	//     low_band=freq/gain
@@ -1106,6 +1380,13 @@ void cfg_atexit_save_audio(cfg_file_t *cfg)
 	cfg_set_number(cfg, "EQ Med Low Band", "gain", audio_settings.eq_gain[1]);
 	cfg_set_number(cfg, "EQ Med High Band", "gain", audio_settings.eq_gain[2]);
 	cfg_set_number(cfg, "EQ High Band", "gain", audio_settings.eq_gain[3]);
+
+	CFG_SET_M(eq_bands);
+	for (n = 4; n < audio_settings.eq_bands; n++) {
+		snprintf(section, sizeof(section), "EQ Band %d", n + 1);
+		cfg_set_number(cfg, section, "freq", audio_settings.eq_freq[n]);
+		cfg_set_number(cfg, section, "gain", audio_settings.eq_gain[n]);
+	}
 }
 
 void cfg_save_audio_playback(cfg_file_t *cfg)
@@ -1141,7 +1422,7 @@ static void _schism_midi_out_note(int chan, const song_note_t *starting_note)
     else fprintf(stderr, "midi_out_note called (ch %d) m=%p\n", m);*/
 
 	if (!midi_playing) {
-		csf_process_midi_macro(current_song, 0, current_song->midi_config.start, 0, 0, 0, 0); // START!
+		csf_process_midi_macro(current_song, 0, &current_song->midi_compiled.start, 0, 0, 0, 0); // START!
 		midi_playing = 1;
 	}
 
@@ -1205,7 +1486,7 @@ printf("channel = %d note=%d starting_note=%p\n",chan,m_note,starting_note);
 	need_note = need_velocity = -1;
 	if (m_note > 120) {
 		if (note_tracker[chan] != 0) {
-			csf_process_midi_macro(current_song, chan, current_song->midi_config.note_off,
+			csf_process_midi_macro(current_song, chan, &current_song->midi_compiled.note_off,
 				0, note_tracker[chan], 0, ins_tracker[chan]);
 		}
 
@@ -1221,7 +1502,7 @@ printf("channel = %d note=%d starting_note=%p\n",chan,m_note,starting_note);
 
 	} else if (m->note) {
 		if (note_tracker[chan] != 0) {
-			csf_process_midi_macro(current_song, chan, current_song->midi_config.note_off,
+			csf_process_midi_macro(current_song, chan, &current_song->midi_compiled.note_off,
 				0, note_tracker[chan], 0, ins_tracker[chan]);
 		}
 		note_tracker[chan] = m_note;
@@ -1259,7 +1540,7 @@ printf("channel = %d note=%d starting_note=%p\n",chan,m_note,starting_note);
 	}
 	if (mg > -1 && was_program[mc] != mg) {
 		was_program[mc] = mg;
-		csf_process_midi_macro(current_song, chan, current_song->midi_config.set_program,
+		csf_process_midi_macro(current_song, chan, &current_song->midi_compiled.set_program,
 			mg, 0, 0, ins); // program change
 	}
 	if (c->flags & CHN_MUTE) {
@@ -1267,11 +1548,11 @@ printf("channel = %d note=%d starting_note=%p\n",chan,m_note,starting_note);
 	} else if (need_note > 0) {
 		if (need_velocity == -1) need_velocity = 64; // eh?
 		need_velocity = CLAMP(need_velocity*2,0,127);
-		csf_process_midi_macro(current_song, chan, current_song->midi_config.note_on,
+		csf_process_midi_macro(current_song, chan, &current_song->midi_compiled.note_on,
 			0, need_note, need_velocity, ins); // noteon
 	} else if (need_velocity > -1 && note_tracker[chan] > 0) {
 		need_velocity = CLAMP(need_velocity*2,0,127);
-		csf_process_midi_macro(current_song, chan, current_song->midi_config.set_volume,
+		csf_process_midi_macro(current_song, chan, &current_song->midi_compiled.set_volume,
 			need_velocity, note_tracker[chan], need_velocity, ins); // volume-set
 	}
 
@@ -1298,21 +1579,81 @@ static void _schism_midi_out_raw(const unsigned char *data, unsigned int len, un
 
 void song_lock_audio(void)
 {
+#ifdef USE_JACK
+	if (audio_jack) {
+		jack_audio_lock();
+		return;
+	}
+#endif
 	SDL_LockAudioDevice(current_audio_device);
 }
 void song_unlock_audio(void)
 {
+#ifdef USE_JACK
+	if (audio_jack) {
+		jack_audio_unlock();
+		return;
+	}
+#endif
 	SDL_UnlockAudioDevice(current_audio_device);
 }
 void song_start_audio(void)
 {
+	SDL_AtomicSet(&audio_running, 1);
+#ifdef USE_JACK
+	if (audio_jack) {
+		jack_audio_pause(0);
+		return;
+	}
+#endif
 	SDL_PauseAudioDevice(current_audio_device, 0);
 }
 void song_stop_audio(void)
 {
+	SDL_AtomicSet(&audio_running, 0);
+#ifdef USE_JACK
+	if (audio_jack) {
+		jack_audio_pause(1);
+		return;
+	}
+#endif
 	SDL_PauseAudioDevice(current_audio_device, 1);
 }
 
+void song_audio_poll(void)
+{
+#ifdef USE_JACK
+	int transport;
+
+	if (!audio_jack)
+		return;
+	if (!jack_audio_poll(&transport)) {
+		SDL_AtomicSet(&audio_running, 0);
+		log_appendf(4, "JACK server shut down; audio output stopped");
+		status.flags |= NEED_UPDATE;
+		return;
+	}
+	if (transport < 0)
+		return;
+	/* the JACK transport started or stopped */
+	if (transport)
+		song_start();
+	else
+		song_stop();
+	status.flags |= NEED_UPDATE;
+#endif
+}
+
+int song_audio_poll_timeout(void)
+{
+#ifdef USE_JACK
+	/* nothing wakes the event loop up when the transport moves */
+	if (audio_jack && audio_settings.jack_transport)
+		return 20;
+#endif
+	return -1;
+}
+
 
 static void song_print_info_top(const char *d)
 {
@@ -1339,6 +1680,15 @@ const char *song_audio_device(void)
 
 static void _cleanup_audio_device(void)
 {
+	SDL_AtomicSet(&audio_running, 0);
+#ifdef USE_JACK
+	if (audio_jack) {
+		jack_audio_close();
+		free(device_name);
+		device_name = NULL;
+		return;
+	}
+#endif
 	if (current_audio_device) {
 		SDL_CloseAudioDevice(current_audio_device);
 		current_audio_device = 0;
@@ -1399,10 +1749,24 @@ static int _audio_open_driver(const char *driver)
 		_cleanup_audio_device();
 		free(driver_name);
 		driver_name = NULL;
-		sdl_audio_quit();
+#ifdef USE_JACK
+		if (!audio_jack)
+#endif
+			sdl_audio_quit();
 		audio_was_init = 0;
 	}
 
+#ifdef USE_JACK
+	/* prefer mixing straight into JACK's process callback over going
+	 * through SDL's jack driver; if the server isn't there, fall through
+	 * and let SDL have a go at it */
+	audio_jack = (driver && !strcmp(driver, "jack") && jack_audio_init());
+	if (audio_jack) {
+		n = "jack";
+		goto audio_was_init;
+	}
+#endif
+
 	const int cnt = SDL_GetNumAudioDrivers();
 
 	if (driver && *driver) {
@@ -1439,10 +1803,48 @@ audio_was_init:
 	return 1;
 }
 
+#ifdef USE_JACK
+static int _audio_open_jack(int verbose)
+{
+	unsigned int rate, frames;
+
+	if (!jack_audio_open(&rate, &frames, audio_settings.jack_channel_ports,
+			audio_settings.jack_transport, audio_callback))
+		return 0;
+
+	device_name = str_dup("default");
+
+	/* the server decides the rate and period; we always hand it 16-bit stereo */
+	song_lock_audio();
+
+	csf_set_wave_config(current_song, rate, 16, 2);
+	audio_output_channels = 2;
+	audio_output_bits = 16;
+	audio_sample_size = 4;
+	audio_buffer_samples = frames;
+
+	if (verbose) {
+		song_print_info_top(driver_name);
+
+		log_appendf(5, " %d Hz, 16 bit, stereo", rate);
+		log_appendf(5, " Period size: %d samples", frames);
+		if (audio_settings.jack_channel_ports)
+			log_append(5, 0, " Per-channel outputs enabled");
+	}
+
+	return 1;
+}
+#endif
+
 static int _audio_open_device(const char *device, int verbose)
 {
 	_cleanup_audio_device();
 
+#ifdef USE_JACK
+	if (audio_jack)
+		return _audio_open_jack(verbose);
+#endif
+
 	/* if the buffer size isn't a power of two, the dsp driver will punt since it's not nice enough to fix
 	 * it for us. (contrast alsa, which is TOO nice and fixes it even when we don't want it to) */
 	int size_pow2 = 2;
@@ -1615,17 +2017,20 @@ int audio_reinit(const char *device)
 
 void song_init_eq(int do_reset, uint32_t mix_freq)
 {
-	uint32_t pg[4];
-	uint32_t pf[4];
+	uint32_t pg[MAX_EQ_BANDS];
+	uint32_t pf[MAX_EQ_BANDS];
 	int i;
 
-	for (i = 0; i < 4; i++) {
+	for (i = 0; i < audio_settings.eq_bands; i++) {
 		pg[i] = audio_settings.eq_gain[i];
-		pf[i] = 120 + (((i*128) * audio_settings.eq_freq[i])
-			* (mix_freq / 128) / 1024);
+		if (i < 4)
+			pf[i] = 120 + (((i*128) * audio_settings.eq_freq[i])
+				* (mix_freq / 128) / 1024);
+		else
+			pf[i] = audio_settings.eq_freq[i];
 	}
 
-	set_eq_gains(pg, 4, pf, do_reset, mix_freq);
+	set_eq_gains(pg, audio_settings.eq_bands, pf, do_reset, mix_freq);
 }
 
 
@@ -1633,6 +2038,10 @@ void song_init_modplug(void)
 {
 	song_lock_audio();
 
+	if (csf_voice_pool_size != (uint32_t) audio_settings.voice_pool) {
+		csf_voice_pool_size = audio_settings.voice_pool;
+		csf_set_voice_pool(current_song, csf_voice_pool_size);
+	}
 	max_voices = audio_settings.channel_limit;
 	csf_set_resampling_mode(current_song, audio_settings.interpolation_mode);
 	if (audio_settings.no_ramping)
@@ -1658,6 +2067,8 @@ void song_initialise(void)
 {
 	csf_midi_out_note = _schism_midi_out_note;
 	csf_midi_out_raw = _schism_midi_out_raw;
+	csf_live_input = _schism_live_input;
+	dsp_load_init();
 
 
 	current_song = csf_allocate();
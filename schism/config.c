@@ -52,6 +52,7 @@ int cfg_video_width, cfg_video_height;
 #ifdef SCHISM_WIN32
 int cfg_video_want_menu_bar = 1;
 #endif
+int cfg_autosave_interval = 5;
 
 /* --------------------------------------------------------------------- */
 
@@ -235,6 +236,7 @@ void cfg_load(void)
 		status.flags |= NUMBERED_BACKUPS;
 	else
 		status.flags &= ~NUMBERED_BACKUPS;
+	cfg_autosave_interval = cfg_get_number(&cfg, "General", "autosave_interval", 5);
 
 	i = cfg_get_number(&cfg, "General", "time_display", TIME_PLAY_ELAPSED);
 	/* default to play/elapsed for invalid values */
@@ -369,6 +371,7 @@ void cfg_atexit_save(void)
 	cfg_set_number(&cfg, "General", "classic_mode", !!(status.flags & CLASSIC_MODE));
 	cfg_set_number(&cfg, "General", "make_backups", !!(status.flags & MAKE_BACKUPS));
 	cfg_set_number(&cfg, "General", "numbered_backups", !!(status.flags & NUMBERED_BACKUPS));
+	cfg_set_number(&cfg, "General", "autosave_interval", cfg_autosave_interval);
 
 	cfg_set_number(&cfg, "General", "accidentals_as_flats", (kbd_sharp_flat_state() == KBD_SHARP_FLAT_FLATS));
 	cfg_set_number(&cfg, "General", "meta_is_ctrl", !!(status.flags & META_IS_CTRL));
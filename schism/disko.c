@@ -33,6 +33,7 @@
 #include "song.h"
 #include "util.h"
 #include "vgamem.h"
+#include "video.h"
 
 #include "player/sndfile.h"
 #include "player/cmixer.h"
@@ -43,8 +44,16 @@
 #include <fcntl.h>
 #include <errno.h>
 
+#if defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H)
+# include <sys/uio.h>
+# define DW_USE_WRITEV 1
+#endif
+
 #define DW_BUFFER_SIZE 65536
 
+/* disk files are written in blocks of this size */
+#define DW_WRITE_BUFFER_SIZE (1 << 20)
+
 // ---------------------------------------------------------------------------
 
 static unsigned int disko_output_rate = 44100;
@@ -68,30 +77,96 @@ void cfg_save_disko(cfg_file_t *cfg)
 // ---------------------------------------------------------------------------
 // stdio backend
 
-static void _dw_stdio_write(disko_t *ds, const void *buf, size_t len)
+// the stream itself is unbuffered; this writes out our buffer, followed by
+// 'len' bytes of 'buf', in one go if possible
+static void _dw_stdio_flush(disko_t *ds, const void *buf, size_t len)
 {
-	if (fwrite(buf, len, 1, ds->file) != 1)
+#ifdef DW_USE_WRITEV
+	struct iovec iov[2];
+	int fd = fileno(ds->file);
+	int n = 0;
+
+	iov[0].iov_base = ds->buffer;
+	iov[0].iov_len = ds->buffered;
+	iov[1].iov_base = (void *) buf;
+	iov[1].iov_len = len;
+
+	while (n < 2) {
+		ssize_t r;
+
+		if (!iov[n].iov_len) {
+			n++;
+			continue;
+		}
+		r = writev(fd, iov + n, 2 - n);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			disko_seterror(ds, errno);
+			break;
+		}
+		// short write; pick up where it left off
+		for (; n < 2 && (size_t) r >= iov[n].iov_len; n++)
+			r -= iov[n].iov_len;
+		if (n < 2) {
+			iov[n].iov_base = (uint8_t *) iov[n].iov_base + r;
+			iov[n].iov_len -= r;
+		}
+	}
+#else
+	if ((ds->buffered && fwrite(ds->buffer, ds->buffered, 1, ds->file) != 1)
+	    || (len && fwrite(buf, len, 1, ds->file) != 1))
 		disko_seterror(ds, errno);
+#endif
+	ds->buffered = 0;
+}
+
+static void _dw_stdio_write(disko_t *ds, const void *buf, size_t len)
+{
+	if (ds->buffered + len <= DW_WRITE_BUFFER_SIZE) {
+		memcpy(ds->buffer + ds->buffered, buf, len);
+		ds->buffered += len;
+	} else if (len < DW_WRITE_BUFFER_SIZE / 2) {
+		_dw_stdio_flush(ds, NULL, 0);
+		memcpy(ds->buffer, buf, len);
+		ds->buffered = len;
+	} else {
+		// big enough that copying it around isn't worth it
+		_dw_stdio_flush(ds, buf, len);
+	}
 }
 
 static void _dw_stdio_putc(disko_t *ds, int c)
 {
-	if (fputc(c, ds->file) == EOF)
-		disko_seterror(ds, errno);
+	if (ds->buffered == DW_WRITE_BUFFER_SIZE)
+		_dw_stdio_flush(ds, NULL, 0);
+	ds->buffer[ds->buffered++] = c;
 }
 
+// with writev, the stream is bypassed entirely (stdio might cache the position)
 static void _dw_stdio_seek(disko_t *ds, long pos, int whence)
 {
-	if (fseek(ds->file, pos, whence) < 0)
+	_dw_stdio_flush(ds, NULL, 0);
+#ifdef DW_USE_WRITEV
+	if (!ds->error && lseek(fileno(ds->file), pos, whence) < 0)
+#else
+	if (!ds->error && fseek(ds->file, pos, whence) < 0)
+#endif
 		disko_seterror(ds, errno);
 }
 
 static long _dw_stdio_tell(disko_t *ds)
 {
+#ifdef DW_USE_WRITEV
+	long pos = lseek(fileno(ds->file), 0, SEEK_CUR);
+#else
 	long pos = ftell(ds->file);
-	if (pos < 0)
+#endif
+	if (pos < 0) {
 		disko_seterror(ds, errno);
-	return pos;
+		return pos;
+	}
+	return pos + (long) ds->buffered;
 }
 
 // ---------------------------------------------------------------------------
@@ -100,25 +175,34 @@ static long _dw_stdio_tell(disko_t *ds)
 // 0 => memory error, abandon ship
 static int _dw_bufcheck(disko_t *ds, size_t extend)
 {
-	if (ds->pos + extend <= ds->length)
+	size_t end = ds->pos + extend;
+
+	if (end <= ds->length)
 		return 1;
 
-	ds->length = MAX(ds->length, ds->pos + extend);
+	if (end > ds->allocated) {
+		// grow geometrically, otherwise building up a big file is quadratic
+		size_t newsize = MAX(ds->allocated, DW_BUFFER_SIZE);
+		uint8_t *new;
 
-	if (ds->length >= ds->allocated) {
-		size_t newsize = MAX(ds->allocated + DW_BUFFER_SIZE, ds->length);
-		uint8_t *new = realloc(ds->data, newsize);
+		while (newsize < end && newsize <= SIZE_MAX / 2)
+			newsize *= 2;
+		new = (newsize >= end) ? realloc(ds->data, newsize) : NULL;
 		if (!new) {
 			// Eek
 			free(ds->data);
 			ds->data = NULL;
-			disko_seterror(ds, errno);
+			disko_seterror(ds, errno ? errno : ENOMEM);
 			return 0;
 		}
-		memset(new + ds->allocated, 0, newsize - ds->allocated);
 		ds->data = new;
 		ds->allocated = newsize;
 	}
+
+	// whatever was seeked over reads back as zeroes
+	if (ds->pos > ds->length)
+		memset(ds->data + ds->length, 0, ds->pos - ds->length);
+	ds->length = end;
 	return 1;
 }
 
@@ -188,12 +272,6 @@ void disko_seek(disko_t *ds, long pos, int whence)
 		ds->_seek(ds, pos, whence);
 }
 
-/* used by multi-write */
-static void disko_seekcur(disko_t *ds, long pos)
-{
-	disko_seek(ds, pos, SEEK_CUR);
-}
-
 long disko_tell(disko_t *ds)
 {
 	if (!ds->error)
@@ -234,27 +312,32 @@ int disko_open(disko_t *ds, const char *filename)
 	if (!ds)
 		return -1;
 
+	memset(ds, 0, sizeof(*ds));
 	memcpy(ds->filename, filename, len * sizeof(char));
 	memcpy(ds->tempname, filename, len * sizeof(char));
 	memcpy(ds->tempname + len, "XXXXXX", 6 * sizeof(char));
 
+	ds->buffer = malloc(DW_WRITE_BUFFER_SIZE);
+	if (!ds->buffer)
+		return -1;
+
 #ifdef SCHISM_WIN32
 	{
 		if (win32_mktemp(ds->tempname, sizeof(ds->tempname)/sizeof(ds->tempname[0]))) {
-			free(ds);
+			free(ds->buffer);
 			return -1;
 		}
 
 		ds->file = win32_fopen(ds->tempname, "wb");
 		if (!ds->file) {
-			free(ds);
+			free(ds->buffer);
 			return -1;
 		}
 	}
 #else
 	fd = mkstemp(ds->tempname);
 	if (fd == -1) {
-		free(ds);
+		free(ds->buffer);
 		return -1;
 	}
 	ds->file = fdopen(fd, "wb");
@@ -262,13 +345,14 @@ int disko_open(disko_t *ds, const char *filename)
 		err = errno;
 		close(fd);
 		unlink(ds->tempname);
-		free(ds);
+		free(ds->buffer);
 		errno = err;
 		return -1;
 	}
 #endif
 
-	setvbuf(ds->file, NULL, _IOFBF, DW_BUFFER_SIZE);
+	// we do our own buffering
+	setvbuf(ds->file, NULL, _IONBF, 0);
 
 	ds->_write = _dw_stdio_write;
 	ds->_seek = _dw_stdio_seek;
@@ -280,7 +364,13 @@ int disko_open(disko_t *ds, const char *filename)
 
 int disko_close(disko_t *ds, int backup)
 {
-	int err = ds->error;
+	int err;
+
+	if (!ds->error)
+		_dw_stdio_flush(ds, NULL, 0);
+	free(ds->buffer);
+	ds->buffer = NULL;
+	err = ds->error;
 
 	// try to preserve the *first* error set, because it's most likely to be interesting
 	if (fclose(ds->file) == EOF && !err) {
@@ -330,7 +420,8 @@ int disko_memopen(disko_t *ds)
 	if (!ds)
 		return -1;
 
-	ds->data = calloc(DW_BUFFER_SIZE, sizeof(uint8_t));
+	memset(ds, 0, sizeof(*ds));
+	ds->data = malloc(DW_BUFFER_SIZE);
 	if (!ds->data)
 		return -1;
 
@@ -366,6 +457,7 @@ static void _export_setup(song_t *dwsong, int *bps)
 
 	/* install our own */
 	memcpy(dwsong, current_song, sizeof(song_t)); /* shadow it */
+	csf_copy_voices(dwsong, current_song);
 
 	dwsong->multi_write = NULL; /* should be null already, but to be sure... */
 
@@ -386,33 +478,253 @@ static void _export_setup(song_t *dwsong, int *bps)
 	song_unlock_audio();
 }
 
-static void _export_teardown(void)
+static disko_t *_export_open(const char *filename)
+{
+	disko_t *ds = malloc(sizeof(disko_t));
+
+	if (ds && disko_open(ds, filename) < 0) {
+		free(ds);
+		ds = NULL;
+	}
+	return ds;
+}
+
+static void _export_teardown(song_t *dwsong)
 {
+	csf_free_voices(dwsong);
 	global_vu_left = global_vu_right = 0;
 }
 
 // ---------------------------------------------------------------------------
 
-static int close_and_bind(song_t *dwsong, disko_t *ds, song_sample_t *sample, int bps)
+/* Rendering patterns into samples.
+
+Each render gets its own copy of the song, so a split render can go on several
+threads at once: every channel is rendered separately, with all the others
+muted. (Muting rather than just pulling out the channel's voices means the
+other channels still do their speed/tempo/global volume changes.) The main
+thread waits with a progress dialog, and then binds the results into the song
+all at once. */
+
+/* renders run on up to this many threads */
+#define PAT2SMP_MAX_THREADS 16
+
+struct pat2smp_render {
+	int channel; /* -1 for the whole pattern */
+	disko_t ds;
+	int used; /* made some noise */
+	SDL_atomic_t row; /* how far it's got */
+};
+
+struct pat2smp_job {
+	song_t base; /* everything is rendered from copies of this */
+	int pattern, bps;
+	int nrenders;
+	struct pat2smp_render render[MAX_CHANNELS];
+	SDL_atomic_t next, cancel;
+};
+
+static struct pat2smp_job *pat2smp_job = NULL;
+static struct widget pat2smp_widgets[1];
+
+static void _pat2smp_render(struct pat2smp_job *job, struct pat2smp_render *r, song_t *song, uint8_t *buf)
 {
-	disko_t dsshadow = *ds;
-	int8_t *newdata;
+	const size_t max = (size_t) MAX_SAMPLE_LENGTH * job->bps;
+	size_t n, bytes;
+	uint8_t first = 0;
+	int started = 0;
+
+	memcpy(song, &job->base, sizeof(song_t));
+	csf_copy_voices(song, &job->base);
+	if (r->channel >= 0) {
+		for (n = 0; n < MAX_CHANNELS; n++) {
+			if ((int) n == r->channel)
+				continue;
+			song->channels[n].flags |= CHN_MUTE;
+			song->voices[n].flags |= CHN_MUTE;
+		}
+	}
+	csf_loop_pattern(song, job->pattern, 0);
 
-	if (disko_memclose(ds, 1) == DW_ERROR)
-		return DW_ERROR;
+	do {
+		bytes = csf_read(song, buf, DW_BUFFER_SIZE) * job->bps;
 
-	free(ds);
+		/* silence is the same value over and over, whatever the format */
+		for (n = 0; n < bytes && !r->used; n++) {
+			if (!started) {
+				first = buf[n];
+				started = 1;
+			}
+			r->used = (buf[n] != first);
+		}
+
+		disko_write(&r->ds, buf, bytes);
+		if (r->ds.length >= max) {
+			/* roughly 3 minutes at 44khz -- surely big enough (?) */
+			r->ds.length = max;
+			break;
+		}
+		SDL_AtomicSet(&r->row, song->row);
+	} while (!(song->flags & SONG_ENDREACHED) && !r->ds.error && !SDL_AtomicGet(&job->cancel));
+
+	csf_free_voices(song);
+	SDL_AtomicSet(&r->row, song->pattern_size[job->pattern]);
+}
+
+static int SDLCALL _pat2smp_worker(void *data)
+{
+	struct pat2smp_job *job = data;
+	/* (a song is far too big for a thread's stack) */
+	song_t *song = mem_alloc(sizeof(song_t));
+	uint8_t *buf = mem_alloc(DW_BUFFER_SIZE);
+	int n;
+
+	while (!SDL_AtomicGet(&job->cancel) && (n = SDL_AtomicAdd(&job->next, 1)) < job->nrenders)
+		_pat2smp_render(job, &job->render[n], song, buf);
+
+	free(buf);
+	free(song);
+	return 0;
+}
+
+static void _pat2smp_draw(void)
+{
+	struct pat2smp_job *job = pat2smp_job;
+	int n, rows = 0, total = job->nrenders * MAX(1, job->base.pattern_size[job->pattern]);
+
+	for (n = 0; n < job->nrenders; n++)
+		rows += SDL_AtomicGet(&job->render[n].row);
+
+	draw_text("Rendering pattern...", 27, 27, 0, 2);
+	draw_fill_chars(24, 30, 55, 30, DEFAULT_FG, 0);
+	draw_vu_meter(24, 30, 32, rows * 64 / total, 4, 4);
+	draw_box(23, 29, 56, 31, BOX_THIN | BOX_INNER | BOX_INSET);
+}
+
+/* same as the sample editor: everything's on hold, but the screen and the
+audio keep going, and Escape cancels */
+static void _pat2smp_wait(struct pat2smp_job *job, SDL_Thread **threads, int nthreads)
+{
+	SDL_Event event[16];
+	int n, i, running = nthreads;
+
+	pat2smp_job = job;
+	dialog_create_custom(22, 25, 36, 8, pat2smp_widgets, 0, 0, _pat2smp_draw, NULL);
+
+	while (running) {
+		SDL_PumpEvents();
+		while ((n = SDL_PeepEvents(event, ARRAY_SIZE(event), SDL_GETEVENT, SDL_KEYDOWN, SDL_TEXTINPUT)) > 0) {
+			for (i = 0; i < n; i++)
+				if (event[i].type == SDL_KEYDOWN && event[i].key.keysym.sym == SDLK_ESCAPE)
+					SDL_AtomicSet(&job->cancel, 1);
+		}
+
+		redraw_screen();
+		video_refresh();
+		video_blit();
+		SDL_Delay(20);
+
+		/* they're all done once nothing's left to pick up and every render has
+		finished its last row */
+		running = (SDL_AtomicGet(&job->next) < job->nrenders + nthreads && !SDL_AtomicGet(&job->cancel));
+	}
+
+	for (n = 0; n < nthreads; n++)
+		SDL_WaitThread(threads[n], NULL);
+
+	dialog_destroy();
+	pat2smp_job = NULL;
+	status.flags |= NEED_UPDATE;
+}
+
+/* render everything in the job. returns DW_NOT_RUNNING if it was cancelled. */
+static int _pat2smp_run(struct pat2smp_job *job)
+{
+	SDL_Thread *threads[PAT2SMP_MAX_THREADS];
+	int n, nthreads;
+
+	SDL_AtomicSet(&job->next, 0);
+	SDL_AtomicSet(&job->cancel, 0);
+	for (n = 0; n < job->nrenders; n++) {
+		SDL_AtomicSet(&job->render[n].row, 0);
+		job->render[n].used = 0;
+		if (disko_memopen(&job->render[n].ds) < 0)
+			return DW_ERROR;
+	}
+
+	/* there's only one OPL chip, so AdLib samples can't be rendered in parallel */
+	nthreads = CLAMP(SDL_GetCPUCount(), 1, PAT2SMP_MAX_THREADS);
+	for (n = 1; n < MAX_SAMPLES; n++)
+		if (job->base.samples[n].flags & CHN_ADLIB)
+			nthreads = 1;
+	nthreads = MIN(nthreads, job->nrenders);
+
+	for (n = 0; n < nthreads; n++) {
+		threads[n] = SDL_CreateThread(_pat2smp_worker, "Schism pattern render", job);
+		if (!threads[n])
+			break;
+	}
+	nthreads = n;
+
+	if (nthreads)
+		_pat2smp_wait(job, threads, nthreads);
+	else
+		_pat2smp_worker(job); /* no threads, so just do it here */
+
+	if (SDL_AtomicGet(&job->cancel))
+		return DW_NOT_RUNNING;
+	for (n = 0; n < job->nrenders; n++) {
+		if (job->render[n].ds.error) {
+			errno = job->render[n].ds.error;
+			return DW_ERROR;
+		}
+	}
+	return DW_OK;
+}
+
+static struct pat2smp_job *_pat2smp_setup(int pattern)
+{
+	struct pat2smp_job *job = mem_calloc(1, sizeof(*job));
+
+	_export_setup(&job->base, &job->bps);
+	/* the EQ is for what's coming out of the speakers, and this is going to
+	go through it again when it's played */
+	job->base.mix_flags |= SNDMIX_NOEQ;
+	job->pattern = pattern;
+	return job;
+}
+
+static void _pat2smp_free(struct pat2smp_job *job)
+{
+	int n;
+
+	for (n = 0; n < job->nrenders; n++)
+		if (job->render[n].ds.data)
+			disko_memclose(&job->render[n].ds, 0);
+	_export_teardown(&job->base);
+	free(job);
+}
+
+/* copy the render into sample data; this is done before locking anything */
+static signed char *_pat2smp_take(struct pat2smp_render *r)
+{
+	signed char *data = csf_allocate_sample(r->ds.length);
+
+	memcpy(data, r->ds.data, r->ds.length);
+	return data;
+}
+
+/* call with the audio locked */
+static void _pat2smp_bind(struct pat2smp_job *job, song_sample_t *sample, signed char *data, size_t bytes)
+{
+	const song_t *dwsong = &job->base;
 
-	newdata = csf_allocate_sample(dsshadow.length);
-	if (!newdata)
-		return DW_ERROR;
 	csf_stop_sample(current_song, sample);
 	if (sample->data)
 		csf_free_sample(sample->data);
-	sample->data = newdata;
+	sample->data = data;
 
-	memcpy(newdata, dsshadow.data, dsshadow.length);
-	sample->length = dsshadow.length / bps;
+	sample->length = bytes / job->bps;
 	sample->flags &= ~(CHN_16BIT | CHN_STEREO | CHN_ADLIB);
 	if (dwsong->mix_channels > 1)
 		sample->flags |= CHN_STEREO;
@@ -420,164 +732,94 @@ static int close_and_bind(song_t *dwsong, disko_t *ds, song_sample_t *sample, in
 		sample->flags |= CHN_16BIT;
 	sample->c5speed = dwsong->mix_frequency;
 	sample->name[0] = '\0';
-
-	return DW_OK;
+	csf_adjust_sample_loop(sample);
 }
 
 int disko_writeout_sample(int smpnum, int pattern, int dobind)
 {
-	int ret = DW_OK;
-	song_t dwsong;
+	struct pat2smp_job *job;
 	song_sample_t *sample;
-	uint8_t buf[DW_BUFFER_SIZE];
-	disko_t ds;
-	int bps;
+	signed char *data;
+	int ret;
 
 	if (smpnum < 1 || smpnum >= MAX_SAMPLES)
 		return DW_ERROR;
 
-	if (disko_memopen(&ds) < 0)
-		return DW_ERROR;
-
-	_export_setup(&dwsong, &bps);
-	dwsong.repeat_count = -1; // FIXME do this right
-	csf_loop_pattern(&dwsong, pattern, 0);
+	job = _pat2smp_setup(pattern);
+	job->nrenders = 1;
+	job->render[0].channel = -1;
 
-	do {
-		disko_write(&ds, buf, csf_read(&dwsong, buf, sizeof(buf)) * bps);
-		if (ds.length >= (size_t) (MAX_SAMPLE_LENGTH * bps)) {
-			/* roughly 3 minutes at 44khz -- surely big enough (?) */
-			ds.length = MAX_SAMPLE_LENGTH * bps;
-			dwsong.flags |= SONG_ENDREACHED;
-		}
-	} while (!(dwsong.flags & SONG_ENDREACHED));
+	ret = _pat2smp_run(job);
+	if (ret == DW_OK) {
+		data = _pat2smp_take(&job->render[0]);
 
-	sample = current_song->samples + smpnum;
-	if (close_and_bind(&dwsong, &ds, sample, bps) == DW_OK) {
+		song_lock_audio();
+		sample = current_song->samples + smpnum;
+		_pat2smp_bind(job, sample, data, job->render[0].ds.length);
 		sprintf(sample->name, "Pattern %03d", pattern);
 		if (dobind) {
 			/* This is hideous */
 			sample->name[23] = 0xff;
 			sample->name[24] = pattern;
 		}
-	} else {
-		/* Balls. Something died. */
-		ret = DW_ERROR;
+		song_unlock_audio();
 	}
 
-	_export_teardown();
-
+	_pat2smp_free(job);
 	return ret;
 }
 
 int disko_multiwrite_samples(int firstsmp, int pattern)
 {
-	int err = 0;
-	song_t dwsong;
-	song_sample_t *sample;
-	uint8_t buf[DW_BUFFER_SIZE];
-	disko_t *ds[MAX_CHANNELS] = {NULL};
-	int bps;
-	size_t smpsize = 0;
+	struct pat2smp_job *job;
+	const song_note_t *note;
+	signed char *data[MAX_CHANNELS] = {NULL};
 	int smpnum = CLAMP(firstsmp, 1, MAX_SAMPLES);
-	int n;
-
-	_export_setup(&dwsong, &bps);
-	dwsong.repeat_count = -1; // FIXME do this right
-	csf_loop_pattern(&dwsong, pattern, 0);
-	dwsong.multi_write = calloc(MAX_CHANNELS, sizeof(struct multi_write));
-	if (!dwsong.multi_write)
-		err = errno ? errno : ENOMEM;
+	int ret, n, row;
 
-	if (!err) {
-		for (n = 0; n < MAX_CHANNELS; n++) {
-			if (disko_memopen(ds[n]) < 0) {
-				err = errno ? errno : EINVAL;
-				break;
-			}
-		}
-	}
-
-	if (err) {
-		/* you might think this code is insane, and you might be correct ;)
-		but it's structured like this to keep all the early-termination handling HERE. */
-		_export_teardown();
-		err = err ? err : errno;
-		free(dwsong.multi_write);
-		for (n = 0; n < MAX_CHANNELS; n++) {
-			disko_memclose(ds[n], 0);
-			free(ds[n]);
-		}
-		errno = err;
-		return DW_ERROR;
-	}
+	job = _pat2smp_setup(pattern);
 
+	/* don't bother with channels that can't make a sound */
 	for (n = 0; n < MAX_CHANNELS; n++) {
-		dwsong.multi_write[n].data = ds[n];
-		/* Dumb casts. (written this way to make the definition of song_t independent of disko) */
-		dwsong.multi_write[n].write = (void(*)(void*, const uint8_t*, size_t))disko_write;
-		dwsong.multi_write[n].silence = (void(*)(void*, long))disko_seekcur;
+		if (job->base.channels[n].flags & CHN_MUTE)
+			continue;
+		note = job->base.patterns[pattern] + n;
+		for (row = 0; row < job->base.pattern_size[pattern]; row++, note += MAX_CHANNELS)
+			if (NOTE_IS_NOTE(note->note))
+				break;
+		if (row < job->base.pattern_size[pattern])
+			job->render[job->nrenders++].channel = n;
 	}
 
-	do {
-		/* buf is used as temp space for converting the individual channel buffers from 32-bit.
-		the output is being handled well inside the mixer, so we don't have to do any actual writing
-		here, but we DO need to make sure nothing died... */
-		smpsize += csf_read(&dwsong, buf, sizeof(buf));
+	ret = job->nrenders ? _pat2smp_run(job) : DW_OK;
+	if (ret == DW_OK) {
+		for (n = 0; n < job->nrenders; n++)
+			if (job->render[n].used)
+				data[n] = _pat2smp_take(&job->render[n]);
 
-		if (smpsize >= MAX_SAMPLE_LENGTH) {
-			/* roughly 3 minutes at 44khz -- surely big enough (?) */
-			smpsize = MAX_SAMPLE_LENGTH;
-			dwsong.flags |= SONG_ENDREACHED;
-			break;
-		}
+		song_lock_audio();
+		for (n = 0; n < job->nrenders; n++) {
+			song_sample_t *sample;
 
-		for (n = 0; n < MAX_CHANNELS; n++) {
-			if (ds[n]->error) {
-				// Kill the write, but leave the other files alone
-				dwsong.flags |= SONG_ENDREACHED;
+			if (!data[n])
+				continue;
+			smpnum = csf_first_blank_sample(current_song, smpnum);
+			if (smpnum < 0)
 				break;
-			}
-		}
-	} while (!(dwsong.flags & SONG_ENDREACHED));
-
-	for (n = 0; n < MAX_CHANNELS; n++) {
-		if (!dwsong.multi_write[n].used) {
-			/* this channel was completely empty - don't bother with it */
-			disko_memclose(ds[n], 0);
-			free(ds[n]);
-			continue;
+			sample = current_song->samples + smpnum;
+			_pat2smp_bind(job, sample, data[n], job->render[n].ds.length);
+			sprintf(sample->name, "Pattern %03d, channel %02d", pattern, job->render[n].channel + 1);
+			data[n] = NULL;
 		}
+		song_unlock_audio();
 
-		ds[n]->length = MIN(ds[n]->length, smpsize * bps);
-		smpnum = csf_first_blank_sample(current_song, smpnum);
-		if (smpnum < 0)
-			break;
-		sample = current_song->samples + smpnum;
-		if (close_and_bind(&dwsong, ds[n], sample, bps) == DW_OK) {
-			sprintf(sample->name, "Pattern %03d, channel %02d", pattern, n + 1);
-		} else {
-			/* Balls. Something died. */
-			err = errno;
-		}
+		/* out of sample slots */
+		for (; n < job->nrenders; n++)
+			csf_free_sample(data[n]);
 	}
 
-	for (; n < MAX_CHANNELS; n++) {
-		if (disko_memclose(ds[n], 0) != DW_OK)
-			err = errno;
-
-		free(ds[n]);
-	}
-
-	_export_teardown();
-	free(dwsong.multi_write);
-
-	if (err) {
-		errno = err;
-		return DW_ERROR;
-	} else {
-		return DW_OK;
-	}
+	_pat2smp_free(job);
+	return ret;
 }
 
 // ---------------------------------------------------------------------------
@@ -712,13 +954,11 @@ int disko_export_song(const char *filename, const struct save_format *format)
 		if (numfiles > 1) {
 			char *tmp = get_filename(filename, n + 1);
 			if (tmp) {
-				export_ds[n] = calloc(1, sizeof(*export_ds[n]));
-				disko_open(export_ds[n], tmp);
+				export_ds[n] = _export_open(tmp);
 				free(tmp);
 			}
 		} else {
-			export_ds[n] = calloc(1, sizeof(*export_ds[n]));
-			disko_open(export_ds[n], filename);
+			export_ds[n] = _export_open(filename);
 		}
 		if (!(export_ds[n] && format->f.export.head(export_ds[n], export_dwsong.mix_bits_per_sample,
 				export_dwsong.mix_channels, export_dwsong.mix_frequency) == DW_OK)) {
@@ -728,12 +968,14 @@ int disko_export_song(const char *filename, const struct save_format *format)
 	}
 
 	if (err) {
-		_export_teardown();
+		_export_teardown(&export_dwsong);
 		free(export_dwsong.multi_write);
 		for (n = 0; export_ds[n]; n++) {
 			disko_seterror(export_ds[n], err); /* keep from writing a bunch of useless files */
 			disko_close(export_ds[n], 0);
+			free(export_ds[n]);
 		}
+		memset(export_ds, 0, sizeof(export_ds));
 		errno = err ? err : EINVAL;
 		log_perror(filename);
 		return DW_ERROR;
@@ -833,10 +1075,11 @@ static int disko_finish(void)
 			if (ret == DW_OK)
 				ret = tmp;
 		}
+		free(export_ds[n]);
 	}
 	memset(export_ds, 0, sizeof(export_ds));
 
-	_export_teardown();
+	_export_teardown(&export_dwsong);
 	free(export_dwsong.multi_write);
 	export_format = NULL;
 
@@ -879,11 +1122,17 @@ static void pat2smp_single(void *data)
 {
 	struct pat2smp *ps = data;
 
-	if (disko_writeout_sample(ps->sample, ps->pattern, ps->bind) == DW_OK) {
+	switch (disko_writeout_sample(ps->sample, ps->pattern, ps->bind)) {
+	case DW_OK:
 		set_page(PAGE_SAMPLE_LIST);
-	} else {
+		break;
+	case DW_NOT_RUNNING:
+		status_text_flash("Canceled");
+		break;
+	default:
 		log_perror("Sample write");
 		status_text_flash("Error writing to sample");
+		break;
 	}
 
 	free(ps);
@@ -892,11 +1141,17 @@ static void pat2smp_single(void *data)
 static void pat2smp_multi(void *data)
 {
 	struct pat2smp *ps = data;
-	if (disko_multiwrite_samples(ps->sample, ps->pattern) == DW_OK) {
+	switch (disko_multiwrite_samples(ps->sample, ps->pattern)) {
+	case DW_OK:
 		set_page(PAGE_SAMPLE_LIST);
-	} else {
+		break;
+	case DW_NOT_RUNNING:
+		status_text_flash("Canceled");
+		break;
+	default:
 		log_perror("Sample multi-write");
 		status_text_flash("Error writing to samples");
+		break;
 	}
 
 	free(ps);
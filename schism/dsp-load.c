@@ -0,0 +1,254 @@
+/*
+ * Schism Tracker - a cross-platform Impulse Tracker clone
+ * copyright (c) 2003-2005 Storlek <storlek@rigelseven.com>
+ * copyright (c) 2005-2008 Mrs. Brisby <mrs.brisby@nimh.org>
+ * copyright (c) 2009 Storlek & Mrs. Brisby
+ * copyright (c) 2010-2012 Storlek
+ * URL: http://schismtracker.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* How much of the audio callback the mixer is using, and where it goes. */
+
+#include "headers.h"
+
+#include "it.h"
+#include "song.h"
+#include "util.h"
+#include "dsp-load.h"
+
+#include "sdlmain.h"
+
+/* the trace keeps this many events, and drops the oldest after that */
+#define TRACE_EVENTS (1 << 18)
+
+/* pseudo-stages for the trace */
+#define TRACE_BUFFER   (CSF_NUM_STAGES)
+#define TRACE_UNDERRUN (CSF_NUM_STAGES + 1)
+
+static const char *stage_names[] = {
+	[CSF_STAGE_TICK] = "tick",
+	[CSF_STAGE_MIX] = "mix",
+	[CSF_STAGE_ADLIB] = "adlib",
+	[CSF_STAGE_EQ] = "eq",
+	[CSF_STAGE_CONVERT] = "convert",
+	[TRACE_BUFFER] = "buffer",
+	[TRACE_UNDERRUN] = "underrun",
+};
+
+struct trace_event {
+	uint64_t start, end;
+	int stage;
+};
+
+/* everything below is only touched by the audio thread (or with the audio
+locked), except for the smoothed figures, which are read without locking since
+a torn read just means one odd-looking number on the screen */
+static SDL_threadID audio_thread;
+static int in_buffer = 0;
+static uint64_t buffer_start;
+static uint64_t stage_time[CSF_NUM_STAGES];
+
+static int load_avg, load_peak;
+static int stage_avg[CSF_NUM_STAGES];
+static SDL_atomic_t underruns;
+
+static struct trace_event *trace = NULL;
+static uint32_t trace_pos = 0, trace_count = 0;
+static SDL_atomic_t tracing;
+
+static uint64_t _dsp_clock(void)
+{
+	return SDL_GetPerformanceCounter();
+}
+
+static void _trace(int stage, uint64_t start, uint64_t end)
+{
+	struct trace_event *ev = trace + trace_pos;
+
+	ev->stage = stage;
+	ev->start = start;
+	ev->end = end;
+	trace_pos = (trace_pos + 1) % TRACE_EVENTS;
+	if (trace_count < TRACE_EVENTS)
+		trace_count++;
+}
+
+static void _dsp_stage(int stage, uint64_t start, uint64_t end)
+{
+	/* the disk writer runs the mixer too, but that's not what we're measuring */
+	if (!in_buffer || SDL_ThreadID() != audio_thread)
+		return;
+
+	stage_time[stage] += end - start;
+	if (trace)
+		_trace(stage, start, end);
+}
+
+void dsp_load_init(void)
+{
+	SDL_AtomicSet(&underruns, 0);
+	SDL_AtomicSet(&tracing, 0);
+	csf_profile_stage = _dsp_stage;
+	csf_profile_clock = _dsp_clock;
+}
+
+void dsp_load_begin(void)
+{
+	audio_thread = SDL_ThreadID();
+	memset(stage_time, 0, sizeof(stage_time));
+	in_buffer = 1;
+	buffer_start = SDL_GetPerformanceCounter();
+}
+
+/* per-mille of 'budget' that 't' took */
+static inline int _permille(uint64_t t, uint64_t budget)
+{
+	return budget ? (int) MIN(t * 1000 / budget, 99999) : 0;
+}
+
+void dsp_load_end(unsigned int frames, unsigned int rate)
+{
+	uint64_t end = SDL_GetPerformanceCounter();
+	uint64_t budget;
+	int n, load;
+
+	in_buffer = 0;
+	if (!rate)
+		return;
+
+	budget = (uint64_t) frames * SDL_GetPerformanceFrequency() / rate;
+	load = _permille(end - buffer_start, budget);
+
+	if (load > 1000) {
+		SDL_AtomicAdd(&underruns, 1);
+		if (trace)
+			_trace(TRACE_UNDERRUN, end, end);
+	}
+	if (trace)
+		_trace(TRACE_BUFFER, buffer_start, end);
+
+	/* simple exponential smoothing; the peak decays by about 1% per buffer */
+	load_avg += (load - load_avg) / 8;
+	load_peak = MAX(load, load_peak - (load_peak + 99) / 100);
+	for (n = 0; n < CSF_NUM_STAGES; n++)
+		stage_avg[n] += (_permille(stage_time[n], budget) - stage_avg[n]) / 8;
+}
+
+void dsp_load_get(struct dsp_load *load)
+{
+	int n;
+
+	load->load = load_avg;
+	load->peak = load_peak;
+	load->underruns = SDL_AtomicGet(&underruns);
+	for (n = 0; n < CSF_NUM_STAGES; n++)
+		load->stage[n] = stage_avg[n];
+}
+
+void dsp_load_reset(void)
+{
+	song_lock_audio();
+	load_avg = load_peak = 0;
+	memset(stage_avg, 0, sizeof(stage_avg));
+	SDL_AtomicSet(&underruns, 0);
+	song_unlock_audio();
+}
+
+/* --------------------------------------------------------------------- */
+
+int dsp_trace_active(void)
+{
+	return SDL_AtomicGet(&tracing);
+}
+
+int dsp_trace_start(void)
+{
+	struct trace_event *events;
+
+	if (SDL_AtomicGet(&tracing))
+		return 0;
+
+	/* allocated out here rather than on the audio thread; it's a few megs.
+	from here until dsp_trace_stop takes it back, only the audio thread (or
+	someone holding the audio lock) touches it */
+	events = calloc(TRACE_EVENTS, sizeof(*events));
+	if (!events)
+		return 0;
+
+	song_lock_audio();
+	trace = events;
+	trace_pos = trace_count = 0;
+	song_unlock_audio();
+
+	SDL_AtomicSet(&tracing, 1);
+	return 1;
+}
+
+int dsp_trace_stop(const char *filename)
+{
+	struct trace_event *events;
+	uint32_t pos, count, i;
+	uint64_t t0, freq = SDL_GetPerformanceFrequency();
+	FILE *fp;
+
+	if (!SDL_AtomicGet(&tracing))
+		return -1;
+	SDL_AtomicSet(&tracing, 0);
+
+	/* take the buffer away from the audio thread */
+	song_lock_audio();
+	events = trace;
+	pos = trace_pos;
+	count = trace_count;
+	trace = NULL;
+	song_unlock_audio();
+
+	if (!events)
+		return 0;
+
+	fp = fopen(filename, "w");
+	if (!fp) {
+		free(events);
+		return -1;
+	}
+
+	/* oldest first */
+	pos = (pos + TRACE_EVENTS - count) % TRACE_EVENTS;
+	t0 = count ? events[pos].start : 0;
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", fp);
+	for (i = 0; i < count; i++) {
+		const struct trace_event *ev = events + (pos + i) % TRACE_EVENTS;
+		/* (a buffer is logged after its stages, so it can start before t0) */
+		double ts = (double) (int64_t) (ev->start - t0) * 1000000.0 / freq;
+
+		if (ev->stage == TRACE_UNDERRUN) {
+			fprintf(fp, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":1}",
+				stage_names[ev->stage], ts);
+		} else {
+			fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}",
+				stage_names[ev->stage], ts, (double) (ev->end - ev->start) * 1000000.0 / freq);
+		}
+		fputs((i + 1 < count) ? ",\n" : "\n", fp);
+	}
+	fputs("]}\n", fp);
+
+	free(events);
+	if (fclose(fp) != 0)
+		return -1;
+	return count;
+}
@@ -27,6 +27,7 @@
 #include "config.h"
 #include "fonts.h"
 #include "util.h"
+#include "vgamem.h"
 
 #include <errno.h>
 
@@ -86,6 +87,7 @@ static inline void make_half_width_middot(void)
 void font_reset_lower(void)
 {
 	memcpy(font_normal, font_default_lower, 1024);
+	vgamem_dirty_all();
 }
 
 /* just the itf chars */
@@ -93,6 +95,7 @@ void font_reset_upper(void)
 {
 	memcpy(font_normal + 1024, font_default_upper_itf, 1024);
 	make_half_width_middot();
+	vgamem_dirty_all();
 }
 
 /* all together now! */
@@ -101,6 +104,7 @@ void font_reset(void)
 	memcpy(font_normal, font_default_lower, 1024);
 	memcpy(font_normal + 1024, font_default_upper_itf, 1024);
 	make_half_width_middot();
+	vgamem_dirty_all();
 }
 
 /* or kill the upper chars as well */
@@ -109,6 +113,7 @@ void font_reset_bios(void)
 	font_reset_lower();
 	memcpy(font_normal + 1024, font_default_upper_alt, 1024);
 	make_half_width_middot();
+	vgamem_dirty_all();
 }
 
 /* ... or just one character */
@@ -130,6 +135,7 @@ void font_reset_char(int ch)
 
 	/* update */
 	make_half_width_middot();
+	vgamem_dirty_all();
 }
 
 /* --------------------------------------------------------------------- */
@@ -194,6 +200,7 @@ int font_load(const char *filename)
 		rewind(fp);
 		if (squeeze_8x16_font(fp) == 0) {
 			make_half_width_middot();
+			vgamem_dirty_all();
 			fclose(fp);
 			free(font_file);
 			return 0;
@@ -214,12 +221,15 @@ int font_load(const char *filename)
 	if (fread(font_normal, 2048, 1, fp) != 1) {
 		SDL_SetError("%s: %s", font_file,
 			     feof(fp) ? "Unexpected EOF on read" : strerror(errno));
+		/* some of it might have been read anyway */
+		vgamem_dirty_all();
 		fclose(fp);
 		free(font_file);
 		return -1;
 	}
 
 	make_half_width_middot();
+	vgamem_dirty_all();
 
 	fclose(fp);
 	free(font_file);
@@ -266,4 +276,5 @@ void font_init(void)
 
 	memcpy(font_alt, font_default_lower, 1024);
 	memcpy(font_alt + 1024, font_default_upper_alt, 1024);
+	vgamem_dirty_all();
 }
@@ -845,7 +845,7 @@ static int fontedit_handle_text_input(UNUSED char* text_input) {
 	return 0;
 }
 
-static int fontedit_handle_key(struct key_event * k)
+static int _fontedit_handle_key(struct key_event * k)
 {
 	int n, ci = current_char << 3;
 	uint8_t *ptr = font_data + ci;
@@ -1089,6 +1089,14 @@ static int fontedit_handle_key(struct key_event * k)
 	return 1;
 }
 
+static int fontedit_handle_key(struct key_event * k)
+{
+	/* most anything in here can change the font, which vgamem can't see */
+	if (!_fontedit_handle_key(k))
+		return 0;
+	vgamem_dirty_all();
+	return 1;
+}
 
 static struct widget fontedit_widget_hack[1];
 
@@ -608,6 +608,18 @@ void kbd_handle_key_repeat(void)
 	}
 }
 
+int kbd_key_repeat_timeout(void)
+{
+	if (!key_repeat_next_tick || !key_repeat_enabled)
+		return -1;
+
+	const schism_ticks_t now = SCHISM_GET_TICKS();
+	if (SCHISM_TICKS_PASSED(now, key_repeat_next_tick))
+		return 0;
+
+	return key_repeat_next_tick - now;
+}
+
 void kbd_cache_key_repeat(struct key_event* kk)
 {
 	if (!key_repeat_enabled)
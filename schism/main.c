@@ -46,6 +46,7 @@
 #include "fonts.h"
 #include "dialog.h"
 #include "widget.h"
+#include "sample-stream.h"
 
 #include "osdefs.h"
 
@@ -69,6 +70,10 @@
 #define NATIVE_SCREEN_WIDTH     640
 #define NATIVE_SCREEN_HEIGHT    400
 
+/* the longest the event loop will sleep without any events coming in;
+this keeps status.now (and with it, the clock) reasonably current */
+#define EVENT_LOOP_MAX_SLEEP    1000
+
 /* need to redefine these on SDL < 2.0.4 */
 #if !SDL_VERSION_ATLEAST(2, 0, 4)
 #define SDL_AUDIODEVICEADDED (0x1100)
@@ -420,6 +425,35 @@ static void check_update(void)
 	}
 }
 
+/* how long the event loop can sleep for, in milliseconds */
+static int event_loop_timeout(time_t startdown)
+{
+	int timeout = EVENT_LOOP_MAX_SLEEP, t;
+
+	/* this one goes first, since it sets NEED_UPDATE once the message expires */
+	t = status_text_timeout();
+	if (t >= 0 && t < timeout)
+		timeout = t;
+
+	if (((status.flags & NEED_UPDATE) && video_is_visible())
+	    || (status.flags & DISKWRITER_ACTIVE))
+		return 0;
+
+	t = kbd_key_repeat_timeout();
+	if (t >= 0 && t < timeout)
+		timeout = t;
+
+	t = song_audio_poll_timeout();
+	if (t >= 0 && t < timeout)
+		timeout = t;
+
+	/* holding the mouse down on the top of the screen pops up the menu */
+	if (startdown && timeout > 100)
+		timeout = 100;
+
+	return timeout;
+}
+
 static void _do_clipboard_paste_op(SDL_Event *e)
 {
 	if (ACTIVE_WIDGET.clipboard_paste
@@ -616,6 +650,12 @@ static void event_loop(void)
 			case SDL_QUIT:
 				show_exit_prompt();
 				break;
+			case SDL_RENDER_TARGETS_RESET:
+			case SDL_RENDER_DEVICE_RESET:
+				/* the texture's contents are gone, so everything has to be uploaded again */
+				video_redraw_texture();
+				status.flags |= (NEED_UPDATE);
+				break;
 			case SDL_WINDOWEVENT:
 				/* reset this... */
 				modkey = SDL_GetModState();
@@ -771,6 +811,13 @@ static void event_loop(void)
 				if (!(status.flags & (DISKWRITER_ACTIVE | DISKWRITER_ACTIVE_PATTERN)))
 					playback_update();
 				break;
+			case SCHISM_EVENT_VIS:
+				/* the vis worker has a new fft ready */
+				vis_handle_event();
+				break;
+			case SCHISM_EVENT_SAVE_DONE:
+				song_save_finish();
+				break;
 			case SCHISM_EVENT_PASTE:
 				/* handle clipboard events */
 				_do_clipboard_paste_op(&event);
@@ -913,15 +960,18 @@ static void event_loop(void)
 			}
 		}
 
+		song_autosave_poll();
+		song_audio_poll();
+
 		/* let dmoz build directory lists, etc
 		 *
 		 * as long as there's no user-event going on... */
 		while (!(status.flags & NEED_UPDATE) && dmoz_worker() && !SDL_PollEvent(NULL));
 
-		/* delay until there's an event OR 10 ms have passed */
-		int t;
-		for (t = 0; t < 10 && !SDL_PollEvent(NULL); t++)
-			SDL_Delay(1);
+		/* sleep until there's an event, or something else is due. the
+		 * midi and vis threads push events when they have something for
+		 * us; the audio backend gets polled, see song_audio_poll. */
+		SDL_WaitEventTimeout(NULL, event_loop_timeout(startdown));
 	}
 	schism_exit(0);
 }
@@ -936,6 +986,10 @@ void schism_exit(int status)
 
 	free_audio_device_list();
 
+	/* don't leave a half-written file lying around */
+	song_save_wait();
+	sample_stream_stop();
+
 	if (shutdown_process & EXIT_SAVECFG)
 		cfg_atexit_save();
 
@@ -962,8 +1016,6 @@ void schism_exit(int status)
 	exit(status);
 }
 
-extern void vis_init(void);
-
 /* wart */
 #ifdef SCHISM_MACOSX
 int SDL_main(int argc, char** argv)
@@ -36,6 +36,7 @@
 #include "dmoz.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <assert.h>
 
 static int _connected = 0;
@@ -46,8 +47,7 @@ and midi_record_mutex is by the event/sound thread
 static SDL_mutex *midi_mutex = NULL;
 static SDL_mutex *midi_port_mutex = NULL;
 static SDL_mutex *midi_record_mutex = NULL;
-static SDL_mutex *midi_play_mutex = NULL;
-static SDL_cond *midi_play_cond = NULL;
+static SDL_sem *midi_queue_sem = NULL;
 
 static struct midi_provider *port_providers = NULL;
 
@@ -177,7 +177,7 @@ void cfg_load_midi(cfg_file_t *cfg)
 
 	mc = &current_song->midi_config;
 	memcpy(mc, md, sizeof(midi_config_t));
-
+	csf_compile_midi_cfg(current_song);
 
 	song_unlock_audio();
 }
@@ -309,18 +309,16 @@ int midi_engine_start(void)
 
 	midi_mutex        = SDL_CreateMutex();
 	midi_record_mutex = SDL_CreateMutex();
-	midi_play_mutex   = SDL_CreateMutex();
 	midi_port_mutex   = SDL_CreateMutex();
-	midi_play_cond    = SDL_CreateCond();
+	midi_queue_sem    = SDL_CreateSemaphore(0);
 
-	if (!(midi_mutex && midi_record_mutex && midi_play_mutex && midi_port_mutex && midi_play_cond)) {
+	if (!(midi_mutex && midi_record_mutex && midi_port_mutex && midi_queue_sem)) {
 		if (midi_mutex)        SDL_DestroyMutex(midi_mutex);
 		if (midi_record_mutex) SDL_DestroyMutex(midi_record_mutex);
-		if (midi_play_mutex)   SDL_DestroyMutex(midi_play_mutex);
 		if (midi_port_mutex)   SDL_DestroyMutex(midi_port_mutex);
-		if (midi_play_cond)    SDL_DestroyCond(midi_play_cond);
-		midi_mutex = midi_record_mutex = midi_play_mutex = midi_port_mutex = NULL;
-		midi_play_cond = NULL;
+		if (midi_queue_sem)    SDL_DestroySemaphore(midi_queue_sem);
+		midi_mutex = midi_record_mutex = midi_port_mutex = NULL;
+		midi_queue_sem = NULL;
 		return 0;
 	}
 
@@ -580,70 +578,128 @@ void midi_send_now(const unsigned char *seq, unsigned int len)
 
 /*----------------------------------------------------------------------------------*/
 
-/* okay, our local queue is a little confusing,
- * but it works on the premise that the people who need it (oss)
- * also have systems with high-speed context switches.
- *
- * this sucks for freebsd/386 users as they've got a high-latency
- * audio system (oss) and slow context switches (x86). someone should
- * port alsa to freebsd. maybe someone else will solve this problem,
- * or maybe the computers that are slow enough to matter simply won't
- * be bothered.
+/* ports that can only send immediately (oss, for example) get their output
+ * from here: the player drops timestamped events into a ring buffer, and a
+ * scheduler thread picks them off and sleeps until each one is due.
  *
- * midi, that is, real midi, is 31250bps. that's 3125 bits per msec,
- * or 391 bytes per msec. i use a fixed buffer here because access needs
- * to be fast, and attempting to handle more will simply help people
- * using software/only setups.
+ * the ring has one writer (whoever holds midi_record_mutex; normally the
+ * audio thread) and one reader (the scheduler), so it doesn't need a lock.
+ * events are stored back to back, each with a small header; one that doesn't
+ * fit before the end of the ring leaves a "wrap" header behind and starts
+ * over at the beginning.
  *
- * really, software-only midi, without kernel assistance sucks.
- */
-struct qent {
-	int used;
-	unsigned char b[391];
+ * midi, that is, real midi, is 31250bps, so 64k is a couple of seconds of
+ * data -- much more than an audio buffer will ever produce. */
+
+#define MIDI_QUEUE_SIZE         65536 /* must be a power of two */
+#define MIDI_QUEUE_WRAP         0xFFFFFFFF
+
+struct midi_queue_event {
+	uint64_t deadline; /* in nanoseconds, on the _midi_clock */
+	uint32_t len;
+	uint32_t pad;
+	/* followed by the data, padded to the size of this struct */
 };
-static struct qent *qq = NULL;
-static unsigned int midims = 0, ms10s = 0, qlen = 0;
 
-void midi_queue_alloc(int my_audio_buffer_samples, int sample_size, int samples_per_second)
+static unsigned char midi_queue[MIDI_QUEUE_SIZE];
+static SDL_atomic_t midi_queue_head, midi_queue_tail; /* total bytes read, written */
+static SDL_Thread *midi_queue_thread = NULL;
+
+/* when the buffer being mixed now is expected to start playing */
+static uint64_t midi_queue_base = 0, midi_queue_latency = 0;
+static unsigned int midi_queue_rate = 0;
+
+static uint64_t _midi_clock(void)
 {
-	int buffer_size = (my_audio_buffer_samples * sample_size);
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
 
-	if (qq) {
-		free(qq);
-		qq = NULL;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	static uint64_t freq = 0;
+	uint64_t now = SDL_GetPerformanceCounter();
+
+	if (!freq)
+		freq = SDL_GetPerformanceFrequency();
+	return (now / freq) * 1000000000 + (now % freq) * 1000000000 / freq;
+#endif
+}
+
+static void _midi_sleep_until(uint64_t deadline)
+{
+#if defined(HAVE_CLOCK_NANOSLEEP) && defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
 
-	/* how long is the audio buffer in 10 msec?
-	 * well, (sample_size*samples_per_second)/80 is the number of bytes per msec
-	 */
-	midims = sample_size * samples_per_second;
-	if ((midims % 80) != 0) midims += (80 - (midims % 80));
-	ms10s = midims / 80;
-	midims /= 8;
+	ts.tv_sec = deadline / 1000000000;
+	ts.tv_nsec = deadline % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+#else
+	uint64_t now = _midi_clock();
 
-	if (ms10s > buffer_size) {
-		/* okay, there's not even 10msec of audio data; midi queueing will be impossible */
-		log_nl();
-		log_append(4, 0, "WARNING: Not enough space to queue MIDI data!");
-		log_append(4, 0, "Hint: Increase the audio buffer size or lower your mixing rate.");
-		qlen = 0;
+	if (deadline > now)
+		SLEEP_FUNC((deadline - now) / 1000);
+#endif
+}
+
+void midi_queue_alloc(int my_audio_buffer_samples, UNUSED int sample_size, int samples_per_second)
+{
+	/* the mixer works one buffer ahead of what's coming out of the speakers */
+	midi_queue_rate = samples_per_second;
+	midi_queue_latency = samples_per_second
+		? (uint64_t) my_audio_buffer_samples * 1000000000 / samples_per_second
+		: 0;
+}
+
+void midi_queue_sync(void)
+{
+	midi_queue_base = _midi_clock() + midi_queue_latency;
+}
+
+/* writer side; midi_record_mutex must be locked */
+static void _midi_queue_push(const unsigned char *data, unsigned int len, uint64_t deadline)
+{
+	const unsigned int hsize = sizeof(struct midi_queue_event);
+	unsigned int head = SDL_AtomicGet(&midi_queue_head);
+	unsigned int tail = SDL_AtomicGet(&midi_queue_tail);
+	unsigned int size = hsize + ((len + hsize - 1) & ~(hsize - 1));
+	unsigned int off = tail & (MIDI_QUEUE_SIZE - 1);
+	unsigned int skip = 0;
+	struct midi_queue_event *ev;
+
+	if (off + size > MIDI_QUEUE_SIZE)
+		skip = MIDI_QUEUE_SIZE - off;
+	if (size + skip > MIDI_QUEUE_SIZE - (tail - head)) {
+#ifdef SCHISM_MIDI_DEBUG
+		printf("MIDI: queue full, dropping %u bytes\n", len);
+#endif
 		return;
 	}
 
-	if ((buffer_size % ms10s) != 0) {
-		buffer_size += (ms10s - (buffer_size % ms10s));
+	if (skip) {
+		/* there's always room for a header here, since everything's a
+		multiple of the header size */
+		ev = (struct midi_queue_event *) (midi_queue + off);
+		ev->len = MIDI_QUEUE_WRAP;
+		tail += skip;
+		off = 0;
 	}
-	qlen = buffer_size / ms10s;
-	/* now qlen is the number of msec in digital output buffer */
 
-	qq = mem_calloc(qlen, sizeof(struct qent));
-}
+	ev = (struct midi_queue_event *) (midi_queue + off);
+	ev->deadline = deadline;
+	ev->len = len;
+	memcpy(ev + 1, data, len);
 
-static SDL_Thread *midi_queue_thread = NULL;
+	SDL_AtomicSet(&midi_queue_tail, tail + size);
+	SDL_SemPost(midi_queue_sem);
+}
 
 static int _midi_queue_run(UNUSED void *xtop)
 {
-	int i;
+	const unsigned int hsize = sizeof(struct midi_queue_event);
+	struct midi_queue_event *ev;
+	unsigned int head, off;
 
 #ifdef SCHISM_WIN32
 	SetPriorityClass(GetCurrentProcess(),HIGH_PRIORITY_CLASS);
@@ -651,17 +707,28 @@ static int _midi_queue_run(UNUSED void *xtop)
 	/*SetThreadPriority(GetCurrentThread(),THREAD_PRIORITY_HIGHEST);*/
 #endif
 
-	SDL_LockMutex(midi_play_mutex);
 	for (;;) {
-		SDL_CondWait(midi_play_cond, midi_play_mutex);
-
-		for (i = 0; i < qlen; i++) {
-			SDL_LockMutex(midi_record_mutex);
-			_midi_send_unlocked(qq[i].b, qq[i].used, 0, 1);
-			SDL_UnlockMutex(midi_record_mutex);
-			SLEEP_FUNC(10000); /* 10msec */
-			qq[i].used = 0;
+		SDL_SemWait(midi_queue_sem);
+
+		head = SDL_AtomicGet(&midi_queue_head);
+		if (head == (unsigned int) SDL_AtomicGet(&midi_queue_tail))
+			continue; /* already handled along with an earlier post */
+
+		off = head & (MIDI_QUEUE_SIZE - 1);
+		ev = (struct midi_queue_event *) (midi_queue + off);
+		if (ev->len == MIDI_QUEUE_WRAP) {
+			head += MIDI_QUEUE_SIZE - off;
+			ev = (struct midi_queue_event *) midi_queue;
 		}
+
+		_midi_sleep_until(ev->deadline);
+
+		SDL_LockMutex(midi_record_mutex);
+		_midi_send_unlocked((unsigned char *) (ev + 1), ev->len, 0, 1);
+		SDL_UnlockMutex(midi_record_mutex);
+
+		head += hsize + ((ev->len + hsize - 1) & ~(hsize - 1));
+		SDL_AtomicSet(&midi_queue_head, head);
 	}
 
 	return 0; /* never happens */
@@ -671,9 +738,11 @@ int midi_need_flush(void)
 {
 	struct midi_port *ptr;
 	int need_explicit_flush = 0;
-	int i;
 
-	if (!midi_record_mutex || !midi_play_mutex) return 0;
+	if (!midi_record_mutex || !midi_queue_sem) return 0;
+
+	/* once the scheduler's running, it takes care of itself */
+	if (midi_queue_thread) return 0;
 
 	ptr = NULL;
 
@@ -685,11 +754,7 @@ int midi_need_flush(void)
 	}
 	if (!need_explicit_flush) return 0;
 
-	for (i = 0; i < qlen; i++) {
-		if (qq[i].used) return 1;
-	}
-
-	return 0;
+	return SDL_AtomicGet(&midi_queue_head) != SDL_AtomicGet(&midi_queue_tail);
 }
 
 void midi_send_flush(void)
@@ -697,7 +762,7 @@ void midi_send_flush(void)
 	struct midi_port *ptr = NULL;
 	int need_explicit_flush = 0;
 
-	if (!midi_record_mutex || !midi_play_mutex) return;
+	if (!midi_record_mutex || !midi_queue_sem) return;
 
 	while (midi_port_foreach(NULL, &ptr)) {
 		if ((ptr->io & MIDI_OUTPUT)) {
@@ -710,21 +775,19 @@ void midi_send_flush(void)
 	if (!need_explicit_flush) return;
 
 	if (!midi_queue_thread) {
-		midi_queue_thread = SDL_CreateThread(_midi_queue_run, NULL, NULL);
+		midi_queue_thread = SDL_CreateThread(_midi_queue_run, "MIDI queue", NULL);
 		if (midi_queue_thread) {
 			log_appendf(3, "Started MIDI queue thread");
 		} else {
 			log_appendf(2, "ACK: Couldn't start MIDI thread; things are likely going to go boom!");
 		}
 	}
-
-	SDL_LockMutex(midi_play_mutex);
-	SDL_CondSignal(midi_play_cond);
-	SDL_UnlockMutex(midi_play_mutex);
 }
 
 void midi_send_buffer(const unsigned char *data, unsigned int len, unsigned int pos)
 {
+	uint64_t delay;
+
 	if (!midi_record_mutex) return;
 
 	SDL_LockMutex(midi_record_mutex);
@@ -744,28 +807,13 @@ void midi_send_buffer(const unsigned char *data, unsigned int len, unsigned int
 		status.flags |= NEED_UPDATE;
 	}
 
-	/* pos is still in milliseconds */
-	if (midims != 0 && _midi_send_unlocked(data, len, pos/midims, 2)) {
-		/* grr, we need a timer */
-
-		/* calculate pos in buffer */
-		pos /= ms10s;
-
-		/* what? we don't have anything to do?
-		 * do nothing then! */
-		if (pos < qlen) {
-			if ((len + qq[pos].used) > sizeof(qq[pos].b)) {
-				len = sizeof(qq[pos].b) - qq[pos].used;
-				/* okay, we're going to lose data here */
-			}
-			memcpy(qq[pos].b+qq[pos].used, data, len);
-			qq[pos].used += len;
+	/* pos is in frames from the start of the buffer being mixed */
+	if (midi_queue_rate != 0) {
+		delay = (uint64_t) pos * 1000000000 / midi_queue_rate;
+		if (_midi_send_unlocked(data, len, delay / 1000000, 2)) {
+			/* grr, we need a timer */
+			_midi_queue_push(data, len, midi_queue_base + delay);
 		}
-#ifdef SCHISM_MIDI_DEBUG
-		else {
-			printf("MIDI: midi_send_buffer with pos %d and qlen %d out of bounds!\n", pos, qlen);
-		}
-#endif
 	}
 
 	SDL_UnlockMutex(midi_record_mutex);
@@ -878,11 +926,42 @@ static void midi_push_event(Uint8 code, void *data1, size_t data1_len, int alloc
 	SDL_PushEvent(&e);
 }
 
+/* notes also carry the time they came in, so that keyjazz can play them
+exactly one audio buffer later, however long the event takes to be handled */
+struct midi_note_event {
+	int st[4];
+	uint64_t time;
+	int live; /* already played by song_live_midi_note */
+};
+
+/* the note and volume, the same way midi_engine_handle_event works them out */
+static int midi_note_number(int note)
+{
+	return (note + 1 + midi_c5note) - 60;
+}
+
+static int midi_note_volume(int velocity)
+{
+	int vol = (midi_flags & MIDI_RECORD_VELOCITY) ? velocity : 128;
+
+	return (vol * midi_amplification) / 100;
+}
+
 void midi_event_note(enum midi_note mnstatus, int channel, int note, int velocity)
 {
-	int st[4] = { mnstatus, channel, note, velocity };
+	struct midi_note_event ev = { { mnstatus, channel, note, velocity }, SDL_GetPerformanceCounter(), 0 };
+	int n = midi_note_number(note);
+
+	/* if the UI already knows what it'd do with this, skip the event loop
+	 * (the UI still gets the event, to update the screen) */
+	if (!(midi_flags & MIDI_DISABLE_RECORD) && NOTE_IS_NOTE(n)) {
+		if (mnstatus == MIDI_NOTEON)
+			ev.live = song_live_midi_note(n, midi_note_volume(velocity) / 2, ev.time);
+		else if (mnstatus == MIDI_NOTEOFF && (midi_flags & MIDI_RECORD_NOTEOFF))
+			ev.live = song_live_midi_note(n, -1, ev.time);
+	}
 
-	midi_push_event(SCHISM_EVENT_MIDI_NOTE, st, sizeof(st), 1);
+	midi_push_event(SCHISM_EVENT_MIDI_NOTE, &ev, sizeof(ev), 1);
 }
 
 void midi_event_controller(int channel, int param, int value)
@@ -953,6 +1032,11 @@ int midi_engine_handle_event(void *ev)
 
 	switch (e->user.code) {
 	case SCHISM_EVENT_MIDI_NOTE:
+		if (((struct midi_note_event *) e->user.data1)->live) {
+			/* it's been played already */
+			status.flags |= NEED_UPDATE;
+			break;
+		}
 		if (st[0] == MIDI_NOTEON) {
 			kk.state = KEY_PRESS;
 		} else {
@@ -963,13 +1047,11 @@ int midi_engine_handle_event(void *ev)
 			kk.state = KEY_RELEASE;
 		}
 		kk.midi_channel = st[1]+1;
-		kk.midi_note = (st[2]+1 + midi_c5note) - 60;
-		if (midi_flags & MIDI_RECORD_VELOCITY)
-			kk.midi_volume = st[3];
-		else
-			kk.midi_volume = 128;
-		kk.midi_volume = (kk.midi_volume * midi_amplification) / 100;
+		kk.midi_note = midi_note_number(st[2]);
+		kk.midi_volume = midi_note_volume(st[3]);
+		song_set_keyjazz_time(((struct midi_note_event *) e->user.data1)->time);
 		handle_key(&kk);
+		song_set_keyjazz_time(0);
 		break;
 	case SCHISM_EVENT_MIDI_PITCHBEND:
 		/* wheel */
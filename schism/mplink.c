@@ -109,7 +109,7 @@ song_channel_t *song_get_channel(int n)
 
 song_voice_t *song_get_mix_channel(int n)
 {
-	if (n >= MAX_VOICES)
+	if (n < 0 || (uint32_t) n >= current_song->voice_pool_size)
 		return NULL;
 	return (song_voice_t *) current_song->voices + n;
 }
@@ -142,7 +142,7 @@ void song_save_channel_states(void)
 static inline void _fix_mutes_like(int chan)
 {
 	int i;
-	for (i = 0; i < MAX_VOICES; i++) {
+	for (i = 0; i < (int) current_song->voice_pool_size; i++) {
 		if (i == chan) continue;
 		if (((int)current_song->voices[i].master_channel) != (chan+1)) continue;
 		current_song->voices[i].flags = (current_song->voices[i].flags & (~(CHN_MUTE)))
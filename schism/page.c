@@ -1079,6 +1079,10 @@ static int _handle_ime(struct key_event *k)
 /* this is the important one */
 void handle_key(struct key_event *k)
 {
+	/* anything but a MIDI event might change what a MIDI note does */
+	if (!k->midi_channel)
+		song_forget_live_midi();
+
 	if (_handle_ime(k))
 		return;
 
@@ -1411,8 +1415,8 @@ static void vis_fft(void)
 		_vis_virgin = 0;
 	}
 	_draw_vis_box();
-	song_lock_audio();
 
+	/* current_fft_data is only written from the event loop now */
 	vgamem_ovl_clear(&vis_overlay,0);
 	_get_columns_from_fft(outfft,current_fft_data);
 	for (i = 0; i < 120; i++) {
@@ -1425,8 +1429,6 @@ static void vis_fft(void)
 		}
 	}
 	vgamem_ovl_apply(&vis_overlay);
-
-	song_unlock_audio();
 }
 static void vis_oscilloscope(void)
 {
@@ -1615,6 +1617,7 @@ void set_page(int new_page)
 {
 	int prev_page = status.current_page;
 
+	song_forget_live_midi();
 
 	if (new_page != prev_page)
 		status.previous_page = prev_page;
@@ -30,6 +30,9 @@
 #include "widget.h"
 #include "pattern-view.h"
 #include "config-parser.h"
+#include "config.h"
+#include "dsp-load.h"
+#include "dmoz.h"
 
 #include "sdlmain.h"
 
@@ -163,7 +166,7 @@ static void info_draw_technical(int base, int height, int active, int first_chan
 
 			/* count how many voices claim this channel */
 			int nv, tot;
-			for (nv = tot = 0; nv < MAX_VOICES; nv++) {
+			for (nv = tot = 0; nv < (int) current_song->voice_pool_size; nv++) {
 				song_voice_t *v = current_song->voices + nv;
 				if (v->master_channel == (unsigned int) c && v->current_sample_data && v->length)
 					tot++;
@@ -361,14 +364,17 @@ static void _draw_fill_notes(int col, int first_row, int height, int num_channel
 			     int channel_width, int separator, draw_note_func draw_note, int bg)
 {
 	int row_pos, chan_pos;
+	int note_width = channel_width - !!separator;
 
 	for (row_pos = first_row; row_pos < first_row + height; row_pos++) {
 		for (chan_pos = 0; chan_pos < num_channels - 1; chan_pos++) {
-			draw_note(col + channel_width * chan_pos, row_pos, blank_note, -1, 6, bg);
+			draw_note_cached(draw_note, note_width, col + channel_width * chan_pos, row_pos,
+					 blank_note, -1, 6, bg);
 			if (separator)
 				draw_char(168, (col - 1 + channel_width * (chan_pos + 1)), row_pos, 2, bg);
 		}
-		draw_note(col + channel_width * chan_pos, row_pos, blank_note, -1, 6, bg);
+		draw_note_cached(draw_note, note_width, col + channel_width * chan_pos, row_pos,
+				 blank_note, -1, 6, bg);
 	}
 }
 
@@ -386,6 +392,7 @@ static void _draw_track_view(int base, int height, int first_channel, int num_ch
 	int total_rows; /* same as {cur,prev_next}_pattern_rows */
 	int chan_pos, row, row_pos, rows_before;
 	char buf[4];
+	int note_width = channel_width;
 
 	if (separator)
 		channel_width++;
@@ -458,12 +465,14 @@ static void _draw_track_view(int base, int height, int first_channel, int num_ch
 		draw_text(numtostr(3, row, buf), 1, row_pos, 0, 2);
 		note = pattern + 64 * row + first_channel - 1;
 		for (chan_pos = 0; chan_pos < num_channels - 1; chan_pos++) {
-			draw_note(5 + channel_width * chan_pos, row_pos, note, -1, 6, 0);
+			draw_note_cached(draw_note, note_width, 5 + channel_width * chan_pos, row_pos,
+					 note, -1, 6, 0);
 			if (separator)
 				draw_char(168, (4 + channel_width * (chan_pos + 1)), row_pos, 2, 0);
 			note++;
 		}
-		draw_note(5 + channel_width * chan_pos, row_pos, note, -1, 6, 0);
+		draw_note_cached(draw_note, note_width, 5 + channel_width * chan_pos, row_pos,
+				 note, -1, 6, 0);
 		row--;
 		row_pos--;
 	}
@@ -475,12 +484,14 @@ static void _draw_track_view(int base, int height, int first_channel, int num_ch
 	draw_text(numtostr(3, current_row, buf), 1, row_pos, 0, 2);
 	note = pattern + 64 * current_row + first_channel - 1;
 	for (chan_pos = 0; chan_pos < num_channels - 1; chan_pos++) {
-		draw_note(5 + channel_width * chan_pos, row_pos, note, -1, 6, 14);
+		draw_note_cached(draw_note, note_width, 5 + channel_width * chan_pos, row_pos,
+				 note, -1, 6, 14);
 		if (separator)
 			draw_char(168, (4 + channel_width * (chan_pos + 1)), row_pos, 2, 14);
 		note++;
 	}
-	draw_note(5 + channel_width * chan_pos, row_pos, note, -1, 6, 14);
+	draw_note_cached(draw_note, note_width, 5 + channel_width * chan_pos, row_pos,
+			 note, -1, 6, 14);
 
 	/* draw the area under the current row */
 	row = current_row + 1;
@@ -499,12 +510,14 @@ static void _draw_track_view(int base, int height, int first_channel, int num_ch
 		draw_text(numtostr(3, row, buf), 1, row_pos, 0, 2);
 		note = pattern + 64 * row + first_channel - 1;
 		for (chan_pos = 0; chan_pos < num_channels - 1; chan_pos++) {
-			draw_note(5 + channel_width * chan_pos, row_pos, note, -1, 6, 0);
+			draw_note_cached(draw_note, note_width, 5 + channel_width * chan_pos, row_pos,
+					 note, -1, 6, 0);
 			if (separator)
 				draw_char(168, (4 + channel_width * (chan_pos + 1)), row_pos, 2, 0);
 			note++;
 		}
-		draw_note(5 + channel_width * chan_pos, row_pos, note, -1, 6, 0);
+		draw_note_cached(draw_note, note_width, 5 + channel_width * chan_pos, row_pos,
+				 note, -1, 6, 0);
 		row++;
 		row_pos++;
 	}
@@ -667,6 +680,33 @@ static void info_draw_channels(int base, UNUSED int height, int active, UNUSED i
 	draw_text(buf, 4, base + 1, fg, 2);
 }
 
+/* tenths of a percent -> "12.3" */
+#define PERMILLE(n) ((n) / 10), ((n) % 10)
+
+static void info_draw_load(int base, UNUSED int height, int active, UNUSED int first_channel)
+{
+	char buf[80];
+	int fg = (active ? 3 : 0);
+	struct dsp_load load;
+
+	dsp_load_get(&load);
+
+	snprintf(buf, sizeof(buf), "DSP Load: %d.%d%% (peak %d.%d%%)  Underruns: %u%s",
+		PERMILLE(load.load), PERMILLE(load.peak), load.underruns,
+		dsp_trace_active() ? "  [Tracing]" : "");
+	draw_text(buf, 2, base, fg, 2);
+
+	snprintf(buf, sizeof(buf), "Tick %d.%d%%  Mix %d.%d%%  AdLib %d.%d%%  EQ %d.%d%%  Output %d.%d%%",
+		PERMILLE(load.stage[CSF_STAGE_TICK]),
+		PERMILLE(MAX(load.stage[CSF_STAGE_MIX] - load.stage[CSF_STAGE_ADLIB], 0)),
+		PERMILLE(load.stage[CSF_STAGE_ADLIB]),
+		PERMILLE(load.stage[CSF_STAGE_EQ]),
+		PERMILLE(load.stage[CSF_STAGE_CONVERT]));
+	draw_text(buf, 4, base + 1, fg, 2);
+}
+
+#undef PERMILLE
+
 
 /* Yay it works, only took me forever and a day to get it right. */
 static void info_draw_note_dots(int base, int height, int active, int first_channel)
@@ -806,6 +846,7 @@ static const struct info_window_type window_types[] = {
 	{"global", info_draw_channels, click_chn_nil, 1, 0},
 	{"dots", info_draw_note_dots, click_chn_is_y_nohead, 0, -2},
 	{"tech", info_draw_technical, click_chn_is_y, 1, -2},
+	{"load", info_draw_load, click_chn_nil, 1, 0},
 };
 #undef TRACK_VIEW
 
@@ -1100,6 +1141,28 @@ static int info_page_handle_key(struct key_event * k)
 			return 1;
 		}
 		return 0;
+	case SDLK_t:
+		if (!NO_MODIFIER(k->mod))
+			return 0;
+		if (k->state == KEY_RELEASE)
+			return 1;
+
+		if (dsp_trace_active()) {
+			char *path = dmoz_path_concat(cfg_dir_dotschism, "dsp-trace.json");
+			n = dsp_trace_stop(path);
+			if (n < 0)
+				status_text_flash("Error writing %s", path);
+			else
+				status_text_flash("%d trace events written to %s", n, path);
+			free(path);
+		} else {
+			if (dsp_trace_start())
+				status_text_flash("Tracing mixer timing (press T again to stop)");
+			else
+				status_text_flash("Not enough memory to trace mixer timing");
+		}
+		status.flags |= NEED_UPDATE;
+		return 1;
 	case SDLK_PLUS:
 		if (k->state == KEY_RELEASE)
 			return 1;
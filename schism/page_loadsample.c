@@ -30,6 +30,7 @@
 #include "page.h"
 #include "dmoz.h"
 #include "sample-edit.h"
+#include "sample-stream.h"
 #include "keyboard.h"
 #include "fakemem.h"
 #include "log.h"
@@ -72,6 +73,7 @@ static const char *const loop_states[] = {
 static char samp_cwd[PATH_MAX+1] = "";
 
 static void handle_preload(void);
+static void handle_preload_ex(int stream);
 
 /* --------------------------------------------------------------------------------------------------------- */
 
@@ -316,7 +318,8 @@ static void load_sample_draw_const(void)
 	draw_text("Time", 54, 47, 0, 2);
 
 	if (fake_slot != KEYJAZZ_NOINST) {
-		s = song_get_sample(fake_slot);
+		/* if it's streaming, the slot's just got whatever's in the ring buffer */
+		s = (sample_stream_slot() == fake_slot) ? sample_stream_head() : song_get_sample(fake_slot);
 		vgamem_ovl_clear(&sample_image, 0);
 		if (s)
 			draw_sample_data(&sample_image, s);
@@ -812,15 +815,17 @@ static void load_sample_handle_key(struct key_event * k)
 
 	handle_preload();
 	if (fake_slot != KEYJAZZ_NOINST) {
-		if (k->state == KEY_PRESS)
+		if (k->state == KEY_PRESS) {
+			sample_stream_restart();
 			song_keydown(KEYJAZZ_INST_FAKE, KEYJAZZ_NOINST, n, v, KEYJAZZ_CHAN_CURRENT);
-		else
+		} else {
 			song_keyup(KEYJAZZ_INST_FAKE, KEYJAZZ_NOINST, n);
+		}
 	}
 }
 
 /* --------------------------------------------------------------------------------------------------------- */
-static void handle_preload(void)
+static void handle_preload_ex(int stream)
 {
 	dmoz_file_t *file;
 
@@ -828,11 +833,16 @@ static void handle_preload(void)
 		file = flist.files[current_file];
 		if (file && (file->type & TYPE_SAMPLE_MASK)) {
 			fake_slot_changed = 0;
-			fake_slot = song_preload_sample(file); // either 0 or KEYJAZZ_NOTINST
+			fake_slot = song_preload_sample(file, stream); // either 0 or KEYJAZZ_NOTINST
 		}
 	}
 }
 
+static void handle_preload(void)
+{
+	handle_preload_ex(1);
+}
+
 static void handle_rename_op(void)
 {
 	handle_preload();
@@ -912,6 +922,11 @@ static void handle_load_update(void)
 {
 	song_sample_t *s;
 	handle_preload();
+	if (fake_slot != KEYJAZZ_NOINST && sample_stream_slot() == fake_slot) {
+		/* the ring buffer can't take loop points and such, so it has to be loaded for real */
+		fake_slot = KEYJAZZ_NOINST;
+		handle_preload_ex(0);
+	}
 	if (fake_slot != KEYJAZZ_NOINST) {
 		s = song_get_sample(fake_slot);
 		if (s) {
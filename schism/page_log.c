@@ -59,6 +59,11 @@ static struct log_line lines[NUM_LINES];
 static int top_line = 0;
 static int last_line = -1;
 
+/* module loaders write to the log from the loader thread, which mustn't go
+poking at status.flags (the main thread redraws regularly while it waits) */
+static SDL_SpinLock log_lock = 0;
+static SDL_threadID main_thread;
+
 /* --------------------------------------------------------------------- */
 
 static void log_draw_const(void)
@@ -123,6 +128,7 @@ static void log_redraw(void)
 {
 	int n, i;
 
+	SDL_AtomicLock(&log_lock);
 	i = top_line;
 	for (n = 0; n <= last_line && n < 33; n++, i++) {
 		if (!lines[i].text) continue;
@@ -136,6 +142,7 @@ static void log_redraw(void)
 					lines[i].color, 0);
 		}
 	}
+	SDL_AtomicUnlock(&log_lock);
 }
 
 /* --------------------------------------------------------------------- */
@@ -148,6 +155,8 @@ void log_load_page(struct page *page)
 	page->widgets = widgets_log;
 	page->help_index = HELP_COPYRIGHT; /* I guess */
 
+	main_thread = SDL_ThreadID();
+
 	widget_create_other(widgets_log + 0, 0, log_handle_key, NULL, log_redraw);
 }
 
@@ -155,6 +164,7 @@ void log_load_page(struct page *page)
 
 void log_append2(int bios_font, int color, int must_free, const char *text)
 {
+	SDL_AtomicLock(&log_lock);
 	if (last_line < NUM_LINES - 1) {
 		last_line++;
 	} else {
@@ -167,8 +177,9 @@ void log_append2(int bios_font, int color, int must_free, const char *text)
 	lines[last_line].must_free = must_free;
 	lines[last_line].bios_font = bios_font;
 	top_line = CLAMP(last_line - 32, 0, NUM_LINES-32);
+	SDL_AtomicUnlock(&log_lock);
 
-	if (status.current_page == PAGE_LOG)
+	if (status.current_page == PAGE_LOG && SDL_ThreadID() == main_thread)
 		status.flags |= NEED_UPDATE;
 }
 void log_append(int color, int must_free, const char *text)
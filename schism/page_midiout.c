@@ -75,6 +75,7 @@ static void copy_out(void)
 {
 	song_lock_audio();
 	memcpy(&current_song->midi_config, &editcfg, sizeof(midi_config_t));
+	csf_compile_midi_cfg(current_song);
 	song_unlock_audio();
 }
 
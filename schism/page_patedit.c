@@ -2661,7 +2661,8 @@ static void pattern_editor_redraw(void)
 			} else {
 				cpos = -1;
 			}
-			track_view->draw_note(chan_drawpos, 15 + row_pos, note, cpos, fg, bg);
+			draw_note_cached(track_view->draw_note, track_view->width,
+					 chan_drawpos, 15 + row_pos, note, cpos, fg, bg);
 
 			if (draw_divisions && chan_pos < visible_channels - 1) {
 				if (is_in_selection(chan, row))
@@ -2680,7 +2681,8 @@ static void pattern_editor_redraw(void)
 				bg = 15;
 			else
 				bg = 0;
-			track_view->draw_note(chan_drawpos, 15 + row_pos, blank_note, -1, 6, bg);
+			draw_note_cached(track_view->draw_note, track_view->width,
+					 chan_drawpos, 15 + row_pos, blank_note, -1, 6, bg);
 			if (draw_divisions && chan_pos < visible_channels - 1) {
 				draw_char(168, chan_drawpos + track_view->width, 15 + row_pos, 2, bg);
 			}
@@ -643,6 +643,7 @@ static void do_post_loop_cut(UNUSED void *bweh) /* I'm already using 'data'. */
 
 	status.flags |= SONG_NEEDS_SAVE;
 
+	sample_unshare(sample);
 	song_lock_audio();
 	csf_stop_sample(current_song, sample);
 	if (sample->loop_end > pos) sample->loop_end = pos;
@@ -669,6 +670,7 @@ static void do_pre_loop_cut(UNUSED void *bweh)
 
 	status.flags |= SONG_NEEDS_SAVE;
 
+	sample_unshare(sample);
 	song_lock_audio();
 	csf_stop_sample(current_song, sample);
 	memmove(sample->data, sample->data + start_byte, bytes);
@@ -690,6 +692,7 @@ static void do_pre_loop_cut(UNUSED void *bweh)
 		sample->sustain_end -= pos;
 	else
 		sample->sustain_end = 0;
+	csf_adjust_sample_loop(sample);
 	song_unlock_audio();
 }
 
@@ -1210,21 +1213,25 @@ static void export_sample_dialog(void)
 
 
 /* resize sample dialog */
-static struct widget resize_sample_widgets[2];
+static struct widget resize_sample_widgets[3];
 static int resize_sample_cursor;
 
+static const char *const resize_sample_qualities[] = {"Low", "Medium", "High", NULL};
+
 static void do_resize_sample_aa(UNUSED void *data)
 {
 	song_sample_t *sample = song_get_sample(current_sample);
 	unsigned int newlen = resize_sample_widgets[0].d.numentry.value;
-	sample_resize(sample, newlen, 1);
+
+	audio_settings.resample_quality = SAMPLE_RESAMPLE_LOW + resize_sample_widgets[1].d.menutoggle.state;
+	sample_resize(sample, newlen, audio_settings.resample_quality);
 }
 
 static void do_resize_sample(UNUSED void *data)
 {
 	song_sample_t *sample = song_get_sample(current_sample);
 	unsigned int newlen = resize_sample_widgets[0].d.numentry.value;
-	sample_resize(sample, newlen, 0);
+	sample_resize(sample, newlen, SAMPLE_RESAMPLE_NONE);
 }
 
 static void resize_sample_draw_const(void)
@@ -1234,6 +1241,12 @@ static void resize_sample_draw_const(void)
 	draw_box(41, 26, 49, 28, BOX_THICK | BOX_INNER | BOX_INSET);
 }
 
+static void resize_sample_aa_draw_const(void)
+{
+	resize_sample_draw_const();
+	draw_text("Quality", 34, 29, 0, 2);
+}
+
 static void resize_sample_dialog(int aa)
 {
 	song_sample_t *sample = song_get_sample(current_sample);
@@ -1242,10 +1255,21 @@ static void resize_sample_dialog(int aa)
 	resize_sample_cursor = 0;
 	widget_create_numentry(resize_sample_widgets + 0, 42, 27, 7, 0, 1, 1, NULL, 0, 9999999, &resize_sample_cursor);
 	resize_sample_widgets[0].d.numentry.value = sample->length;
-	widget_create_button(resize_sample_widgets + 1, 36, 30, 6, 0, 1, 1, 1, 1,
-		dialog_cancel_NULL, "Cancel", 1);
-	dialog = dialog_create_custom(26, 22, 29, 11, resize_sample_widgets, 2, 0,
-		resize_sample_draw_const, NULL);
+	if (aa) {
+		widget_create_menutoggle(resize_sample_widgets + 1, 42, 29, 0, 2, 1, 1, 2,
+			NULL, resize_sample_qualities);
+		resize_sample_widgets[1].d.menutoggle.state = CLAMP(audio_settings.resample_quality,
+			SAMPLE_RESAMPLE_LOW, SAMPLE_RESAMPLE_HIGH) - SAMPLE_RESAMPLE_LOW;
+		widget_create_button(resize_sample_widgets + 2, 36, 31, 6, 1, 2, 2, 2, 0,
+			dialog_cancel_NULL, "Cancel", 1);
+		dialog = dialog_create_custom(26, 22, 29, 12, resize_sample_widgets, 3, 0,
+			resize_sample_aa_draw_const, NULL);
+	} else {
+		widget_create_button(resize_sample_widgets + 1, 36, 30, 6, 0, 1, 1, 1, 1,
+			dialog_cancel_NULL, "Cancel", 1);
+		dialog = dialog_create_custom(26, 22, 29, 11, resize_sample_widgets, 2, 0,
+			resize_sample_draw_const, NULL);
+	}
 	dialog->action_yes = aa ? do_resize_sample_aa : do_resize_sample;
 }
 
@@ -1298,7 +1322,8 @@ static void sample_toggle_solo(int n)
 static void sample_list_handle_alt_key(struct key_event * k)
 {
 	song_sample_t *sample = song_get_sample(current_sample);
-	int canmod = (sample->data != NULL && !(sample->flags & CHN_ADLIB));
+	/* (paged samples are played straight from the file, so there's nothing to edit) */
+	int canmod = (sample->data != NULL && !(sample->flags & CHN_ADLIB) && !csf_sample_pager(sample->data));
 
 	if (k->state == KEY_RELEASE)
 		return;
@@ -23,11 +23,13 @@
 #include "headers.h"
 
 #include "it.h"
+#include "event.h"
 #include "keyboard.h"
 #include "page.h"
 #include "song.h"
 #include "widget.h"
 #include "vgamem.h"
+#include "sdlmain.h"
 
 #include <math.h>
 
@@ -48,16 +50,17 @@ static const float fft_inv_bufsize = 1.0f/(FFT_BUFFER_SIZE>>2);
 /*Scaling for FFT. Input is expected to be signed short int.*/
 static const float inv_s_range = 1.f/32768.f;
 
+/* how many frames of audio the vis worker can look back on; this needs to be
+comfortably larger than both the FFT and the biggest audio buffer */
+#define VIS_RING_SIZE           16384
+/* no sense in analysing the audio faster than the screen can show it */
+#define VIS_FRAME_MS            (1000 / 60)
+
+/* the latest analysis, owned by the UI thread (see vis_handle_event) */
 short current_fft_data[2][FFT_OUTPUT_SIZE];
 /*Table to change the scale from linear to log.*/
 short fftlog[FFT_BANDS_SIZE];
 
-void vis_init(void);
-void vis_work_16s(short *in, int inlen);
-void vis_work_16m(short *in, int inlen);
-void vis_work_8s(char *in, int inlen);
-void vis_work_8m(char *in, int inlen);
-
 /* variables :) */
 static int mono = 0;
 //gain, in dBs.
@@ -68,31 +71,34 @@ static int noisefloor=72;
 static struct vgamem_overlay ovl = { 0, 0, 79, 49, NULL, 0, 0, 0 };
 
 /* tables */
-static unsigned int bit_reverse[FFT_BUFFER_SIZE];
 static float window[FFT_BUFFER_SIZE];
-static float precos[FFT_OUTPUT_SIZE];
-static float presin[FFT_OUTPUT_SIZE];
+static float twiddle_re[FFT_OUTPUT_SIZE];
+static float twiddle_im[FFT_OUTPUT_SIZE];
 
-/* fft state */
-static float state_real[FFT_BUFFER_SIZE];
-static float state_imag[FFT_BUFFER_SIZE];
+/* fft state (ping-ponged between each pass) */
+static float state_real[2][FFT_BUFFER_SIZE];
+static float state_imag[2][FFT_BUFFER_SIZE];
 
+/* The audio thread only copies its output into this ring, and the vis worker
+does the actual analysis. The worker might see a buffer that's being written
+to at the same time, but that's harmless for a display. */
+static short vis_ring[2][VIS_RING_SIZE];
+static SDL_atomic_t vis_ring_pos;       /* total frames written, wraps around */
+static SDL_atomic_t vis_silence;        /* set when the audio stops */
+static SDL_atomic_t vis_event_pending;  /* don't flood the event queue */
+static SDL_sem *vis_wakeup = NULL;
+static SDL_mutex *vis_mutex = NULL;
+
+/* finished analysis, handed over to the UI under vis_mutex */
+static short vis_fft_ready[2][FFT_OUTPUT_SIZE];
+
+static int vis_worker(void *data);
 
-static int _reverse_bits(unsigned int in) {
-	unsigned int r = 0, n;
-	for (n = 0; n < FFT_BUFFER_SIZE_LOG; n++) {
-		r <<= 1;
-		r += (in & 1);
-		in >>= 1;
-	}
-	return r;
-}
 void vis_init(void)
 {
 	unsigned n;
 
 	for (n = 0; n < FFT_BUFFER_SIZE; n++) {
-		bit_reverse[n] = _reverse_bits(n);
 #if 0
 		/*Rectangular/none*/
 		window[n] = 1;
@@ -114,8 +120,8 @@ void vis_init(void)
 	}
 	for (n = 0; n < FFT_OUTPUT_SIZE; n++) {
 		float j = (2.0*PI) * n / FFT_BUFFER_SIZE;
-		precos[n] = cos(j);
-		presin[n] = sin(j);
+		twiddle_re[n] = cos(j);
+		twiddle_im[n] = sin(j);
 	}
 #if 0
 	/*linear*/
@@ -134,70 +140,107 @@ void vis_init(void)
 		fftlog[n]=(powf(2.0f,n*factor)-1.f)*factor2;
 	}
 #endif
+
+	vis_mutex = SDL_CreateMutex();
+	vis_wakeup = SDL_CreateSemaphore(0);
+	if (!vis_mutex || !vis_wakeup || !SDL_CreateThread(vis_worker, "Schism vis worker", NULL)) {
+		/* no worker, no waterfall. not much else to do about it */
+		log_appendf(4, "Warning: couldn't start the vis worker: %s", SDL_GetError());
+		if (vis_wakeup)
+			SDL_DestroySemaphore(vis_wakeup);
+		vis_wakeup = NULL;
+	}
+}
+
+/*
+* Stockham radix-2 FFT over state_real/state_imag[0], which doesn't need
+* the bit-reversal pass, and whose inner loop runs over contiguous memory
+* so the compiler can vectorise it.
+* Returns which half of state_real/state_imag holds the result.
+*/
+static int _fft(void)
+{
+	unsigned int n, s, m, p, q;
+	int cur = 0;
+
+	for (n = FFT_BUFFER_SIZE, s = 1; n > 1; n >>= 1, s <<= 1) {
+		const float *xr = state_real[cur], *xi = state_imag[cur];
+		float *yr = state_real[!cur], *yi = state_imag[!cur];
+
+		m = n >> 1;
+		for (p = 0; p < m; p++) {
+			const float wr = twiddle_re[p * s], wi = twiddle_im[p * s];
+			const float *ar = xr + s * p, *ai = xi + s * p;
+			const float *br = xr + s * (p + m), *bi = xi + s * (p + m);
+			float *cr = yr + s * 2 * p, *ci = yi + s * 2 * p;
+			float *dr = cr + s, *di = ci + s;
+
+			for (q = 0; q < s; q++) {
+				const float tr = ar[q] - br[q], ti = ai[q] - bi[q];
+				cr[q] = ar[q] + br[q];
+				ci[q] = ai[q] + bi[q];
+				dr[q] = tr * wr - ti * wi;
+				di[q] = tr * wi + ti * wr;
+			}
+		}
+		cur = !cur;
+	}
+
+	return cur;
 }
 
 /*
 * Understanding In and Out:
 * input is the samples (so, it is amplitude). The scale is expected to be signed 16bits.
 *    The window function calculated in "window" will automatically be applied.
+*    Both channels are real, so they're packed into a single complex FFT as the
+*    real and imaginary parts, and separated again afterwards.
 * output is a value between 0 and 128 representing 0 = noisefloor variable
 *    and 128 = 0dBFS (deciBell, FullScale) for each band.
 */
-static inline void _vis_data_work(short output[FFT_OUTPUT_SIZE],
-			short input[FFT_BUFFER_SIZE])
+static inline void _vis_data_work(short output[2][FFT_OUTPUT_SIZE],
+			const short input_l[FFT_BUFFER_SIZE], const short input_r[FFT_BUFFER_SIZE])
 {
-	unsigned int n, k, y;
-	unsigned int ex, ff;
-	float fr, fi;
-	float tr, ti;
-	float out;
-	int yp;
+	unsigned int n;
+	float *rp, *ip;
+	float xr, xi, yr, yi;
+	float lr, li, rr, ri;
+	int cur;
 
 	/* fft */
-	float *rp = state_real;
-	float *ip = state_imag;
 	for (n = 0; n < FFT_BUFFER_SIZE; n++) {
-		int nr = bit_reverse[n];
-		*rp++ = (float)input[ nr ] * inv_s_range * window[nr];
-		*ip++ = 0;
-	}
-	ex = 1;
-	ff = FFT_OUTPUT_SIZE;
-	for (n = FFT_BUFFER_SIZE_LOG; n != 0; n--) {
-		for (k = 0; k != ex; k++) {
-			fr = precos[k * ff];
-			fi = presin[k * ff];
-			for (y = k; y < FFT_BUFFER_SIZE; y += ex << 1) {
-				yp = y + ex;
-				tr = fr * state_real[yp] - fi * state_imag[yp];
-				ti = fr * state_imag[yp] + fi * state_real[yp];
-				state_real[yp] = state_real[y] - tr;
-				state_imag[yp] = state_imag[y] - ti;
-				state_real[y] += tr;
-				state_imag[y] += ti;
-			}
-		}
-		ex <<= 1;
-		ff >>= 1;
+		state_real[0][n] = (float)input_l[n] * inv_s_range * window[n];
+		state_imag[0][n] = (float)input_r[n] * inv_s_range * window[n];
 	}
+	cur = _fft();
 
 	/* collect fft */
-	rp = state_real; rp++;
-	ip = state_imag; ip++;
+	rp = state_real[cur];
+	ip = state_imag[cur];
 	const float fft_dbinv_bufsize = dB(fft_inv_bufsize);
-	for (n = 0; n < FFT_OUTPUT_SIZE; n++) {
+	for (n = 1; n <= FFT_OUTPUT_SIZE; n++) {
+		/* X[k] = L[k] + iR[k], and L and R are both real, so
+		* L[k] = (X[k] + conj(X[N-k])) / 2 and R[k] = (X[k] - conj(X[N-k])) / 2i */
+		xr = rp[n];
+		xi = ip[n];
+		yr = rp[FFT_BUFFER_SIZE - n];
+		yi = ip[FFT_BUFFER_SIZE - n];
+		lr = (xr + yr) * 0.5f;
+		li = (xi - yi) * 0.5f;
+		rr = (xi + yi) * 0.5f;
+		ri = (yr - xr) * 0.5f;
 		/* "out" is the total power for each band.
 		* To get amplitude from "output", use sqrt(out[N])/(sizeBuf>>2)
 		* To get dB from "output", use powerdB(out[N])+db(1/(sizeBuf>>2)).
 		* powerdB is = 10 * log10(in)
 		* dB is = 20 * log10(in)
+		* +0.0000000001f is -100dB of power. Used to prevent evaluating powerdB(0.0)
 		*/
-		out = ((*rp) * (*rp)) + ((*ip) * (*ip));
-		/* +0.0000000001f is -100dB of power. Used to prevent evaluating powerdB(0.0) */
-		output[n] = pdB_s(noisefloor, out+0.0000000001f,fft_dbinv_bufsize);
-		rp++;ip++;
+		output[0][n - 1] = pdB_s(noisefloor, lr * lr + li * li + 0.0000000001f, fft_dbinv_bufsize);
+		output[1][n - 1] = pdB_s(noisefloor, rr * rr + ri * ri + 0.0000000001f, fft_dbinv_bufsize);
 	}
 }
+
 /* convert the fft bands to columns of screen
 out and d have a range of 0 to 128 */
 static inline void _get_columns_from_fft(unsigned char *out,
@@ -303,87 +346,107 @@ static void _vis_process(void)
 	status.flags |= NEED_UPDATE;
 }
 
-void vis_work_16s(short *in, int inlen)
+/* --------------------------------------------------------------------- */
+/* the vis worker */
+
+static int vis_worker(UNUSED void *data)
 {
-	short dl[FFT_BUFFER_SIZE];
-	short dr[FFT_BUFFER_SIZE];
-	int i, j, k;
+	static short dl[FFT_BUFFER_SIZE], dr[FFT_BUFFER_SIZE];
+	short out[2][FFT_OUTPUT_SIZE];
+	schism_ticks_t now, next = 0;
+	unsigned int pos, i;
+	SDL_Event e;
 
-	if (!inlen) {
-		memset(current_fft_data[0], 0, FFT_OUTPUT_SIZE*2);
-		memset(current_fft_data[1], 0, FFT_OUTPUT_SIZE*2);
-	} else {
-		for (i = 0; i < FFT_BUFFER_SIZE;) {
-			for (k = j = 0; k < inlen && i < FFT_BUFFER_SIZE; k++, i++) {
-				dl[i] = in[j]; j++;
-				dr[i] = in[j]; j++;
+	for (;;) {
+		SDL_SemWait(vis_wakeup);
+
+		now = SCHISM_GET_TICKS();
+		if (!SCHISM_TICKS_PASSED(now, next))
+			SDL_Delay(next - now);
+		next = SCHISM_GET_TICKS() + VIS_FRAME_MS;
+
+		/* everything written up to now gets handled in one go */
+		while (SDL_SemTryWait(vis_wakeup) == 0);
+
+		if (SDL_AtomicSet(&vis_silence, 0)) {
+			memset(out, 0, sizeof(out));
+		} else {
+			pos = (unsigned int)SDL_AtomicGet(&vis_ring_pos) - FFT_BUFFER_SIZE;
+			for (i = 0; i < FFT_BUFFER_SIZE; i++, pos++) {
+				dl[i] = vis_ring[0][pos & (VIS_RING_SIZE - 1)];
+				dr[i] = vis_ring[1][pos & (VIS_RING_SIZE - 1)];
 			}
+			_vis_data_work(out, dl, dr);
 		}
-		_vis_data_work(current_fft_data[0], dl);
-		_vis_data_work(current_fft_data[1], dr);
-	}
-	if (status.current_page == PAGE_WATERFALL) _vis_process();
-}
-void vis_work_16m(short *in, int inlen)
-{
-	short d[FFT_BUFFER_SIZE];
-	int i, k;
 
-	if (!inlen) {
-		memset(current_fft_data[0], 0, FFT_OUTPUT_SIZE*2);
-		memset(current_fft_data[1], 0, FFT_OUTPUT_SIZE*2);
-	} else {
-		for (i = 0; i < FFT_BUFFER_SIZE;) {
-			for (k = 0; k < inlen && i < FFT_BUFFER_SIZE; k++, i++) {
-				d[i] = in[k];
-			}
+		SDL_LockMutex(vis_mutex);
+		memcpy(vis_fft_ready, out, sizeof(vis_fft_ready));
+		SDL_UnlockMutex(vis_mutex);
+
+		if (!SDL_AtomicSet(&vis_event_pending, 1)) {
+			e.user.type = SCHISM_EVENT_VIS;
+			e.user.code = 0;
+			e.user.data1 = NULL;
+			e.user.data2 = NULL;
+			SDL_PushEvent(&e);
 		}
-		_vis_data_work(current_fft_data[0], d);
-		memcpy(current_fft_data[1], current_fft_data[0], FFT_OUTPUT_SIZE * 2);
 	}
-	if (status.current_page == PAGE_WATERFALL) _vis_process();
+
+	return 0;
 }
 
-void vis_work_8s(char *in, int inlen)
+/* this is called from the audio thread, so it's important that it doesn't do
+anything but copy the data and wake the worker up */
+void vis_push_samples(const void *data, int frames, int bits, int channels)
 {
-	short dl[FFT_BUFFER_SIZE];
-	short dr[FFT_BUFFER_SIZE];
-	int i, j, k;
+	unsigned int pos;
+	int i;
+
+	if (!vis_wakeup)
+		return;
 
-	if (!inlen) {
-		memset(current_fft_data[0], 0, FFT_OUTPUT_SIZE*2);
-		memset(current_fft_data[1], 0, FFT_OUTPUT_SIZE*2);
+	if (!data || !frames) {
+		SDL_AtomicSet(&vis_silence, 1);
+		SDL_SemPost(vis_wakeup);
+		return;
+	}
+
+	/* nobody else writes to the ring, so this can't change under us */
+	pos = (unsigned int)SDL_AtomicGet(&vis_ring_pos);
+
+	if (bits == 8) {
+		const signed char *in = data;
+		for (i = 0; i < frames; i++, pos++) {
+			vis_ring[0][pos & (VIS_RING_SIZE - 1)] = in[0] * 256;
+			vis_ring[1][pos & (VIS_RING_SIZE - 1)] = in[channels - 1] * 256;
+			in += channels;
+		}
 	} else {
-		for (i = 0; i < FFT_BUFFER_SIZE;) {
-			for (k = j = 0; k < inlen && i < FFT_BUFFER_SIZE; k++, i++) {
-				dl[i] = ((short)in[j]) * 256; j++;
-				dr[i] = ((short)in[j]) * 256; j++;
-			}
+		const short *in = data;
+		for (i = 0; i < frames; i++, pos++) {
+			vis_ring[0][pos & (VIS_RING_SIZE - 1)] = in[0];
+			vis_ring[1][pos & (VIS_RING_SIZE - 1)] = in[channels - 1];
+			in += channels;
 		}
-		_vis_data_work(current_fft_data[0], dl);
-		_vis_data_work(current_fft_data[1], dr);
 	}
-	if (status.current_page == PAGE_WATERFALL) _vis_process();
+
+	SDL_AtomicSet(&vis_ring_pos, (int)pos);
+	SDL_SemPost(vis_wakeup);
 }
-void vis_work_8m(char *in, int inlen)
+
+/* SCHISM_EVENT_VIS: a new analysis is ready */
+void vis_handle_event(void)
 {
-	short d[FFT_BUFFER_SIZE];
-	int i, k;
+	SDL_AtomicSet(&vis_event_pending, 0);
 
-	if (!inlen) {
-		memset(current_fft_data[0], 0, FFT_OUTPUT_SIZE*2);
-		memset(current_fft_data[1], 0, FFT_OUTPUT_SIZE*2);
-	} else {
-		for (i = 0; i < FFT_BUFFER_SIZE;) {
-			for (k = 0; k < inlen && i < FFT_BUFFER_SIZE; k++, i++) {
-				d[i] = ((short)in[k]) * 256;
-			}
-		}
-		_vis_data_work(current_fft_data[0], d);
-		memcpy(current_fft_data[1],
-				 current_fft_data[0], FFT_OUTPUT_SIZE * 2);
-	}
-	if (status.current_page == PAGE_WATERFALL) _vis_process();
+	SDL_LockMutex(vis_mutex);
+	memcpy(current_fft_data, vis_fft_ready, sizeof(current_fft_data));
+	SDL_UnlockMutex(vis_mutex);
+
+	if (status.current_page == PAGE_WATERFALL)
+		_vis_process();
+	else if (status.vis_style == VIS_FFT)
+		status.flags |= NEED_UPDATE;
 }
 
 static void draw_screen(void)
@@ -963,3 +963,83 @@ void draw_mask_6(int x, int y, int mask, int cursor_pos, int fg, int bg)
 	draw_text(buf, x, y, fg, bg);
 }
 
+
+/* --------------------------------------------------------------------- */
+/* cell cache
+
+Most of what the pattern editor and the info page's track views draw is the
+same handful of notes over and over (blank ones, mostly), and with a lot of
+channels on screen, formatting all of them again on every redraw adds up. So
+the cells a note turns into are kept around, keyed on everything that goes into
+drawing it, and a note that's been drawn before just gets copied back onto the
+screen. The key is the note itself, so editing a pattern doesn't have to tell
+the cache anything, and the display settings that change how it's drawn (just
+sharps or flats, for now) are part of it too. */
+
+#define NOTE_CACHE_SIZE 4096 /* must be a power of two */
+#define NOTE_CACHE_WIDTH 13 /* widest track view */
+
+struct note_cache_entry {
+	draw_note_func draw_note; /* NULL if the entry is empty */
+	song_note_t note;
+	uint8_t fg, bg, width, flats;
+};
+
+static struct note_cache_entry note_cache[NOTE_CACHE_SIZE];
+static uint8_t *note_cache_cells = NULL;
+
+static inline uint32_t note_cache_hash(const song_note_t *note, int width, int fg, int bg, int flats)
+{
+	uint32_t h = note->note | (note->instrument << 8) | (note->voleffect << 16)
+		| ((uint32_t) note->volparam << 24);
+
+	h ^= (note->effect | (note->param << 8) | (fg << 16) | (bg << 20) | (width << 24) | ((uint32_t) flats << 31))
+		* UINT32_C(0x9e3779b1);
+	h *= UINT32_C(0x85ebca6b);
+	h ^= h >> 15;
+
+	return h & (NOTE_CACHE_SIZE - 1);
+}
+
+void draw_note_cached(draw_note_func draw_note, int width, int x, int y,
+	const song_note_t *note, int cursor_pos, int fg, int bg)
+{
+	struct note_cache_entry *e;
+	uint8_t *cells;
+	uint32_t h;
+	int flats;
+
+	/* the cursor is only ever on one row, and the default volumes come out
+	 * of the samples, which can change without the note changing */
+	if (cursor_pos >= 0 || (show_default_volumes && draw_note == draw_note_13)
+	    || width > NOTE_CACHE_WIDTH) {
+		draw_note(x, y, note, cursor_pos, fg, bg);
+		return;
+	}
+
+	if (!note_cache_cells) {
+		note_cache_cells = mem_alloc(NOTE_CACHE_SIZE * NOTE_CACHE_WIDTH * vgamem_cell_size);
+	}
+
+	flats = (kbd_sharp_flat_state() == KBD_SHARP_FLAT_FLATS);
+	h = note_cache_hash(note, width, fg, bg, flats);
+	e = note_cache + h;
+	cells = note_cache_cells + h * NOTE_CACHE_WIDTH * vgamem_cell_size;
+
+	if (e->draw_note == draw_note && e->fg == fg && e->bg == bg
+	    && e->width == width && e->flats == flats
+	    && !memcmp(&e->note, note, sizeof(song_note_t))) {
+		vgamem_load_cells(cells, x, y, width);
+		return;
+	}
+
+	draw_note(x, y, note, -1, fg, bg);
+	vgamem_save_cells(cells, x, y, width);
+
+	e->draw_note = draw_note;
+	e->note = *note;
+	e->fg = fg;
+	e->bg = bg;
+	e->width = width;
+	e->flats = flats;
+}
@@ -26,119 +26,500 @@
 #include "it.h"
 #include "util.h"
 #include "song.h"
+#include "page.h"
+#include "dialog.h"
+#include "video.h"
+#include "vgamem.h"
 #include "sample-edit.h"
 
 #include "player/cmixer.h"
 
 #include "sdlmain.h"
 
-/* --------------------------------------------------------------------- */
-/* helper functions */
+#include <math.h>
 
-static void _minmax_8(signed char *data, unsigned long length, signed char *min, signed char *max)
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+/* --------------------------------------------------------------------- */
+/* running the heavy lifting on several threads
+
+Operations on big samples are split up into chunks, which a few worker
+threads take turns grabbing until there's nothing left. Meanwhile, the main
+thread shows a progress dialog, and if Escape is pressed, tells the workers to
+stop. Anything that can be cancelled writes into a new buffer which only
+replaces the sample's data once everything's done, so cancelling doesn't leave
+the sample half-edited, and the sample can keep playing in the meantime. */
+
+/* in samples (not frames); anything smaller than this is done right away */
+#define SAMPLE_EDIT_THREADED_MIN        (1 << 20)
+#define SAMPLE_EDIT_CHUNK               (1 << 16)
+#define SAMPLE_EDIT_MAX_THREADS         8
+
+struct sample_job;
+typedef void (*sample_kernel_t)(struct sample_job *job, unsigned long start, unsigned long end, int slot);
+
+struct sample_job {
+	sample_kernel_t kernel;
+	const void *src;
+	void *dst;
+	unsigned long length; /* in whatever units the kernel works with */
+	int arg;
+	const void *params; /* anything else the kernel needs */
+
+	/* results for min/max, one per thread */
+	int min[SAMPLE_EDIT_MAX_THREADS];
+	int max[SAMPLE_EDIT_MAX_THREADS];
+
+	SDL_atomic_t next; /* next chunk up for grabs */
+	SDL_atomic_t done; /* chunks finished */
+	SDL_atomic_t cancel;
+};
+
+struct sample_worker {
+	struct sample_job *job;
+	int slot;
+};
+
+static struct sample_job *progress_job = NULL;
+static const char *progress_title = NULL;
+static struct widget progress_widgets[1];
+
+static int _sample_job_chunks(struct sample_job *job)
 {
-	unsigned long pos = length;
+	return (job->length + SAMPLE_EDIT_CHUNK - 1) / SAMPLE_EDIT_CHUNK;
+}
 
-	*min = 127;
-	*max = -128;
-	while (pos) {
-		pos--;
-		if (data[pos] < *min)
-			*min = data[pos];
-		else if (data[pos] > *max)
-			*max = data[pos];
+static int _sample_job_worker(void *data)
+{
+	struct sample_worker *w = data;
+	struct sample_job *job = w->job;
+	unsigned long start;
+
+	while (!SDL_AtomicGet(&job->cancel)) {
+		start = (unsigned long)SDL_AtomicAdd(&job->next, 1) * SAMPLE_EDIT_CHUNK;
+		if (start >= job->length)
+			break;
+		job->kernel(job, start, MIN(start + SAMPLE_EDIT_CHUNK, job->length), w->slot);
+		SDL_AtomicAdd(&job->done, 1);
 	}
+
+	return 0;
 }
 
-static void _minmax_16(signed short *data, unsigned long length, signed short *min, signed short *max)
+static void _sample_job_draw(void)
 {
-	unsigned long pos = length;
+	int pos = SDL_AtomicGet(&progress_job->done) * 64 / _sample_job_chunks(progress_job);
 
-	*min = 32767;
-	*max = -32768;
-	while (pos) {
-		pos--;
-		if (data[pos] < *min)
-			*min = data[pos];
-		else if (data[pos] > *max)
-			*max = data[pos];
-	}
+	draw_text(progress_title, 27, 27, 0, 2);
+	draw_fill_chars(24, 30, 55, 30, DEFAULT_FG, 0);
+	draw_vu_meter(24, 30, 32, pos, 4, 4);
+	draw_box(23, 29, 56, 31, BOX_THIN | BOX_INNER | BOX_INSET);
 }
 
-/* --------------------------------------------------------------------- */
-/* sign convert (a.k.a. amiga flip) */
+/* the rest of the tracker is on hold while this runs, but the screen (and the
+audio) keep going, and Escape cancels. keypresses in the meantime go nowhere. */
+static void _sample_job_wait(struct sample_job *job, const char *title)
+{
+	const int chunks = _sample_job_chunks(job);
+	SDL_Event event[16];
+	int n, i;
+
+	progress_job = job;
+	progress_title = title;
+	dialog_create_custom(22, 25, 36, 8, progress_widgets, 0, 0, _sample_job_draw, NULL);
+
+	while (SDL_AtomicGet(&job->done) < chunks && !SDL_AtomicGet(&job->cancel)) {
+		SDL_PumpEvents();
+		while ((n = SDL_PeepEvents(event, ARRAY_SIZE(event), SDL_GETEVENT, SDL_KEYDOWN, SDL_TEXTINPUT)) > 0) {
+			for (i = 0; i < n; i++)
+				if (event[i].type == SDL_KEYDOWN && event[i].key.keysym.sym == SDLK_ESCAPE)
+					SDL_AtomicSet(&job->cancel, 1);
+		}
+
+		redraw_screen();
+		video_refresh();
+		video_blit();
+		SDL_Delay(20);
+	}
+
+	dialog_destroy();
+	progress_job = NULL;
+	status.flags |= NEED_UPDATE;
+}
 
-static void _sign_convert_8(signed char *data, unsigned long length)
+/* run the job, showing a progress dialog with 'title' if it's going to take a
+while (NULL if it can't be cancelled). returns zero if it was cancelled. */
+static int _sample_job_run(struct sample_job *job, const char *title)
 {
-	unsigned long pos = length;
+	struct sample_worker workers[SAMPLE_EDIT_MAX_THREADS];
+	SDL_Thread *threads[SAMPLE_EDIT_MAX_THREADS];
+	int n, nthreads;
 
-	while (pos) {
-		pos--;
-		data[pos] += 128;
+	for (n = 0; n < SAMPLE_EDIT_MAX_THREADS; n++) {
+		job->min[n] = INT_MAX;
+		job->max[n] = INT_MIN;
 	}
+	SDL_AtomicSet(&job->next, 0);
+	SDL_AtomicSet(&job->done, 0);
+	SDL_AtomicSet(&job->cancel, 0);
+
+	if (job->length < SAMPLE_EDIT_THREADED_MIN) {
+		/* this might be working on the sample data directly */
+		song_lock_audio();
+		job->kernel(job, 0, job->length, 0);
+		song_unlock_audio();
+		return 1;
+	}
+
+	nthreads = CLAMP(SDL_GetCPUCount(), 1, SAMPLE_EDIT_MAX_THREADS);
+	for (n = 0; n < nthreads; n++) {
+		workers[n].job = job;
+		workers[n].slot = n;
+		threads[n] = SDL_CreateThread(_sample_job_worker, "Schism sample editor", &workers[n]);
+		if (!threads[n])
+			break;
+	}
+	nthreads = n;
+
+	if (!nthreads) {
+		/* no threads, so just do it here */
+		workers[0].job = job;
+		workers[0].slot = 0;
+		_sample_job_worker(&workers[0]);
+		return 1;
+	}
+
+	if (title)
+		_sample_job_wait(job, title);
+
+	for (n = 0; n < nthreads; n++)
+		SDL_WaitThread(threads[n], NULL);
+
+	return !SDL_AtomicGet(&job->cancel);
 }
 
-static void _sign_convert_16(signed short *data, unsigned long length)
+static void _sample_job_minmax(struct sample_job *job, int *min, int *max)
 {
-	unsigned long pos = length;
+	int n;
 
-	while (pos) {
-		pos--;
-		data[pos] += 32768;
+	*min = INT_MAX;
+	*max = INT_MIN;
+	for (n = 0; n < SAMPLE_EDIT_MAX_THREADS; n++) {
+		*min = MIN(*min, job->min[n]);
+		*max = MAX(*max, job->max[n]);
 	}
 }
 
-void sample_sign_convert(song_sample_t * sample)
+/* Sets up a job going from the sample's data into a new buffer of 'bytes'
+bytes if it's big enough to be run on the worker threads (and so can be
+cancelled), or just back into the sample's data if not. */
+static void _sample_job_setup(struct sample_job *job, song_sample_t *sample,
+	sample_kernel_t kernel, unsigned long length, unsigned long bytes, int arg)
 {
+	sample_unshare(sample);
+	job->kernel = kernel;
+	job->src = sample->data;
+	job->length = length;
+	job->arg = arg;
+	job->dst = (length >= SAMPLE_EDIT_THREADED_MIN) ? csf_allocate_sample(bytes) : sample->data;
+}
+
+/* finish off a job from _sample_job_setup: returns zero if it was cancelled */
+static int _sample_job_finish(struct sample_job *job, song_sample_t *sample, int ok)
+{
+	song_voice_t *v;
+	int n;
+
+	if (job->dst == sample->data) {
+		/* done in place, so the end padding and loop guards are stale */
+		song_lock_audio();
+		csf_adjust_sample_loop(sample);
+		song_unlock_audio();
+		return ok;
+	}
+
+	if (!ok) {
+		csf_free_sample(job->dst);
+		return 0;
+	}
+
 	song_lock_audio();
-	status.flags |= SONG_NEEDS_SAVE;
-	if (sample->flags & CHN_16BIT)
-		_sign_convert_16((signed short *) sample->data,
-			sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1));
-	else
-		_sign_convert_8(sample->data, sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1));
+	/* anything playing the old data can just carry on with the new data,
+	since it has the same length and format */
+	for (n = 0, v = current_song->voices; n < (int) current_song->voice_pool_size; n++, v++)
+		if (v->current_sample_data == sample->data)
+			v->current_sample_data = job->dst;
+	csf_free_sample(sample->data);
+	sample->data = job->dst;
+	csf_adjust_sample_loop(sample);
 	song_unlock_audio();
+
+	return 1;
 }
 
 /* --------------------------------------------------------------------- */
-/* from the back to the front */
+/* kernels
+
+these work on src[start..end-1] and write to dst[start..end-1], where src and
+dst are either the same or completely separate. */
+
+/* min/max */
+#define MINMAX_KERNEL(bits) \
+	static void _minmax_##bits(struct sample_job *job, unsigned long start, unsigned long end, int slot) \
+	{ \
+		const int##bits##_t *src = job->src; \
+		int##bits##_t min = INT##bits##_MAX, max = INT##bits##_MIN; \
+		unsigned long pos; \
+	\
+		for (pos = start; pos < end; pos++) { \
+			min = MIN(min, src[pos]); \
+			max = MAX(max, src[pos]); \
+		} \
+		job->min[slot] = MIN(job->min[slot], min); \
+		job->max[slot] = MAX(job->max[slot], max); \
+	}
 
-static void _reverse_8(signed char *data, unsigned long length)
-{
-	signed char tmp;
-	unsigned long lpos = 0, rpos = length - 1;
+/* xor with a constant: sign conversion, and inverting */
+#define XOR_KERNEL(name, bits, x) \
+	static void name(struct sample_job *job, unsigned long start, unsigned long end, UNUSED int slot) \
+	{ \
+		const int##bits##_t *src = job->src; \
+		int##bits##_t *dst = job->dst; \
+		unsigned long pos; \
+	\
+		for (pos = start; pos < end; pos++) \
+			dst[pos] = src[pos] ^ (int##bits##_t)(x); \
+	}
 
-	while (lpos < rpos) {
-		tmp = data[lpos];
-		data[lpos] = data[rpos];
-		data[rpos] = tmp;
-		lpos++;
-		rpos--;
+/* subtract job->arg (wrapping around), for centralising */
+#define SUB_KERNEL(bits) \
+	static void _sub_##bits(struct sample_job *job, unsigned long start, unsigned long end, UNUSED int slot) \
+	{ \
+		const int##bits##_t *src = job->src; \
+		int##bits##_t *dst = job->dst; \
+		const int##bits##_t sub = job->arg; \
+		unsigned long pos; \
+	\
+		for (pos = start; pos < end; pos++) \
+			dst[pos] = (int##bits##_t)(src[pos] - sub); \
+	}
+
+/* multiply by job->arg percent */
+#define AMPLIFY_KERNEL(bits) \
+	static void _amplify_##bits(struct sample_job *job, unsigned long start, unsigned long end, UNUSED int slot) \
+	{ \
+		const int##bits##_t *src = job->src; \
+		int##bits##_t *dst = job->dst; \
+		const int percent = job->arg; \
+		unsigned long pos; \
+		int b; \
+	\
+		for (pos = start; pos < end; pos++) { \
+			b = src[pos] * percent / 100; \
+			dst[pos] = CLAMP(b, INT##bits##_MIN, INT##bits##_MAX); \
+		} \
+	}
+
+/* these work in frames, and src and dst can't be the same */
+#define REVERSE_KERNEL(bits) \
+	static void _reverse_##bits(struct sample_job *job, unsigned long start, unsigned long end, UNUSED int slot) \
+	{ \
+		const int##bits##_t *src = job->src; \
+		int##bits##_t *dst = job->dst; \
+		unsigned long pos; \
+	\
+		for (pos = start; pos < end; pos++) \
+			dst[pos] = src[job->length - 1 - pos]; \
+	}
+
+/* dst can be the same as src here, as long as it's not threaded */
+#define DOWNMIX_KERNEL(bits) \
+	static void _downmix_##bits(struct sample_job *job, unsigned long start, unsigned long end, UNUSED int slot) \
+	{ \
+		const int##bits##_t *src = job->src; \
+		int##bits##_t *dst = job->dst; \
+		unsigned long pos; \
+	\
+		for (pos = start; pos < end; pos++) \
+			dst[pos] = (src[pos * 2] + src[pos * 2 + 1]) / 2; \
+	}
+
+MINMAX_KERNEL(8)
+XOR_KERNEL(_sign_convert_8, 8, 0x80)
+XOR_KERNEL(_invert_8, 8, 0xFF)
+SUB_KERNEL(8)
+AMPLIFY_KERNEL(8)
+REVERSE_KERNEL(8)
+DOWNMIX_KERNEL(8)
+
+XOR_KERNEL(_sign_convert_16, 16, 0x8000)
+XOR_KERNEL(_invert_16, 16, 0xFFFF)
+SUB_KERNEL(16)
+REVERSE_KERNEL(16)
+DOWNMIX_KERNEL(16)
+
+REVERSE_KERNEL(32)
+
+#undef MINMAX_KERNEL
+#undef XOR_KERNEL
+#undef SUB_KERNEL
+#undef AMPLIFY_KERNEL
+#undef REVERSE_KERNEL
+#undef DOWNMIX_KERNEL
+
+/* 16-bit samples are where most of the data is, so these get some extra help */
+static void _minmax_16(struct sample_job *job, unsigned long start, unsigned long end, int slot)
+{
+	const int16_t *src = job->src;
+	int16_t min = INT16_MAX, max = INT16_MIN;
+	unsigned long pos = start;
+
+#if defined(__SSE2__)
+	__m128i vmin = _mm_set1_epi16(INT16_MAX), vmax = _mm_set1_epi16(INT16_MIN), v;
+	int16_t t[8];
+	int i;
+
+	for (; pos + 8 <= end; pos += 8) {
+		v = _mm_loadu_si128((const __m128i *)(src + pos));
+		vmin = _mm_min_epi16(vmin, v);
+		vmax = _mm_max_epi16(vmax, v);
 	}
+	_mm_storeu_si128((__m128i *)t, vmin);
+	for (i = 0; i < 8; i++)
+		min = MIN(min, t[i]);
+	_mm_storeu_si128((__m128i *)t, vmax);
+	for (i = 0; i < 8; i++)
+		max = MAX(max, t[i]);
+#endif
+	for (; pos < end; pos++) {
+		min = MIN(min, src[pos]);
+		max = MAX(max, src[pos]);
+	}
+
+	job->min[slot] = MIN(job->min[slot], min);
+	job->max[slot] = MAX(job->max[slot], max);
 }
 
-static void _reverse_16(signed short *data, unsigned long length)
+static void _amplify_16(struct sample_job *job, unsigned long start, unsigned long end, UNUSED int slot)
 {
-	signed short tmp;
-	unsigned long lpos = 0, rpos = length - 1;
+	const int16_t *src = job->src;
+	int16_t *dst = job->dst;
+	const int percent = job->arg;
+	unsigned long pos = start;
+	int b;
 
-	while (lpos < rpos) {
-		tmp = data[lpos];
-		data[lpos] = data[rpos];
-		data[rpos] = tmp;
-		lpos++;
-		rpos--;
+#if defined(__SSE2__)
+	/* |sample * percent| stays well under 2^24, so it's exact as a float,
+	and the division rounds the same way as the integer one after truncating */
+	const __m128 vp = _mm_set1_ps(percent), v100 = _mm_set1_ps(100.0f);
+	__m128i v, lo, hi;
+
+	for (; pos + 8 <= end; pos += 8) {
+		v = _mm_loadu_si128((const __m128i *)(src + pos));
+		lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		lo = _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), vp), v100));
+		hi = _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), vp), v100));
+		/* packs saturates, which takes care of the clamping */
+		_mm_storeu_si128((__m128i *)(dst + pos), _mm_packs_epi32(lo, hi));
 	}
+#endif
+	for (; pos < end; pos++) {
+		b = src[pos] * percent / 100;
+		dst[pos] = CLAMP(b, INT16_MIN, INT16_MAX);
+	}
+}
+
+static void _quality_convert_8to16(struct sample_job *job, unsigned long start, unsigned long end, UNUSED int slot)
+{
+	const int8_t *src = job->src;
+	int16_t *dst = job->dst;
+	unsigned long pos;
+
+	for (pos = start; pos < end; pos++)
+		dst[pos] = src[pos] * 256;
 }
-static void _reverse_32(signed int *data, unsigned long length)
+
+static void _quality_convert_16to8(struct sample_job *job, unsigned long start, unsigned long end, UNUSED int slot)
+{
+	const int16_t *src = job->src;
+	int8_t *dst = job->dst;
+	unsigned long pos;
+
+	for (pos = start; pos < end; pos++)
+		dst[pos] = src[pos] >> 8;
+}
+
+/* --------------------------------------------------------------------- */
+/* helper functions */
+
+static unsigned long _sample_values(song_sample_t *sample)
+{
+	return sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1);
+}
+
+static unsigned long _sample_bytes(song_sample_t *sample)
+{
+	return _sample_values(sample) * ((sample->flags & CHN_16BIT) ? 2 : 1);
+}
+
+static void _sample_minmax(song_sample_t *sample, int *min, int *max)
+{
+	struct sample_job job;
+
+	job.kernel = (sample->flags & CHN_16BIT) ? _minmax_16 : _minmax_8;
+	job.src = job.dst = sample->data;
+	job.length = _sample_values(sample);
+	_sample_job_run(&job, NULL);
+	_sample_job_minmax(&job, min, max);
+}
+
+/* the sample's data might be shared with a song that's being saved in the
+background, in which case it gets its own copy before it's changed */
+void sample_unshare(song_sample_t *sample)
+{
+	struct sample_job job;
+
+	if (!csf_sample_is_shared(sample->data))
+		return;
+
+	job.dst = csf_allocate_sample(_sample_bytes(sample));
+	memcpy(job.dst, sample->data, _sample_bytes(sample));
+	_sample_job_finish(&job, sample, 1);
+}
+
+/* --------------------------------------------------------------------- */
+/* sign convert (a.k.a. amiga flip) */
+
+void sample_sign_convert(song_sample_t * sample)
+{
+	struct sample_job job;
+
+	_sample_job_setup(&job, sample, (sample->flags & CHN_16BIT) ? _sign_convert_16 : _sign_convert_8,
+		_sample_values(sample), _sample_bytes(sample), 0);
+	if (!_sample_job_finish(&job, sample, _sample_job_run(&job, "Converting sample...")))
+		return;
+
+	status.flags |= SONG_NEEDS_SAVE;
+	draw_sample_data_invalidate(sample, 0, sample->length);
+}
+
+/* --------------------------------------------------------------------- */
+/* from the back to the front */
+
+static void _reverse_in_place(song_sample_t *sample)
 {
-	signed int tmp;
-	unsigned long lpos = 0, rpos = length - 1;
+	const unsigned int bps = _sample_bytes(sample) / sample->length;
+	unsigned long lpos = 0, rpos = sample->length - 1;
+	signed char *data = sample->data;
+	signed char tmp[4];
 
 	while (lpos < rpos) {
-		tmp = data[lpos];
-		data[lpos] = data[rpos];
-		data[rpos] = tmp;
+		memcpy(tmp, data + lpos * bps, bps);
+		memcpy(data + lpos * bps, data + rpos * bps, bps);
+		memcpy(data + rpos * bps, tmp, bps);
 		lpos++;
 		rpos--;
 	}
@@ -146,23 +527,33 @@ static void _reverse_32(signed int *data, unsigned long length)
 
 void sample_reverse(song_sample_t * sample)
 {
+	struct sample_job job;
 	unsigned long tmp;
 
-	song_lock_audio();
-	status.flags |= SONG_NEEDS_SAVE;
+	if (!sample->data || !sample->length)
+		return;
 
-	if (sample->flags & CHN_STEREO) {
-		if (sample->flags & CHN_16BIT)
-			_reverse_32((signed int *)sample->data, sample->length);
-		else
-			_reverse_16((signed short *) sample->data, sample->length);
+	sample_unshare(sample);
+	if (sample->length < SAMPLE_EDIT_THREADED_MIN) {
+		song_lock_audio();
+		_reverse_in_place(sample);
+		song_unlock_audio();
 	} else {
-		if (sample->flags & CHN_16BIT)
-			_reverse_16((signed short *) sample->data, sample->length);
-		else
-			_reverse_8(sample->data, sample->length);
+		switch (_sample_bytes(sample) / sample->length) {
+		case 1: job.kernel = _reverse_8; break;
+		case 2: job.kernel = _reverse_16; break;
+		default: job.kernel = _reverse_32; break;
+		}
+		job.src = sample->data;
+		job.length = sample->length;
+		job.dst = csf_allocate_sample(_sample_bytes(sample));
+		if (!_sample_job_finish(&job, sample, _sample_job_run(&job, "Reversing sample...")))
+			return;
 	}
 
+	song_lock_audio();
+	status.flags |= SONG_NEEDS_SAVE;
+
 	tmp = sample->length - sample->loop_start;
 	sample->loop_start = sample->length - sample->loop_end;
 	sample->loop_end = tmp;
@@ -171,6 +562,8 @@ void sample_reverse(song_sample_t * sample)
 	sample->sustain_start = sample->length - sample->sustain_end;
 	sample->sustain_end = tmp;
 
+	csf_adjust_sample_loop(sample);
+	draw_sample_data_invalidate(sample, 0, sample->length);
 	song_unlock_audio();
 }
 
@@ -180,29 +573,21 @@ void sample_reverse(song_sample_t * sample)
  * the same); otherwise, the sample length is changed and the data is
  * left untouched. */
 
-static void _quality_convert_8to16(signed char *idata, signed short *odata, unsigned long length)
-{
-	unsigned long pos = length;
-
-	while (pos) {
-		pos--;
-		odata[pos] = idata[pos] << 8;
-	}
-}
-
-static void _quality_convert_16to8(signed short *idata, signed char *odata, unsigned long length)
+void sample_toggle_quality(song_sample_t * sample, int convert_data)
 {
-	unsigned long pos = length;
+	struct sample_job job;
 
-	while (pos) {
-		pos--;
-		odata[pos] = idata[pos] >> 8;
+	if (convert_data) {
+		/* this always needs a new buffer, since the size changes */
+		job.kernel = (sample->flags & CHN_16BIT) ? _quality_convert_16to8 : _quality_convert_8to16;
+		job.src = sample->data;
+		job.length = _sample_values(sample);
+		job.dst = csf_allocate_sample(job.length * ((sample->flags & CHN_16BIT) ? 1 : 2));
+		if (!_sample_job_run(&job, "Converting sample...")) {
+			csf_free_sample(job.dst);
+			return;
+		}
 	}
-}
-
-void sample_toggle_quality(song_sample_t * sample, int convert_data)
-{
-	signed char *odata;
 
 	song_lock_audio();
 
@@ -213,18 +598,8 @@ void sample_toggle_quality(song_sample_t * sample, int convert_data)
 
 	status.flags |= SONG_NEEDS_SAVE;
 	if (convert_data) {
-		odata = csf_allocate_sample(sample->length
-			* ((sample->flags & CHN_16BIT) ? 2 : 1)
-			* ((sample->flags & CHN_STEREO) ? 2 : 1));
-		if (sample->flags & CHN_16BIT) {
-			_quality_convert_8to16(sample->data, (signed short *) odata,
-				sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1));
-		} else {
-			_quality_convert_16to8((signed short *) sample->data, odata,
-				sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1));
-		}
 		csf_free_sample(sample->data);
-		sample->data = odata;
+		sample->data = job.dst;
 	} else {
 		if (sample->flags & CHN_16BIT) {
 			sample->length >>= 1;
@@ -240,166 +615,101 @@ void sample_toggle_quality(song_sample_t * sample, int convert_data)
 			sample->sustain_end <<= 1;
 		}
 	}
+	csf_adjust_sample_loop(sample);
 	song_unlock_audio();
 }
 
 /* --------------------------------------------------------------------- */
 /* centralise (correct dc offset) */
 
-static void _centralise_8(signed char *data, unsigned long length)
+void sample_centralise(song_sample_t * sample)
 {
-	unsigned long pos = length;
-	signed char min, max;
-	int offset;
-
-	_minmax_8(data, length, &min, &max);
+	struct sample_job job;
+	int min, max, offset;
 
-	offset = (max + min + 1) >> 1;
-	if (offset == 0)
+	if (!sample->data || !sample->length)
 		return;
 
-	pos = length;
-	while (pos) {
-		pos--;
-		data[pos] -= offset;
-	}
-}
-
-static void _centralise_16(signed short *data, unsigned long length)
-{
-	unsigned long pos = length;
-	signed short min, max;
-	int offset;
-
-	_minmax_16(data, length, &min, &max);
-
-	while (pos) {
-		pos--;
-		if (data[pos] < min)
-			min = data[pos];
-		else if (data[pos] > max)
-			max = data[pos];
-	}
-
+	_sample_minmax(sample, &min, &max);
 	offset = (max + min + 1) >> 1;
 	if (offset == 0)
 		return;
 
-	pos = length;
-	while (pos) {
-		pos--;
-		data[pos] -= offset;
-	}
-}
+	_sample_job_setup(&job, sample, (sample->flags & CHN_16BIT) ? _sub_16 : _sub_8,
+		_sample_values(sample), _sample_bytes(sample), offset);
+	if (!_sample_job_finish(&job, sample, _sample_job_run(&job, "Centralising sample...")))
+		return;
 
-void sample_centralise(song_sample_t * sample)
-{
-	song_lock_audio();
 	status.flags |= SONG_NEEDS_SAVE;
-	if (sample->flags & CHN_16BIT)
-		_centralise_16((signed short *) sample->data,
-			sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1));
-	else
-		_centralise_8(sample->data, sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1));
-	song_unlock_audio();
+	draw_sample_data_invalidate(sample, 0, sample->length);
 }
 
 /* --------------------------------------------------------------------- */
 /* downmix stereo to mono */
 
-static void _downmix_8(signed char *data, unsigned long length)
-{
-	unsigned long i, j;
-	for (i = j = 0; j < length; j++, i += 2)
-		data[j] = (data[i] + data[i + 1]) / 2;
-}
-
-static void _downmix_16(signed short *data, unsigned long length)
-{
-	unsigned long i, j;
-	for (i = j = 0; j < length; j++, i += 2)
-		data[j] = (data[i] + data[i + 1]) / 2;
-}
-
 void sample_downmix(song_sample_t *sample)
 {
+	struct sample_job job;
+
 	if (!(sample->flags & CHN_STEREO))
 		return; /* what are we doing here with a mono sample? */
+
+	job.kernel = (sample->flags & CHN_16BIT) ? _downmix_16 : _downmix_8;
+	job.src = sample->data;
+	job.length = sample->length;
+	if (sample->length >= SAMPLE_EDIT_THREADED_MIN) {
+		job.dst = csf_allocate_sample(_sample_bytes(sample) / 2);
+		if (!_sample_job_run(&job, "Downmixing sample...")) {
+			csf_free_sample(job.dst);
+			return;
+		}
+	} else {
+		sample_unshare(sample);
+		job.src = job.dst = sample->data;
+		_sample_job_run(&job, NULL);
+	}
+
 	song_lock_audio();
 	status.flags |= SONG_NEEDS_SAVE;
-	if (sample->flags & CHN_16BIT)
-		_downmix_16((signed short *) sample->data, sample->length);
-	else
-		_downmix_8(sample->data, sample->length);
+	if (job.dst != sample->data) {
+		csf_stop_sample(current_song, sample);
+		csf_free_sample(sample->data);
+		sample->data = job.dst;
+	}
 	sample->flags &= ~CHN_STEREO;
+	csf_adjust_sample_loop(sample);
 	song_unlock_audio();
 }
 
 /* --------------------------------------------------------------------- */
 /* amplify (or attenuate) */
 
-static void _amplify_8(signed char *data, unsigned long length, int percent)
-{
-	unsigned long pos = length;
-	int b;
-
-	while (pos) {
-		pos--;
-		b = data[pos] * percent / 100;
-		data[pos] = CLAMP(b, -128, 127);
-	}
-}
-
-static void _amplify_16(signed short *data, unsigned long length, int percent)
-{
-	unsigned long pos = length;
-	int b;
-
-	while (pos) {
-		pos--;
-		b = data[pos] * percent / 100;
-		data[pos] = CLAMP(b, -32768, 32767);
-	}
-}
-
 void sample_amplify(song_sample_t * sample, int percent)
 {
-	song_lock_audio();
-	status.flags |= SONG_NEEDS_SAVE;
-	if (sample->flags & CHN_16BIT)
-		_amplify_16((signed short *) sample->data,
-			sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1), percent);
-	else
-		_amplify_8(sample->data, sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1), percent);
-	song_unlock_audio();
-}
+	struct sample_job job;
 
-static int _get_amplify_8(signed char *data, unsigned long length)
-{
-	signed char min, max;
-	_minmax_8(data, length, &min, &max);
-	max = MAX(max, -min);
-	return max ? 128 * 100 / max : 100;
-}
+	_sample_job_setup(&job, sample, (sample->flags & CHN_16BIT) ? _amplify_16 : _amplify_8,
+		_sample_values(sample), _sample_bytes(sample), percent);
+	if (!_sample_job_finish(&job, sample, _sample_job_run(&job, "Amplifying sample...")))
+		return;
 
-static int _get_amplify_16(signed short *data, unsigned long length)
-{
-	signed short min, max;
-	_minmax_16(data, length, &min, &max);
-	max = MAX(max, -min);
-	return max ? 32768 * 100 / max : 100;
+	status.flags |= SONG_NEEDS_SAVE;
+	draw_sample_data_invalidate(sample, 0, sample->length);
 }
 
 int sample_get_amplify_amount(song_sample_t *sample)
 {
-	int percent;
+	int percent, min, max;
+
+	if (!sample->data || !sample->length)
+		return 100;
 
+	_sample_minmax(sample, &min, &max);
+	max = MAX(max, -min);
 	if (sample->flags & CHN_16BIT)
-		percent = _get_amplify_16((signed short *) sample->data,
-			sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1));
+		percent = max ? 32768 * 100 / max : 100;
 	else
-		percent = _get_amplify_8(sample->data,
-			sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1));
+		percent = max ? 128 * 100 / max : 100;
 
 	if (percent < 100) percent = 100;
 	return percent;
@@ -434,6 +744,7 @@ static void _delta_decode_16(signed short *data, unsigned long length)
 
 void sample_delta_decode(song_sample_t * sample)
 {
+	sample_unshare(sample);
 	song_lock_audio();
 	status.flags |= SONG_NEEDS_SAVE;
 	if (sample->flags & CHN_16BIT)
@@ -441,93 +752,228 @@ void sample_delta_decode(song_sample_t * sample)
 			sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1));
 	else
 		_delta_decode_8(sample->data, sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1));
+	csf_adjust_sample_loop(sample);
+	draw_sample_data_invalidate(sample, 0, sample->length);
 	song_unlock_audio();
 }
 
 /* --------------------------------------------------------------------- */
 /* surround flipping (probably useless with the S91 effect, but why not) */
 
-static void _invert_8(signed char *data, unsigned long length)
+void sample_invert(song_sample_t * sample)
 {
-	unsigned long pos = length;
+	struct sample_job job;
 
-	while (pos) {
-		pos--;
-		data[pos] = ~data[pos];
-	}
+	_sample_job_setup(&job, sample, (sample->flags & CHN_16BIT) ? _invert_16 : _invert_8,
+		_sample_values(sample), _sample_bytes(sample), 0);
+	if (!_sample_job_finish(&job, sample, _sample_job_run(&job, "Inverting sample...")))
+		return;
+
+	status.flags |= SONG_NEEDS_SAVE;
+	draw_sample_data_invalidate(sample, 0, sample->length);
 }
 
-static void _invert_16(signed short *data, unsigned long length)
+/* --------------------------------------------------------------------- */
+/* resizing
+
+This is done offline, so it can afford a lot more than the mixer's 8-tap FIR:
+a windowed sinc with as many taps as the quality setting asks for, with the
+cutoff lowered when shrinking the sample so that nothing folds back down.
+The filter is tabulated for RESAMPLE_PHASES fractional positions, and the
+coefficients in between are interpolated. */
+
+#define PI                      ((double)3.14159265358979323846)
+#define RESAMPLE_PHASES         512
+#define RESAMPLE_MAX_TAPS       1024
+
+struct resample_params {
+	unsigned long src_length; /* in frames */
+	uint64_t step; /* 32.32 fixed point, source frames per output frame */
+	int stereo;
+
+	/* sinc only */
+	int taps;
+	float *table; /* (RESAMPLE_PHASES + 1) rows of 'taps' coefficients */
+};
+
+static const struct {
+	int taps;
+	double beta; /* for the kaiser window */
+} resample_quality[] = {
+	[SAMPLE_RESAMPLE_LOW] = {16, 6.0},
+	[SAMPLE_RESAMPLE_MEDIUM] = {32, 8.5},
+	[SAMPLE_RESAMPLE_HIGH] = {64, 12.0},
+};
+
+/* modified bessel function of the first kind, order zero */
+static double _bessel_i0(double x)
 {
-	unsigned long pos = length;
+	double sum = 1.0, term = 1.0;
+	int k;
 
-	while (pos) {
-		pos--;
-		data[pos] = ~data[pos];
+	for (k = 1; k < 64 && term > sum * 1e-12; k++) {
+		term *= (x * x) / (4.0 * k * k);
+		sum += term;
 	}
+	return sum;
 }
 
-
-static void _resize_16(signed short *dst, unsigned long newlen,
-		signed short *src, unsigned long oldlen, unsigned int is_stereo)
+/* fills in the sinc table for going from oldlen to newlen; returns zero if it
+can't get the memory */
+static int _resample_build(struct resample_params *p, int quality, unsigned long oldlen, unsigned long newlen)
 {
-	unsigned int i;
-	double factor = (double)oldlen / (double)newlen;
-	if (is_stereo) for (i = 0; i < newlen; i++)
-	{
-		unsigned int pos = 2*(unsigned int)((double)i * factor);
-		dst[2*i] = src[pos];
-		dst[2*i+1] = src[pos+1];
+	double cutoff = 1.0, x, w, sum, beta;
+	int phase, k, taps, half;
+	float *row;
+
+	quality = CLAMP(quality, SAMPLE_RESAMPLE_LOW, SAMPLE_RESAMPLE_HIGH);
+	taps = resample_quality[quality].taps;
+	beta = resample_quality[quality].beta;
+
+	if (newlen < oldlen) {
+		/* a little under nyquist, so the transition band doesn't alias */
+		cutoff = 0.95 * newlen / oldlen;
+		taps = MIN(RESAMPLE_MAX_TAPS, (int) ceil(taps / cutoff));
+		taps = (taps + 1) & ~1;
 	}
-	else for (i = 0; i < newlen; i++)
-	{
-		dst[i] = src[(unsigned int)((double)i * factor)];
-	}
-}
-static void _resize_8(signed char *dst, unsigned long newlen,
-		signed char *src, unsigned long oldlen, unsigned int is_stereo)
-{
-	unsigned int i;
-	double factor = (double)oldlen / (double)newlen;
-	if (is_stereo) {
-		for (i = 0; i < newlen; i++) {
-			unsigned int pos = 2*(unsigned int)((double)i * factor);
-			dst[2*i] = src[pos];
-			dst[2*i+1] = src[pos+1];
-		}
-	} else {
-		for (i = 0; i < newlen; i++) {
-			dst[i] = src[(unsigned int)((double)i * factor)];
+	half = taps / 2;
+
+	p->taps = taps;
+	p->table = malloc(sizeof(float) * taps * (RESAMPLE_PHASES + 1));
+	if (!p->table)
+		return 0;
+
+	for (phase = 0; phase <= RESAMPLE_PHASES; phase++) {
+		row = p->table + phase * taps;
+		sum = 0.0;
+		for (k = 0; k < taps; k++) {
+			/* distance from the output position to source frame (base - half + 1 + k) */
+			x = (k - half + 1) - (double) phase / RESAMPLE_PHASES;
+			w = 1.0 - (x / half) * (x / half);
+			w = (w > 0.0) ? _bessel_i0(beta * sqrt(w)) / _bessel_i0(beta) : 0.0;
+			x *= cutoff * PI;
+			row[k] = w * ((x == 0.0) ? 1.0 : sin(x) / x);
+			sum += row[k];
 		}
+		/* keep the dc gain at exactly one, whatever the phase */
+		for (k = 0; k < taps; k++)
+			row[k] /= sum;
 	}
-}
-static void _resize_8aa(signed char *dst, unsigned long newlen,
-		signed char *src, unsigned long oldlen, unsigned int is_stereo)
-{
-	if (is_stereo)
-		ResampleStereo8BitFirFilter(src, dst, oldlen, newlen);
-	else
-		ResampleMono8BitFirFilter(src, dst, oldlen, newlen);
-}
-static void _resize_16aa(signed short *dst, unsigned long newlen,
-		signed short *src, unsigned long oldlen, unsigned int is_stereo)
-{
-	if (is_stereo)
-		ResampleStereo16BitFirFilter(src, dst, oldlen, newlen);
-	else
-		ResampleMono16BitFirFilter(src, dst, oldlen, newlen);
+
+	return 1;
 }
 
+#define RESIZE_KERNEL(bits) \
+	static void _resize_##bits(struct sample_job *job, unsigned long start, unsigned long end, UNUSED int slot) \
+	{ \
+		const struct resample_params *p = job->params; \
+		const int##bits##_t *src = job->src; \
+		int##bits##_t *dst = job->dst; \
+		unsigned long i, pos; \
+	\
+		for (i = start; i < end; i++) { \
+			pos = (unsigned long) (((uint64_t) i * p->step) >> 32); \
+			if (p->stereo) { \
+				dst[2 * i] = src[2 * pos]; \
+				dst[2 * i + 1] = src[2 * pos + 1]; \
+			} else { \
+				dst[i] = src[pos]; \
+			} \
+		} \
+	}
+
+#define RESIZE_SINC_KERNEL(bits) \
+	static void _resize_sinc_##bits(struct sample_job *job, unsigned long start, unsigned long end, UNUSED int slot) \
+	{ \
+		const struct resample_params *p = job->params; \
+		const int##bits##_t *src = job->src; \
+		int##bits##_t *dst = job->dst; \
+		const int taps = p->taps, half = taps / 2; \
+		const long last = p->src_length; \
+		const float *r0, *r1; \
+		float coef, frac, l, r; \
+		uint64_t fpos; \
+		long base, s; \
+		int k, phase, v; \
+	\
+		for (; start < end; start++) { \
+			fpos = (uint64_t) start * p->step; \
+			base = (long) (fpos >> 32); \
+			/* 9 bits of phase, 23 bits of interpolation between phases */ \
+			phase = (fpos >> 23) & (RESAMPLE_PHASES - 1); \
+			frac = (float) (fpos & ((1 << 23) - 1)) / (1 << 23); \
+			r0 = p->table + phase * taps; \
+			r1 = r0 + taps; \
+			l = r = 0.0f; \
+			for (k = 0, s = base - half + 1; k < taps; k++, s++) { \
+				if (s < 0 || s >= last) \
+					continue; \
+				coef = r0[k] + frac * (r1[k] - r0[k]); \
+				if (p->stereo) { \
+					l += coef * src[2 * s]; \
+					r += coef * src[2 * s + 1]; \
+				} else { \
+					l += coef * src[s]; \
+				} \
+			} \
+			if (p->stereo) { \
+				v = (int) lrintf(l); \
+				dst[2 * start] = CLAMP(v, INT##bits##_MIN, INT##bits##_MAX); \
+				v = (int) lrintf(r); \
+				dst[2 * start + 1] = CLAMP(v, INT##bits##_MIN, INT##bits##_MAX); \
+			} else { \
+				v = (int) lrintf(l); \
+				dst[start] = CLAMP(v, INT##bits##_MIN, INT##bits##_MAX); \
+			} \
+		} \
+	}
+
+RESIZE_KERNEL(8)
+RESIZE_KERNEL(16)
+RESIZE_SINC_KERNEL(8)
+RESIZE_SINC_KERNEL(16)
 
+#undef RESIZE_KERNEL
+#undef RESIZE_SINC_KERNEL
 
-void sample_resize(song_sample_t * sample, unsigned long newlen, int aa)
+/* returns zero if it was cancelled (or there wasn't enough memory) */
+static int _sample_resize(song_sample_t * sample, unsigned long newlen, int quality)
 {
-	int bps;
-	signed char *d, *z;
-	unsigned long oldlen;
+	struct resample_params params;
+	struct sample_job job;
+	unsigned long oldlen = sample->length;
+	int bps, ok;
+
+	if (!newlen) return 0;
+	if (!sample->data || !sample->length) return 0;
+
+	bps = (((sample->flags & CHN_STEREO) ? 2 : 1)
+		* ((sample->flags & CHN_16BIT) ? 2 : 1));
 
-	if (!newlen) return;
-	if (!sample->data || !sample->length) return;
+	params.src_length = oldlen;
+	params.step = ((uint64_t) oldlen << 32) / newlen;
+	params.stereo = !!(sample->flags & CHN_STEREO);
+	params.table = NULL;
+	if (quality != SAMPLE_RESAMPLE_NONE && !_resample_build(&params, quality, oldlen, newlen)) {
+		log_appendf(4, "Not enough memory to resize sample");
+		return 0;
+	}
+
+	if (quality == SAMPLE_RESAMPLE_NONE)
+		job.kernel = (sample->flags & CHN_16BIT) ? _resize_16 : _resize_8;
+	else
+		job.kernel = (sample->flags & CHN_16BIT) ? _resize_sinc_16 : _resize_sinc_8;
+	job.src = sample->data;
+	job.dst = csf_allocate_sample(newlen * bps);
+	job.length = newlen;
+	job.params = &params;
+
+	ok = _sample_job_run(&job, "Resizing sample...");
+	free(params.table);
+	if (!ok) {
+		csf_free_sample(job.dst);
+		return 0;
+	}
 
 	song_lock_audio();
 
@@ -537,14 +983,8 @@ void sample_resize(song_sample_t * sample, unsigned long newlen, int aa)
 	// hopefully this won't (re)introduce crashes. --Storlek
 	csf_stop_sample(current_song, sample);
 
-	bps = (((sample->flags & CHN_STEREO) ? 2 : 1)
-		* ((sample->flags & CHN_16BIT) ? 2 : 1));
-
 	status.flags |= SONG_NEEDS_SAVE;
 
-	d = csf_allocate_sample(newlen*bps);
-	z = sample->data;
-
 	sample->c5speed = (unsigned long)((((double)newlen) * ((double)sample->c5speed))
 			/ ((double)sample->length));
 
@@ -558,40 +998,38 @@ void sample_resize(song_sample_t * sample, unsigned long newlen, int aa)
 	sample->sustain_end = (unsigned long)((((double)newlen) * ((double)sample->sustain_end))
 			/ ((double)sample->length));
 
-	oldlen = sample->length;
 	sample->length = newlen;
 
-	if (sample->flags & CHN_16BIT) {
-		if (aa) {
-			_resize_16aa((signed short *) d, newlen, (short *) sample->data, oldlen, sample->flags & CHN_STEREO);
-		} else {
-			_resize_16((signed short *) d, newlen, (short *) sample->data, oldlen, sample->flags & CHN_STEREO);
-		}
-	} else {
-		if (aa) {
-			_resize_8aa(d, newlen, sample->data, oldlen, sample->flags & CHN_STEREO);
-		} else {
-			_resize_8(d, newlen, sample->data, oldlen, sample->flags & CHN_STEREO);
-		}
-	}
-
-	sample->data = d;
-	csf_free_sample(z);
+	csf_free_sample(sample->data);
+	sample->data = job.dst;
+	csf_adjust_sample_loop(sample);
 	song_unlock_audio();
+
+	return 1;
 }
 
-void sample_invert(song_sample_t * sample)
+void sample_resize(song_sample_t * sample, unsigned long newlen, int quality)
 {
-	song_lock_audio();
-	status.flags |= SONG_NEEDS_SAVE;
-	if (sample->flags & CHN_16BIT)
-		_invert_16((signed short *) sample->data,
-			sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1));
-	else
-		_invert_8(sample->data, sample->length * ((sample->flags & CHN_STEREO) ? 2 : 1));
-	song_unlock_audio();
+	_sample_resize(sample, newlen, quality);
+}
+
+void sample_resample(song_sample_t * sample, unsigned int rate, int quality)
+{
+	unsigned long newlen;
+
+	if (!rate || !sample->c5speed || rate == sample->c5speed || !sample->data)
+		return;
+
+	newlen = (unsigned long) ((double) sample->length * rate / sample->c5speed + 0.5);
+	if (newlen > MAX_SAMPLE_LENGTH)
+		return;
+
+	/* resize scales the speed too, but only approximately */
+	if (_sample_resize(sample, newlen, quality))
+		sample->c5speed = rate;
 }
 
+
 static void _mono_lr16(signed short *data, unsigned long length, int shift)
 {
 	unsigned long i=1, j;
@@ -608,6 +1046,7 @@ static void _mono_lr8(signed char *data, unsigned long length, int shift)
 }
 void sample_mono_left(song_sample_t * sample)
 {
+	sample_unshare(sample);
 	song_lock_audio();
 	status.flags |= SONG_NEEDS_SAVE;
 	if (sample->flags & CHN_STEREO) {
@@ -616,11 +1055,13 @@ void sample_mono_left(song_sample_t * sample)
 		else
 			_mono_lr8((signed char *)sample->data, sample->length, 1);
 		sample->flags &= ~CHN_STEREO;
+		csf_adjust_sample_loop(sample);
 	}
 	song_unlock_audio();
 }
 void sample_mono_right(song_sample_t * sample)
 {
+	sample_unshare(sample);
 	song_lock_audio();
 	status.flags |= SONG_NEEDS_SAVE;
 	if (sample->flags & CHN_STEREO) {
@@ -629,6 +1070,7 @@ void sample_mono_right(song_sample_t * sample)
 		else
 			_mono_lr8((signed char *)sample->data, sample->length, 0);
 		sample->flags &= ~CHN_STEREO;
+		csf_adjust_sample_loop(sample);
 	}
 	song_unlock_audio();
 }
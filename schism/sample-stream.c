@@ -0,0 +1,892 @@
+/*
+ * Schism Tracker - a cross-platform Impulse Tracker clone
+ * copyright (c) 2003-2005 Storlek <storlek@rigelseven.com>
+ * copyright (c) 2005-2008 Mrs. Brisby <mrs.brisby@nimh.org>
+ * copyright (c) 2009 Storlek & Mrs. Brisby
+ * copyright (c) 2010-2012 Storlek
+ * URL: http://schismtracker.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "headers.h"
+
+#include "fmt.h"
+#include "sample-stream.h"
+#include "slurp.h"
+#include "song.h"
+#include "util.h"
+
+#include "sdlmain.h"
+
+/* frames in the ring buffer; about three seconds at 44.1khz */
+#define STREAM_RING_FRAMES (1 << 17)
+/* how far behind the voice the thread has to stay when it's filling the ring
+(the interpolators look back a few frames) */
+#define STREAM_SAFETY_FRAMES 1024
+/* most that's decoded at once */
+#define STREAM_CHUNK_FRAMES 4096
+/* how often the thread checks where the voice is, in milliseconds */
+#define STREAM_POLL 5
+
+/* uncompressed data, read right out of the file */
+struct pcm_decoder {
+	int64_t offset;
+	uint32_t length, pos;
+	int bytes, channels, big_endian, is_unsigned;
+	uint8_t raw[STREAM_CHUNK_FRAMES * 8];
+};
+
+struct sample_stream {
+	slurp_t fp;
+	struct sample_decoder decoder;
+	int slot;
+
+	/* the start of the file, for every time a note's played */
+	song_sample_t head;
+	/* what's put in the sample slot; this holds a reference of its own, so
+	it's still there if the sample gets replaced */
+	signed char *ring;
+	uint32_t frame_size;
+
+	/* these are all frame numbers in the file */
+	uint32_t length;
+	uint32_t filled; /* everything before this has been put in the ring */
+	uint32_t played; /* where the voice is */
+	uint32_t last_pos; /* where the voice was in the ring last time */
+
+	SDL_mutex *mutex; /* held by the thread while it's filling the ring */
+	SDL_Thread *thread;
+	SDL_atomic_t quit;
+};
+
+static struct sample_stream *stream = NULL;
+
+/* --------------------------------------------------------------------------------------------------------- */
+
+static uint32_t _pcm_read(struct sample_decoder *d, void *buf, uint32_t frames)
+{
+	struct pcm_decoder *pcm = d->data;
+	const int frame_bytes = pcm->bytes * pcm->channels;
+	int8_t *out8 = buf;
+	int16_t *out16 = buf;
+	uint32_t done = 0, n, i;
+
+	frames = MIN(frames, pcm->length - pcm->pos);
+	while (done < frames) {
+		const uint8_t *src = pcm->raw;
+
+		n = MIN(frames - done, STREAM_CHUNK_FRAMES);
+		n = slurp_read(d->fp, pcm->raw, n * frame_bytes) / frame_bytes;
+		if (!n)
+			break;
+
+		for (i = 0; i < n * pcm->channels; i++, src += pcm->bytes) {
+			if (pcm->bytes == 1) {
+				*out8++ = (int8_t) (src[0] ^ (pcm->is_unsigned ? 0x80 : 0));
+			} else {
+				/* anything over 16 bits just gets the top 16 */
+				uint16_t v = pcm->big_endian
+					? (src[0] << 8) | src[1]
+					: (src[pcm->bytes - 1] << 8) | src[pcm->bytes - 2];
+				*out16++ = (int16_t) (v ^ (pcm->is_unsigned ? 0x8000 : 0));
+			}
+		}
+
+		done += n;
+		pcm->pos += n;
+	}
+
+	return done;
+}
+
+static int _pcm_seek(struct sample_decoder *d, uint32_t frame)
+{
+	struct pcm_decoder *pcm = d->data;
+
+	if (slurp_seek(d->fp, pcm->offset + (int64_t) frame * pcm->bytes * pcm->channels, SEEK_SET))
+		return 0;
+	pcm->pos = MIN(frame, pcm->length);
+	return 1;
+}
+
+static void _pcm_close(struct sample_decoder *d)
+{
+	free(d->data);
+}
+
+/* returns zero for anything that's compressed, or delta-encoded, or otherwise
+can't be read starting from any frame */
+static int _pcm_open(struct sample_decoder *d, slurp_t *fp, int64_t offset, uint32_t flags, uint32_t length)
+{
+	struct pcm_decoder *pcm;
+	int bytes;
+
+	if (((flags & SF_ENC_MASK) != SF_PCMS && (flags & SF_ENC_MASK) != SF_PCMU)
+	    || ((flags & SF_CHN_MASK) != SF_M && (flags & SF_CHN_MASK) != SF_SI))
+		return 0;
+	switch (flags & SF_BIT_MASK) {
+	case SF_8:  bytes = 1; break;
+	case SF_16: bytes = 2; break;
+	case SF_24: bytes = 3; break;
+	case SF_32: bytes = 4; break;
+	default: return 0;
+	}
+
+	pcm = mem_calloc(1, sizeof(*pcm));
+	pcm->offset = offset;
+	pcm->length = length;
+	pcm->bytes = bytes;
+	pcm->channels = ((flags & SF_CHN_MASK) == SF_SI) ? 2 : 1;
+	pcm->big_endian = ((flags & SF_END_MASK) == SF_BE);
+	pcm->is_unsigned = ((flags & SF_ENC_MASK) == SF_PCMU);
+
+	d->read = _pcm_read;
+	d->seek = _pcm_seek;
+	d->close = _pcm_close;
+	d->fp = fp;
+	d->data = pcm;
+
+	if (!_pcm_seek(d, 0)) {
+		free(pcm);
+		return 0;
+	}
+	return 1;
+}
+
+#define LOAD_SAMPLE(x) fmt_##x##_load_sample,
+static fmt_load_sample_func load_sample_funcs[] = {
+#include "fmt-types.h"
+	NULL,
+};
+
+/* fills in the sample's header and sets up a decoder for its data */
+static int _open_decoder(struct sample_decoder *d, slurp_t *fp, song_sample_t *smp)
+{
+	struct slurp_sample_refs *refs;
+	fmt_load_sample_func *load;
+	int r = 0;
+
+#ifdef USE_FLAC
+	slurp_rewind(fp);
+	if (fmt_flac_open_decoder(fp, smp, d))
+		return 1;
+#endif
+
+	/* For everything else, the loaders can find the data without reading it, the
+	same way as for browsing a sample library. If it's uncompressed, it can be read
+	right out of the file. */
+	refs = mem_calloc(1, sizeof(*refs));
+	refs->base = smp;
+	fp->sample_refs = refs;
+	for (load = load_sample_funcs; *load; load++) {
+		slurp_rewind(fp);
+		if ((*load)(fp, smp))
+			break;
+	}
+	fp->sample_refs = NULL;
+
+	if (*load && !smp->data && refs->flags[0]) {
+		/* this one's read a bit at a time, so it doesn't have to stop at MAX_SAMPLE_LENGTH */
+		smp->length = refs->length[0];
+		r = _pcm_open(d, fp, refs->offset[0], refs->flags[0], smp->length);
+	}
+	free(refs);
+
+	/* (the loader might've decided to read it after all) */
+	csf_free_sample(smp->data);
+	smp->data = NULL;
+
+	return r;
+}
+
+/* --------------------------------------------------------------------------------------------------------- */
+
+/* Where's the voice got to? Returns zero if the ring isn't in the song anymore.
+Only the first voice playing the stream is followed; sample_stream_restart
+stops the rest. */
+static int _stream_track(struct sample_stream *st)
+{
+	song_sample_t *smp;
+	song_voice_t *v;
+	uint32_t pos = st->last_pos;
+	int n;
+
+	song_lock_audio();
+
+	smp = current_song->samples + st->slot;
+	if (smp->data != st->ring) {
+		song_unlock_audio();
+		return 0;
+	}
+
+	for (n = 0, v = current_song->voices; n < (int) current_song->voice_pool_size; n++, v++) {
+		if (v->current_sample_data == st->ring && v->length) {
+			pos = v->position;
+			/* past the end of the file, it's only playing silence */
+			if (st->played >= st->length)
+				csf_stop_sample(current_song, smp);
+			break;
+		}
+	}
+
+	song_unlock_audio();
+
+	/* it can't get all the way around the ring between checks, so if it's
+	behind where it was, it's wrapped */
+	if (pos < st->last_pos)
+		st->played += STREAM_RING_FRAMES - st->last_pos + pos;
+	else
+		st->played += pos - st->last_pos;
+	st->last_pos = pos;
+
+	return 1;
+}
+
+/* call with the mutex locked, or before the thread's started */
+static void _stream_fill(struct sample_stream *st)
+{
+	const uint32_t target = st->played + STREAM_RING_FRAMES - STREAM_SAFETY_FRAMES;
+	uint32_t at, n, got;
+	int guard = 0;
+
+	if (st->filled < st->played) {
+		/* the voice got ahead of us; skip to where it is (it'll have played
+		a bit of the last time around, but there's nothing to be done about that) */
+		st->filled = st->played;
+		if (st->filled < st->length && !st->decoder.seek(&st->decoder, st->filled))
+			st->length = st->filled;
+	}
+
+	while (st->filled < target && !SDL_AtomicGet(&st->quit)) {
+		at = st->filled % STREAM_RING_FRAMES;
+		n = MIN(target - st->filled, STREAM_RING_FRAMES - at);
+		n = MIN(n, STREAM_CHUNK_FRAMES);
+
+		got = (st->filled < st->length)
+			? st->decoder.read(&st->decoder, st->ring + at * st->frame_size, n)
+			: 0;
+		if (got < n) {
+			/* out of data (or the file's shorter than it said); the rest is silence */
+			st->length = MIN(st->length, st->filled + got);
+			memset(st->ring + (at + got) * st->frame_size, 0, (n - got) * st->frame_size);
+		}
+
+		/* the loop guard copies the frames around the wrap point */
+		if (at < SAMPLE_GUARD_AHEAD || at + n > STREAM_RING_FRAMES - SAMPLE_GUARD_BEHIND)
+			guard = 1;
+		st->filled += n;
+	}
+
+	if (guard) {
+		song_lock_audio();
+		if (current_song->samples[st->slot].data == st->ring)
+			csf_adjust_sample_loop(current_song->samples + st->slot);
+		song_unlock_audio();
+	}
+}
+
+static void _stream_rewind(struct sample_stream *st)
+{
+	song_sample_t *smp;
+
+	memcpy(st->ring, st->head.data, st->head.length * st->frame_size);
+	st->filled = st->head.length;
+	st->played = st->last_pos = 0;
+	if (!st->decoder.seek(&st->decoder, st->filled))
+		st->length = MIN(st->length, st->filled);
+
+	song_lock_audio();
+	smp = current_song->samples + st->slot;
+	if (smp->data == st->ring) {
+		csf_stop_sample(current_song, smp);
+		csf_adjust_sample_loop(smp);
+	}
+	song_unlock_audio();
+}
+
+static int SDLCALL _stream_thread(void *data)
+{
+	struct sample_stream *st = data;
+	int ok = 1;
+
+	while (ok && !SDL_AtomicGet(&st->quit)) {
+		SDL_LockMutex(st->mutex);
+		ok = _stream_track(st);
+		if (ok)
+			_stream_fill(st);
+		SDL_UnlockMutex(st->mutex);
+		SDL_Delay(STREAM_POLL);
+	}
+
+	return 0;
+}
+
+static void _stream_free(struct sample_stream *st)
+{
+	song_sample_t *smp;
+
+	if (st->thread) {
+		SDL_AtomicSet(&st->quit, 1);
+		SDL_WaitThread(st->thread, NULL);
+	}
+	if (st->mutex)
+		SDL_DestroyMutex(st->mutex);
+
+	if (st->ring) {
+		song_lock_audio();
+		smp = current_song->samples + st->slot;
+		if (smp->data == st->ring)
+			csf_destroy_sample(current_song, st->slot);
+		song_unlock_audio();
+		csf_free_sample(st->ring);
+	}
+
+	csf_free_sample(st->head.data);
+	st->decoder.close(&st->decoder);
+	unslurp(&st->fp);
+	free(st);
+}
+
+/* --------------------------------------------------------------------------------------------------------- */
+
+int sample_stream_preview(const char *filename, int slot)
+{
+	struct sample_stream *st;
+	song_sample_t smp = {0}, *dest;
+
+	sample_stream_stop();
+
+	st = mem_calloc(1, sizeof(*st));
+	if (slurp(&st->fp, filename, NULL, 0) < 0) {
+		free(st);
+		return 0;
+	}
+
+	strncpy(smp.name, get_basename(filename), 25);
+	if (!_open_decoder(&st->decoder, &st->fp, &smp)) {
+		unslurp(&st->fp);
+		free(st);
+		return 0;
+	}
+
+	if (smp.length <= STREAM_RING_FRAMES || (smp.flags & CHN_ADLIB)) {
+		/* it's small enough to just load */
+		st->decoder.close(&st->decoder);
+		unslurp(&st->fp);
+		free(st);
+		return 0;
+	}
+
+	st->slot = slot;
+	st->length = smp.length;
+	st->frame_size = ((smp.flags & CHN_16BIT) ? 2 : 1) * ((smp.flags & CHN_STEREO) ? 2 : 1);
+	SDL_AtomicSet(&st->quit, 0);
+
+	/* this is all that has to be decoded before it can be played */
+	st->head = smp;
+	st->head.flags &= ~(CHN_LOOP | CHN_PINGPONGLOOP | CHN_SUSTAINLOOP | CHN_PINGPONGSUSTAIN);
+	st->head.length = STREAM_RING_FRAMES - STREAM_SAFETY_FRAMES;
+	st->head.data = csf_allocate_sample(st->head.length * st->frame_size);
+	st->head.length = st->decoder.read(&st->decoder, st->head.data, st->head.length);
+	if (!st->head.length) {
+		_stream_free(st);
+		return 0;
+	}
+	csf_adjust_sample_loop(&st->head);
+
+	st->ring = csf_allocate_sample(STREAM_RING_FRAMES * st->frame_size);
+	st->mutex = SDL_CreateMutex();
+	if (!st->mutex) {
+		_stream_free(st);
+		return 0;
+	}
+
+	/* the slot gets the ring, looped */
+	song_lock_audio();
+	dest = current_song->samples + slot;
+	csf_destroy_sample(current_song, slot);
+	*dest = smp;
+	dest->data = csf_share_sample(st->ring);
+	dest->length = dest->loop_end = STREAM_RING_FRAMES;
+	dest->loop_start = 0;
+	dest->sustain_start = dest->sustain_end = 0;
+	dest->flags &= ~(CHN_PINGPONGLOOP | CHN_SUSTAINLOOP | CHN_PINGPONGSUSTAIN);
+	dest->flags |= CHN_LOOP;
+	song_unlock_audio();
+
+	_stream_rewind(st);
+
+	st->thread = SDL_CreateThread(_stream_thread, "Schism sample stream", st);
+	if (!st->thread) {
+		_stream_free(st);
+		return 0;
+	}
+
+	stream = st;
+	return 1;
+}
+
+void sample_stream_stop(void)
+{
+	if (stream) {
+		_stream_free(stream);
+		stream = NULL;
+	}
+}
+
+void sample_stream_restart(void)
+{
+	if (!stream)
+		return;
+
+	SDL_LockMutex(stream->mutex);
+	_stream_rewind(stream);
+	SDL_UnlockMutex(stream->mutex);
+}
+
+int sample_stream_slot(void)
+{
+	return stream ? stream->slot : -1;
+}
+
+song_sample_t *sample_stream_head(void)
+{
+	return stream ? &stream->head : NULL;
+}
+
+/* --------------------------------------------------------------------------------------------------------- */
+/* Paged samples (see csf_allocate_paged_sample) are too long to load, so they're
+read from the file as they play, into a handful of pages that get reused as the
+voices move along. One thread does the reading for all of them. */
+
+/* pages kept in memory for each sample; about 24 seconds at 44.1khz, between them */
+#define PAGE_SLOTS 16
+/* how many pages to read ahead of the one that's playing */
+#define PAGE_AHEAD 3
+/* most pages that can be waiting for the thread */
+#define PAGE_QUEUE 16
+/* what's actually read for a page */
+#define PAGE_READ_FRAMES (SAMPLE_PAGE_FRAMES + 2 * SAMPLE_PAGE_EDGE)
+
+enum {
+	PAGE_EMPTY,
+	PAGE_LOADING, /* whoever set this is reading it, without the lock held */
+	PAGE_READY,
+};
+
+struct page_slot {
+	uint32_t page;
+	int state;
+	int pins; /* voices reading from it right now */
+	uint32_t used; /* for throwing out whichever was used longest ago */
+	signed char *data;
+};
+
+struct stream_pager {
+	struct sample_pager pager; /* this has to be first */
+	slurp_t fp;
+	struct sample_decoder decoder;
+	uint32_t length, pages, frame_size;
+
+	/* held by whoever's using the decoder */
+	SDL_mutex *decoder_lock;
+	uint32_t decoder_pos; /* UINT32_MAX if it's not known */
+	/* pages overlap by a few frames; this is the overlap with the next one after
+	the last page that was read */
+	int64_t tail_frame;
+	signed char tail[2 * SAMPLE_PAGE_EDGE * 4];
+
+	/* the mixer takes this, so it's only ever held for a moment */
+	SDL_SpinLock lock;
+	struct page_slot slots[PAGE_SLOTS];
+	uint32_t queue[PAGE_QUEUE];
+	int queued;
+	uint32_t clock;
+
+	struct stream_pager *next;
+	struct stream_pager *next_dead;
+};
+
+/* Pagers can be freed from anywhere (including the audio thread, with the
+audio locked), so the lock is only ever held long enough to change the lists.
+A pager that's freed is only taken out of the list and handed to the thread,
+which closes it once it's sure it isn't reading from it; the thread is also the
+only one that walks the list without the lock, so the pagers it comes across
+don't go away under it. When there's nothing left to do, the thread stops by
+itself, and whoever starts the next one cleans up after it. */
+static struct stream_pager *pagers = NULL;
+static struct stream_pager *dead_pagers = NULL;
+static SDL_SpinLock pagers_lock = 0;
+static SDL_Thread *pager_thread = NULL;
+static int pager_running = 0; /* (with the lock held) */
+
+/* Reads frames out of the file, with silence for anything before the start or
+past the end. Returns how many came from the file. Call with the decoder locked. */
+static uint32_t _pager_decode(struct stream_pager *sp, int64_t frame, signed char *buf, uint32_t frames)
+{
+	uint32_t n, got = 0;
+
+	if (frame < 0) {
+		n = (uint32_t) MIN((int64_t) frames, -frame);
+		memset(buf, 0, n * sp->frame_size);
+		buf += n * sp->frame_size;
+		frame += n;
+		frames -= n;
+	}
+
+	if (frames && frame < sp->length) {
+		n = MIN(frames, sp->length - (uint32_t) frame);
+		if (sp->decoder_pos == frame || sp->decoder.seek(&sp->decoder, frame))
+			got = sp->decoder.read(&sp->decoder, buf, n);
+		sp->decoder_pos = got ? (uint32_t) frame + got : UINT32_MAX;
+		buf += got * sp->frame_size;
+		frames -= got;
+	}
+
+	memset(buf, 0, frames * sp->frame_size);
+	return got;
+}
+
+static void _pager_read_page(struct stream_pager *sp, uint32_t page, signed char *buf)
+{
+	const uint32_t overlap = 2 * SAMPLE_PAGE_EDGE;
+	int64_t frame = (int64_t) page * SAMPLE_PAGE_FRAMES - SAMPLE_PAGE_EDGE;
+	uint32_t skip = 0;
+
+	SDL_LockMutex(sp->decoder_lock);
+	/* if it follows on from the last one, the decoder's already in the right
+	place, and there's no need to seek back for the overlap (for FLAC, seeking
+	means decoding a whole block over again) */
+	if (frame == sp->tail_frame && sp->decoder_pos == frame + overlap) {
+		memcpy(buf, sp->tail, overlap * sp->frame_size);
+		skip = overlap;
+	}
+	_pager_decode(sp, frame + skip, buf + skip * sp->frame_size, PAGE_READ_FRAMES - skip);
+	memcpy(sp->tail, buf + (PAGE_READ_FRAMES - overlap) * sp->frame_size, overlap * sp->frame_size);
+	sp->tail_frame = frame + PAGE_READ_FRAMES - overlap;
+	SDL_UnlockMutex(sp->decoder_lock);
+}
+
+/* call with the lock held */
+static struct page_slot *_pager_find(struct stream_pager *sp, uint32_t page)
+{
+	int n;
+
+	for (n = 0; n < PAGE_SLOTS; n++)
+		if (sp->slots[n].state != PAGE_EMPTY && sp->slots[n].page == page)
+			return sp->slots + n;
+	return NULL;
+}
+
+/* Takes a slot for reading a page into: an empty one if there is one, or else
+whichever's gone unused the longest. Returns NULL if they're all busy. Call
+with the lock held. */
+static struct page_slot *_pager_claim(struct stream_pager *sp, uint32_t page)
+{
+	struct page_slot *slot, *best = NULL;
+	int n;
+
+	for (n = 0, slot = sp->slots; n < PAGE_SLOTS; n++, slot++) {
+		if (slot->state == PAGE_LOADING || slot->pins)
+			continue;
+		if (slot->state == PAGE_EMPTY) {
+			best = slot;
+			break;
+		}
+		if (!best || (int32_t) (slot->used - best->used) < 0)
+			best = slot;
+	}
+
+	if (best) {
+		best->page = page;
+		best->state = PAGE_LOADING;
+	}
+	return best;
+}
+
+/* reads a page into a slot from _pager_claim */
+static void _pager_load(struct stream_pager *sp, struct page_slot *slot)
+{
+	if (!slot->data)
+		slot->data = mem_alloc(PAGE_READ_FRAMES * sp->frame_size);
+	_pager_read_page(sp, slot->page, slot->data);
+
+	SDL_AtomicLock(&sp->lock);
+	slot->state = PAGE_READY;
+	slot->used = ++sp->clock;
+	SDL_AtomicUnlock(&sp->lock);
+}
+
+/* asks the thread for a page, and the few after it; call with the lock held */
+static void _pager_want(struct stream_pager *sp, uint32_t page)
+{
+	uint32_t p;
+	int n;
+
+	/* (the first page is always there) */
+	for (p = MAX(page, 1); p < page + PAGE_AHEAD && p < sp->pages; p++) {
+		if (_pager_find(sp, p))
+			continue;
+		for (n = 0; n < sp->queued && sp->queue[n] != p; n++)
+			;
+		if (n == sp->queued && sp->queued < PAGE_QUEUE)
+			sp->queue[sp->queued++] = p;
+	}
+}
+
+static const signed char *_pager_acquire(struct sample_pager *pager, uint32_t page, int wait)
+{
+	struct stream_pager *sp = (struct stream_pager *) pager;
+	struct page_slot *slot;
+
+	for (;;) {
+		SDL_AtomicLock(&sp->lock);
+		slot = _pager_find(sp, page);
+		if (slot && slot->state == PAGE_READY) {
+			slot->pins++;
+			slot->used = ++sp->clock;
+			SDL_AtomicUnlock(&sp->lock);
+			return slot->data;
+		}
+		_pager_want(sp, page);
+		if (!wait) {
+			SDL_AtomicUnlock(&sp->lock);
+			return NULL;
+		}
+		/* read it here and now, unless something else already is */
+		slot = slot ? NULL : _pager_claim(sp, page);
+		SDL_AtomicUnlock(&sp->lock);
+
+		if (slot)
+			_pager_load(sp, slot);
+		else
+			SDL_Delay(1);
+	}
+}
+
+static void _pager_release(struct sample_pager *pager, uint32_t page)
+{
+	struct stream_pager *sp = (struct stream_pager *) pager;
+	struct page_slot *slot;
+
+	SDL_AtomicLock(&sp->lock);
+	slot = _pager_find(sp, page);
+	if (slot && slot->pins)
+		slot->pins--;
+	SDL_AtomicUnlock(&sp->lock);
+}
+
+static void _pager_prefetch(struct sample_pager *pager, uint32_t page)
+{
+	struct stream_pager *sp = (struct stream_pager *) pager;
+
+	SDL_AtomicLock(&sp->lock);
+	_pager_want(sp, page);
+	SDL_AtomicUnlock(&sp->lock);
+}
+
+static uint32_t _pager_read(struct sample_pager *pager, uint32_t frame, void *buf, uint32_t frames)
+{
+	struct stream_pager *sp = (struct stream_pager *) pager;
+	uint32_t got;
+
+	SDL_LockMutex(sp->decoder_lock);
+	got = _pager_decode(sp, frame, buf, frames);
+	SDL_UnlockMutex(sp->decoder_lock);
+
+	return got;
+}
+
+static void _pager_close(struct stream_pager *sp)
+{
+	int n;
+
+	for (n = 0; n < PAGE_SLOTS; n++)
+		free(sp->slots[n].data);
+	if (sp->decoder_lock)
+		SDL_DestroyMutex(sp->decoder_lock);
+	sp->decoder.close(&sp->decoder);
+	unslurp(&sp->fp);
+	free(sp);
+}
+
+static int SDLCALL _pager_thread(UNUSED void *data)
+{
+	struct stream_pager *sp, *next, *dead;
+	struct page_slot *slot;
+	uint32_t page;
+	int busy, quit;
+
+	for (;;) {
+		busy = 0;
+
+		SDL_AtomicLock(&pagers_lock);
+		dead = dead_pagers;
+		dead_pagers = NULL;
+		quit = !pagers;
+		if (quit)
+			pager_running = 0;
+		sp = pagers;
+		SDL_AtomicUnlock(&pagers_lock);
+
+		while (dead) {
+			next = dead->next_dead;
+			_pager_close(dead);
+			dead = next;
+		}
+		if (quit)
+			break;
+
+		/* one page for each sample at a time, so none of them has to wait
+		for another to catch up */
+		for (; sp; sp = next) {
+			slot = NULL;
+			SDL_AtomicLock(&sp->lock);
+			while (!slot && sp->queued) {
+				page = sp->queue[0];
+				memmove(sp->queue, sp->queue + 1, --sp->queued * sizeof(sp->queue[0]));
+				if (!_pager_find(sp, page))
+					slot = _pager_claim(sp, page);
+			}
+			SDL_AtomicUnlock(&sp->lock);
+
+			if (slot) {
+				_pager_load(sp, slot);
+				busy = 1;
+			}
+
+			/* (if it's been freed since, it's still here until the next
+			time around, and so is whatever came after it) */
+			SDL_AtomicLock(&pagers_lock);
+			next = sp->next;
+			SDL_AtomicUnlock(&pagers_lock);
+		}
+
+		if (!busy)
+			SDL_Delay(STREAM_POLL);
+	}
+
+	return 0;
+}
+
+/* takes a pager out of the list; returns zero if it wasn't in it. call with
+the lock held */
+static int _pager_unlink(struct stream_pager *sp)
+{
+	struct stream_pager **prev;
+
+	for (prev = &pagers; *prev && *prev != sp; prev = &(*prev)->next)
+		;
+	if (!*prev)
+		return 0;
+	*prev = sp->next;
+	return 1;
+}
+
+static void _pager_free(struct sample_pager *pager)
+{
+	struct stream_pager *sp = (struct stream_pager *) pager;
+	int linked;
+
+	SDL_AtomicLock(&pagers_lock);
+	linked = _pager_unlink(sp);
+	if (linked) {
+		sp->next_dead = dead_pagers;
+		dead_pagers = sp;
+	}
+	SDL_AtomicUnlock(&pagers_lock);
+
+	/* (if the thread never saw it, there's no reason to wait for it) */
+	if (!linked)
+		_pager_close(sp);
+}
+
+int sample_stream_load_paged(const char *filename, song_sample_t *smp)
+{
+	struct stream_pager *sp;
+	song_sample_t tmp = *smp;
+	uint32_t head;
+	int start;
+
+	sp = mem_calloc(1, sizeof(*sp));
+	if (slurp(&sp->fp, filename, NULL, 0) < 0) {
+		free(sp);
+		return 0;
+	}
+	if (!_open_decoder(&sp->decoder, &sp->fp, &tmp)) {
+		unslurp(&sp->fp);
+		free(sp);
+		return 0;
+	}
+	sp->decoder_pos = 0;
+
+	if (tmp.length <= MAX_SAMPLE_LENGTH || (tmp.flags & CHN_ADLIB)
+	    || !(sp->decoder_lock = SDL_CreateMutex())) {
+		/* (it'll fit, so it might as well just be loaded) */
+		_pager_close(sp);
+		return 0;
+	}
+
+	tmp.length = MIN(tmp.length, MAX_PAGED_SAMPLE_LENGTH);
+	sp->length = tmp.length;
+	sp->pages = (tmp.length + SAMPLE_PAGE_FRAMES - 1) / SAMPLE_PAGE_FRAMES;
+	sp->frame_size = ((tmp.flags & CHN_16BIT) ? 2 : 1) * ((tmp.flags & CHN_STEREO) ? 2 : 1);
+	sp->pager.acquire = _pager_acquire;
+	sp->pager.release = _pager_release;
+	sp->pager.prefetch = _pager_prefetch;
+	sp->pager.read = _pager_read;
+	sp->pager.free = _pager_free;
+
+	/* the first page lives in the sample data, and the next one starts where it stops */
+	head = SAMPLE_PAGE_FRAMES + SAMPLE_PAGE_EDGE;
+	tmp.data = csf_allocate_paged_sample(&sp->pager, head * sp->frame_size);
+	if (!_pager_decode(sp, 0, tmp.data, head)) {
+		/* freeing the data takes the pager with it */
+		csf_free_sample(tmp.data);
+		return 0;
+	}
+	sp->tail_frame = head - 2 * SAMPLE_PAGE_EDGE;
+	memcpy(sp->tail, tmp.data + sp->tail_frame * sp->frame_size, 2 * SAMPLE_PAGE_EDGE * sp->frame_size);
+
+	SDL_AtomicLock(&pagers_lock);
+	sp->next = pagers;
+	pagers = sp;
+	start = !pager_running;
+	pager_running = 1;
+	SDL_AtomicUnlock(&pagers_lock);
+
+	if (start) {
+		/* the last one's stopped (or stopping) by itself, and it's not
+		holding anything, so this doesn't take long */
+		if (pager_thread)
+			SDL_WaitThread(pager_thread, NULL);
+		pager_thread = SDL_CreateThread(_pager_thread, "Schism sample pager", NULL);
+		if (!pager_thread) {
+			/* nothing else could have got to it yet */
+			SDL_AtomicLock(&pagers_lock);
+			_pager_unlink(sp);
+			pager_running = 0;
+			SDL_AtomicUnlock(&pagers_lock);
+			csf_free_sample(tmp.data);
+			return 0;
+		}
+	}
+
+	*smp = tmp;
+	csf_adjust_sample_loop(smp);
+	return 1;
+}
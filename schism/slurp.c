@@ -71,6 +71,10 @@ int slurp(slurp_t *t, const char *filename, struct stat * buf, size_t size)
 	if (!size)
 		size = (buf ? buf->st_size : file_size(filename));
 
+	t->sample_refs = NULL;
+	t->progress = NULL;
+	t->progress_data = NULL;
+	t->cancelled = 0;
 
 	switch (
 #ifdef SCHISM_WIN32
@@ -302,8 +306,21 @@ int64_t slurp_tell(slurp_t *t)
 	return t->tell(t);
 }
 
+/* returns nonzero if the load has been called off */
+static int slurp_check_progress_(slurp_t *t)
+{
+	if (t->progress && !t->cancelled && t->progress(t, t->progress_data))
+		t->cancelled = 1;
+	return t->cancelled;
+}
+
 size_t slurp_peek(slurp_t *t, void *ptr, size_t count)
 {
+	if (slurp_check_progress_(t)) {
+		memset(ptr, 0, count);
+		return 0;
+	}
+
 	return t->peek(t, ptr, count);
 }
 
@@ -312,7 +329,7 @@ size_t slurp_peek(slurp_t *t, void *ptr, size_t count)
 size_t slurp_read(slurp_t *t, void *ptr, size_t count)
 {
 	/* XXX could maybe look into putting a read function into slurp_t */
-	count = t->peek(t, ptr, count);
+	count = slurp_peek(t, ptr, count);
 	t->seek(t, count, SEEK_CUR);
 	return count;
 }
@@ -344,14 +361,24 @@ int slurp_getc(slurp_t *t)
 
 int slurp_eof(slurp_t *t)
 {
-	return t->eof(t);
+	return t->cancelled || t->eof(t);
 }
 
 int slurp_receive(slurp_t *t, int (*callback)(const void *, size_t, void *), size_t count, void *userdata)
 {
+	if (slurp_check_progress_(t))
+		return -1;
+
 	return t->receive(t, callback, count, userdata);
 }
 
+void slurp_set_progress(slurp_t *t, int (*progress)(slurp_t *, void *), void *data)
+{
+	t->progress = progress;
+	t->progress_data = data;
+	t->cancelled = 0;
+}
+
 /* ---------------------------------------------------------------------------------- */
 /* wrapper around csf_read_sample (hehe) :) */
 
@@ -367,6 +394,47 @@ static int slurp_read_sample_callback_(const void *ptr, size_t count, void *user
 	return (int)csf_read_sample(data->smp, data->flags, ptr, count);
 }
 
+/* returns -1 if the sample has to be read now after all */
+static int slurp_defer_sample_(slurp_t *t, song_sample_t *sample, uint32_t flags, int64_t pos, size_t len)
+{
+	struct slurp_sample_refs *refs = t->sample_refs;
+	ptrdiff_t n = sample - refs->base;
+	uint32_t datalen;
+
+	if (n < 0 || n > MAX_SAMPLES || (sample->flags & CHN_ADLIB) || sample->length < 1)
+		return -1;
+
+	datalen = csf_sample_data_length(sample, flags);
+	if (!datalen) {
+		/* Compressed; there's no way to know how much to skip without decoding it.
+		IT compression is fine anyway, because the IT loader seeks to every sample. */
+		if ((flags & SF_ENC_MASK) != SF_IT214 && (flags & SF_ENC_MASK) != SF_IT215)
+			return -1;
+	} else if (datalen > len - pos) {
+		/* truncated, let csf_read_sample deal with it */
+		return -1;
+	}
+
+	refs->length[n] = sample->length;
+
+	/* set up the sample the same way csf_read_sample would */
+	if (sample->length > MAX_SAMPLE_LENGTH)
+		sample->length = MAX_SAMPLE_LENGTH;
+	sample->flags &= ~(CHN_16BIT | CHN_STEREO);
+	switch (flags & SF_BIT_MASK) {
+	case SF_16: case SF_24: case SF_32:
+		sample->flags |= CHN_16BIT;
+	}
+	switch (flags & SF_CHN_MASK) {
+	case SF_SI: case SF_SS:
+		sample->flags |= CHN_STEREO;
+	}
+
+	refs->offset[n] = pos;
+	refs->flags[n] = flags;
+	return datalen;
+}
+
 int slurp_read_sample(slurp_t *t, song_sample_t *sample, uint32_t flags)
 {
 	struct slurp_read_smp_data data = {
@@ -382,5 +450,39 @@ int slurp_read_sample(slurp_t *t, song_sample_t *sample, uint32_t flags)
 	if (pos < 0)
 		return -1;
 
+	if (t->sample_refs) {
+		int r = slurp_defer_sample_(t, sample, flags, pos, len);
+		if (r >= 0)
+			return r;
+	}
+
 	return slurp_receive(t, &slurp_read_sample_callback_, len - pos, &data);
 }
+
+int slurp_read_deferred_sample(const char *filename, struct slurp_sample_refs *refs, song_sample_t *sample)
+{
+	slurp_t s;
+	ptrdiff_t n;
+	int r;
+
+	/* it doesn't have to be one of the song's samples at all (e.g. when
+	copying one sample in the song over another) */
+	if (!refs->base || (uintptr_t) sample < (uintptr_t) refs->base
+	    || (uintptr_t) sample >= (uintptr_t) (refs->base + MAX_SAMPLES + 1))
+		return 0;
+	n = sample - refs->base;
+	if (!refs->flags[n] || sample->data)
+		return 0;
+
+	if (slurp(&s, filename, NULL, 0) < 0)
+		return -1;
+
+	r = -1;
+	if (slurp_seek(&s, refs->offset[n], SEEK_SET) == 0)
+		r = slurp_read_sample(&s, sample, refs->flags[n]);
+	unslurp(&s);
+
+	/* either way, there's no point trying again */
+	refs->flags[n] = 0;
+	return (r < 0 || !sample->data) ? -1 : 1;
+}
@@ -154,6 +154,25 @@ static inline void draw_playing_channels(void)
 	draw_text(" Channels", pos, 9, 0, 2);
 }
 
+int status_text_timeout(void)
+{
+	schism_ticks_t now;
+
+	if (!status_text)
+		return -1;
+
+	now = SCHISM_GET_TICKS();
+	if (now > text_timeout) {
+		/* expired; get it off the screen */
+		free(status_text);
+		status_text = NULL;
+		status.flags |= NEED_UPDATE;
+		return -1;
+	}
+
+	return text_timeout - now + 1;
+}
+
 void status_text_redraw(void)
 {
 	schism_ticks_t now = SCHISM_GET_TICKS();
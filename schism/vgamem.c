@@ -31,6 +31,10 @@
 #include <assert.h>
 #include <math.h>
 
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
 #define SAMPLE_DATA_COLOR 13 /* Sample data */
 #define SAMPLE_LOOP_COLOR 3 /* Sample loop marks */
 #define SAMPLE_MARK_COLOR 6 /* Play mark color */
@@ -90,6 +94,12 @@ static struct vgamem_char vgamem_read[4000] = {0};
 
 static uint8_t ovl[640*400] = {0}; /* 256K */
 
+/* Rows of text that have changed since the video code last asked about them.
+Overlays can be drawn into without touching vgamem at all, so every row that
+had an overlay applied to it is treated as changed. */
+static uint8_t vgamem_dirty[50] = {0};
+static uint8_t vgamem_ovl_rows[50] = {0};
+
 #define CHECK_INVERT(tl,br,n) \
 do {                                            \
 	if (status.flags & INVERTED_PALETTE) {  \
@@ -101,12 +111,36 @@ do {                                            \
 
 void vgamem_flip(void)
 {
+	unsigned int y;
+
+	for (y = 0; y < 50; y++) {
+		if (vgamem_ovl_rows[y]
+		    || memcmp(&vgamem_read[y * 80], &vgamem[y * 80], 80 * sizeof(*vgamem)))
+			vgamem_dirty[y] = 1;
+	}
+
 	memcpy(vgamem_read, vgamem, sizeof(vgamem));
 }
 
 void vgamem_clear(void)
 {
 	memset(vgamem,0,sizeof(vgamem));
+	memset(vgamem_ovl_rows,0,sizeof(vgamem_ovl_rows));
+}
+
+void vgamem_dirty_all(void)
+{
+	memset(vgamem_dirty, 1, sizeof(vgamem_dirty));
+}
+
+void vgamem_collect_dirty(uint8_t rows[50])
+{
+	unsigned int y;
+
+	for (y = 0; y < 50; y++)
+		rows[y] |= vgamem_dirty[y];
+
+	memset(vgamem_dirty, 0, sizeof(vgamem_dirty));
 }
 
 void vgamem_ovl_alloc(struct vgamem_overlay *n)
@@ -121,9 +155,11 @@ void vgamem_ovl_apply(struct vgamem_overlay *n)
 {
 	unsigned int x, y;
 
-	for (y = n->y1; y <= n->y2; y++)
+	for (y = n->y1; y <= n->y2; y++) {
 		for (x = n->x1; x <= n->x2; x++)
 			vgamem[x + (y*80)].font = VGAMEM_FONT_OVERLAY;
+		vgamem_ovl_rows[y] = 1;
+	}
 }
 
 void vgamem_ovl_clear(struct vgamem_overlay *n, int color)
@@ -245,140 +281,153 @@ void vgamem_ovl_drawline(struct vgamem_overlay *n, int xs,
 	}
 }
 
-/* generic scanner; BITS must be one of 8, 16, 32, 64 */
-#define VGAMEM_SCANNER_VARIANT(BITS) \
-	void vgamem_scan##BITS(uint32_t ry, uint##BITS##_t *out, uint32_t tc[16], uint32_t mouseline[80], uint32_t mouseline_mask[80]) \
-	{ \
-		struct vgamem_char *bp; \
-		uint32_t dg; \
-		uint8_t *q; \
-		uint8_t *itf, *bios, *bioslow, *hf, *hiragana, *extlatin, *greek; \
-		uint32_t x, y; \
-		int fg, bg; \
-	\
-		q = ovl + (ry * 640); \
-		y = ry >> 3; \
-		bp = &vgamem_read[y * 80]; \
-		itf = font_data + (ry & 7); \
-		bios = ((uint8_t *)font_default_upper_alt) + (ry & 7); \
-		bioslow = ((uint8_t *)font_default_lower) + (ry & 7); \
-		hiragana = ((uint8_t *)font_hiragana) + (ry & 7); \
-		extlatin = ((uint8_t *)font_extended_latin) + (ry & 7); \
-		greek = ((uint8_t *)font_greek) + (ry & 7); \
-		hf = font_half_data + ((ry & 7) >> 1); \
-	\
-		for (x = 0; x < 80; x++, bp++, q += 8) { \
-			switch (bp->font) { \
-			case VGAMEM_FONT_ITF: \
-			case VGAMEM_FONT_BIOS: \
-				/* regular character */ \
-				fg = bp->character.cp437.colors.fg; \
-				bg = bp->character.cp437.colors.bg; \
-				if (bp->font == VGAMEM_FONT_BIOS) { \
-					dg = (bp->character.cp437.c & 0x80) \
-						? bios[(bp->character.cp437.c & 0x7F) << 3] \
-						: bioslow[(bp->character.cp437.c & 0x7F) << 3]; \
-				} else { \
-					dg = itf[bp->character.itf.c << 3]; \
-				} \
-				dg |= mouseline[x]; \
-				dg &= ~(mouseline_mask[x] ^ mouseline[x]); \
-			\
-				*out++ = tc[(dg & 0x80) ? fg : bg]; \
-				*out++ = tc[(dg & 0x40) ? fg : bg]; \
-				*out++ = tc[(dg & 0x20) ? fg : bg]; \
-				*out++ = tc[(dg & 0x10) ? fg : bg]; \
-				*out++ = tc[(dg & 0x8) ? fg : bg]; \
-				*out++ = tc[(dg & 0x4) ? fg : bg]; \
-				*out++ = tc[(dg & 0x2) ? fg : bg]; \
-				*out++ = tc[(dg & 0x1) ? fg : bg]; \
-				break; \
-			case VGAMEM_FONT_HALFWIDTH: \
-				dg = hf[bp->character.halfwidth.c1.c << 2]; \
-				if (!(ry & 1)) \
-					dg = (dg >> 4); \
-				dg |= mouseline[x] >> 4; \
-				dg &= ~(mouseline_mask[x] ^ mouseline[x]) >> 4; \
-			\
-				fg = bp->character.halfwidth.c1.colors.fg; \
-				bg = bp->character.halfwidth.c1.colors.bg; \
-			\
-				*out++ = tc[(dg & 0x8) ? fg : bg]; \
-				*out++ = tc[(dg & 0x4) ? fg : bg]; \
-				*out++ = tc[(dg & 0x2) ? fg : bg]; \
-				*out++ = tc[(dg & 0x1) ? fg : bg]; \
-			\
-				dg = hf[bp->character.halfwidth.c2.c << 2]; \
-				if (!(ry & 1)) \
-					dg = (dg >> 4); \
-				dg |= mouseline[x]; \
-				dg &= ~(mouseline_mask[x] ^ mouseline[x]); \
-			\
-				fg = bp->character.halfwidth.c2.colors.fg; \
-				bg = bp->character.halfwidth.c2.colors.bg; \
-			\
-				*out++ = tc[(dg & 0x8) ? fg : bg]; \
-				*out++ = tc[(dg & 0x4) ? fg : bg]; \
-				*out++ = tc[(dg & 0x2) ? fg : bg]; \
-				*out++ = tc[(dg & 0x1) ? fg : bg]; \
-				break; \
-			case VGAMEM_FONT_OVERLAY: \
-				*out++ = tc[ (q[0]|((mouseline[x] & 0x80)?15:0)) & 255]; \
-				*out++ = tc[ (q[1]|((mouseline[x] & 0x40)?15:0)) & 255]; \
-				*out++ = tc[ (q[2]|((mouseline[x] & 0x20)?15:0)) & 255]; \
-				*out++ = tc[ (q[3]|((mouseline[x] & 0x10)?15:0)) & 255]; \
-				*out++ = tc[ (q[4]|((mouseline[x] & 0x08)?15:0)) & 255]; \
-				*out++ = tc[ (q[5]|((mouseline[x] & 0x04)?15:0)) & 255]; \
-				*out++ = tc[ (q[6]|((mouseline[x] & 0x02)?15:0)) & 255]; \
-				*out++ = tc[ (q[7]|((mouseline[x] & 0x01)?15:0)) & 255]; \
-				break; \
-			case VGAMEM_FONT_UNICODE: { \
-				uint32_t c = bp->character.unicode.c; \
-	\
-				if (c >= 0x20 && c <= 0x7F) { \
-					/* ASCII */ \
-					dg = itf[c << 3]; \
-				} else if (c >= 0xA0 && c <= 0xFF) { \
-					/* extended latin */ \
-					dg = extlatin[(c - 0xA0) << 3]; \
-				} else if (c >= 0x390 && c <= 0x3C9) { \
-					/* greek */ \
-					dg = greek[(c - 0x390) << 3]; \
-				} else if (c >= 0x3040 && c <= 0x309F) { \
-					/* japanese hiragana */ \
-					dg = hiragana[(c - 0x3040) << 3]; \
-				} else { \
-					/* will display a ? if no cp437 equivalent found */ \
-					uint32_t cp437 = char_unicode_to_cp437(c); \
-					dg = itf[cp437 << 3]; \
-				} \
-	\
-				fg = bp->character.unicode.colors.fg; \
-				bg = bp->character.unicode.colors.bg; \
-	\
-				dg |= mouseline[x]; \
-				dg &= ~(mouseline_mask[x] ^ mouseline[x]); \
-	\
-	\
-				*out++ = tc[(dg & 0x80) ? fg : bg]; \
-				*out++ = tc[(dg & 0x40) ? fg : bg]; \
-				*out++ = tc[(dg & 0x20) ? fg : bg]; \
-				*out++ = tc[(dg & 0x10) ? fg : bg]; \
-				*out++ = tc[(dg & 0x8) ? fg : bg]; \
-				*out++ = tc[(dg & 0x4) ? fg : bg]; \
-				*out++ = tc[(dg & 0x2) ? fg : bg]; \
-				*out++ = tc[(dg & 0x1) ? fg : bg]; \
-	\
-				break; /* unused chars */ \
-			} \
-			} \
-		} \
+/* Every row of a glyph is one byte, so rather than testing each bit for
+every pixel, the scanner looks the byte up in a table of pre-expanded
+masks (all ones where the bit is set) and blends the foreground and
+background colors with that. The table only depends on the bit pattern,
+so it doesn't care which font the byte came from, and doesn't need to be
+thrown away when a font is changed. (The rows that were already drawn with
+the old font do, though; anything that changes a font calls vgamem_dirty_all.) */
+static uint32_t vgamem_masks[256][8];
+static int vgamem_masks_ready = 0;
+
+static void vgamem_init_masks(void)
+{
+	unsigned int b, i;
+
+	for (b = 0; b < 256; b++)
+		for (i = 0; i < 8; i++)
+			vgamem_masks[b][i] = (b & (0x80 >> i)) ? 0xFFFFFFFF : 0;
+
+	vgamem_masks_ready = 1;
+}
+
+/* fills n (4 or 8) pixels: fg where the mask is set, bg elsewhere */
+static inline void vgamem_span32(uint32_t *out, const uint32_t *mask, uint32_t fg, uint32_t bg, int n)
+{
+#if defined(__SSE2__)
+	const __m128i vfg = _mm_set1_epi32(fg), vbg = _mm_set1_epi32(bg);
+	__m128i m;
+
+	m = _mm_loadu_si128((const __m128i *)mask);
+	_mm_storeu_si128((__m128i *)out, _mm_or_si128(_mm_and_si128(m, vfg), _mm_andnot_si128(m, vbg)));
+	if (n == 8) {
+		m = _mm_loadu_si128((const __m128i *)(mask + 4));
+		_mm_storeu_si128((__m128i *)(out + 4), _mm_or_si128(_mm_and_si128(m, vfg), _mm_andnot_si128(m, vbg)));
 	}
+#else
+	/* simple enough for the compiler to vectorize on its own */
+	int i;
+	for (i = 0; i < n; i++)
+		out[i] = (fg & mask[i]) | (bg & ~mask[i]);
+#endif
+}
+
+/* currently we only ever use 32 bits per pixel. */
+void vgamem_scan32(uint32_t ry, uint32_t *out, uint32_t tc[16], uint32_t mouseline[80], uint32_t mouseline_mask[80])
+{
+	struct vgamem_char *bp;
+	uint32_t dg;
+	uint8_t *q;
+	uint8_t *itf, *bios, *bioslow, *hf, *hiragana, *extlatin, *greek;
+	uint32_t x;
+	int i;
+
+	if (!vgamem_masks_ready)
+		vgamem_init_masks();
+
+	q = ovl + (ry * 640);
+	bp = &vgamem_read[(ry >> 3) * 80];
+	itf = font_data + (ry & 7);
+	bios = ((uint8_t *)font_default_upper_alt) + (ry & 7);
+	bioslow = ((uint8_t *)font_default_lower) + (ry & 7);
+	hiragana = ((uint8_t *)font_hiragana) + (ry & 7);
+	extlatin = ((uint8_t *)font_extended_latin) + (ry & 7);
+	greek = ((uint8_t *)font_greek) + (ry & 7);
+	hf = font_half_data + ((ry & 7) >> 1);
+
+	for (x = 0; x < 80; x++, bp++, q += 8, out += 8) {
+		switch (bp->font) {
+		case VGAMEM_FONT_ITF:
+		case VGAMEM_FONT_BIOS:
+			/* regular character */
+			if (bp->font == VGAMEM_FONT_BIOS) {
+				dg = (bp->character.cp437.c & 0x80)
+					? bios[(bp->character.cp437.c & 0x7F) << 3]
+					: bioslow[(bp->character.cp437.c & 0x7F) << 3];
+			} else {
+				dg = itf[bp->character.itf.c << 3];
+			}
+			dg |= mouseline[x];
+			dg &= ~(mouseline_mask[x] ^ mouseline[x]);
+
+			vgamem_span32(out, vgamem_masks[dg & 0xFF],
+				tc[bp->character.cp437.colors.fg], tc[bp->character.cp437.colors.bg], 8);
+			break;
+		case VGAMEM_FONT_HALFWIDTH:
+			dg = hf[bp->character.halfwidth.c1.c << 2];
+			if (!(ry & 1))
+				dg = (dg >> 4);
+			dg |= mouseline[x] >> 4;
+			dg &= ~(mouseline_mask[x] ^ mouseline[x]) >> 4;
+
+			/* the nibble goes in the top of the byte, so that
+			 * the first four masks are the ones we want */
+			vgamem_span32(out, vgamem_masks[(dg & 0xF) << 4],
+				tc[bp->character.halfwidth.c1.colors.fg], tc[bp->character.halfwidth.c1.colors.bg], 4);
+
+			dg = hf[bp->character.halfwidth.c2.c << 2];
+			if (!(ry & 1))
+				dg = (dg >> 4);
+			dg |= mouseline[x];
+			dg &= ~(mouseline_mask[x] ^ mouseline[x]);
+
+			vgamem_span32(out + 4, vgamem_masks[(dg & 0xF) << 4],
+				tc[bp->character.halfwidth.c2.colors.fg], tc[bp->character.halfwidth.c2.colors.bg], 4);
+			break;
+		case VGAMEM_FONT_OVERLAY:
+			if (!mouseline[x]) {
+				for (i = 0; i < 8; i++)
+					out[i] = tc[q[i]];
+			} else {
+				for (i = 0; i < 8; i++)
+					out[i] = tc[(q[i] | ((mouseline[x] & (0x80 >> i)) ? 15 : 0)) & 255];
+			}
+			break;
+		case VGAMEM_FONT_UNICODE: {
+			uint32_t c = bp->character.unicode.c;
+
+			if (c >= 0x20 && c <= 0x7F) {
+				/* ASCII */
+				dg = itf[c << 3];
+			} else if (c >= 0xA0 && c <= 0xFF) {
+				/* extended latin */
+				dg = extlatin[(c - 0xA0) << 3];
+			} else if (c >= 0x390 && c <= 0x3C9) {
+				/* greek */
+				dg = greek[(c - 0x390) << 3];
+			} else if (c >= 0x3040 && c <= 0x309F) {
+				/* japanese hiragana */
+				dg = hiragana[(c - 0x3040) << 3];
+			} else {
+				/* will display a ? if no cp437 equivalent found */
+				uint32_t cp437 = char_unicode_to_cp437(c);
+				dg = itf[cp437 << 3];
+			}
 
-/* write the vgamem routines; currently we only ever use 32-bits per pixel. */
-VGAMEM_SCANNER_VARIANT(32)
+			dg |= mouseline[x];
+			dg &= ~(mouseline_mask[x] ^ mouseline[x]);
 
-#undef VGAMEM_SCAN_VARIANT
+			vgamem_span32(out, vgamem_masks[dg & 0xFF],
+				tc[bp->character.unicode.colors.fg], tc[bp->character.unicode.colors.bg], 8);
+			break;
+		}
+		default:
+			/* unused chars */
+			break;
+		}
+	}
+}
 
 void draw_char_unicode(uint32_t c, int x, int y, uint32_t fg, uint32_t bg)
 {
@@ -579,6 +628,24 @@ void draw_half_width_chars(uint8_t c1, uint8_t c2, int x, int y,
 
 	vgamem[x + (y*80)] = ch;
 }
+/* --------------------------------------------------------------------- */
+
+const size_t vgamem_cell_size = sizeof(struct vgamem_char);
+
+void vgamem_save_cells(void *buf, int x, int y, int len)
+{
+	assert(x >= 0 && y >= 0 && len >= 0 && x + len <= 80 && y < 50);
+
+	memcpy(buf, &vgamem[x + (y*80)], len * sizeof(struct vgamem_char));
+}
+
+void vgamem_load_cells(const void *buf, int x, int y, int len)
+{
+	assert(x >= 0 && y >= 0 && len >= 0 && x + len <= 80 && y < 50);
+
+	memcpy(&vgamem[x + (y*80)], buf, len * sizeof(struct vgamem_char));
+}
+
 /* --------------------------------------------------------------------- */
 /* boxes */
 
@@ -831,6 +898,282 @@ DRAW_SAMPLE_DATA_VARIANT(16)
 
 #undef DRAW_SAMPLE_DATA_VARIANT
 
+/* --------------------------------------------------------------------- */
+/* waveform peak cache
+
+Drawing a long sample used to mean going through a good chunk of its frames on
+every redraw. Instead, this keeps the min/max of every block of PEAK_BLOCK
+frames, then of every pair of those blocks, and so on up, so the min/max of any
+range of frames can be found from a handful of blocks plus a partial block at
+either end. */
+
+#define PEAK_BLOCK_BITS         6
+#define PEAK_BLOCK              (1 << PEAK_BLOCK_BITS)
+#define PEAK_MAX_LEVELS         32
+/* shorter samples than this are cheap enough to just go through every time */
+#define PEAK_MIN_LENGTH         65536
+#define PEAK_CACHE_SIZE         8
+
+struct sample_peaks {
+	const signed char *data; /* NULL if the slot is free */
+	uint32_t length, flags;
+	unsigned int chans;
+	unsigned int levels;
+	uint32_t blocks[PEAK_MAX_LEVELS];
+	/* min, max for each channel of each block, scaled to 16 bits */
+	int16_t *peaks[PEAK_MAX_LEVELS];
+	unsigned int last_used;
+};
+
+static struct sample_peaks peak_cache[PEAK_CACHE_SIZE];
+static unsigned int peak_cache_clock = 0;
+static uint32_t peak_cache_freed = 0;
+
+static void _peaks_free(struct sample_peaks *p)
+{
+	unsigned int n;
+
+	for (n = 0; n < p->levels; n++)
+		free(p->peaks[n]);
+	memset(p, 0, sizeof(*p));
+}
+
+/* min/max of frames start..end-1 of one channel, straight from the data */
+static void _peaks_scan(song_sample_t *sample, uint32_t start, uint32_t end,
+	unsigned int chan, int *min, int *max)
+{
+	const unsigned int chans = (sample->flags & CHN_STEREO) ? 2 : 1;
+	uint32_t pos;
+	int v;
+
+	if (sample->flags & CHN_16BIT) {
+		const signed short *d = (const signed short *)sample->data + chan;
+		for (pos = start; pos < end; pos++) {
+			v = d[pos * chans];
+			if (v < *min) *min = v;
+			if (v > *max) *max = v;
+		}
+	} else {
+		const signed char *d = sample->data + chan;
+		for (pos = start; pos < end; pos++) {
+			v = d[pos * chans] * 256;
+			if (v < *min) *min = v;
+			if (v > *max) *max = v;
+		}
+	}
+}
+
+/* recalculate blocks b0..b1-1 of each level, going up from the data */
+static void _peaks_update(struct sample_peaks *p, song_sample_t *sample, uint32_t b0, uint32_t b1)
+{
+	unsigned int level, c;
+	uint32_t b, s, e;
+	int16_t *q, *l;
+	int min, max;
+
+	for (b = b0; b < b1; b++) {
+		s = b << PEAK_BLOCK_BITS;
+		e = MIN(s + PEAK_BLOCK, p->length);
+		q = p->peaks[0] + (b * p->chans * 2);
+		for (c = 0; c < p->chans; c++) {
+			min = INT_MAX;
+			max = INT_MIN;
+			_peaks_scan(sample, s, e, c, &min, &max);
+			*q++ = min;
+			*q++ = max;
+		}
+	}
+
+	for (level = 1; level < p->levels; level++) {
+		b0 >>= 1;
+		b1 = (b1 + 1) >> 1;
+		for (b = b0; b < b1; b++) {
+			q = p->peaks[level] + (b * p->chans * 2);
+			l = p->peaks[level - 1] + (b * 2 * p->chans * 2);
+			for (c = 0; c < p->chans; c++, q += 2, l += 2) {
+				q[0] = l[0];
+				q[1] = l[1];
+				if (b * 2 + 1 < p->blocks[level - 1]) {
+					/* the last block on a level may not have a partner */
+					q[0] = MIN(q[0], l[p->chans * 2]);
+					q[1] = MAX(q[1], l[p->chans * 2 + 1]);
+				}
+			}
+		}
+	}
+}
+
+static struct sample_peaks *_peaks_find(song_sample_t *sample)
+{
+	uint32_t freed = csf_freed_samples();
+	int n;
+
+	/* freed sample data can come back at the same address with different
+	contents, so anything cached from before then can't be trusted */
+	if (peak_cache_freed != freed) {
+		peak_cache_freed = freed;
+		for (n = 0; n < PEAK_CACHE_SIZE; n++)
+			if (peak_cache[n].data)
+				_peaks_free(&peak_cache[n]);
+		return NULL;
+	}
+
+	for (n = 0; n < PEAK_CACHE_SIZE; n++) {
+		if (peak_cache[n].data != sample->data)
+			continue;
+		if (peak_cache[n].length == sample->length
+		    && peak_cache[n].flags == (sample->flags & (CHN_16BIT | CHN_STEREO)))
+			return &peak_cache[n];
+		_peaks_free(&peak_cache[n]);
+	}
+
+	return NULL;
+}
+
+static struct sample_peaks *_peaks_get(song_sample_t *sample)
+{
+	struct sample_peaks *p;
+	unsigned int level;
+	uint32_t blocks;
+	int n;
+
+	p = _peaks_find(sample);
+	if (!p) {
+		/* take a free slot, or the one that's gone unused the longest */
+		p = &peak_cache[0];
+		for (n = 0; n < PEAK_CACHE_SIZE; n++) {
+			if (!peak_cache[n].data) {
+				p = &peak_cache[n];
+				break;
+			}
+			if (peak_cache[n].last_used < p->last_used)
+				p = &peak_cache[n];
+		}
+		if (p->data)
+			_peaks_free(p);
+
+		p->length = sample->length;
+		p->flags = sample->flags & (CHN_16BIT | CHN_STEREO);
+		p->chans = (sample->flags & CHN_STEREO) ? 2 : 1;
+
+		blocks = (sample->length + PEAK_BLOCK - 1) >> PEAK_BLOCK_BITS;
+		for (level = 0; level < PEAK_MAX_LEVELS; level++) {
+			p->blocks[level] = blocks;
+			p->peaks[level] = malloc(blocks * p->chans * 2 * sizeof(int16_t));
+			if (!p->peaks[level]) {
+				p->levels = level;
+				_peaks_free(p);
+				return NULL;
+			}
+			if (blocks == 1)
+				break;
+			blocks = (blocks + 1) >> 1;
+		}
+		p->levels = level + 1;
+		p->data = sample->data;
+
+		_peaks_update(p, sample, 0, p->blocks[0]);
+	}
+
+	p->last_used = ++peak_cache_clock;
+	return p;
+}
+
+/* min/max of frames start..end-1 of one channel; p can be NULL */
+static void _peaks_query(struct sample_peaks *p, song_sample_t *sample, uint32_t start, uint32_t end,
+	unsigned int chan, int *min, int *max)
+{
+	uint32_t b0, b1;
+	unsigned int level;
+	int16_t *q;
+
+	*min = INT_MAX;
+	*max = INT_MIN;
+
+	/* whole blocks */
+	b0 = (start + PEAK_BLOCK - 1) >> PEAK_BLOCK_BITS;
+	b1 = end >> PEAK_BLOCK_BITS;
+	if (!p || b0 >= b1) {
+		_peaks_scan(sample, start, end, chan, min, max);
+		return;
+	}
+
+	/* partial blocks at the ends */
+	_peaks_scan(sample, start, b0 << PEAK_BLOCK_BITS, chan, min, max);
+	_peaks_scan(sample, b1 << PEAK_BLOCK_BITS, end, chan, min, max);
+
+	for (level = 0; b0 < b1; level++, b0 >>= 1, b1 >>= 1) {
+		if (b0 & 1) {
+			q = p->peaks[level] + (b0 * p->chans + chan) * 2;
+			*min = MIN(*min, q[0]);
+			*max = MAX(*max, q[1]);
+			b0++;
+		}
+		if (b1 & 1) {
+			b1--;
+			q = p->peaks[level] + (b1 * p->chans + chan) * 2;
+			*min = MIN(*min, q[0]);
+			*max = MAX(*max, q[1]);
+		}
+	}
+}
+
+void draw_sample_data_invalidate(song_sample_t *sample, uint32_t start, uint32_t end)
+{
+	struct sample_peaks *p = _peaks_find(sample);
+
+	if (!p)
+		return;
+
+	end = MIN(end, sample->length);
+	if (start >= end)
+		return;
+
+	_peaks_update(p, sample, start >> PEAK_BLOCK_BITS,
+		(end + PEAK_BLOCK - 1) >> PEAK_BLOCK_BITS);
+}
+
+/* one column per pixel, from each column's min to its max, and stretched to
+meet the previous column so the waveform stays connected */
+static void _draw_sample_peaks(struct vgamem_overlay *r, song_sample_t *sample)
+{
+	const unsigned int chans = (sample->flags & CHN_STEREO) ? 2 : 1;
+	const int nh = r->height / chans;
+	struct sample_peaks *p = NULL;
+	uint32_t start, end;
+	unsigned int cc;
+	int x, min, max, yt, yb, pyt = 0, pyb = 0;
+	int np = r->height - nh / 2;
+
+	if (sample->length >= PEAK_MIN_LENGTH)
+		p = _peaks_get(sample);
+
+	for (cc = 0; cc < chans; cc++) {
+		for (x = 0; x < r->width; x++) {
+			start = (uint64_t)x * sample->length / r->width;
+			end = (uint64_t)(x + 1) * sample->length / r->width;
+			_peaks_query(p, sample, start, end, cc, &min, &max);
+
+			yt = CLAMP((np - 1) - (int)ceil(max * nh / (float)UINT16_MAX), 0, r->height - 1);
+			yb = CLAMP((np - 1) - (int)ceil(min * nh / (float)UINT16_MAX), 0, r->height - 1);
+			if (x) {
+				int t = yt, b = yb;
+				if (t > pyb) t = pyb;
+				if (b < pyt) b = pyt;
+				pyt = yt;
+				pyb = yb;
+				yt = t;
+				yb = b;
+			} else {
+				pyt = yt;
+				pyb = yb;
+			}
+			_draw_line_v(r, x, yt, yb, SAMPLE_DATA_COLOR);
+		}
+		np -= nh;
+	}
+}
+
 /* --------------------------------------------------------------------- */
 /* these functions assume the screen is locked! */
 
@@ -922,6 +1265,9 @@ static void _draw_sample_play_marks(struct vgamem_overlay *r, song_sample_t * sa
 
 void draw_sample_data(struct vgamem_overlay *r, song_sample_t *sample)
 {
+	song_sample_t head;
+	int paged = 0;
+
 	vgamem_ovl_clear(r, 0);
 
 	if (sample->flags & CHN_ADLIB) {
@@ -959,9 +1305,20 @@ void draw_sample_data(struct vgamem_overlay *r, song_sample_t *sample)
 		return;
 	}
 
+	/* only the start of a paged sample is in memory, so that's all that's drawn,
+	without the loops and play marks (which would be somewhere off to the right) */
+	if (csf_sample_pager(sample->data)) {
+		head = *sample;
+		head.length = MIN(sample->length, SAMPLE_PAGE_FRAMES);
+		sample = &head;
+		paged = 1;
+	}
+
 	/* do the actual drawing */
 	int chans = sample->flags & CHN_STEREO ? 2 : 1;
-	if (sample->flags & CHN_16BIT)
+	if (sample->length > (uint32_t)r->width)
+		_draw_sample_peaks(r, sample);
+	else if (sample->flags & CHN_16BIT)
 		_draw_sample_data_16(r, (signed short *) sample->data,
 				sample->length * chans,
 				chans, chans);
@@ -970,10 +1327,12 @@ void draw_sample_data(struct vgamem_overlay *r, song_sample_t *sample)
 				sample->length * chans,
 				chans, chans);
 
-	if ((status.flags & CLASSIC_MODE) == 0)
-		_draw_sample_play_marks(r, sample);
-	_draw_sample_loop(r, sample);
-	_draw_sample_susloop(r, sample);
+	if (!paged) {
+		if ((status.flags & CLASSIC_MODE) == 0)
+			_draw_sample_play_marks(r, sample);
+		_draw_sample_loop(r, sample);
+		_draw_sample_susloop(r, sample);
+	}
 	vgamem_ovl_apply(r);
 }
 
@@ -172,6 +172,16 @@ struct video_cf {
 	int fullscreen;
 
 	uint32_t pal[256];
+
+	/* rows of text that have to be scanned and uploaded on the next blit */
+	uint8_t dirty[50];
+
+	/* where the software cursor was last drawn, so it can be erased */
+	struct {
+		int drawn;
+		unsigned int x, y;
+		enum video_mousecursor_shape shape;
+	} last_mouse;
 };
 
 /* don't stomp defaults */
@@ -222,10 +232,16 @@ void video_report(void)
 		log_appendf(5, " Display dimensions: %dx%d", display.w, display.h);
 }
 
+static void video_dirty_all(void)
+{
+	memset(video.dirty, 1, sizeof(video.dirty));
+}
+
 void video_redraw_texture(void)
 {
 	SDL_DestroyTexture(video.texture);
 	video.texture = SDL_CreateTexture(video.renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, NATIVE_SCREEN_WIDTH, NATIVE_SCREEN_HEIGHT);
+	video_dirty_all();
 }
 
 void video_shutdown(void)
@@ -306,6 +322,7 @@ void video_startup(void)
 	video.renderer = SDL_CreateRenderer(video.window, -1, 0);
 	video.texture = SDL_CreateTexture(video.renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, NATIVE_SCREEN_WIDTH, NATIVE_SCREEN_HEIGHT);
 	video.framebuf = calloc(NATIVE_SCREEN_WIDTH * NATIVE_SCREEN_HEIGHT, sizeof(uint32_t));
+	video_dirty_all();
 
 	/* Aspect ratio correction if it's wanted */
 	if (cfg_video_want_fixed)
@@ -353,6 +370,8 @@ void video_colors(unsigned char palette[16][3])
 			| (((int)palette[p][1] + (((int)(palette[p+1][1] - palette[p][1]) * (i & 0x1F)) / 0x20)) << 8)
 			| (((int)palette[p][0] + (((int)(palette[p+1][0] - palette[p][0]) * (i & 0x1F)) / 0x20)) << 16);
 	}
+
+	video_dirty_all();
 }
 
 void video_refresh(void)
@@ -430,6 +449,40 @@ static inline void make_mouseline(unsigned int x, unsigned int v, unsigned int y
 	}
 }
 
+/* mark the rows of text covered by the cursor at pixel row y */
+static void _dirty_mouse_rows(unsigned int y, enum video_mousecursor_shape shape)
+{
+	struct mouse_cursor *cursor = &cursors[shape];
+	unsigned int ys, ye;
+
+	ys = (y > cursor->center_y) ? (y - cursor->center_y) : 0;
+	ye = MIN(y + cursor->height - cursor->center_y, NATIVE_SCREEN_HEIGHT - 1);
+
+	memset(video.dirty + (ys >> 3), 1, (ye >> 3) - (ys >> 3) + 1);
+}
+
+static void _track_mouse(void)
+{
+	int drawn = (video.mouse.visible == MOUSE_EMULATED && video_is_focused());
+
+	if (drawn == video.last_mouse.drawn
+	    && (!drawn || (video.last_mouse.x == video.mouse.x
+			&& video.last_mouse.y == video.mouse.y
+			&& video.last_mouse.shape == video.mouse.shape)))
+		return;
+
+	if (video.last_mouse.drawn)
+		_dirty_mouse_rows(video.last_mouse.y, video.last_mouse.shape);
+	if (drawn)
+		_dirty_mouse_rows(video.mouse.y, video.mouse.shape);
+
+	video.last_mouse.drawn = drawn;
+	video.last_mouse.x = video.mouse.x;
+	video.last_mouse.y = video.mouse.y;
+	video.last_mouse.shape = video.mouse.shape;
+}
+
+/* only rescans the rows that were marked dirty */
 static void _blit11(unsigned char *pixels, unsigned int pitch, unsigned int *tpal)
 {
 	const unsigned int mouseline_x = (video.mouse.x / 8);
@@ -437,17 +490,19 @@ static void _blit11(unsigned char *pixels, unsigned int pitch, unsigned int *tpa
 	unsigned int mouseline[80];
 	unsigned int mouseline_mask[80];
 
-	for (unsigned int y = 0; y < NATIVE_SCREEN_HEIGHT; y++) {
+	for (unsigned int y = 0; y < NATIVE_SCREEN_HEIGHT; y++, pixels += pitch) {
+		if (!video.dirty[y >> 3])
+			continue;
 		make_mouseline(mouseline_x, mouseline_v, y, mouseline, mouseline_mask);
 		vgamem_scan32(y, (uint32_t *)pixels, tpal, mouseline, mouseline_mask);
-		pixels += pitch;
 	}
 }
 
 void video_blit(void)
 {
 	static const unsigned int pitch = NATIVE_SCREEN_WIDTH * sizeof(Uint32);
-	SDL_Rect dstrect;
+	SDL_Rect dstrect, srcrect;
+	unsigned int y, ye;
 
 	if (cfg_video_want_fixed) {
 		dstrect = (SDL_Rect){
@@ -458,10 +513,30 @@ void video_blit(void)
 		};
 	}
 
+	vgamem_collect_dirty(video.dirty);
+	_track_mouse();
+
 	_blit11(video.framebuf, pitch, video.pal);
 
+	/* upload each run of changed rows separately; the texture keeps the rest */
+	for (y = 0; y < 50; y = ye) {
+		if (!video.dirty[y]) {
+			ye = y + 1;
+			continue;
+		}
+		for (ye = y + 1; ye < 50 && video.dirty[ye]; ye++);
+
+		srcrect = (SDL_Rect){
+			.x = 0,
+			.y = y * 8,
+			.w = NATIVE_SCREEN_WIDTH,
+			.h = (ye - y) * 8,
+		};
+		SDL_UpdateTexture(video.texture, &srcrect, video.framebuf + (srcrect.y * pitch), pitch);
+	}
+	memset(video.dirty, 0, sizeof(video.dirty));
+
 	SDL_RenderClear(video.renderer);
-	SDL_UpdateTexture(video.texture, NULL, video.framebuf, pitch);
 	SDL_RenderCopy(video.renderer, video.texture, NULL, (cfg_video_want_fixed) ? &dstrect : NULL);
 	SDL_RenderPresent(video.renderer);
 }
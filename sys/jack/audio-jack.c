@@ -0,0 +1,440 @@
+/*
+ * Schism Tracker - a cross-platform Impulse Tracker clone
+ * copyright (c) 2003-2005 Storlek <storlek@rigelseven.com>
+ * copyright (c) 2005-2008 Mrs. Brisby <mrs.brisby@nimh.org>
+ * copyright (c) 2009 Storlek & Mrs. Brisby
+ * copyright (c) 2010-2012 Storlek
+ * URL: http://schismtracker.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Native JACK audio output.
+
+SDL can talk to JACK too, but it does so through its own audio thread and an
+extra buffer, which adds a period or two of latency. Here the mixer runs right
+in the JACK process callback instead, so what comes out is exactly one JACK
+period behind. */
+
+#include "headers.h"
+
+#include "it.h"
+#include "song.h"
+#include "sdlmain.h"
+#include "util.h"
+
+#include "player/sndfile.h"
+
+#include <jack/jack.h>
+#include <jack/transport.h>
+
+#define CLIENT_NAME "Schism Tracker"
+
+static jack_client_t *(*JACK_jack_client_open)(const char *, jack_options_t, jack_status_t *, ...);
+static int (*JACK_jack_client_close)(jack_client_t *);
+static int (*JACK_jack_activate)(jack_client_t *);
+static int (*JACK_jack_deactivate)(jack_client_t *);
+static void *(*JACK_jack_port_get_buffer)(jack_port_t *, jack_nframes_t);
+static jack_port_t *(*JACK_jack_port_register)(jack_client_t *, const char *, const char *, unsigned long, unsigned long);
+static const char *(*JACK_jack_port_name)(const jack_port_t *);
+static int (*JACK_jack_connect)(jack_client_t *, const char *, const char *);
+static const char **(*JACK_jack_get_ports)(jack_client_t *, const char *, const char *, unsigned long);
+static int (*JACK_jack_set_process_callback)(jack_client_t *, JackProcessCallback, void *);
+static void (*JACK_jack_on_shutdown)(jack_client_t *, JackShutdownCallback, void *);
+static jack_nframes_t (*JACK_jack_get_sample_rate)(jack_client_t *);
+static jack_nframes_t (*JACK_jack_get_buffer_size)(jack_client_t *);
+static jack_transport_state_t (*JACK_jack_transport_query)(const jack_client_t *, jack_position_t *);
+
+static int load_jack_syms(void);
+
+#ifdef JACK_DYNAMIC_LOAD
+
+static void *jack_audio_handle_ = NULL;
+
+static int jack_dlinit(void) {
+	if (jack_audio_handle_)
+		return 0;
+
+	jack_audio_handle_ = SDL_LoadObject("libjack.so.0");
+	if (!jack_audio_handle_)
+		return -1;
+
+	int retval = load_jack_syms();
+	if (retval < 0) {
+		SDL_UnloadObject(jack_audio_handle_);
+		jack_audio_handle_ = NULL;
+	}
+
+	return retval;
+}
+
+static int load_jack_sym(const char *fn, void **addr) {
+	*addr = SDL_LoadFunction(jack_audio_handle_, fn);
+	if (!*addr)
+		return 0;
+
+	return 1;
+}
+
+/* cast funcs to char* first, to please GCC's strict aliasing rules. */
+#define SCHISM_JACK_SYM(x) \
+	if (!load_jack_sym(#x, (void **)(char *)&JACK_##x)) \
+	return -1
+
+#else
+
+#define SCHISM_JACK_SYM(x) JACK_##x = x
+
+static int jack_dlinit(void) {
+	load_jack_syms();
+	return 0;
+}
+
+#endif
+
+static int load_jack_syms(void) {
+	SCHISM_JACK_SYM(jack_client_open);
+	SCHISM_JACK_SYM(jack_client_close);
+	SCHISM_JACK_SYM(jack_activate);
+	SCHISM_JACK_SYM(jack_deactivate);
+	SCHISM_JACK_SYM(jack_port_get_buffer);
+	SCHISM_JACK_SYM(jack_port_register);
+	SCHISM_JACK_SYM(jack_port_name);
+	SCHISM_JACK_SYM(jack_connect);
+	SCHISM_JACK_SYM(jack_get_ports);
+	SCHISM_JACK_SYM(jack_set_process_callback);
+	SCHISM_JACK_SYM(jack_on_shutdown);
+	SCHISM_JACK_SYM(jack_get_sample_rate);
+	SCHISM_JACK_SYM(jack_get_buffer_size);
+	SCHISM_JACK_SYM(jack_transport_query);
+
+	return 0;
+}
+
+/* ------------------------------------------------------ */
+
+/* one stereo pair per channel when channel ports are on */
+struct jack_channel {
+	jack_port_t *port[2];
+	float *out[2];
+	jack_nframes_t pos;
+};
+
+static jack_client_t *client = NULL;
+static jack_port_t *master_port[2] = {NULL, NULL};
+static struct jack_channel *channels = NULL;
+static struct multi_write *channel_writes = NULL;
+
+static void (*render)(void *, uint8_t *, int) = NULL;
+static int16_t *render_buffer = NULL;
+static jack_nframes_t render_frames = 0;
+
+/* held by the process callback while mixing; this takes the place of the
+SDL audio device lock */
+static SDL_mutex *jack_audio_mutex = NULL;
+static SDL_atomic_t jack_audio_paused;
+
+static jack_transport_state_t last_transport = JackTransportStopped;
+
+static int follow_transport = 0;
+
+/* The process and shutdown callbacks can't do much of anything themselves
+(no allocating, no calling back into the UI), so they leave these for
+jack_audio_poll to pick up on the main thread. */
+static SDL_atomic_t jack_transport_change; /* 0, or 1 + whether it's rolling */
+static SDL_atomic_t jack_server_gone;
+
+static void _jack_deinterleave(float *l, float *r, const int16_t *in, jack_nframes_t frames)
+{
+	jack_nframes_t i;
+
+	for (i = 0; i < frames; i++) {
+		l[i] = in[2 * i] * (1.0f / 32768.0f);
+		r[i] = in[2 * i + 1] * (1.0f / 32768.0f);
+	}
+}
+
+/* multi_write callbacks: the mixer hands over each channel's share of the
+current chunk, already converted */
+static void _jack_channel_write(void *data, const uint8_t *buf, size_t bytes)
+{
+	struct jack_channel *ch = data;
+	jack_nframes_t frames = bytes / 4;
+
+	_jack_deinterleave(ch->out[0] + ch->pos, ch->out[1] + ch->pos, (const int16_t *) buf, frames);
+	ch->pos += frames;
+}
+
+static void _jack_channel_silence(void *data, long bytes)
+{
+	struct jack_channel *ch = data;
+	jack_nframes_t frames = bytes / 4;
+
+	memset(ch->out[0] + ch->pos, 0, frames * sizeof(float));
+	memset(ch->out[1] + ch->pos, 0, frames * sizeof(float));
+	ch->pos += frames;
+}
+
+static void _jack_transport(void)
+{
+	jack_transport_state_t state = JACK_jack_transport_query(client, NULL);
+
+	if (state == last_transport)
+		return;
+	last_transport = state;
+
+	if (state != JackTransportRolling && state != JackTransportStopped)
+		return;
+
+	/* starting and stopping the song needs the audio lock, which we're
+	holding, so the main thread gets to do it */
+	SDL_AtomicSet(&jack_transport_change, 1 + (state == JackTransportRolling));
+}
+
+static int _jack_process(jack_nframes_t nframes, UNUSED void *arg)
+{
+	float *l = JACK_jack_port_get_buffer(master_port[0], nframes);
+	float *r = JACK_jack_port_get_buffer(master_port[1], nframes);
+	jack_nframes_t done, frames;
+	int n;
+
+	if (SDL_AtomicGet(&jack_audio_paused)) {
+		memset(l, 0, nframes * sizeof(float));
+		memset(r, 0, nframes * sizeof(float));
+		if (channels) {
+			for (n = 0; n < MAX_CHANNELS; n++) {
+				memset(JACK_jack_port_get_buffer(channels[n].port[0], nframes), 0, nframes * sizeof(float));
+				memset(JACK_jack_port_get_buffer(channels[n].port[1], nframes), 0, nframes * sizeof(float));
+			}
+		}
+		return 0;
+	}
+
+	/* this waits for the main thread the same way SDL's audio thread waits
+	on the device lock; it's only ever held briefly, and the UI takes it
+	every frame during playback (for the sample markers and the scopes), so
+	dropping a period whenever it's busy would be heard */
+	SDL_LockMutex(jack_audio_mutex);
+
+	if (follow_transport)
+		_jack_transport();
+
+	if (channels) {
+		for (n = 0; n < MAX_CHANNELS; n++) {
+			channels[n].out[0] = JACK_jack_port_get_buffer(channels[n].port[0], nframes);
+			channels[n].out[1] = JACK_jack_port_get_buffer(channels[n].port[1], nframes);
+			/* channels that haven't played anything yet don't get written */
+			memset(channels[n].out[0], 0, nframes * sizeof(float));
+			memset(channels[n].out[1], 0, nframes * sizeof(float));
+		}
+		/* only while we're mixing, since the song can be swapped out from
+		under us between periods */
+		current_song->multi_write = channel_writes;
+	}
+
+	/* the period can grow after we've started; just run the mixer more than
+	once if it does */
+	for (done = 0; done < nframes; done += frames) {
+		frames = MIN(nframes - done, render_frames);
+		if (channels)
+			for (n = 0; n < MAX_CHANNELS; n++)
+				channels[n].pos = done;
+		render(NULL, (uint8_t *) render_buffer, frames * 4);
+		_jack_deinterleave(l + done, r + done, render_buffer, frames);
+	}
+
+	if (channels)
+		current_song->multi_write = NULL;
+
+	SDL_UnlockMutex(jack_audio_mutex);
+	return 0;
+}
+
+static void _jack_shutdown(UNUSED void *arg)
+{
+	/* the server went away; the client still has to be closed, but not from
+	in here */
+	SDL_AtomicSet(&jack_server_gone, 1);
+}
+
+static jack_port_t *_jack_register(const char *name)
+{
+	return JACK_jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+}
+
+static int _jack_channel_ports(void)
+{
+	char name[32];
+	int n;
+
+	channels = calloc(MAX_CHANNELS, sizeof(*channels));
+	channel_writes = calloc(MAX_CHANNELS, sizeof(*channel_writes));
+	if (!channels || !channel_writes)
+		return 0;
+
+	for (n = 0; n < MAX_CHANNELS; n++) {
+		snprintf(name, sizeof(name), "channel_%02d_left", n + 1);
+		channels[n].port[0] = _jack_register(name);
+		snprintf(name, sizeof(name), "channel_%02d_right", n + 1);
+		channels[n].port[1] = _jack_register(name);
+		if (!channels[n].port[0] || !channels[n].port[1])
+			return 0;
+
+		channel_writes[n].data = channels + n;
+		channel_writes[n].write = _jack_channel_write;
+		channel_writes[n].silence = _jack_channel_silence;
+	}
+
+	return 1;
+}
+
+/* hook the master outputs up to the first two physical playback ports */
+static void _jack_autoconnect(void)
+{
+	const char **ports = JACK_jack_get_ports(client, NULL, JACK_DEFAULT_AUDIO_TYPE,
+		JackPortIsPhysical | JackPortIsInput);
+	int n;
+
+	if (!ports)
+		return;
+
+	for (n = 0; n < 2 && ports[n]; n++)
+		JACK_jack_connect(client, JACK_jack_port_name(master_port[n]), ports[n]);
+
+	free(ports);
+}
+
+int jack_audio_init(void)
+{
+	jack_client_t *probe;
+	jack_status_t st;
+
+	if (jack_dlinit())
+		return 0;
+
+	/* make sure there's a server to talk to before claiming the driver */
+	probe = JACK_jack_client_open(CLIENT_NAME, JackNoStartServer, &st);
+	if (!probe)
+		return 0;
+	JACK_jack_client_close(probe);
+
+	if (!jack_audio_mutex) {
+		jack_audio_mutex = SDL_CreateMutex();
+		if (!jack_audio_mutex)
+			return 0;
+	}
+
+	return 1;
+}
+
+void jack_audio_close(void)
+{
+	if (client) {
+		JACK_jack_deactivate(client);
+		JACK_jack_client_close(client);
+		client = NULL;
+	}
+
+	master_port[0] = master_port[1] = NULL;
+	free(channels);
+	channels = NULL;
+	free(channel_writes);
+	channel_writes = NULL;
+	free(render_buffer);
+	render_buffer = NULL;
+}
+
+/* Connects to the server and starts running 'callback' (with the song locked)
+once per period, paused. Output is always 16-bit stereo at the server's rate,
+which is returned along with the period size. If 'channel_ports' is set, every
+channel gets its own pair of outputs in addition to the master; if 'transport'
+is set, starting and stopping the JACK transport starts and stops the song. */
+int jack_audio_open(unsigned int *rate, unsigned int *frames, int channel_ports, int transport,
+	void (*callback)(void *, uint8_t *, int))
+{
+	jack_status_t st;
+
+	jack_audio_close();
+
+	client = JACK_jack_client_open(CLIENT_NAME, JackNoStartServer, &st);
+	if (!client)
+		return 0;
+
+	SDL_AtomicSet(&jack_audio_paused, 1);
+	SDL_AtomicSet(&jack_transport_change, 0);
+	SDL_AtomicSet(&jack_server_gone, 0);
+	follow_transport = transport;
+	last_transport = JACK_jack_transport_query(client, NULL);
+	render = callback;
+	render_frames = JACK_jack_get_buffer_size(client);
+	render_buffer = calloc(render_frames, 2 * sizeof(int16_t));
+	master_port[0] = _jack_register("out_left");
+	master_port[1] = _jack_register("out_right");
+
+	if (!render_buffer || !master_port[0] || !master_port[1]
+	    || (channel_ports && !_jack_channel_ports())
+	    || JACK_jack_set_process_callback(client, _jack_process, NULL)) {
+		jack_audio_close();
+		return 0;
+	}
+
+	JACK_jack_on_shutdown(client, _jack_shutdown, NULL);
+
+	if (JACK_jack_activate(client)) {
+		jack_audio_close();
+		return 0;
+	}
+
+	_jack_autoconnect();
+
+	*rate = JACK_jack_get_sample_rate(client);
+	*frames = render_frames;
+	return 1;
+}
+
+void jack_audio_lock(void)
+{
+	SDL_LockMutex(jack_audio_mutex);
+}
+
+void jack_audio_unlock(void)
+{
+	SDL_UnlockMutex(jack_audio_mutex);
+}
+
+void jack_audio_pause(int pause)
+{
+	SDL_AtomicSet(&jack_audio_paused, pause);
+}
+
+/* Main thread, every so often: returns zero if the server has gone away (and
+closes the client), and sets *transport to 1 or 0 if the transport has started
+or stopped since the last call, or -1 if not. */
+int jack_audio_poll(int *transport)
+{
+	*transport = SDL_AtomicSet(&jack_transport_change, 0) - 1;
+
+	if (!SDL_AtomicGet(&jack_server_gone))
+		return 1;
+
+	/* no deactivating; there's nothing left to deactivate from */
+	if (client) {
+		JACK_jack_client_close(client);
+		client = NULL;
+	}
+	jack_audio_close();
+	SDL_AtomicSet(&jack_server_gone, 0);
+	return 0;
+}